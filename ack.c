@@ -0,0 +1,254 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ack.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define ACK_WINDOW_MAGIC 0xAC3317D0AC3317D0L
+
+struct ack_slot {
+	/// Window of the slot, NULL for standalone slots
+	struct ack_window *window;
+	/// References not released yet. Slot is free if 0.
+	size_t refs;
+	int failed;
+	/// Standalone slot callback
+	ack_slot_cb cb;
+	void *cb_opaque;
+};
+
+struct ack_window {
+#ifdef ACK_WINDOW_MAGIC
+	uint64_t magic;
+#endif
+	pthread_mutex_t mutex;
+	ack_window_cb cb;
+	void *cb_opaque;
+	/// Window has been closed by its owner
+	int closed;
+	/// A record has been pushed, so base is set
+	int started;
+	/// First record sequence number
+	uint64_t base;
+	/// Next record to ack
+	uint64_t head;
+	/// Next record to push
+	uint64_t tail;
+	/// Slot references not released yet, of all records
+	size_t refs;
+	/// Head record has failed, so no more records will be acked
+	int failed;
+	size_t size;
+	struct ack_slot slots[];
+};
+
+struct ack_window *ack_window_new(size_t size,ack_window_cb cb,void *opaque) {
+	size_t i;
+
+	assert(size > 0);
+	struct ack_window *window = calloc(1,
+		sizeof(*window) + size*sizeof(window->slots[0]));
+	if(NULL == window) {
+		rdlog(LOG_ERR,"Can't allocate ack window (out of memory?)");
+		return NULL;
+	}
+
+#ifdef ACK_WINDOW_MAGIC
+	window->magic = ACK_WINDOW_MAGIC;
+#endif
+	pthread_mutex_init(&window->mutex,NULL);
+	window->cb = cb;
+	window->cb_opaque = opaque;
+	window->size = size;
+	for(i=0;i<size;++i)
+		window->slots[i].window = window;
+
+	return window;
+}
+
+static void ack_window_done(struct ack_window *window) {
+	pthread_mutex_destroy(&window->mutex);
+	free(window);
+}
+
+int ack_window_full(struct ack_window *window) {
+	pthread_mutex_lock(&window->mutex);
+	const int full = window->tail - window->head == window->size;
+	pthread_mutex_unlock(&window->mutex);
+
+	return full;
+}
+
+struct ack_slot *ack_window_push(struct ack_window *window,uint64_t seq) {
+	struct ack_slot *slot = NULL;
+
+#ifdef ACK_WINDOW_MAGIC
+	assert(ACK_WINDOW_MAGIC == window->magic);
+#endif
+
+	pthread_mutex_lock(&window->mutex);
+	if(!window->started) {
+		window->started = 1;
+		window->base = window->head = window->tail = seq;
+	}
+
+	if(seq == window->tail && window->tail - window->head < window->size) {
+		slot = &window->slots[seq % window->size];
+		assert(0 == slot->refs);
+		slot->refs = 1;
+		slot->failed = 0;
+		window->tail++;
+		window->refs++;
+	}
+	pthread_mutex_unlock(&window->mutex);
+
+	return slot;
+}
+
+int ack_window_acked(struct ack_window *window,uint64_t *acked,int *failed) {
+	pthread_mutex_lock(&window->mutex);
+	const int rc = window->started && window->head != window->base;
+	*acked = window->head - 1;
+	*failed = window->failed;
+	pthread_mutex_unlock(&window->mutex);
+
+	return rc;
+}
+
+int ack_window_idle(struct ack_window *window) {
+	pthread_mutex_lock(&window->mutex);
+	const int idle = 0 == window->refs;
+	pthread_mutex_unlock(&window->mutex);
+
+	return idle;
+}
+
+void ack_window_close(struct ack_window *window) {
+#ifdef ACK_WINDOW_MAGIC
+	assert(ACK_WINDOW_MAGIC == window->magic);
+#endif
+
+	pthread_mutex_lock(&window->mutex);
+	window->closed = 1;
+	window->cb = NULL;
+	const int done = 0 == window->refs;
+	pthread_mutex_unlock(&window->mutex);
+
+	if(done)
+		ack_window_done(window);
+}
+
+struct ack_slot *ack_slot_new(ack_slot_cb cb,void *opaque) {
+	struct ack_slot *slot = calloc(1,sizeof(*slot));
+	if(NULL == slot) {
+		rdlog(LOG_ERR,"Can't allocate ack slot (out of memory?)");
+		return NULL;
+	}
+
+	slot->refs = 1;
+	slot->cb = cb;
+	slot->cb_opaque = opaque;
+	return slot;
+}
+
+/// Release a standalone slot reference, without any lock
+static void ack_standalone_release(struct ack_slot *slot,int failed) {
+	if(failed)
+		__atomic_store_n(&slot->failed,1,__ATOMIC_RELAXED);
+
+	if(0 != __atomic_sub_fetch(&slot->refs,1,__ATOMIC_ACQ_REL))
+		return;
+
+	slot->cb(slot->cb_opaque,__atomic_load_n(&slot->failed,__ATOMIC_RELAXED));
+	free(slot);
+}
+
+void ack_slot_ref(struct ack_slot *slot) {
+	struct ack_window *window = slot->window;
+
+	if(NULL == window) {
+		assert(ATOMIC_LOAD(slot->refs) > 0);
+		ATOMIC_INC(slot->refs);
+		return;
+	}
+
+	pthread_mutex_lock(&window->mutex);
+	assert(slot->refs > 0);
+	slot->refs++;
+	window->refs++;
+	pthread_mutex_unlock(&window->mutex);
+}
+
+void ack_slot_release(struct ack_slot *slot,int failed) {
+	struct ack_window *window = slot->window;
+	int changed = 0;
+
+	if(NULL == window) {
+		ack_standalone_release(slot,failed);
+		return;
+	}
+
+	pthread_mutex_lock(&window->mutex);
+	assert(slot->refs > 0);
+	slot->failed = slot->failed || failed;
+	slot->refs--;
+	window->refs--;
+
+	/* Ack done records, up to the first failed one */
+	while(!window->failed && window->head != window->tail) {
+		const struct ack_slot *head =
+			&window->slots[window->head % window->size];
+		if(head->refs > 0)
+			break;
+		if(head->failed)
+			window->failed = 1;
+		else
+			window->head++;
+		changed = 1;
+	}
+
+	if(changed && window->cb)
+		window->cb(window->cb_opaque);
+
+	const int done = window->closed && 0 == window->refs;
+	pthread_mutex_unlock(&window->mutex);
+
+	if(done)
+		ack_window_done(window);
+}
+
+void ack_slot_fail(struct ack_slot *slot) {
+	struct ack_window *window = slot->window;
+
+	if(NULL == window) {
+		assert(ATOMIC_LOAD(slot->refs) > 0);
+		__atomic_store_n(&slot->failed,1,__ATOMIC_RELAXED);
+		return;
+	}
+
+	pthread_mutex_lock(&window->mutex);
+	assert(slot->refs > 0);
+	slot->failed = 1;
+	pthread_mutex_unlock(&window->mutex);
+}
@@ -0,0 +1,105 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Delivery tracking of sequenced records, for acknowledged listeners. Every
+ * record of a window has a slot, referenced by msg_meta::ack while the
+ * listener hands it over and by every kafka message produced from it, until
+ * its delivery report. A record is done when its last reference is
+ * released, and the window acks records cumulatively: up to the first one
+ * that is not done. A failed record (a message not produced, or not
+ * delivered) is never acked, and the window stops there.
+ *
+ * Slots can be referenced and released from any thread.
+ *
+ * Standalone slots (ack_slot_new) are not part of any window: they track the
+ * references of one message, and call their callback when the last one is
+ * released.
+ */
+
+struct ack_window;
+struct ack_slot;
+
+/** Acked records changed. Called with window lock held, so it must not call
+    window functions. */
+typedef void (*ack_window_cb)(void *opaque);
+
+/** Last reference of a standalone slot has been released
+    @param failed Some reference holder could not deliver it
+    */
+typedef void (*ack_slot_cb)(void *opaque,int failed);
+
+/** Create a window
+    @param size Max number of records not acked yet
+    @param cb Acked records changed callback
+    @param opaque cb opaque
+    @return New window, or NULL on error
+    */
+struct ack_window *ack_window_new(size_t size,ack_window_cb cb,void *opaque);
+
+/// Window can't track more records until some of them are acked
+int ack_window_full(struct ack_window *window);
+
+/** Start tracking a record, with one reference that the caller has to
+    release.
+    @param seq Record sequence number. First record sets the window base,
+               and the next ones have to follow it.
+    @return Record slot, or NULL if window is full or seq does not follow
+    */
+struct ack_slot *ack_window_push(struct ack_window *window,uint64_t seq);
+
+/** Get window acked records
+    @param acked Last acked sequence number
+    @param failed Set to 1 if next record has failed
+    @return 1 if any record has been acked, 0 if none yet
+    */
+int ack_window_acked(struct ack_window *window,uint64_t *acked,int *failed);
+
+/** Check if window records have no references left, so every pushed record
+    is done or failed */
+int ack_window_idle(struct ack_window *window);
+
+/** Stop calling window callback. Window is freed when its last slot is
+    released. */
+void ack_window_close(struct ack_window *window);
+
+/** Create a standalone slot, with one reference that the caller has to
+    release.
+    @param cb Called when last reference is released, from the thread that
+              releases it. Slot is freed after it.
+    @param opaque cb opaque
+    @return New slot, or NULL on error
+    */
+struct ack_slot *ack_slot_new(ack_slot_cb cb,void *opaque);
+
+/// Add a reference to a record
+void ack_slot_ref(struct ack_slot *slot);
+
+/** Release a record reference
+    @param failed Reference holder could not deliver record
+    */
+void ack_slot_release(struct ack_slot *slot,int failed);
+
+/** Mark a record as failed, without releasing any reference. For holders that
+    drop a record they don't own a reference of, like stages. */
+void ack_slot_fail(struct ack_slot *slot);
@@ -0,0 +1,898 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "aggregate.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <ev.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#define CONFIG_AGGREGATE_WINDOW_KEY "window_s"
+#define CONFIG_AGGREGATE_KEYS_KEY "keys"
+#define CONFIG_AGGREGATE_SUM_KEY "sum"
+#define CONFIG_AGGREGATE_MIN_KEY "min"
+#define CONFIG_AGGREGATE_MAX_KEY "max"
+#define CONFIG_AGGREGATE_MAX_GROUPS_KEY "max_groups"
+
+#define AGGREGATE_DEFAULT_WINDOW_S 60
+#define AGGREGATE_DEFAULT_MAX_GROUPS 16384
+
+#define AGGREGATE_MAX_KEYS 16
+#define AGGREGATE_MAX_FIELDS 32
+/// Max rendered group key, '"key":value,' for every key
+#define AGGREGATE_MAX_KEY_SIZE 1024
+/// Max threads aggregating in the same stage
+#define AGGREGATE_MAX_WORKERS 256
+/// Time to wait after window end to close it
+#define AGGREGATE_CLOSE_DELAY_MS 10
+
+#define AGGREGATE_PRIVATE_MAGIC 0xA66A66A66A66A66AL
+
+enum aggregate_op{
+	AGGREGATE_SUM,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+};
+
+struct aggregate_field{
+	char *name;
+	size_t name_len;
+	enum aggregate_op op;
+	/// Output member, already quoted: "name", "name_min" or "name_max"
+	char *out_name;
+};
+
+struct aggregate_value{
+	int set;
+	int real;
+	int64_t integer;
+	double d;
+};
+
+struct aggregate_group{
+	LIST_ENTRY(aggregate_group) entry;
+	uint64_t hash;
+	uint64_t count;
+	/// Sender and listener of the first aggregated message
+	struct sockaddr_in client_addr;
+	struct sockaddr_in6 client_addr6;
+	uint16_t listener_port;
+	/// Rendered key, '"key":value,' for every key
+	char *key;
+	size_t key_len;
+	struct aggregate_value values[];
+};
+
+LIST_HEAD(aggregate_group_list,aggregate_group);
+
+/// Groups of one window
+struct aggregate_map{
+	uint64_t window;
+	/// Map has been merged by the flusher, so the worker can reuse it
+	int merged;
+	size_t groups;
+	struct aggregate_group_list *buckets;
+};
+
+/** Thread private maps, one for current window and one for the previous one,
+    that may be being merged. */
+struct aggregate_worker{
+	/// Odd while the worker is updating a map
+	uint64_t seq;
+	struct aggregate_map maps[2];
+};
+
+struct aggregate_private{
+#ifdef AGGREGATE_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	uint64_t window_ms;
+	/// Realtime - monotonic, so windows start at wall clock boundaries
+	int64_t clock_offset_ms;
+	size_t max_groups;
+	size_t buckets_mask;
+
+	/// Rendered '"key":' prefixes
+	char *keys[AGGREGATE_MAX_KEYS];
+	size_t keys_len[AGGREGATE_MAX_KEYS];
+	size_t keys_count;
+	struct aggregate_field fields[AGGREGATE_MAX_FIELDS];
+	size_t fields_count;
+
+	/// Stage to send aggregated messages from
+	const struct stage *stage;
+
+	pthread_key_t worker_key;
+	struct aggregate_worker *workers[AGGREGATE_MAX_WORKERS];
+	size_t workers_count;
+
+	/// Window close thread
+	struct {
+		pthread_t thread;
+		struct ev_loop *loop;
+		ev_timer timer;
+		ev_async async;
+		int stop;
+		/// Next window to close
+		uint64_t next_window;
+	} flusher;
+
+	struct {
+		uint64_t messages;
+		uint64_t aggregated_messages;
+		uint64_t groups;
+		uint64_t windows;
+		uint64_t overflow;
+		uint64_t invalid;
+	} counters;
+};
+
+static uint64_t current_window(const struct aggregate_private *priv) {
+	return (uint64_t)((int64_t)monotonic_ms() + priv->clock_offset_ms)
+		/ priv->window_ms;
+}
+
+static uint64_t group_hash(const char *key,size_t key_len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for(i=0;i<key_len;++i) {
+		hash ^= (uint8_t)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Values
+ */
+
+static double value_double(const struct aggregate_value *value) {
+	return value->real ? value->d : (double)value->integer;
+}
+
+/// Aggregate src into dst
+static void value_update(struct aggregate_value *dst,enum aggregate_op op,
+                                          const struct aggregate_value *src) {
+	int64_t sum;
+
+	if(!src->set)
+		return;
+
+	if(!dst->set) {
+		*dst = *src;
+		return;
+	}
+
+	switch(op) {
+	case AGGREGATE_SUM:
+		if(!dst->real && !src->real
+		        && !__builtin_add_overflow(dst->integer,src->integer,&sum)) {
+			dst->integer = sum;
+		} else {
+			dst->d = value_double(dst) + value_double(src);
+			dst->real = 1;
+		}
+		break;
+	case AGGREGATE_MIN:
+		if(dst->real || src->real ? value_double(src) < value_double(dst)
+		                          : src->integer < dst->integer)
+			*dst = *src;
+		break;
+	case AGGREGATE_MAX:
+		if(dst->real || src->real ? value_double(src) > value_double(dst)
+		                          : src->integer > dst->integer)
+			*dst = *src;
+		break;
+	default:
+		break;
+	}
+}
+
+static void parse_value(const char *buffer,size_t buf_size,
+                 const struct aggregate_field *field,struct aggregate_value *value) {
+	const char *value_end = NULL,*number_end = NULL;
+
+	memset(value,0,sizeof(*value));
+	const char *number = json_scan_member(buffer,buf_size,field->name,
+		field->name_len,&value_end);
+	if(NULL == number)
+		return;
+
+	switch(json_parse_number(number,value_end,&value->integer,&value->d,
+	                                                        &number_end)) {
+	case JSON_NUMBER_INTEGER:
+		value->set = 1;
+		break;
+	case JSON_NUMBER_REAL:
+		value->set = isfinite(value->d);
+		value->real = 1;
+		break;
+	case JSON_NUMBER_INVALID:
+	default:
+		break;
+	}
+}
+
+/*
+ * Maps
+ */
+
+static struct aggregate_group *map_lookup(const struct aggregate_private *priv,
+                         const struct aggregate_map *map,uint64_t hash,
+                         const char *key,size_t key_len) {
+	struct aggregate_group *group = NULL;
+	LIST_FOREACH(group,&map->buckets[hash & priv->buckets_mask],entry) {
+		if(group->hash == hash && group->key_len == key_len
+		                       && 0 == memcmp(group->key,key,key_len))
+			return group;
+	}
+	return NULL;
+}
+
+static void map_insert(const struct aggregate_private *priv,
+                       struct aggregate_map *map,struct aggregate_group *group) {
+	LIST_INSERT_HEAD(&map->buckets[group->hash & priv->buckets_mask],group,
+		entry);
+	map->groups++;
+}
+
+static void map_clear(const struct aggregate_private *priv,
+                      struct aggregate_map *map) {
+	size_t i;
+	struct aggregate_group *group = NULL;
+
+	for(i=0;map->groups && i<=priv->buckets_mask;++i) {
+		while((group = LIST_FIRST(&map->buckets[i]))) {
+			LIST_REMOVE(group,entry);
+			free(group);
+			map->groups--;
+		}
+	}
+}
+
+static struct aggregate_group *group_new(const struct aggregate_private *priv,
+                            uint64_t hash,const char *key,size_t key_len,
+                            const struct msg_meta *meta) {
+	const size_t values_size = priv->fields_count*sizeof(struct aggregate_value);
+	struct aggregate_group *group = calloc(1,sizeof(*group) + values_size
+		+ key_len);
+	if(NULL == group) {
+		rdlog(LOG_ERR,"Can't allocate aggregation group (out of memory?)");
+		return NULL;
+	}
+
+	group->hash = hash;
+	group->client_addr = meta->client_addr;
+	group->client_addr6 = meta->client_addr6;
+	group->listener_port = meta->listener_port;
+	group->key = (char *)group->values + values_size;
+	group->key_len = key_len;
+	memcpy(group->key,key,key_len);
+	return group;
+}
+
+static struct aggregate_worker *worker_new(struct aggregate_private *priv) {
+	size_t i;
+
+	const size_t worker_idx = ATOMIC_ADD(priv->workers_count,1) - 1;
+	if(worker_idx >= AGGREGATE_MAX_WORKERS)
+		return NULL;
+
+	struct aggregate_worker *worker = calloc(1,sizeof(*worker));
+	if(worker) {
+		for(i=0;i<2;++i) {
+			worker->maps[i].merged = 1;
+			worker->maps[i].buckets = calloc(priv->buckets_mask + 1,
+				sizeof(worker->maps[i].buckets[0]));
+		}
+	}
+
+	if(NULL == worker || NULL == worker->maps[0].buckets
+	                  || NULL == worker->maps[1].buckets) {
+		rdlog(LOG_ERR,"Can't allocate aggregation worker (out of memory?)");
+		if(worker) {
+			free(worker->maps[0].buckets);
+			free(worker->maps[1].buckets);
+		}
+		free(worker);
+		return NULL;
+	}
+
+	__atomic_store_n(&priv->workers[worker_idx],worker,__ATOMIC_RELEASE);
+	pthread_setspecific(priv->worker_key,worker);
+	return worker;
+}
+
+static void worker_done(const struct aggregate_private *priv,
+                        struct aggregate_worker *worker) {
+	size_t i;
+	for(i=0;i<2;++i) {
+		map_clear(priv,&worker->maps[i]);
+		free(worker->maps[i].buckets);
+	}
+	free(worker);
+}
+
+/*
+ * Window close
+ */
+
+static char *render_group(const struct aggregate_private *priv,
+                          const struct aggregate_group *group,uint64_t window,
+                          size_t *size) {
+	size_t i,alloc_size = group->key_len + sizeof("{\"timestamp\":,\"count\":}")
+		+ 2*24;
+	for(i=0;i<priv->fields_count;++i)
+		alloc_size += strlen(priv->fields[i].out_name) + 2 + 32;
+
+	char *buf = malloc(alloc_size);
+	if(NULL == buf) {
+		rdlog(LOG_ERR,"Can't allocate aggregated message (out of memory?)");
+		return NULL;
+	}
+
+	char *cursor = buf;
+	*cursor++ = '{';
+	memcpy(cursor,group->key,group->key_len);
+	cursor += group->key_len;
+	cursor += sprintf(cursor,"\"timestamp\":%" PRIu64 ",\"count\":%" PRIu64,
+		window*priv->window_ms/1000,group->count);
+
+	for(i=0;i<priv->fields_count;++i) {
+		const struct aggregate_value *value = &group->values[i];
+		if(!value->set)
+			continue;
+
+		if(value->real) {
+			cursor += sprintf(cursor,",%s:%.17g",priv->fields[i].out_name,
+				value->d);
+		} else {
+			cursor += sprintf(cursor,",%s:%" PRId64,priv->fields[i].out_name,
+				value->integer);
+		}
+	}
+
+	*cursor++ = '}';
+	*size = (size_t)(cursor - buf);
+	return buf;
+}
+
+/// Wait until worker is not in the middle of an update
+static void wait_worker(struct aggregate_worker *worker) {
+	const uint64_t seq = __atomic_load_n(&worker->seq,__ATOMIC_SEQ_CST);
+	if(seq & 1) {
+		/* Next update will see a newer window */
+		while(seq == __atomic_load_n(&worker->seq,__ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+/// Merge every worker map of window, and send the result
+static void close_window(struct aggregate_private *priv,uint64_t window) {
+	struct aggregate_map merged;
+	struct aggregate_group *group = NULL,*merged_group = NULL;
+	size_t i,j,k;
+
+	memset(&merged,0,sizeof(merged));
+	merged.buckets = calloc(priv->buckets_mask + 1,sizeof(merged.buckets[0]));
+	if(NULL == merged.buckets) {
+		rdlog(LOG_ERR,"Can't allocate aggregation window, discarding it "
+			"(out of memory?)");
+	}
+
+	const size_t workers_count = ATOMIC_LOAD(priv->workers_count);
+	for(i=0;i<workers_count && i<AGGREGATE_MAX_WORKERS;++i) {
+		struct aggregate_worker *worker = __atomic_load_n(&priv->workers[i],
+			__ATOMIC_ACQUIRE);
+		if(NULL == worker)
+			continue;
+
+		wait_worker(worker);
+		struct aggregate_map *map = &worker->maps[window & 1];
+		if(map->window != window || map->merged)
+			continue;
+
+		if(NULL == merged.buckets)
+			map_clear(priv,map);
+
+		/* Worker will not touch this map until merged is set, so groups
+		   can be moved */
+		for(j=0;map->groups && j<=priv->buckets_mask;++j) {
+			while((group = LIST_FIRST(&map->buckets[j]))) {
+				LIST_REMOVE(group,entry);
+				map->groups--;
+
+				merged_group = map_lookup(priv,&merged,group->hash,group->key,
+					group->key_len);
+				if(NULL == merged_group) {
+					map_insert(priv,&merged,group);
+					continue;
+				}
+
+				merged_group->count += group->count;
+				for(k=0;k<priv->fields_count;++k) {
+					value_update(&merged_group->values[k],priv->fields[k].op,
+						&group->values[k]);
+				}
+				free(group);
+			}
+		}
+
+		__atomic_store_n(&map->merged,1,__ATOMIC_RELEASE);
+	}
+
+	if(NULL == merged.buckets || 0 == merged.groups) {
+		free(merged.buckets);
+		return;
+	}
+
+	const struct stage *stage = __atomic_load_n(&priv->stage,__ATOMIC_ACQUIRE);
+	/* Aggregated messages are received when their window closes */
+	const double window_end = (double)((window + 1)*priv->window_ms)/1000;
+	for(i=0;i<=priv->buckets_mask;++i) {
+		while((group = LIST_FIRST(&merged.buckets[i]))) {
+			size_t size = 0;
+			char *buf = render_group(priv,group,window,&size);
+			if(buf) {
+				struct msg_meta meta;
+				memset(&meta,0,sizeof(meta));
+				meta.client_addr = group->client_addr;
+				meta.client_addr6 = group->client_addr6;
+				meta.listener_port = group->listener_port;
+				meta.receive_time = window_end;
+				ATOMIC_INC(priv->counters.groups);
+				stage_forward(stage,buf,size,&meta);
+			}
+			LIST_REMOVE(group,entry);
+			free(group);
+		}
+	}
+
+	ATOMIC_INC(priv->counters.windows);
+	free(merged.buckets);
+}
+
+static void rearm_timer(struct aggregate_private *priv) {
+	const int64_t window_end_ms = (int64_t)((priv->flusher.next_window + 1)
+		*priv->window_ms) - priv->clock_offset_ms;
+	const int64_t after_ms = window_end_ms + AGGREGATE_CLOSE_DELAY_MS
+		- (int64_t)monotonic_ms();
+
+	ev_timer_stop(priv->flusher.loop,&priv->flusher.timer);
+	ev_timer_set(&priv->flusher.timer,after_ms > 0 ? (double)after_ms/1000 : 0.,
+		0.);
+	ev_timer_start(priv->flusher.loop,&priv->flusher.timer);
+}
+
+static void flusher_timer_cb(struct ev_loop *loop RB_UNUSED,ev_timer *w,
+                                                       int revents RB_UNUSED) {
+	struct aggregate_private *priv = w->data;
+	const uint64_t window = current_window(priv);
+
+	for(;priv->flusher.next_window < window;priv->flusher.next_window++)
+		close_window(priv,priv->flusher.next_window);
+	rearm_timer(priv);
+}
+
+static void flusher_async_cb(struct ev_loop *loop,ev_async *w RB_UNUSED,
+                                                       int revents RB_UNUSED) {
+	ev_break(loop,EVBREAK_ALL);
+}
+
+static void *flusher_main(void *_priv) {
+	struct aggregate_private *priv = _priv;
+	ev_run(priv->flusher.loop,0);
+	return NULL;
+}
+
+/*
+ * Stage
+ */
+
+static char *quoted_name(const char *name,const char *suffix,const char *tail) {
+	const size_t size = strlen(name) + strlen(suffix) + strlen(tail) + 3;
+	char *ret = malloc(size);
+	if(ret)
+		snprintf(ret,size,"\"%s%s\"%s",name,suffix,tail);
+	return ret;
+}
+
+static int parse_fields(struct aggregate_private *priv,json_t *names,
+                        enum aggregate_op op,char *err,size_t errsize) {
+	static const char *suffixes[] = {
+		[AGGREGATE_SUM] = "",
+		[AGGREGATE_MIN] = "_min",
+		[AGGREGATE_MAX] = "_max",
+	};
+	json_t *value = NULL;
+	size_t i;
+
+	if(NULL == names)
+		return 0;
+
+	if(!json_is_array(names)) {
+		snprintf(err,errsize,"aggregate stage fields must be an array");
+		return -1;
+	}
+
+	json_array_foreach(names,i,value) {
+		const char *name = json_string_value(value);
+		if(NULL == name) {
+			snprintf(err,errsize,"aggregate stage fields must be strings");
+			return -1;
+		}
+
+		if(priv->fields_count == AGGREGATE_MAX_FIELDS) {
+			snprintf(err,errsize,"aggregate stage supports up to %d fields",
+				AGGREGATE_MAX_FIELDS);
+			return -1;
+		}
+
+		struct aggregate_field *field = &priv->fields[priv->fields_count++];
+		field->op = op;
+		field->name = strdup(name);
+		field->name_len = strlen(name);
+		field->out_name = quoted_name(name,suffixes[op],"");
+		if(NULL == field->name || NULL == field->out_name) {
+			snprintf(err,errsize,
+				"Can't allocate aggregate field (out of memory?)");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_keys(struct aggregate_private *priv,json_t *keys,
+                                               char *err,size_t errsize) {
+	json_t *value = NULL;
+	size_t i;
+
+	if(NULL == keys)
+		return 0;
+
+	if(!json_is_array(keys) || json_array_size(keys) > AGGREGATE_MAX_KEYS) {
+		snprintf(err,errsize,"aggregate stage keys must be an array of up to "
+			"%d strings",AGGREGATE_MAX_KEYS);
+		return -1;
+	}
+
+	json_array_foreach(keys,i,value) {
+		const char *key = json_string_value(value);
+		if(NULL == key) {
+			snprintf(err,errsize,"aggregate stage keys must be strings");
+			return -1;
+		}
+
+		priv->keys[i] = quoted_name(key,"",":");
+		if(NULL == priv->keys[i]) {
+			snprintf(err,errsize,"Can't allocate aggregate key (out of memory?)");
+			return -1;
+		}
+		priv->keys_len[i] = strlen(priv->keys[i]);
+		priv->keys_count++;
+	}
+
+	return 0;
+}
+
+static void aggregate_private_done(struct aggregate_private *priv) {
+	size_t i;
+
+	for(i=0;i<AGGREGATE_MAX_WORKERS;++i) {
+		if(priv->workers[i])
+			worker_done(priv,priv->workers[i]);
+	}
+	for(i=0;i<priv->keys_count;++i)
+		free(priv->keys[i]);
+	for(i=0;i<priv->fields_count;++i) {
+		free(priv->fields[i].name);
+		free(priv->fields[i].out_name);
+	}
+	if(priv->flusher.loop)
+		ev_loop_destroy(priv->flusher.loop);
+	free(priv);
+}
+
+int aggregate_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	json_t *keys = NULL,*sum = NULL,*min = NULL,*max = NULL;
+	json_int_t window_s = AGGREGATE_DEFAULT_WINDOW_S;
+	json_int_t max_groups = AGGREGATE_DEFAULT_MAX_GROUPS;
+	json_error_t jerr;
+	struct timespec realtime;
+	size_t buckets = 1;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?I,s?o,s?o,s?o,s?o,s?I}",
+		CONFIG_AGGREGATE_WINDOW_KEY,&window_s,
+		CONFIG_AGGREGATE_KEYS_KEY,&keys,
+		CONFIG_AGGREGATE_SUM_KEY,&sum,
+		CONFIG_AGGREGATE_MIN_KEY,&min,
+		CONFIG_AGGREGATE_MAX_KEY,&max,
+		CONFIG_AGGREGATE_MAX_GROUPS_KEY,&max_groups);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse aggregate stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(window_s <= 0 || max_groups <= 0) {
+		snprintf(err,errsize,"Aggregate window_s and max_groups have to be "
+			"greater than 0");
+		return -1;
+	}
+
+	struct aggregate_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate aggregate private (out of memory?)");
+		return -1;
+	}
+
+#ifdef AGGREGATE_PRIVATE_MAGIC
+	priv->magic = AGGREGATE_PRIVATE_MAGIC;
+#endif
+
+	if(0 != parse_keys(priv,keys,err,errsize)
+	        || 0 != parse_fields(priv,sum,AGGREGATE_SUM,err,errsize)
+	        || 0 != parse_fields(priv,min,AGGREGATE_MIN,err,errsize)
+	        || 0 != parse_fields(priv,max,AGGREGATE_MAX,err,errsize)) {
+		aggregate_private_done(priv);
+		return -1;
+	}
+
+	priv->window_ms = (uint64_t)window_s*1000;
+	priv->max_groups = (size_t)max_groups;
+	while(buckets < priv->max_groups)
+		buckets *= 2;
+	priv->buckets_mask = buckets - 1;
+
+	clock_gettime(CLOCK_REALTIME,&realtime);
+	priv->clock_offset_ms = (int64_t)realtime.tv_sec*1000
+		+ realtime.tv_nsec/1000000 - (int64_t)monotonic_ms();
+	priv->flusher.next_window = current_window(priv);
+
+	if(0 != pthread_key_create(&priv->worker_key,NULL)) {
+		snprintf(err,errsize,"Can't create aggregate thread key");
+		aggregate_private_done(priv);
+		return -1;
+	}
+
+	priv->flusher.loop = ev_loop_new(0);
+	if(NULL == priv->flusher.loop) {
+		snprintf(err,errsize,"Can't create aggregate event loop");
+		pthread_key_delete(priv->worker_key);
+		aggregate_private_done(priv);
+		return -1;
+	}
+
+	ev_timer_init(&priv->flusher.timer,flusher_timer_cb,0.,0.);
+	priv->flusher.timer.data = priv;
+	ev_async_init(&priv->flusher.async,flusher_async_cb);
+	priv->flusher.async.data = priv;
+	ev_async_start(priv->flusher.loop,&priv->flusher.async);
+	rearm_timer(priv);
+
+	if(0 != pthread_create(&priv->flusher.thread,NULL,flusher_main,priv)) {
+		snprintf(err,errsize,"Can't create aggregate window thread");
+		pthread_key_delete(priv->worker_key);
+		aggregate_private_done(priv);
+		return -1;
+	}
+
+	*_opaque = priv;
+	return 0;
+}
+
+void aggregate_stage_opaque_destructor(void *opaque) {
+	struct aggregate_private *priv = opaque;
+	size_t i,j;
+#ifdef AGGREGATE_PRIVATE_MAGIC
+	assert(AGGREGATE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ev_async_send(priv->flusher.loop,&priv->flusher.async);
+	pthread_join(priv->flusher.thread,NULL);
+
+	/* Next stages are still alive, so open windows can be sent, oldest
+	   first */
+	while(1) {
+		uint64_t window = UINT64_MAX;
+		for(i=0;i<AGGREGATE_MAX_WORKERS;++i) {
+			for(j=0;priv->workers[i] && j<2;++j) {
+				const struct aggregate_map *map = &priv->workers[i]->maps[j];
+				if(!map->merged && map->window < window)
+					window = map->window;
+			}
+		}
+
+		if(UINT64_MAX == window)
+			break;
+		close_window(priv,window);
+	}
+
+	pthread_key_delete(priv->worker_key);
+	aggregate_private_done(priv);
+}
+
+void aggregate_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct aggregate_private *priv = opaque;
+#ifdef AGGREGATE_PRIVATE_MAGIC
+	assert(AGGREGATE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const uint64_t aggregated = ATOMIC_LOAD(priv->counters.aggregated_messages);
+	const uint64_t groups = ATOMIC_LOAD(priv->counters.groups);
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"aggregated_messages",
+		json_integer((json_int_t)aggregated));
+	json_object_set_new(stats,"groups",json_integer((json_int_t)groups));
+	json_object_set_new(stats,"windows",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.windows)));
+	json_object_set_new(stats,"overflow",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.overflow)));
+	json_object_set_new(stats,"invalid",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.invalid)));
+	json_object_set_new(stats,"ratio",
+		json_real(groups ? (double)aggregated/(double)groups : 0.));
+}
+
+/// Render group key. Return key length, or 0 if it does not fit.
+static size_t render_key(const struct aggregate_private *priv,
+                         const char *buffer,size_t buf_size,char *key) {
+	size_t i,key_len = 0;
+
+	for(i=0;i<priv->keys_count;++i) {
+		const char *value_end = NULL;
+		/* Skip quotes and colon to compare with message keys */
+		const char *value = json_scan_member(buffer,buf_size,priv->keys[i]+1,
+			priv->keys_len[i]-3,&value_end);
+		if(NULL == value) {
+			value = "null";
+			value_end = value + strlen("null");
+		}
+
+		const size_t value_len = (size_t)(value_end - value);
+		if(key_len + priv->keys_len[i] + value_len + 1 > AGGREGATE_MAX_KEY_SIZE)
+			return 0;
+
+		memcpy(&key[key_len],priv->keys[i],priv->keys_len[i]);
+		key_len += priv->keys_len[i];
+		memcpy(&key[key_len],value,value_len);
+		key_len += value_len;
+		key[key_len++] = ',';
+	}
+
+	return key_len;
+}
+
+/// Aggregate message in worker map. Return 0 on success.
+static int worker_aggregate(struct aggregate_private *priv,
+                        struct aggregate_worker *worker,const char *key,
+                        size_t key_len,const struct aggregate_value *values,
+                        const struct msg_meta *meta) {
+	struct aggregate_group *group = NULL;
+	struct aggregate_map *map = NULL;
+	size_t i;
+	int rc = 0;
+
+	const uint64_t hash = group_hash(key,key_len);
+
+	while(1) {
+		/* Flusher waits for us if it sees an odd seq, so window has to be
+		   read after this */
+		__atomic_add_fetch(&worker->seq,1,__ATOMIC_SEQ_CST);
+		const uint64_t window = current_window(priv);
+		map = &worker->maps[window & 1];
+		if(map->window == window)
+			break;
+
+		if(__atomic_load_n(&map->merged,__ATOMIC_ACQUIRE)) {
+			/* Reuse map from two windows ago */
+			map_clear(priv,map);
+			map->window = window;
+			map->merged = 0;
+			break;
+		}
+
+		/* Flusher has not closed the window two windows ago yet */
+		__atomic_add_fetch(&worker->seq,1,__ATOMIC_RELEASE);
+		sched_yield();
+	}
+
+	group = map_lookup(priv,map,hash,key,key_len);
+	if(NULL == group && map->groups < priv->max_groups) {
+		group = group_new(priv,hash,key,key_len,meta);
+		if(group)
+			map_insert(priv,map,group);
+	}
+
+	if(group) {
+		group->count++;
+		for(i=0;i<priv->fields_count;++i)
+			value_update(&group->values[i],priv->fields[i].op,&values[i]);
+	} else {
+		rc = -1;
+	}
+
+	__atomic_add_fetch(&worker->seq,1,__ATOMIC_RELEASE);
+	return rc;
+}
+
+void aggregate_stage_process(const struct stage *stage,char *buffer,
+                             size_t buf_size,const struct msg_meta *meta) {
+	struct aggregate_private *priv = stage->opaque;
+	struct aggregate_value values[AGGREGATE_MAX_FIELDS];
+	char key[AGGREGATE_MAX_KEY_SIZE];
+	size_t i;
+
+#ifdef AGGREGATE_PRIVATE_MAGIC
+	assert(AGGREGATE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.messages);
+	if(NULL == __atomic_load_n(&priv->stage,__ATOMIC_RELAXED))
+		__atomic_store_n(&priv->stage,stage,__ATOMIC_RELEASE);
+
+	const char *end = buffer + buf_size;
+	const char *open_brace = json_scan_spaces(buffer,end);
+	if(open_brace == end || '{' != *open_brace) {
+		ATOMIC_INC(priv->counters.invalid);
+		free(buffer);
+		return;
+	}
+
+	const size_t key_len = render_key(priv,buffer,buf_size,key);
+	struct aggregate_worker *worker = pthread_getspecific(priv->worker_key);
+	if(NULL == worker)
+		worker = worker_new(priv);
+
+	if((priv->keys_count > 0 && 0 == key_len) || NULL == worker) {
+		ATOMIC_INC(priv->counters.overflow);
+		stage_forward(stage,buffer,buf_size,meta);
+		return;
+	}
+
+	for(i=0;i<priv->fields_count;++i)
+		parse_value(buffer,buf_size,&priv->fields[i],&values[i]);
+
+	if(0 != worker_aggregate(priv,worker,key,key_len,values,meta)) {
+		ATOMIC_INC(priv->counters.overflow);
+		stage_forward(stage,buffer,buf_size,meta);
+		return;
+	}
+
+	ATOMIC_INC(priv->counters.aggregated_messages);
+	free(buffer);
+}
@@ -0,0 +1,54 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * Windowed pre-aggregation stage. Groups messages by the value of `keys`
+ * top level members over tumbling windows of `window_s` seconds, and sends
+ * one message per group when the window closes:
+ *
+ *   {"type":"aggregate","window_s":60,"keys":["sensor","type"],
+ *    "sum":["bytes","pkts"],"min":["rtt"],"max":["rtt"],"max_groups":16384}
+ *
+ * With that config, messages like {"sensor":"a","type":"x","bytes":10,
+ * "pkts":1,"rtt":2.5} are sent as {"sensor":"a","type":"x",
+ * "timestamp":1700000040,"count":12,"bytes":5020,"pkts":13,"rtt_min":0.5,
+ * "rtt_max":9}, where timestamp is the window start. Missing keys are
+ * grouped as null, and missing or non numeric fields are ignored.
+ *
+ * Group messages keep the listener and sender of the first aggregated
+ * message, so listener policies still apply, and their receive time is the
+ * window end.
+ *
+ * Every thread aggregates in its own hash table, so no lock is needed in the
+ * message path. Tables are merged when the window closes. Messages that
+ * don't fit in max_groups groups per thread and window are forwarded as they
+ * are.
+ */
+
+#define AGGREGATE_STAGE_TYPE "aggregate"
+
+int aggregate_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void aggregate_stage_opaque_destructor(void *opaque);
+void aggregate_stage_opaque_stats(void *opaque,struct json_t *stats);
+void aggregate_stage_process(const struct stage *stage,char *buffer,
+                             size_t buf_size,const struct msg_meta *meta);
@@ -0,0 +1,447 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "avro.h"
+#include "encode.h"
+#include "json_scan.h"
+
+#include <jansson.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Max number of record fields
+#define AVRO_MAX_FIELDS 256
+
+/// Longest varint (10 bytes) + value
+#define AVRO_SCALAR_MAX_SIZE 16
+
+enum avro_type{
+	AVRO_NULL,
+	AVRO_BOOLEAN,
+	AVRO_INT,
+	AVRO_LONG,
+	AVRO_FLOAT,
+	AVRO_DOUBLE,
+	AVRO_STRING,
+};
+
+struct avro_field{
+	char *name;
+	size_t name_len;
+	enum avro_type type;
+	/// Field is an union of null and type
+	int nullable;
+	/// Union branch of null
+	int64_t null_branch;
+};
+
+struct avro_schema{
+	size_t fields_count;
+	struct avro_field *fields;
+	/// Open addressing table of field index + 1, 0 if empty
+	size_t table_mask;
+	uint16_t *table;
+};
+
+static uint64_t fnv1a(const char *str,size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for(i=0;i<len;++i) {
+		hash ^= (uint8_t)str[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static const struct avro_field *avro_schema_field(
+                 const struct avro_schema *schema,const char *name,size_t len,
+                 size_t *field_index) {
+	size_t pos = fnv1a(name,len) & schema->table_mask;
+
+	while(schema->table[pos]) {
+		const struct avro_field *field = &schema->fields[schema->table[pos]-1];
+		if(field->name_len == len && 0 == memcmp(field->name,name,len)) {
+			*field_index = schema->table[pos]-1;
+			return field;
+		}
+		pos = (pos + 1) & schema->table_mask;
+	}
+
+	return NULL;
+}
+
+static int parse_primitive_type(const char *type_name,enum avro_type *type) {
+	static const struct {
+		const char *name;
+		enum avro_type type;
+	} types[] = {
+		{"null",    AVRO_NULL},
+		{"boolean", AVRO_BOOLEAN},
+		{"int",     AVRO_INT},
+		{"long",    AVRO_LONG},
+		{"float",   AVRO_FLOAT},
+		{"double",  AVRO_DOUBLE},
+		{"string",  AVRO_STRING},
+	};
+	size_t i;
+
+	for(i=0;i<sizeof(types)/sizeof(types[0]);++i) {
+		if(0 == strcmp(types[i].name,type_name)) {
+			*type = types[i].type;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/// Parse "type" or ["null","type"]
+static int parse_field_type(json_t *type,struct avro_field *field) {
+	if(json_is_string(type))
+		return parse_primitive_type(json_string_value(type),&field->type);
+
+	if(!json_is_array(type) || 2 != json_array_size(type))
+		return -1;
+
+	enum avro_type branches[2];
+	size_t i;
+	for(i=0;i<2;++i) {
+		json_t *branch = json_array_get(type,i);
+		if(!json_is_string(branch)
+		       || 0 != parse_primitive_type(json_string_value(branch),&branches[i]))
+			return -1;
+	}
+
+	if(AVRO_NULL == branches[0] && AVRO_NULL != branches[1]) {
+		field->null_branch = 0;
+		field->type = branches[1];
+	} else if(AVRO_NULL != branches[0] && AVRO_NULL == branches[1]) {
+		field->null_branch = 1;
+		field->type = branches[0];
+	} else {
+		return -1;
+	}
+
+	field->nullable = 1;
+	return 0;
+}
+
+void avro_schema_done(struct avro_schema *schema) {
+	size_t i;
+	for(i=0;i<schema->fields_count;++i)
+		free(schema->fields[i].name);
+	free(schema->fields);
+	free(schema->table);
+	free(schema);
+}
+
+static int avro_schema_parse(struct avro_schema *schema,json_t *json,
+                             const char *path,char *err,size_t errsize) {
+	const char *record_type = NULL;
+	json_t *fields = NULL,*field_json = NULL;
+	json_error_t jerr;
+	size_t i,table_size = 1;
+
+	if(0 != json_unpack_ex(json,&jerr,0,"{s:s,s:o}","type",&record_type,
+	                                              "fields",&fields)) {
+		snprintf(err,errsize,"Can't parse avro schema %s: %s",path,jerr.text);
+		return -1;
+	}
+
+	if(0 != strcmp(record_type,"record") || !json_is_array(fields)
+	        || 0 == json_array_size(fields)
+	        || json_array_size(fields) > AVRO_MAX_FIELDS) {
+		snprintf(err,errsize,"Avro schema %s has to be a record with 1 to %d "
+			"fields",path,AVRO_MAX_FIELDS);
+		return -1;
+	}
+
+	while(table_size < 2*json_array_size(fields))
+		table_size *= 2;
+
+	schema->fields = calloc(json_array_size(fields),sizeof(schema->fields[0]));
+	schema->table = calloc(table_size,sizeof(schema->table[0]));
+	if(NULL == schema->fields || NULL == schema->table) {
+		snprintf(err,errsize,"Can't allocate avro schema (out of memory?)");
+		return -1;
+	}
+	schema->table_mask = table_size - 1;
+
+	json_array_foreach(fields,i,field_json) {
+		const char *name = NULL;
+		json_t *type = NULL;
+		size_t dup_index = 0;
+
+		if(0 != json_unpack_ex(field_json,&jerr,0,"{s:s,s:o}","name",&name,
+		                                                     "type",&type)) {
+			snprintf(err,errsize,"Can't parse avro schema %s field %zu: %s",
+				path,i,jerr.text);
+			return -1;
+		}
+
+		struct avro_field *field = &schema->fields[i];
+		if(0 != parse_field_type(type,field)) {
+			snprintf(err,errsize,"Avro schema %s field %s: only primitive "
+				"types and unions of null and a primitive type are supported",
+				path,name);
+			return -1;
+		}
+
+		if(avro_schema_field(schema,name,strlen(name),&dup_index)) {
+			snprintf(err,errsize,"Avro schema %s: duplicated field %s",
+				path,name);
+			return -1;
+		}
+
+		field->name = strdup(name);
+		if(NULL == field->name) {
+			snprintf(err,errsize,"Can't allocate avro schema (out of memory?)");
+			return -1;
+		}
+		field->name_len = strlen(name);
+		schema->fields_count++;
+
+		size_t pos = fnv1a(field->name,field->name_len) & schema->table_mask;
+		while(schema->table[pos])
+			pos = (pos + 1) & schema->table_mask;
+		schema->table[pos] = (uint16_t)(i + 1);
+	}
+
+	return 0;
+}
+
+struct avro_schema *avro_schema_load(const char *path,char *err,size_t errsize) {
+	json_error_t jerr;
+
+	json_t *json = json_load_file(path,0,&jerr);
+	if(NULL == json) {
+		snprintf(err,errsize,"Can't load avro schema %s: %s",path,jerr.text);
+		return NULL;
+	}
+
+	struct avro_schema *schema = calloc(1,sizeof(*schema));
+	if(NULL == schema) {
+		snprintf(err,errsize,"Can't allocate avro schema (out of memory?)");
+	} else if(0 != avro_schema_parse(schema,json,path,err,errsize)) {
+		avro_schema_done(schema);
+		schema = NULL;
+	}
+
+	json_decref(json);
+	return schema;
+}
+
+/*
+ * Encoding
+ */
+
+static size_t put_varlong(uint8_t *out,int64_t value) {
+	uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	size_t len = 0;
+
+	while(zigzag >= 0x80) {
+		out[len++] = (uint8_t)(zigzag | 0x80);
+		zigzag >>= 7;
+	}
+	out[len++] = (uint8_t)zigzag;
+	return len;
+}
+
+static size_t put_le(uint8_t *out,uint64_t value,size_t bytes) {
+	size_t i;
+	for(i=0;i<bytes;++i)
+		out[i] = (uint8_t)(value >> (8*i));
+	return bytes;
+}
+
+/// Avro string: length and bytes. Non string values are copied as JSON text.
+static int encode_avro_string(struct encode_buffer *out,const char *value,
+                                                   const char *value_end) {
+	const int is_string = '"' == *value;
+	const char *text = is_string ? value + 1 : value;
+	const char *text_end = is_string ? value_end - 1 : value_end;
+	const int escaped = is_string
+		&& NULL != memchr(text,'\\',(size_t)(text_end - text));
+	const size_t len = escaped ? json_unescaped_length(text,text_end)
+	                           : (size_t)(text_end - text);
+
+	if((size_t)-1 == len
+	        || 0 != encode_buffer_reserve(out,AVRO_SCALAR_MAX_SIZE + len))
+		return -1;
+
+	out->used += put_varlong((uint8_t *)out->buf + out->used,(int64_t)len);
+	if(escaped)
+		json_unescape(out->buf + out->used,text,text_end);
+	else
+		memcpy(out->buf + out->used,text,len);
+	out->used += len;
+	return 0;
+}
+
+static int encode_avro_field(const struct avro_field *field,
+                        struct encode_buffer *out,
+                        const char *value,const char *value_end) {
+	const int is_null = NULL == value || ((size_t)(value_end - value)
+		== strlen("null") && 0 == memcmp(value,"null",strlen("null")));
+	const char *number_end = NULL;
+	int64_t integer = 0;
+	double real = 0;
+	uint8_t *dst = NULL;
+
+	if(0 != encode_buffer_reserve(out,AVRO_SCALAR_MAX_SIZE))
+		return -1;
+	dst = (uint8_t *)out->buf + out->used;
+
+	if(field->nullable) {
+		const int64_t branch = is_null ? field->null_branch
+		                               : 1 - field->null_branch;
+		const size_t branch_len = put_varlong(dst,branch);
+		out->used += branch_len;
+		dst += branch_len;
+		if(is_null)
+			return 0;
+	} else if(is_null || AVRO_NULL == field->type) {
+		return is_null && AVRO_NULL == field->type ? 0 : -1;
+	}
+
+	switch(field->type) {
+	case AVRO_BOOLEAN:
+		if((size_t)(value_end - value) == strlen("true")
+		        && 0 == memcmp(value,"true",strlen("true"))) {
+			*dst = 1;
+		} else if((size_t)(value_end - value) == strlen("false")
+		        && 0 == memcmp(value,"false",strlen("false"))) {
+			*dst = 0;
+		} else {
+			return -1;
+		}
+		out->used++;
+		return 0;
+
+	case AVRO_INT:
+	case AVRO_LONG:
+		if(JSON_NUMBER_INTEGER != json_parse_number(value,value_end,&integer,
+		                                            &real,&number_end)
+		        || number_end != value_end
+		        || (AVRO_INT == field->type
+		            && (integer < INT32_MIN || integer > INT32_MAX)))
+			return -1;
+		out->used += put_varlong(dst,integer);
+		return 0;
+
+	case AVRO_FLOAT:
+	case AVRO_DOUBLE:
+		switch(json_parse_number(value,value_end,&integer,&real,&number_end)) {
+		case JSON_NUMBER_INTEGER:
+			real = (double)integer;
+			break;
+		case JSON_NUMBER_REAL:
+			break;
+		case JSON_NUMBER_INVALID:
+		default:
+			return -1;
+		};
+		if(number_end != value_end)
+			return -1;
+
+		if(AVRO_FLOAT == field->type) {
+			const float single = (float)real;
+			uint32_t bits;
+			memcpy(&bits,&single,sizeof(bits));
+			out->used += put_le(dst,bits,sizeof(bits));
+		} else {
+			uint64_t bits;
+			memcpy(&bits,&real,sizeof(bits));
+			out->used += put_le(dst,bits,sizeof(bits));
+		}
+		return 0;
+
+	case AVRO_STRING:
+		return encode_avro_string(out,value,value_end);
+
+	case AVRO_NULL:
+	default:
+		return -1;
+	};
+}
+
+int avro_encode(const struct avro_schema *schema,const char *buffer,
+                                   size_t buf_size,struct encode_buffer *out) {
+	struct {
+		const char *start,*end;
+	} values[AVRO_MAX_FIELDS];
+	const char *end = buffer + buf_size;
+	const char *cursor = json_scan_spaces(buffer,end);
+	size_t i;
+
+	memset(values,0,schema->fields_count*sizeof(values[0]));
+
+	if(cursor == end || '{' != *cursor)
+		return -1;
+
+	/* Locate fields values. Unknown members are ignored. */
+	cursor = json_scan_spaces(cursor + 1,end);
+	if(cursor < end && '}' == *cursor)
+		cursor = json_scan_spaces(cursor + 1,end);
+	else while(1) {
+		if(cursor == end || '"' != *cursor)
+			return -1;
+		const char *key = cursor + 1;
+		const char *key_end = json_scan_string(key,end);
+		if(NULL == key_end)
+			return -1;
+
+		cursor = json_scan_spaces(key_end + 1,end);
+		if(cursor == end || ':' != *cursor)
+			return -1;
+
+		const char *value = json_scan_spaces(cursor + 1,end);
+		const char *value_end = json_scan_value(value,end);
+		if(NULL == value_end)
+			return -1;
+
+		size_t field_index = 0;
+		if(avro_schema_field(schema,key,(size_t)(key_end - key),&field_index)) {
+			values[field_index].start = value;
+			values[field_index].end = value_end;
+		}
+
+		cursor = json_scan_spaces(value_end,end);
+		if(cursor < end && ',' == *cursor) {
+			cursor = json_scan_spaces(cursor + 1,end);
+		} else if(cursor < end && '}' == *cursor) {
+			cursor = json_scan_spaces(cursor + 1,end);
+			break;
+		} else {
+			return -1;
+		}
+	}
+
+	if(cursor != end)
+		return -1;
+
+	for(i=0;i<schema->fields_count;++i) {
+		if(0 != encode_avro_field(&schema->fields[i],out,values[i].start,
+		                                                    values[i].end))
+			return -1;
+	}
+
+	return 0;
+}
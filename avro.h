@@ -0,0 +1,46 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Avro binary encoding of flat JSON objects. Schema has to be a record whose
+ * fields are primitive types (null, boolean, int, long, float, double,
+ * string), or unions of null and one of them. Missing fields are encoded as
+ * null if the type allows it.
+ */
+
+struct avro_schema;
+struct encode_buffer;
+
+/// Load schema from file. Return NULL in case of error.
+struct avro_schema *avro_schema_load(const char *path,char *err,size_t errsize);
+
+void avro_schema_done(struct avro_schema *schema);
+
+/** Encode a JSON object.
+    @param schema Record schema
+    @param buffer JSON text
+    @param buf_size JSON text size
+    @param out Output buffer
+    @return 0 on success
+    */
+int avro_encode(const struct avro_schema *schema,const char *buffer,
+                                   size_t buf_size,struct encode_buffer *out);
@@ -0,0 +1,527 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "batch.h"
+#include "ack.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <ev.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#define CONFIG_BATCH_FORMAT_KEY "format"
+#define CONFIG_BATCH_MAX_MESSAGES_KEY "max_messages"
+#define CONFIG_BATCH_MAX_BYTES_KEY "max_bytes"
+#define CONFIG_BATCH_MAX_DELAY_KEY "max_delay_ms"
+#define CONFIG_BATCH_KEY_KEY "key"
+
+#define BATCH_DEFAULT_MAX_MESSAGES 1000
+#define BATCH_DEFAULT_MAX_BYTES (64*1024)
+#define BATCH_DEFAULT_MAX_DELAY_MS 100
+
+/// Batches hash table buckets
+#define BATCH_BUCKETS 64
+/// Minimum batch buffer allocation
+#define BATCH_MIN_ALLOC 1024
+
+#define BATCH_PRIVATE_MAGIC 0xBA7C4BA7C4BA7C4L
+
+enum batch_format{
+	BATCH_NDJSON,
+	BATCH_ARRAY,
+};
+
+struct batch{
+	/// Stage to forward batch from
+	const struct stage *stage;
+	struct msg_meta meta;
+	uint64_t key_hash;
+	size_t key_len;
+	char *key;
+	char *buf;
+	size_t used,size;
+	size_t count;
+	/// Monotonic time the batch has to be sent
+	double deadline;
+	TAILQ_ENTRY(batch) pending_entry;
+	LIST_ENTRY(batch) bucket_entry;
+};
+
+TAILQ_HEAD(batch_queue,batch);
+LIST_HEAD(batch_list,batch);
+
+struct batch_private{
+#ifdef BATCH_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	enum batch_format format;
+	size_t max_messages;
+	size_t max_bytes;
+	double max_delay;
+	char *key;
+	size_t key_len;
+
+	pthread_mutex_t mutex;
+	/// Open batches, by deadline
+	struct batch_queue pending;
+	struct batch_list buckets[BATCH_BUCKETS];
+	/// Last sent batch size, used to size new ones
+	size_t last_batch_size;
+
+	/// Delay flush thread
+	struct {
+		pthread_t thread;
+		struct ev_loop *loop;
+		ev_timer timer;
+		ev_async async;
+		int stop;
+	} flusher;
+
+	struct {
+		uint64_t messages;
+		uint64_t batches;
+		uint64_t flushed_by_count;
+		uint64_t flushed_by_bytes;
+		uint64_t flushed_by_delay;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+		/// Messages dropped because they could not be batched
+		uint64_t errors;
+	} counters;
+};
+
+static double monotonic_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+static uint64_t key_hash(const char *key,size_t key_len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for(i=0;i<key_len;++i) {
+		hash ^= (uint8_t)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Batches. Need priv->mutex.
+ */
+
+static struct batch *batch_lookup(struct batch_private *priv,uint64_t hash,
+                                  const char *key,size_t key_len) {
+	struct batch *batch = NULL;
+	LIST_FOREACH(batch,&priv->buckets[hash % BATCH_BUCKETS],bucket_entry) {
+		if(batch->key_hash == hash && batch->key_len == key_len
+		                  && 0 == memcmp(batch->key,key,key_len))
+			return batch;
+	}
+	return NULL;
+}
+
+static struct batch *batch_new(struct batch_private *priv,
+                               const struct stage *stage,
+                               const struct msg_meta *meta,uint64_t hash,
+                               const char *key,size_t key_len,
+                               size_t first_message_size) {
+	struct batch *batch = calloc(1,sizeof(*batch) + key_len);
+	if(NULL == batch) {
+		rdlog(LOG_ERR,"Can't allocate batch (out of memory?)");
+		return NULL;
+	}
+
+	/* Envelope chars, one per message plus array closing bracket */
+	batch->size = priv->last_batch_size;
+	if(batch->size < first_message_size + 2)
+		batch->size = first_message_size + 2;
+	if(batch->size < BATCH_MIN_ALLOC)
+		batch->size = BATCH_MIN_ALLOC;
+
+	batch->buf = malloc(batch->size);
+	if(NULL == batch->buf) {
+		rdlog(LOG_ERR,"Can't allocate batch buffer (out of memory?)");
+		free(batch);
+		return NULL;
+	}
+
+	batch->stage = stage;
+	batch->meta = *meta;
+	batch->meta.headers_count = 0;
+	batch->meta.key = NULL;
+	batch->meta.key_size = 0;
+	/* Record is acked once handed over */
+	batch->meta.ack = NULL;
+	batch->key_hash = hash;
+	batch->key_len = key_len;
+	batch->key = (char *)&batch[1];
+	memcpy(batch->key,key,key_len);
+	batch->deadline = monotonic_now() + priv->max_delay;
+
+	TAILQ_INSERT_TAIL(&priv->pending,batch,pending_entry);
+	LIST_INSERT_HEAD(&priv->buckets[hash % BATCH_BUCKETS],batch,bucket_entry);
+	return batch;
+}
+
+static int batch_append(struct batch_private *priv,struct batch *batch,
+                        const char *buffer,size_t buf_size) {
+	/* Room for a separator and array closing bracket */
+	const size_t needed = batch->used + buf_size + 2;
+	if(needed > batch->size) {
+		size_t new_size = batch->size;
+		while(new_size < needed)
+			new_size *= 2;
+
+		char *new_buf = realloc(batch->buf,new_size);
+		if(NULL == new_buf) {
+			rdlog(LOG_ERR,"Can't grow batch buffer (out of memory?)");
+			return -1;
+		}
+		batch->buf = new_buf;
+		batch->size = new_size;
+	}
+
+	if(BATCH_ARRAY == priv->format)
+		batch->buf[batch->used++] = batch->count ? ',' : '[';
+	memcpy(&batch->buf[batch->used],buffer,buf_size);
+	batch->used += buf_size;
+	if(BATCH_NDJSON == priv->format)
+		batch->buf[batch->used++] = '\n';
+	batch->count++;
+
+	return 0;
+}
+
+static void batch_detach(struct batch_private *priv,struct batch *batch) {
+	TAILQ_REMOVE(&priv->pending,batch,pending_entry);
+	LIST_REMOVE(batch,bucket_entry);
+	priv->last_batch_size = batch->size;
+}
+
+/// Send a detached batch. Don't hold priv->mutex.
+static void batch_send(struct batch_private *priv,struct batch *batch) {
+	if(0 == batch->count) {
+		/* Could not append any message */
+		free(batch->buf);
+		free(batch);
+		return;
+	}
+
+	if(BATCH_ARRAY == priv->format)
+		batch->buf[batch->used++] = ']';
+
+	ATOMIC_INC(priv->counters.batches);
+	ATOMIC_ADD(priv->counters.bytes_out,batch->used);
+
+	stage_forward(batch->stage,batch->buf,batch->used,&batch->meta);
+	free(batch);
+}
+
+/*
+ * Delay flush thread. It keeps a timer armed at the oldest batch deadline.
+ */
+
+static void flush_expired(struct batch_private *priv) {
+	struct batch_queue expired = TAILQ_HEAD_INITIALIZER(expired);
+	struct batch *batch = NULL;
+	const double now = monotonic_now();
+
+	pthread_mutex_lock(&priv->mutex);
+	while((batch = TAILQ_FIRST(&priv->pending)) && batch->deadline <= now) {
+		batch_detach(priv,batch);
+		TAILQ_INSERT_TAIL(&expired,batch,pending_entry);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+
+	while((batch = TAILQ_FIRST(&expired))) {
+		TAILQ_REMOVE(&expired,batch,pending_entry);
+		ATOMIC_INC(priv->counters.flushed_by_delay);
+		batch_send(priv,batch);
+	}
+}
+
+static void rearm_timer(struct batch_private *priv) {
+	double after = -1;
+
+	pthread_mutex_lock(&priv->mutex);
+	const struct batch *oldest = TAILQ_FIRST(&priv->pending);
+	if(oldest)
+		after = oldest->deadline - monotonic_now();
+	pthread_mutex_unlock(&priv->mutex);
+
+	ev_timer_stop(priv->flusher.loop,&priv->flusher.timer);
+	if(oldest) {
+		ev_timer_set(&priv->flusher.timer,after > 0 ? after : 0.,0.);
+		ev_timer_start(priv->flusher.loop,&priv->flusher.timer);
+	}
+}
+
+static void flusher_timer_cb(struct ev_loop *loop RB_UNUSED,ev_timer *w,
+                                                       int revents RB_UNUSED) {
+	struct batch_private *priv = w->data;
+	flush_expired(priv);
+	rearm_timer(priv);
+}
+
+static void flusher_async_cb(struct ev_loop *loop,ev_async *w,
+                                                       int revents RB_UNUSED) {
+	struct batch_private *priv = w->data;
+	if(ATOMIC_LOAD(priv->flusher.stop))
+		ev_break(loop,EVBREAK_ALL);
+	else
+		rearm_timer(priv);
+}
+
+static void *flusher_main(void *_priv) {
+	struct batch_private *priv = _priv;
+	ev_run(priv->flusher.loop,0);
+	return NULL;
+}
+
+/*
+ * Stage
+ */
+
+static int parse_batch_format(const char *format_name,enum batch_format *format) {
+	if(0 == strcmp(format_name,"ndjson")) {
+		*format = BATCH_NDJSON;
+	} else if(0 == strcmp(format_name,"array")) {
+		*format = BATCH_ARRAY;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void batch_private_done(struct batch_private *priv) {
+	if(priv->flusher.loop)
+		ev_loop_destroy(priv->flusher.loop);
+	pthread_mutex_destroy(&priv->mutex);
+	free(priv->key);
+	free(priv);
+}
+
+int batch_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	const char *format_name = "ndjson",*key = NULL;
+	json_int_t max_messages = BATCH_DEFAULT_MAX_MESSAGES;
+	json_int_t max_bytes = BATCH_DEFAULT_MAX_BYTES;
+	json_int_t max_delay_ms = BATCH_DEFAULT_MAX_DELAY_MS;
+	enum batch_format format = BATCH_NDJSON;
+	json_error_t jerr;
+	size_t i;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?s,s?I,s?I,s?I,s?s}",
+		CONFIG_BATCH_FORMAT_KEY,&format_name,
+		CONFIG_BATCH_MAX_MESSAGES_KEY,&max_messages,
+		CONFIG_BATCH_MAX_BYTES_KEY,&max_bytes,
+		CONFIG_BATCH_MAX_DELAY_KEY,&max_delay_ms,
+		CONFIG_BATCH_KEY_KEY,&key);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse batch stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(0 != parse_batch_format(format_name,&format)) {
+		snprintf(err,errsize,"Unknown batch format %s",format_name);
+		return -1;
+	}
+
+	if(max_messages <= 0 || max_bytes <= 0 || max_delay_ms <= 0) {
+		snprintf(err,errsize,"Batch max_messages, max_bytes and max_delay_ms "
+			"have to be greater than 0");
+		return -1;
+	}
+
+	struct batch_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate batch private (out of memory?)");
+		return -1;
+	}
+
+#ifdef BATCH_PRIVATE_MAGIC
+	priv->magic = BATCH_PRIVATE_MAGIC;
+#endif
+	priv->format = format;
+	priv->max_messages = (size_t)max_messages;
+	priv->max_bytes = (size_t)max_bytes;
+	priv->max_delay = (double)max_delay_ms/1000;
+	pthread_mutex_init(&priv->mutex,NULL);
+	TAILQ_INIT(&priv->pending);
+	for(i=0;i<BATCH_BUCKETS;++i)
+		LIST_INIT(&priv->buckets[i]);
+
+	if(key) {
+		priv->key = strdup(key);
+		priv->key_len = strlen(key);
+		if(NULL == priv->key) {
+			snprintf(err,errsize,"Can't allocate batch key (out of memory?)");
+			batch_private_done(priv);
+			return -1;
+		}
+	}
+
+	priv->flusher.loop = ev_loop_new(0);
+	if(NULL == priv->flusher.loop) {
+		snprintf(err,errsize,"Can't create batch event loop");
+		batch_private_done(priv);
+		return -1;
+	}
+
+	ev_timer_init(&priv->flusher.timer,flusher_timer_cb,0.,0.);
+	priv->flusher.timer.data = priv;
+	ev_async_init(&priv->flusher.async,flusher_async_cb);
+	priv->flusher.async.data = priv;
+	ev_async_start(priv->flusher.loop,&priv->flusher.async);
+
+	if(0 != pthread_create(&priv->flusher.thread,NULL,flusher_main,priv)) {
+		snprintf(err,errsize,"Can't create batch flush thread");
+		batch_private_done(priv);
+		return -1;
+	}
+
+	*_opaque = priv;
+	return 0;
+}
+
+void batch_stage_opaque_destructor(void *opaque) {
+	struct batch_private *priv = opaque;
+	struct batch *batch = NULL;
+#ifdef BATCH_PRIVATE_MAGIC
+	assert(BATCH_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_STORE(priv->flusher.stop,1);
+	ev_async_send(priv->flusher.loop,&priv->flusher.async);
+	pthread_join(priv->flusher.thread,NULL);
+
+	/* Next stages are still alive, so pending batches can be sent */
+	while((batch = TAILQ_FIRST(&priv->pending))) {
+		batch_detach(priv,batch);
+		batch_send(priv,batch);
+	}
+
+	batch_private_done(priv);
+}
+
+void batch_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct batch_private *priv = opaque;
+#ifdef BATCH_PRIVATE_MAGIC
+	assert(BATCH_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"batches",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.batches)));
+	json_object_set_new(stats,"flushed_by_count",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.flushed_by_count)));
+	json_object_set_new(stats,"flushed_by_bytes",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.flushed_by_bytes)));
+	json_object_set_new(stats,"flushed_by_delay",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.flushed_by_delay)));
+	json_object_set_new(stats,"bytes_in",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_in)));
+	json_object_set_new(stats,"bytes_out",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_out)));
+	json_object_set_new(stats,"errors",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.errors)));
+}
+
+void batch_stage_process(const struct stage *stage,char *buffer,
+                         size_t buf_size,const struct msg_meta *meta) {
+	struct batch_private *priv = stage->opaque;
+	struct batch *full_batch = NULL,*overflowed_batch = NULL;
+	const char *key = NULL,*key_end = NULL;
+	int new_oldest = 0,appended = 0;
+
+#ifdef BATCH_PRIVATE_MAGIC
+	assert(BATCH_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.messages);
+	ATOMIC_ADD(priv->counters.bytes_in,buf_size);
+
+	if(priv->key)
+		key = json_scan_member(buffer,buf_size,priv->key,priv->key_len,&key_end);
+	const size_t key_len = key ? (size_t)(key_end - key) : 0;
+	const uint64_t hash = key_hash(key,key_len);
+
+	pthread_mutex_lock(&priv->mutex);
+	struct batch *batch = batch_lookup(priv,hash,key,key_len);
+	if(batch && batch->used + buf_size + 1 > priv->max_bytes) {
+		/* Message does not fit in current batch */
+		batch_detach(priv,batch);
+		overflowed_batch = batch;
+		batch = NULL;
+	}
+
+	if(NULL == batch) {
+		new_oldest = TAILQ_EMPTY(&priv->pending);
+		batch = batch_new(priv,stage,meta,hash,key,key_len,buf_size);
+	}
+
+	if(batch)
+		appended = 0 == batch_append(priv,batch,buffer,buf_size);
+
+	if(appended && (batch->count >= priv->max_messages
+	                || batch->used >= priv->max_bytes)) {
+		batch_detach(priv,batch);
+		full_batch = batch;
+	}
+	pthread_mutex_unlock(&priv->mutex);
+
+	if(!appended) {
+		rdlog(LOG_WARNING,"Can't batch message of %zu bytes, dropping it",
+			buf_size);
+		ATOMIC_INC(priv->counters.errors);
+		/* Its record must not be acked */
+		if(meta && meta->ack)
+			ack_slot_fail(meta->ack);
+	}
+
+	free(buffer);
+
+	if(new_oldest)
+		ev_async_send(priv->flusher.loop,&priv->flusher.async);
+
+	if(overflowed_batch) {
+		ATOMIC_INC(priv->counters.flushed_by_bytes);
+		batch_send(priv,overflowed_batch);
+	}
+
+	if(full_batch) {
+		if(full_batch->count >= priv->max_messages)
+			ATOMIC_INC(priv->counters.flushed_by_count);
+		else
+			ATOMIC_INC(priv->counters.flushed_by_bytes);
+		batch_send(priv,full_batch);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * Micro batching stage. Packs many small messages into one kafka message:
+ *
+ *   {"type":"batch","format":"ndjson","max_messages":1000,
+ *    "max_bytes":65536,"max_delay_ms":100,"key":"sensor_ip"}
+ *
+ * Formats are "ndjson" (every message followed by a newline), and "array"
+ * (messages as JSON array elements). A batch is sent when it reaches
+ * max_messages or max_bytes, or max_delay_ms after its first message. If key
+ * is defined, messages are batched by that top level member value.
+ *
+ * Batches are sent with the meta of their first message but without its
+ * headers, so stages that add headers have to be placed after this one.
+ */
+
+#define BATCH_STAGE_TYPE "batch"
+
+int batch_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void batch_stage_opaque_destructor(void *opaque);
+void batch_stage_opaque_stats(void *opaque,struct json_t *stats);
+void batch_stage_process(const struct stage *stage,char *buffer,
+                         size_t buf_size,const struct msg_meta *meta);
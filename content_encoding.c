@@ -0,0 +1,404 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "content_encoding.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <zlib.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/// Decompressed block size
+#define CONTENT_DECODER_BLOCK_SIZE (16*1024)
+/// Max free decoders per thread and encoding
+#define CONTENT_DECODER_CACHE_SIZE 4
+
+enum content_encoding {
+	CONTENT_ENCODING_ZLIB,
+#ifdef HAVE_LIBZSTD
+	CONTENT_ENCODING_ZSTD,
+#endif
+#ifdef HAVE_LIBLZ4
+	CONTENT_ENCODING_LZ4,
+#endif
+	CONTENT_ENCODING_MAX,
+};
+
+static const struct {
+	const char *name;
+	enum content_encoding encoding;
+} content_encodings[] = {
+	{"gzip",CONTENT_ENCODING_ZLIB},
+	{"x-gzip",CONTENT_ENCODING_ZLIB},
+	{"deflate",CONTENT_ENCODING_ZLIB},
+#ifdef HAVE_LIBZSTD
+	{"zstd",CONTENT_ENCODING_ZSTD},
+#endif
+#ifdef HAVE_LIBLZ4
+	{"lz4",CONTENT_ENCODING_LZ4},
+#endif
+};
+
+struct content_decoder {
+	enum content_encoding encoding;
+	struct content_decoder_limits limits;
+	/// Bytes consumed and produced since get
+	size_t in_size,out_size;
+	/// In the middle of a compressed frame
+	int in_frame;
+	/// Next free decoder in thread cache
+	struct content_decoder *next;
+	union {
+		z_stream zlib;
+#ifdef HAVE_LIBZSTD
+		ZSTD_DCtx *zstd;
+#endif
+#ifdef HAVE_LIBLZ4
+		LZ4F_dctx *lz4;
+#endif
+	} ctx;
+};
+
+static void content_decoder_free(struct content_decoder *decoder) {
+	switch(decoder->encoding) {
+	case CONTENT_ENCODING_ZLIB:
+		inflateEnd(&decoder->ctx.zlib);
+		break;
+#ifdef HAVE_LIBZSTD
+	case CONTENT_ENCODING_ZSTD:
+		ZSTD_freeDCtx(decoder->ctx.zstd);
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case CONTENT_ENCODING_LZ4:
+		LZ4F_freeDecompressionContext(decoder->ctx.lz4);
+		break;
+#endif
+	case CONTENT_ENCODING_MAX:
+	default:
+		break;
+	};
+
+	free(decoder);
+}
+
+static struct content_decoder *content_decoder_new(
+                                             enum content_encoding encoding) {
+	struct content_decoder *decoder = calloc(1,sizeof(*decoder));
+	if(NULL == decoder)
+		return NULL;
+
+	decoder->encoding = encoding;
+	int ok = 0;
+	switch(encoding) {
+	case CONTENT_ENCODING_ZLIB:
+		/* Detect gzip or zlib header */
+		ok = Z_OK == inflateInit2(&decoder->ctx.zlib,15+32);
+		break;
+#ifdef HAVE_LIBZSTD
+	case CONTENT_ENCODING_ZSTD:
+		decoder->ctx.zstd = ZSTD_createDCtx();
+		ok = NULL != decoder->ctx.zstd;
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case CONTENT_ENCODING_LZ4:
+		ok = !LZ4F_isError(LZ4F_createDecompressionContext(
+			&decoder->ctx.lz4,LZ4F_VERSION));
+		break;
+#endif
+	case CONTENT_ENCODING_MAX:
+	default:
+		break;
+	};
+
+	if(!ok) {
+		free(decoder);
+		return NULL;
+	}
+
+	return decoder;
+}
+
+/*
+ * Per thread cache of free decoders
+ */
+
+struct content_decoder_cache {
+	struct content_decoder *free[CONTENT_ENCODING_MAX];
+	size_t count[CONTENT_ENCODING_MAX];
+};
+
+static pthread_key_t decoder_cache_key;
+static pthread_once_t decoder_cache_key_once = PTHREAD_ONCE_INIT;
+
+static void decoder_cache_destructor(void *_cache) {
+	struct content_decoder_cache *cache = _cache;
+	size_t i;
+
+	for(i=0;i<CONTENT_ENCODING_MAX;++i) {
+		while(cache->free[i]) {
+			struct content_decoder *decoder = cache->free[i];
+			cache->free[i] = decoder->next;
+			content_decoder_free(decoder);
+		}
+	}
+	free(cache);
+}
+
+static void decoder_cache_key_create() {
+	pthread_key_create(&decoder_cache_key,decoder_cache_destructor);
+}
+
+static struct content_decoder_cache *decoder_cache() {
+	pthread_once(&decoder_cache_key_once,decoder_cache_key_create);
+
+	struct content_decoder_cache *cache
+		= pthread_getspecific(decoder_cache_key);
+	if(unlikely(NULL == cache)) {
+		cache = calloc(1,sizeof(*cache));
+		if(cache)
+			pthread_setspecific(decoder_cache_key,cache);
+	}
+
+	return cache;
+}
+
+int content_decoder_get(const char *content_encoding,
+                        const struct content_decoder_limits *limits,
+                        struct content_decoder **_decoder) {
+	size_t i;
+
+	*_decoder = NULL;
+	if(NULL == content_encoding || 0 == strcasecmp(content_encoding,"identity"))
+		return 0;
+
+	for(i=0;i<sizeof(content_encodings)/sizeof(content_encodings[0]);++i) {
+		if(0 == strcasecmp(content_encoding,content_encodings[i].name))
+			break;
+	}
+
+	if(i == sizeof(content_encodings)/sizeof(content_encodings[0]))
+		return -1;
+
+	const enum content_encoding encoding = content_encodings[i].encoding;
+	struct content_decoder_cache *cache = decoder_cache();
+	struct content_decoder *decoder = cache ? cache->free[encoding] : NULL;
+	if(decoder) {
+		cache->free[encoding] = decoder->next;
+		cache->count[encoding]--;
+	} else {
+		decoder = content_decoder_new(encoding);
+		if(NULL == decoder) {
+			rdlog(LOG_ERR,"Can't allocate %s decoder (out of memory?)",
+				content_encoding);
+			return -1;
+		}
+	}
+
+	decoder->limits = *limits;
+	decoder->in_size = decoder->out_size = 0;
+	decoder->in_frame = 0;
+	decoder->next = NULL;
+	*_decoder = decoder;
+	return 0;
+}
+
+void content_decoder_release(struct content_decoder *decoder) {
+	switch(decoder->encoding) {
+	case CONTENT_ENCODING_ZLIB:
+		inflateReset(&decoder->ctx.zlib);
+		break;
+#ifdef HAVE_LIBZSTD
+	case CONTENT_ENCODING_ZSTD:
+		ZSTD_DCtx_reset(decoder->ctx.zstd,ZSTD_reset_session_only);
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case CONTENT_ENCODING_LZ4:
+		LZ4F_resetDecompressionContext(decoder->ctx.lz4);
+		break;
+#endif
+	case CONTENT_ENCODING_MAX:
+	default:
+		break;
+	};
+
+	struct content_decoder_cache *cache = decoder_cache();
+	if(NULL == cache
+	        || cache->count[decoder->encoding] == CONTENT_DECODER_CACHE_SIZE) {
+		content_decoder_free(decoder);
+		return;
+	}
+
+	decoder->next = cache->free[decoder->encoding];
+	cache->free[decoder->encoding] = decoder;
+	cache->count[decoder->encoding]++;
+}
+
+/*
+ * Decompression
+ */
+
+/// Check limits and call user callback with a decompressed block
+static int content_decoder_output(struct content_decoder *decoder,
+                                  const char *data,size_t size,
+                                  content_decoder_cb cb,void *opaque) {
+	decoder->out_size += size;
+
+	if(decoder->limits.max_size
+	        && decoder->out_size > decoder->limits.max_size)
+		return CONTENT_DECODER_LIMIT;
+
+	/* Allow one block of slack, so tiny bodies are not rejected */
+	if(decoder->limits.max_ratio
+	        && decoder->out_size > CONTENT_DECODER_BLOCK_SIZE
+	        && decoder->out_size/decoder->limits.max_ratio > decoder->in_size)
+		return CONTENT_DECODER_LIMIT;
+
+	return size > 0 ? cb(data,size,opaque) : 0;
+}
+
+static int zlib_decode(struct content_decoder *decoder,const char *in,
+                       size_t in_size,content_decoder_cb cb,void *opaque) {
+	char out[CONTENT_DECODER_BLOCK_SIZE];
+	z_stream *strm = &decoder->ctx.zlib;
+
+	strm->next_in = (Bytef *)(uintptr_t)in;
+	strm->avail_in = (uInt)in_size;
+
+	/* Full output buffer: there could be more data to flush */
+	do {
+		strm->next_out = (Bytef *)out;
+		strm->avail_out = sizeof(out);
+		if(strm->avail_in > 0)
+			decoder->in_frame = 1;
+
+		const int zrc = inflate(strm,Z_NO_FLUSH);
+		if(Z_BUF_ERROR == zrc)
+			break; /* No progress possible */
+		if(Z_OK != zrc && Z_STREAM_END != zrc)
+			return CONTENT_DECODER_INVALID;
+
+		const int rc = content_decoder_output(decoder,out,
+			sizeof(out) - strm->avail_out,cb,opaque);
+		if(0 != rc)
+			return rc;
+
+		if(Z_STREAM_END == zrc) {
+			/* Concatenated gzip members */
+			decoder->in_frame = 0;
+			inflateReset(strm);
+		}
+	} while(strm->avail_in > 0 || 0 == strm->avail_out);
+
+	return CONTENT_DECODER_OK;
+}
+
+#ifdef HAVE_LIBZSTD
+static int zstd_decode(struct content_decoder *decoder,const char *in,
+                       size_t in_size,content_decoder_cb cb,void *opaque) {
+	char out[CONTENT_DECODER_BLOCK_SIZE];
+	ZSTD_inBuffer input = {in,in_size,0};
+
+	do {
+		ZSTD_outBuffer output = {out,sizeof(out),0};
+		const size_t zrc = ZSTD_decompressStream(decoder->ctx.zstd,&output,
+			&input);
+		if(ZSTD_isError(zrc))
+			return CONTENT_DECODER_INVALID;
+		decoder->in_frame = 0 != zrc;
+
+		const int rc = content_decoder_output(decoder,out,output.pos,cb,
+			opaque);
+		if(0 != rc)
+			return rc;
+
+		/* Output buffer full: there could be more data to flush */
+		if(output.pos < output.size && input.pos == input.size)
+			break;
+	} while(1);
+
+	return CONTENT_DECODER_OK;
+}
+#endif
+
+#ifdef HAVE_LIBLZ4
+static int lz4_decode(struct content_decoder *decoder,const char *in,
+                      size_t in_size,content_decoder_cb cb,void *opaque) {
+	char out[CONTENT_DECODER_BLOCK_SIZE];
+
+	do {
+		size_t out_size = sizeof(out),consumed = in_size;
+		const size_t lrc = LZ4F_decompress(decoder->ctx.lz4,out,&out_size,
+			in,&consumed,NULL);
+		if(LZ4F_isError(lrc))
+			return CONTENT_DECODER_INVALID;
+		decoder->in_frame = 0 != lrc;
+		in += consumed;
+		in_size -= consumed;
+
+		const int rc = content_decoder_output(decoder,out,out_size,cb,
+			opaque);
+		if(0 != rc)
+			return rc;
+
+		if(out_size < sizeof(out) && 0 == in_size)
+			break;
+	} while(1);
+
+	return CONTENT_DECODER_OK;
+}
+#endif
+
+int content_decoder_decode(struct content_decoder *decoder,const char *in,
+                           size_t in_size,content_decoder_cb cb,void *opaque) {
+	decoder->in_size += in_size;
+
+	switch(decoder->encoding) {
+	case CONTENT_ENCODING_ZLIB:
+		return zlib_decode(decoder,in,in_size,cb,opaque);
+#ifdef HAVE_LIBZSTD
+	case CONTENT_ENCODING_ZSTD:
+		return zstd_decode(decoder,in,in_size,cb,opaque);
+#endif
+#ifdef HAVE_LIBLZ4
+	case CONTENT_ENCODING_LZ4:
+		return lz4_decode(decoder,in,in_size,cb,opaque);
+#endif
+	case CONTENT_ENCODING_MAX:
+	default:
+		return CONTENT_DECODER_INVALID;
+	};
+}
+
+int content_decoder_finished(const struct content_decoder *decoder) {
+	return !decoder->in_frame;
+}
@@ -0,0 +1,76 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Streaming decompression of HTTP request bodies, by Content-Encoding:
+ * gzip and deflate (zlib), zstd (if built with --enable-zstd) and lz4 frames
+ * (if built with --enable-lz4). Decompression contexts are reused between
+ * requests of the same thread.
+ */
+
+struct content_decoder;
+
+/// Decompression limits, against decompression bombs
+struct content_decoder_limits {
+	/// Max decompressed size. 0 for no limit.
+	size_t max_size;
+	/// Max decompressed/compressed size ratio. 0 for no limit.
+	size_t max_ratio;
+};
+
+/// Default limits of HTTP listeners
+#define CONTENT_DECODER_DEFAULT_MAX_SIZE (64*1024*1024)
+#define CONTENT_DECODER_DEFAULT_MAX_RATIO 100
+
+enum content_decoder_rc {
+	CONTENT_DECODER_OK = 0,
+	/// Input is not valid compressed data
+	CONTENT_DECODER_INVALID = -1,
+	/// Output exceeded limits
+	CONTENT_DECODER_LIMIT = -2,
+};
+
+/// Decompressed data callback. Return 0 to continue.
+typedef int (*content_decoder_cb)(const char *data,size_t size,void *opaque);
+
+/** Get a decoder for a Content-Encoding.
+    @param content_encoding Content-Encoding header value
+    @param limits Decompression limits (copied)
+    @param decoder Decoder, or NULL if content is not encoded (identity)
+    @return 0 on success, -1 if encoding is not supported.
+    */
+int content_decoder_get(const char *content_encoding,
+                        const struct content_decoder_limits *limits,
+                        struct content_decoder **decoder);
+
+/** Decompress a body chunk, calling cb with every decompressed block
+    @return CONTENT_DECODER_OK on success. If cb does not return 0,
+            decompression stops and its return code is returned.
+    */
+int content_decoder_decode(struct content_decoder *decoder,const char *in,
+                           size_t in_size,content_decoder_cb cb,void *opaque);
+
+/// Check that body ended at the end of a compressed frame
+int content_decoder_finished(const struct content_decoder *decoder);
+
+/// Return decoder to thread cache
+void content_decoder_release(struct content_decoder *decoder);
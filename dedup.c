@@ -0,0 +1,333 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dedup.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_DEDUP_KEY_KEY "key"
+#define CONFIG_DEDUP_WINDOW_KEY "window_ms"
+#define CONFIG_DEDUP_MAX_ENTRIES_KEY "max_entries"
+
+#define DEDUP_DEFAULT_WINDOW_MS 60000
+#define DEDUP_DEFAULT_MAX_ENTRIES 262144
+
+/// Independent hash sets, to reduce lock contention
+#define DEDUP_SHARDS 16
+
+/** Every shard is a ring of DEDUP_GENERATIONS hash tables. New hashes are
+    inserted in the newest one, and the oldest one is cleared and reused when
+    the newest one is full or window_ms/(DEDUP_GENERATIONS-1) old. */
+#define DEDUP_GENERATIONS 4
+
+#define DEDUP_PRIVATE_MAGIC 0xDED0DED0DED0DED0L
+
+/// Open addressing hash table. 0 means empty slot.
+struct dedup_generation{
+	uint64_t *slots;
+	size_t entries;
+	uint64_t start_ms;
+};
+
+struct dedup_shard{
+	pthread_mutex_t mutex;
+	struct dedup_generation generations[DEDUP_GENERATIONS];
+	/// Newest generation
+	size_t current;
+};
+
+struct dedup_private{
+#ifdef DEDUP_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	char *key;
+	size_t key_len;
+	uint64_t generation_ms;
+	/// Max entries per generation
+	size_t generation_entries;
+	size_t slots_mask;
+	struct dedup_shard shards[DEDUP_SHARDS];
+	struct {
+		uint64_t messages;
+		uint64_t bytes;
+		uint64_t duplicated_messages;
+		uint64_t duplicated_bytes;
+		uint64_t missing_key;
+		uint64_t rotations;
+	} counters;
+};
+
+static uint64_t hash_mix(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/// 64 bits hash, 8 bytes at a time
+static uint64_t dedup_hash(const char *buffer,size_t buf_size) {
+	static const uint64_t m = 0x9e3779b97f4a7c15ULL;
+	uint64_t hash = buf_size * m;
+	uint64_t word;
+
+	for(;buf_size >= sizeof(word);buf_size -= sizeof(word)) {
+		memcpy(&word,buffer,sizeof(word));
+		buffer += sizeof(word);
+		hash = (hash ^ hash_mix(word)) * m;
+	}
+
+	if(buf_size > 0) {
+		word = 0;
+		memcpy(&word,buffer,buf_size);
+		hash = (hash ^ hash_mix(word)) * m;
+	}
+
+	hash = hash_mix(hash);
+	return hash ? hash : 1;
+}
+
+/*
+ * Shard. All functions need shard mutex.
+ */
+
+static int generation_contains(const struct dedup_private *priv,
+                      const struct dedup_generation *generation,uint64_t hash) {
+	size_t i;
+	for(i=hash & priv->slots_mask;generation->slots[i];
+	                                    i = (i+1) & priv->slots_mask) {
+		if(generation->slots[i] == hash)
+			return 1;
+	}
+	return 0;
+}
+
+static void generation_insert(const struct dedup_private *priv,
+                      struct dedup_generation *generation,uint64_t hash) {
+	size_t i = hash & priv->slots_mask;
+	while(generation->slots[i])
+		i = (i+1) & priv->slots_mask;
+	generation->slots[i] = hash;
+	generation->entries++;
+}
+
+/// Clear oldest generation and make it the newest one
+static void shard_rotate(struct dedup_private *priv,struct dedup_shard *shard,
+                                                            uint64_t now_ms) {
+	shard->current = (shard->current + 1) % DEDUP_GENERATIONS;
+	struct dedup_generation *generation = &shard->generations[shard->current];
+	memset(generation->slots,0,
+		(priv->slots_mask + 1)*sizeof(generation->slots[0]));
+	generation->entries = 0;
+	generation->start_ms = now_ms;
+	ATOMIC_INC(priv->counters.rotations);
+}
+
+/// Check hash, and insert it if it is new. Return 1 if it was seen.
+static int shard_check(struct dedup_private *priv,struct dedup_shard *shard,
+                                             uint64_t hash,uint64_t now_ms) {
+	size_t i;
+
+	/* Forget generations older than the window */
+	const uint64_t elapsed = (now_ms -
+		shard->generations[shard->current].start_ms) / priv->generation_ms;
+	for(i=0;i<elapsed && i<DEDUP_GENERATIONS;++i)
+		shard_rotate(priv,shard,now_ms);
+
+	for(i=0;i<DEDUP_GENERATIONS;++i) {
+		if(generation_contains(priv,&shard->generations[i],hash))
+			return 1;
+	}
+
+	if(shard->generations[shard->current].entries >= priv->generation_entries)
+		shard_rotate(priv,shard,now_ms);
+
+	generation_insert(priv,&shard->generations[shard->current],hash);
+	return 0;
+}
+
+/*
+ * Stage
+ */
+
+int dedup_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	const char *key = NULL;
+	json_int_t window_ms = DEDUP_DEFAULT_WINDOW_MS;
+	json_int_t max_entries = DEDUP_DEFAULT_MAX_ENTRIES;
+	json_error_t jerr;
+	size_t i,j,slots = 1;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?s,s?I,s?I}",
+		CONFIG_DEDUP_KEY_KEY,&key,
+		CONFIG_DEDUP_WINDOW_KEY,&window_ms,
+		CONFIG_DEDUP_MAX_ENTRIES_KEY,&max_entries);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse dedup stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(window_ms <= 0 || max_entries < DEDUP_SHARDS*DEDUP_GENERATIONS) {
+		snprintf(err,errsize,"Dedup window_ms has to be greater than 0, and "
+			"max_entries at least %d",DEDUP_SHARDS*DEDUP_GENERATIONS);
+		return -1;
+	}
+
+	struct dedup_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate dedup private (out of memory?)");
+		return -1;
+	}
+
+#ifdef DEDUP_PRIVATE_MAGIC
+	priv->magic = DEDUP_PRIVATE_MAGIC;
+#endif
+
+	if(key) {
+		priv->key = strdup(key);
+		priv->key_len = strlen(key);
+		if(NULL == priv->key) {
+			snprintf(err,errsize,"Can't allocate dedup key (out of memory?)");
+			free(priv);
+			return -1;
+		}
+	}
+
+	priv->generation_ms = (uint64_t)window_ms / (DEDUP_GENERATIONS - 1);
+	if(0 == priv->generation_ms)
+		priv->generation_ms = 1;
+	priv->generation_entries = (size_t)max_entries
+		/ (DEDUP_SHARDS*DEDUP_GENERATIONS);
+
+	/* Keep load factor under 50% */
+	while(slots < 2*priv->generation_entries)
+		slots *= 2;
+	priv->slots_mask = slots - 1;
+
+	const uint64_t now_ms = monotonic_ms();
+	for(i=0;i<DEDUP_SHARDS;++i) {
+		struct dedup_shard *shard = &priv->shards[i];
+		pthread_mutex_init(&shard->mutex,NULL);
+		for(j=0;j<DEDUP_GENERATIONS;++j) {
+			shard->generations[j].start_ms = now_ms;
+			shard->generations[j].slots = calloc(slots,
+				sizeof(shard->generations[j].slots[0]));
+			if(NULL == shard->generations[j].slots) {
+				snprintf(err,errsize,
+					"Can't allocate dedup table (out of memory?)");
+				dedup_stage_opaque_destructor(priv);
+				return -1;
+			}
+		}
+	}
+
+	*_opaque = priv;
+	return 0;
+}
+
+void dedup_stage_opaque_destructor(void *opaque) {
+	struct dedup_private *priv = opaque;
+	size_t i,j;
+#ifdef DEDUP_PRIVATE_MAGIC
+	assert(DEDUP_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	for(i=0;i<DEDUP_SHARDS;++i) {
+		for(j=0;j<DEDUP_GENERATIONS;++j)
+			free(priv->shards[i].generations[j].slots);
+		pthread_mutex_destroy(&priv->shards[i].mutex);
+	}
+	free(priv->key);
+	free(priv);
+}
+
+void dedup_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct dedup_private *priv = opaque;
+#ifdef DEDUP_PRIVATE_MAGIC
+	assert(DEDUP_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const size_t memory = DEDUP_SHARDS*DEDUP_GENERATIONS
+		*(priv->slots_mask + 1)*sizeof(uint64_t);
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"bytes",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes)));
+	json_object_set_new(stats,"duplicated_messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.duplicated_messages)));
+	json_object_set_new(stats,"duplicated_bytes",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.duplicated_bytes)));
+	json_object_set_new(stats,"missing_key",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.missing_key)));
+	json_object_set_new(stats,"rotations",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.rotations)));
+	json_object_set_new(stats,"memory",json_integer((json_int_t)memory));
+}
+
+void dedup_stage_process(const struct stage *stage,char *buffer,
+                         size_t buf_size,const struct msg_meta *meta) {
+	struct dedup_private *priv = stage->opaque;
+	const char *hashed = buffer,*value_end = NULL;
+	size_t hashed_size = buf_size;
+
+#ifdef DEDUP_PRIVATE_MAGIC
+	assert(DEDUP_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.messages);
+	ATOMIC_ADD(priv->counters.bytes,buf_size);
+
+	if(priv->key) {
+		hashed = json_scan_member(buffer,buf_size,priv->key,priv->key_len,
+			&value_end);
+		if(NULL == hashed) {
+			ATOMIC_INC(priv->counters.missing_key);
+			stage_forward(stage,buffer,buf_size,meta);
+			return;
+		}
+		hashed_size = (size_t)(value_end - hashed);
+	}
+
+	const uint64_t hash = dedup_hash(hashed,hashed_size);
+	/* Shard with the high bits, slot with the low ones */
+	struct dedup_shard *shard = &priv->shards[(hash >> 60) % DEDUP_SHARDS];
+
+	pthread_mutex_lock(&shard->mutex);
+	const int duplicated = shard_check(priv,shard,hash,monotonic_ms());
+	pthread_mutex_unlock(&shard->mutex);
+
+	if(duplicated) {
+		ATOMIC_INC(priv->counters.duplicated_messages);
+		ATOMIC_ADD(priv->counters.duplicated_bytes,buf_size);
+		free(buffer);
+	} else {
+		stage_forward(stage,buffer,buf_size,meta);
+	}
+}
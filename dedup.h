@@ -0,0 +1,42 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * Duplicated messages suppression. Messages are identified by a 64 bits hash
+ * of the whole payload, or of the value of the top level member `key`:
+ *
+ *   {"type":"dedup","key":"id","window_ms":60000,"max_entries":262144}
+ *
+ * A message is dropped if another one with the same hash has been seen in the
+ * last window_ms. At most max_entries hashes are remembered, so the window is
+ * shorter under heavy load; memory is fixed at creation (16 to 32 bytes per
+ * entry). Messages without key member are always forwarded.
+ */
+
+#define DEDUP_STAGE_TYPE "dedup"
+
+int dedup_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void dedup_stage_opaque_destructor(void *opaque);
+void dedup_stage_opaque_stats(void *opaque,struct json_t *stats);
+void dedup_stage_process(const struct stage *stage,char *buffer,
+                         size_t buf_size,const struct msg_meta *meta);
@@ -0,0 +1,588 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "encode.h"
+#include "ack.h"
+#include "avro.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_ENCODE_FORMAT_KEY "format"
+#define CONFIG_ENCODE_SCHEMA_KEY "schema"
+
+#define ENCODE_PRIVATE_MAGIC 0xE2C0DEE2C0DEL
+
+/// Room reserved for a container header until its elements are counted
+#define CONTAINER_PLACEHOLDER_SIZE 5
+/// Longest scalar that is not a string (type byte + 8 bytes value)
+#define SCALAR_MAX_SIZE 9
+/// Scratch buffer initial size
+#define SCRATCH_INITIAL_SIZE 4096
+
+enum encode_format{
+	ENCODE_MSGPACK,
+	ENCODE_CBOR,
+	ENCODE_AVRO,
+};
+
+struct encode_private{
+#ifdef ENCODE_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	enum encode_format format;
+	struct avro_schema *schema;
+	struct {
+		uint64_t messages;
+		uint64_t errors;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+	} counters;
+};
+
+/*
+ * Encode buffer
+ */
+
+int encode_buffer_reserve(struct encode_buffer *buffer,size_t n) {
+	if(likely(buffer->size - buffer->used >= n))
+		return 0;
+
+	size_t new_size = buffer->size ? buffer->size : SCRATCH_INITIAL_SIZE;
+	while(new_size - buffer->used < n)
+		new_size *= 2;
+
+	char *new_buf = realloc(buffer->buf,new_size);
+	if(NULL == new_buf) {
+		rdlog(LOG_ERR,"Can't grow encode buffer to %zu bytes (out of memory?)",
+			new_size);
+		return -1;
+	}
+
+	buffer->buf = new_buf;
+	buffer->size = new_size;
+	return 0;
+}
+
+/*
+ * Per thread scratch buffer, so output only needs to be allocated once it
+ * has its final size.
+ */
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+static void scratch_destructor(void *_scratch) {
+	struct encode_buffer *scratch = _scratch;
+	free(scratch->buf);
+	free(scratch);
+}
+
+static void scratch_key_create() {
+	pthread_key_create(&scratch_key,scratch_destructor);
+}
+
+static struct encode_buffer *thread_scratch() {
+	pthread_once(&scratch_key_once,scratch_key_create);
+
+	struct encode_buffer *scratch = pthread_getspecific(scratch_key);
+	if(unlikely(NULL == scratch)) {
+		scratch = calloc(1,sizeof(*scratch));
+		if(NULL == scratch) {
+			rdlog(LOG_ERR,"Can't allocate encode buffer (out of memory?)");
+			return NULL;
+		}
+		pthread_setspecific(scratch_key,scratch);
+	}
+
+	scratch->used = 0;
+	return scratch;
+}
+
+/*
+ * MessagePack and CBOR primitives. All of them write at most
+ * SCALAR_MAX_SIZE bytes and return the number of bytes written.
+ */
+
+static size_t put_be(uint8_t *out,uint64_t value,size_t bytes) {
+	size_t i;
+	for(i=0;i<bytes;++i)
+		out[i] = (uint8_t)(value >> (8*(bytes - i - 1)));
+	return bytes;
+}
+
+/// CBOR major type and argument
+static size_t cbor_head(uint8_t *out,uint8_t major,uint64_t n) {
+	major <<= 5;
+	if(n < 24) {
+		out[0] = major | (uint8_t)n;
+		return 1;
+	} else if(n <= UINT8_MAX) {
+		out[0] = major | 24;
+		return 1 + put_be(&out[1],n,1);
+	} else if(n <= UINT16_MAX) {
+		out[0] = major | 25;
+		return 1 + put_be(&out[1],n,2);
+	} else if(n <= UINT32_MAX) {
+		out[0] = major | 26;
+		return 1 + put_be(&out[1],n,4);
+	} else {
+		out[0] = major | 27;
+		return 1 + put_be(&out[1],n,8);
+	}
+}
+
+/// MessagePack header with 8/16/32 bits length variants
+static size_t msgpack_head(uint8_t *out,uint8_t fix_type,uint64_t fix_limit,
+                           uint8_t type8,uint8_t type16,uint8_t type32,
+                           uint64_t n) {
+	if(n < fix_limit) {
+		out[0] = fix_type | (uint8_t)n;
+		return 1;
+	} else if(type8 && n <= UINT8_MAX) {
+		out[0] = type8;
+		return 1 + put_be(&out[1],n,1);
+	} else if(n <= UINT16_MAX) {
+		out[0] = type16;
+		return 1 + put_be(&out[1],n,2);
+	} else {
+		out[0] = type32;
+		return 1 + put_be(&out[1],n,4);
+	}
+}
+
+static size_t container_head(enum encode_format format,uint8_t *out,
+                                                    int is_map,uint64_t n) {
+	if(ENCODE_CBOR == format)
+		return cbor_head(out,is_map ? 5 : 4,n);
+	else if(is_map)
+		return msgpack_head(out,0x80,16,0,0xde,0xdf,n);
+	else
+		return msgpack_head(out,0x90,16,0,0xdc,0xdd,n);
+}
+
+static size_t string_head(enum encode_format format,uint8_t *out,uint64_t n) {
+	if(ENCODE_CBOR == format)
+		return cbor_head(out,3,n);
+	else
+		return msgpack_head(out,0xa0,32,0xd9,0xda,0xdb,n);
+}
+
+static size_t encode_integer(enum encode_format format,uint8_t *out,
+                                                           int64_t value) {
+	if(ENCODE_CBOR == format) {
+		return value >= 0 ? cbor_head(out,0,(uint64_t)value)
+		                  : cbor_head(out,1,(uint64_t)(-1 - value));
+	}
+
+	if(value >= 0) {
+		if(value < 128) {
+			out[0] = (uint8_t)value;
+			return 1;
+		}
+		if(value <= UINT8_MAX) {
+			out[0] = 0xcc;
+			return 1 + put_be(&out[1],(uint64_t)value,1);
+		}
+		if(value <= UINT16_MAX) {
+			out[0] = 0xcd;
+			return 1 + put_be(&out[1],(uint64_t)value,2);
+		}
+		if(value <= UINT32_MAX) {
+			out[0] = 0xce;
+			return 1 + put_be(&out[1],(uint64_t)value,4);
+		}
+		out[0] = 0xcf;
+		return 1 + put_be(&out[1],(uint64_t)value,8);
+	}
+
+	if(value >= -32) {
+		out[0] = (uint8_t)value;
+		return 1;
+	}
+	if(value >= INT8_MIN) {
+		out[0] = 0xd0;
+		return 1 + put_be(&out[1],(uint64_t)value,1);
+	}
+	if(value >= INT16_MIN) {
+		out[0] = 0xd1;
+		return 1 + put_be(&out[1],(uint64_t)value,2);
+	}
+	if(value >= INT32_MIN) {
+		out[0] = 0xd2;
+		return 1 + put_be(&out[1],(uint64_t)value,4);
+	}
+	out[0] = 0xd3;
+	return 1 + put_be(&out[1],(uint64_t)value,8);
+}
+
+static size_t encode_real(enum encode_format format,uint8_t *out,double value) {
+	uint64_t bits;
+	memcpy(&bits,&value,sizeof(bits));
+	out[0] = ENCODE_CBOR == format ? 0xfb : 0xcb;
+	return 1 + put_be(&out[1],bits,sizeof(bits));
+}
+
+/// true, false or null. Return 0 if text is not a literal.
+static size_t encode_literal(enum encode_format format,uint8_t *out,
+                                   const char *cursor,const char *end,
+                                   const char **literal_end) {
+	static const struct {
+		const char *text;
+		size_t len;
+		uint8_t msgpack,cbor;
+	} literals[] = {
+		{"true",  strlen("true"),  0xc3, 0xf5},
+		{"false", strlen("false"), 0xc2, 0xf4},
+		{"null",  strlen("null"),  0xc0, 0xf6},
+	};
+	size_t i;
+
+	for(i=0;i<sizeof(literals)/sizeof(literals[0]);++i) {
+		if((size_t)(end - cursor) >= literals[i].len
+		        && 0 == memcmp(cursor,literals[i].text,literals[i].len)) {
+			out[0] = ENCODE_CBOR == format ? literals[i].cbor
+			                               : literals[i].msgpack;
+			*literal_end = cursor + literals[i].len;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Encode a JSON string.
+    @param cursor Pointer just after the opening quote
+    @return Pointer after the closing quote, or NULL in case of error
+    */
+static const char *encode_string(enum encode_format format,
+                                 struct encode_buffer *out,
+                                 const char *cursor,const char *end) {
+	const char *string_end = json_scan_string(cursor,end);
+	if(NULL == string_end)
+		return NULL;
+
+	const size_t raw_len = (size_t)(string_end - cursor);
+	const int escaped = NULL != memchr(cursor,'\\',raw_len);
+	const size_t len = escaped ? json_unescaped_length(cursor,string_end)
+	                           : raw_len;
+	if((size_t)-1 == len || 0 != encode_buffer_reserve(out,SCALAR_MAX_SIZE + len))
+		return NULL;
+
+	out->used += string_head(format,(uint8_t *)out->buf + out->used,len);
+	if(escaped)
+		json_unescape(out->buf + out->used,cursor,string_end);
+	else
+		memcpy(out->buf + out->used,cursor,len);
+	out->used += len;
+
+	return string_end + 1;
+}
+
+struct open_container{
+	size_t head_pos;
+	uint64_t count;
+	int is_map;
+};
+
+/// Write container final header, moving its elements if needed
+static void close_container(enum encode_format format,struct encode_buffer *out,
+                            const struct open_container *container) {
+	uint8_t head[CONTAINER_PLACEHOLDER_SIZE];
+	const size_t head_len = container_head(format,head,container->is_map,
+		container->count);
+	char *dst = out->buf + container->head_pos;
+
+	if(head_len < CONTAINER_PLACEHOLDER_SIZE) {
+		const size_t elements_len = out->used - container->head_pos
+			- CONTAINER_PLACEHOLDER_SIZE;
+		memmove(dst + head_len,dst + CONTAINER_PLACEHOLDER_SIZE,elements_len);
+		out->used -= CONTAINER_PLACEHOLDER_SIZE - head_len;
+	}
+	memcpy(dst,head,head_len);
+}
+
+/** Convert JSON text to MessagePack or CBOR in a single pass. Containers
+    headers are written when they are closed, since element count is not
+    known before.
+    @return 0 on success
+    */
+static int json_to_binary(enum encode_format format,const char *buffer,
+                          size_t buf_size,struct encode_buffer *out) {
+	struct open_container stack[ENCODE_MAX_DEPTH];
+	const char *end = buffer + buf_size;
+	const char *cursor = json_scan_spaces(buffer,end);
+	size_t depth = 0;
+	int expect_key = 0;
+
+	while(1) {
+		if(cursor == end || 0 != encode_buffer_reserve(out,SCALAR_MAX_SIZE))
+			return -1;
+
+		uint8_t *dst = (uint8_t *)out->buf + out->used;
+		const char *value_end = NULL;
+		int64_t integer = 0;
+		double real = 0;
+
+		if(expect_key) {
+			if('"' != *cursor)
+				return -1;
+			cursor = encode_string(format,out,cursor + 1,end);
+			if(NULL == cursor)
+				return -1;
+			cursor = json_scan_spaces(cursor,end);
+			if(cursor == end || ':' != *cursor)
+				return -1;
+			cursor = json_scan_spaces(cursor + 1,end);
+			expect_key = 0;
+			continue;
+		}
+
+		switch(*cursor) {
+		case '{':
+		case '[':
+			if(depth == ENCODE_MAX_DEPTH
+			        || 0 != encode_buffer_reserve(out,CONTAINER_PLACEHOLDER_SIZE))
+				return -1;
+
+			stack[depth].head_pos = out->used;
+			stack[depth].count = 0;
+			stack[depth].is_map = '{' == *cursor;
+			out->used += CONTAINER_PLACEHOLDER_SIZE;
+
+			const char close_char = '{' == *cursor ? '}' : ']';
+			cursor = json_scan_spaces(cursor + 1,end);
+			if(cursor < end && close_char == *cursor) {
+				/* Empty container */
+				value_end = cursor + 1;
+				close_container(format,out,&stack[depth]);
+				break;
+			}
+			expect_key = stack[depth++].is_map;
+			continue;
+
+		case '"':
+			value_end = encode_string(format,out,cursor + 1,end);
+			break;
+
+		case 't':
+		case 'f':
+		case 'n':
+			out->used += encode_literal(format,dst,cursor,end,&value_end);
+			break;
+
+		default:
+			switch(json_parse_number(cursor,end,&integer,&real,&value_end)) {
+			case JSON_NUMBER_INTEGER:
+				out->used += encode_integer(format,dst,integer);
+				break;
+			case JSON_NUMBER_REAL:
+				out->used += encode_real(format,dst,real);
+				break;
+			case JSON_NUMBER_INVALID:
+			default:
+				return -1;
+			};
+			break;
+		};
+
+		if(NULL == value_end)
+			return -1;
+
+		/* Value done. Close all containers ending here */
+		cursor = json_scan_spaces(value_end,end);
+		while(1) {
+			if(0 == depth)
+				return cursor == end ? 0 : -1;
+			if(cursor == end)
+				return -1;
+
+			struct open_container *container = &stack[depth-1];
+			container->count++;
+			if(',' == *cursor) {
+				cursor = json_scan_spaces(cursor + 1,end);
+				expect_key = container->is_map;
+				break;
+			}
+
+			if(*cursor != (container->is_map ? '}' : ']'))
+				return -1;
+			close_container(format,out,container);
+			depth--;
+			cursor = json_scan_spaces(cursor + 1,end);
+		}
+	}
+}
+
+/*
+ * Stage
+ */
+
+static int parse_format(const char *format_name,enum encode_format *format) {
+	static const struct {
+		const char *name;
+		enum encode_format format;
+	} formats[] = {
+		{"msgpack", ENCODE_MSGPACK},
+		{"cbor",    ENCODE_CBOR},
+		{"avro",    ENCODE_AVRO},
+	};
+	size_t i;
+
+	for(i=0;i<sizeof(formats)/sizeof(formats[0]);++i) {
+		if(0 == strcmp(formats[i].name,format_name)) {
+			*format = formats[i].format;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int encode_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	const char *format_name = NULL,*schema_path = NULL;
+	enum encode_format format = ENCODE_MSGPACK;
+	struct avro_schema *schema = NULL;
+	json_error_t jerr;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s:s,s?s}",
+		CONFIG_ENCODE_FORMAT_KEY,&format_name,
+		CONFIG_ENCODE_SCHEMA_KEY,&schema_path);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse encode stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(0 != parse_format(format_name,&format)) {
+		snprintf(err,errsize,"Unknown encode format %s",format_name);
+		return -1;
+	}
+
+	if(ENCODE_AVRO == format) {
+		if(NULL == schema_path) {
+			snprintf(err,errsize,"Avro encode stage needs a %s",
+				CONFIG_ENCODE_SCHEMA_KEY);
+			return -1;
+		}
+
+		schema = avro_schema_load(schema_path,err,errsize);
+		if(NULL == schema)
+			return -1;
+	}
+
+	struct encode_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate encode private (out of memory?)");
+		if(schema)
+			avro_schema_done(schema);
+		return -1;
+	}
+
+#ifdef ENCODE_PRIVATE_MAGIC
+	priv->magic = ENCODE_PRIVATE_MAGIC;
+#endif
+	priv->format = format;
+	priv->schema = schema;
+
+	*_opaque = priv;
+	return 0;
+}
+
+void encode_stage_opaque_destructor(void *opaque) {
+	struct encode_private *priv = opaque;
+#ifdef ENCODE_PRIVATE_MAGIC
+	assert(ENCODE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	if(priv->schema)
+		avro_schema_done(priv->schema);
+	free(priv);
+}
+
+void encode_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct encode_private *priv = opaque;
+#ifdef ENCODE_PRIVATE_MAGIC
+	assert(ENCODE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"errors",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.errors)));
+	json_object_set_new(stats,"bytes_in",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_in)));
+	json_object_set_new(stats,"bytes_out",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_out)));
+}
+
+/// Discard a message that can't be encoded. Its record must not be acked.
+static void encode_drop(char *buffer,const struct msg_meta *meta) {
+	if(meta && meta->ack)
+		ack_slot_fail(meta->ack);
+	free(buffer);
+}
+
+void encode_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta) {
+	struct encode_private *priv = stage->opaque;
+#ifdef ENCODE_PRIVATE_MAGIC
+	assert(ENCODE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.messages);
+	ATOMIC_ADD(priv->counters.bytes_in,buf_size);
+
+	struct encode_buffer *scratch = thread_scratch();
+	const int encode_rc = NULL == scratch ? -1 :
+		ENCODE_AVRO == priv->format ?
+			avro_encode(priv->schema,buffer,buf_size,scratch) :
+			json_to_binary(priv->format,buffer,buf_size,scratch);
+
+	if(0 != encode_rc) {
+		ATOMIC_INC(priv->counters.errors);
+		encode_drop(buffer,meta);
+		return;
+	}
+
+	/* Binary encoding is usually smaller than JSON, so reuse input buffer */
+	char *encoded = buffer;
+	if(scratch->used > buf_size) {
+		encoded = malloc(scratch->used);
+		if(NULL == encoded) {
+			rdlog(LOG_ERR,"Can't allocate encoded message (out of memory?)");
+			ATOMIC_INC(priv->counters.errors);
+			encode_drop(buffer,meta);
+			return;
+		}
+		free(buffer);
+	}
+
+	memcpy(encoded,scratch->buf,scratch->used);
+	ATOMIC_ADD(priv->counters.bytes_out,scratch->used);
+	stage_forward(stage,encoded,scratch->used,meta);
+}
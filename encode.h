@@ -0,0 +1,58 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+#include <stdint.h>
+
+/*
+ * Binary encoding stage. Converts JSON messages to MessagePack, CBOR or Avro
+ * binary encoding (raw datum, no header):
+ *
+ *   {"type":"encode","format":"msgpack"}
+ *   {"type":"encode","format":"cbor"}
+ *   {"type":"encode","format":"avro","schema":"/etc/n2kafka/flow.avsc"}
+ *
+ * MessagePack and CBOR are converted from JSON text directly, without
+ * building any JSON object. Messages that can't be encoded are dropped, and
+ * their acked listener records fail instead of being acked.
+ */
+
+#define ENCODE_STAGE_TYPE "encode"
+
+/// Max nesting level of encoded messages
+#define ENCODE_MAX_DEPTH 64
+
+/// Growable output buffer. Encoders reuse one per thread.
+struct encode_buffer{
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+/// Make room for n bytes more. Return 0 on success.
+int encode_buffer_reserve(struct encode_buffer *buffer,size_t n);
+
+int encode_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void encode_stage_opaque_destructor(void *opaque);
+void encode_stage_opaque_stats(void *opaque,struct json_t *stats);
+void encode_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta);
@@ -0,0 +1,294 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "enrich.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define CONFIG_ENRICH_TABLE_KEY "table"
+
+#define ENRICH_PRIVATE_MAGIC 0xE1C4E1C4E1C4L
+
+struct enrich_table{
+	void *map;
+	size_t map_size;
+	const struct enrich_table_hdr *hdr;
+	const struct enrich_table_range *ranges;
+};
+
+struct enrich_private{
+#ifdef ENRICH_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	/// Protects table from being unmapped in the middle of a lookup
+	pthread_rwlock_t rwlock;
+	struct enrich_table table;
+};
+
+static void enrich_table_done(struct enrich_table *table) {
+	if(table->map)
+		munmap(table->map,table->map_size);
+	memset(table,0,sizeof(*table));
+}
+
+static int enrich_table_load(struct enrich_table *table,const char *path,
+                                                   char *err,size_t errsize) {
+	struct stat st;
+	char errbuf[BUFSIZ];
+
+	memset(table,0,sizeof(*table));
+
+	const int fd = open(path,O_RDONLY);
+	if(fd < 0) {
+		snprintf(err,errsize,"Can't open enrichment table %s: %s",path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	if(0 != fstat(fd,&st)) {
+		snprintf(err,errsize,"Can't stat enrichment table %s: %s",path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		close(fd);
+		return -1;
+	}
+
+	if((size_t)st.st_size < sizeof(struct enrich_table_hdr)) {
+		snprintf(err,errsize,"Enrichment table %s too small",path);
+		close(fd);
+		return -1;
+	}
+
+	table->map_size = (size_t)st.st_size;
+	table->map = mmap(NULL,table->map_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(MAP_FAILED == table->map) {
+		snprintf(err,errsize,"Can't map enrichment table %s: %s",path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		table->map = NULL;
+		return -1;
+	}
+
+	table->hdr = table->map;
+	table->ranges = (const struct enrich_table_range *)&table->hdr[1];
+
+	const size_t ranges_size = table->hdr->ranges*sizeof(table->ranges[0]);
+	if(0 != memcmp(table->hdr->magic,ENRICH_TABLE_MAGIC,sizeof(table->hdr->magic))
+	        || ENRICH_TABLE_VERSION != table->hdr->version
+	        || table->map_size - sizeof(*table->hdr) < ranges_size) {
+		snprintf(err,errsize,"%s is not a valid enrichment table",path);
+		enrich_table_done(table);
+		return -1;
+	}
+
+	rdlog(LOG_INFO,"Loaded enrichment table %s with %u ranges",path,
+		table->hdr->ranges);
+
+	return 0;
+}
+
+/// Longest prefix match. Return fragment, or NULL if addr is not in table
+static const char *enrich_table_lookup(const struct enrich_table *table,
+                                       uint32_t addr,size_t *fragment_length) {
+	size_t lo = 0,hi = table->hdr->ranges;
+
+	/* Last range with first <= addr */
+	while(lo < hi) {
+		const size_t mid = lo + (hi - lo)/2;
+		if(table->ranges[mid].first <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(0 == lo)
+		return NULL;
+
+	const struct enrich_table_range *range = &table->ranges[lo-1];
+	if(addr > range->last)
+		return NULL;
+
+	if((size_t)range->fragment_offset + range->fragment_length > table->map_size)
+		return NULL; /* Corrupted table */
+
+	*fragment_length = range->fragment_length;
+	return (const char *)table->map + range->fragment_offset;
+}
+
+/** Insert fragment members at the beginning of buffer JSON object.
+    @return new buffer, or NULL if buffer is not a JSON object or fragment
+            has no members
+    */
+static char *splice_fragment(const char *buffer,size_t buf_size,
+                             const char *fragment,size_t fragment_length,
+                             size_t *new_size) {
+	const char *end = buffer + buf_size;
+
+	/* Empty object entry ({}): nothing to add */
+	if(0 == fragment_length)
+		return NULL;
+
+	const char *open_brace = json_scan_spaces(buffer,end);
+	if(open_brace == end || *open_brace != '{')
+		return NULL;
+
+	const char *rest = open_brace + 1;
+	const char *first_member = json_scan_spaces(rest,end);
+	const int empty_object = first_member < end && *first_member == '}';
+	const size_t head_len = (size_t)(rest - buffer);
+	const size_t rest_len = (size_t)(end - rest);
+
+	*new_size = buf_size + fragment_length + (empty_object ? 0 : 1);
+	char *ret = malloc(*new_size);
+	if(NULL == ret) {
+		rdlog(LOG_ERR,"Can't allocate enriched message (out of memory?)");
+		return NULL;
+	}
+
+	char *cursor = ret;
+	memcpy(cursor,buffer,head_len);
+	cursor += head_len;
+	memcpy(cursor,fragment,fragment_length);
+	cursor += fragment_length;
+	if(!empty_object)
+		*cursor++ = ',';
+	memcpy(cursor,rest,rest_len);
+
+	return ret;
+}
+
+static const char *config_table_path(json_t *config,char *err,size_t errsize) {
+	const char *path = NULL;
+	json_error_t jerr;
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s:s}",
+		CONFIG_ENRICH_TABLE_KEY,&path);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse enrich stage: %s",jerr.text);
+		return NULL;
+	}
+
+	return path;
+}
+
+int enrich_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	assert(_opaque);
+
+	const char *path = config_table_path(config,err,errsize);
+	if(NULL == path)
+		return -1;
+
+	struct enrich_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate enrich private (out of memory?)");
+		return -1;
+	}
+
+#ifdef ENRICH_PRIVATE_MAGIC
+	priv->magic = ENRICH_PRIVATE_MAGIC;
+#endif
+
+	if(0 != enrich_table_load(&priv->table,path,err,errsize)) {
+		free(priv);
+		return -1;
+	}
+
+	pthread_rwlock_init(&priv->rwlock,NULL);
+	*_opaque = priv;
+	return 0;
+}
+
+int enrich_stage_opaque_reload(json_t *config,void *opaque) {
+	struct enrich_private *priv = opaque;
+	struct enrich_table new_table,old_table;
+	char err[BUFSIZ];
+
+#ifdef ENRICH_PRIVATE_MAGIC
+	assert(ENRICH_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const char *path = config_table_path(config,err,sizeof(err));
+	if(NULL == path || 0 != enrich_table_load(&new_table,path,err,sizeof(err))) {
+		rdlog(LOG_ERR,"%s. Keeping old enrichment table.",err);
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&priv->rwlock);
+	old_table = priv->table;
+	priv->table = new_table;
+	pthread_rwlock_unlock(&priv->rwlock);
+
+	enrich_table_done(&old_table);
+	return 0;
+}
+
+void enrich_stage_opaque_destructor(void *opaque) {
+	struct enrich_private *priv = opaque;
+#ifdef ENRICH_PRIVATE_MAGIC
+	assert(ENRICH_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	enrich_table_done(&priv->table);
+	pthread_rwlock_destroy(&priv->rwlock);
+	free(priv);
+}
+
+void enrich_stage_process(const struct stage *stage,char *buffer,size_t buf_size,
+                                                const struct msg_meta *meta) {
+	struct enrich_private *priv = stage->opaque;
+	size_t fragment_length = 0,new_size = 0;
+	char *enriched = NULL;
+
+#ifdef ENRICH_PRIVATE_MAGIC
+	assert(ENRICH_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	if(AF_INET == meta->client_addr.sin_family) {
+		const uint32_t addr = ntohl(meta->client_addr.sin_addr.s_addr);
+
+		pthread_rwlock_rdlock(&priv->rwlock);
+		const char *fragment = enrich_table_lookup(&priv->table,addr,
+			&fragment_length);
+		if(fragment) {
+			enriched = splice_fragment(buffer,buf_size,fragment,
+				fragment_length,&new_size);
+		}
+		pthread_rwlock_unlock(&priv->rwlock);
+	}
+
+	if(enriched) {
+		free(buffer);
+		stage_forward(stage,enriched,new_size,meta);
+	} else {
+		stage_forward(stage,buffer,buf_size,meta);
+	}
+}
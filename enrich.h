@@ -0,0 +1,70 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+#include <stdint.h>
+
+/*
+ * Source address enrichment stage. Looks up message sender address in a
+ * CIDR -> JSON fragment table, and splice the fragment at the beginning of
+ * the message JSON object:
+ *
+ *   {"a":1} + "site":"mad1" -> {"site":"mad1","a":1}
+ *
+ * Table is a binary file mapped in memory, so load & reload do not depend on
+ * table size. It can be generated with tools/enrich_table.py. Format (all
+ * integers in host byte order):
+ *
+ *   struct enrich_table_hdr
+ *   struct enrich_table_range[hdr.ranges]   (sorted, not overlapping)
+ *   fragments                               (JSON object members, no braces)
+ *
+ * Nested CIDRs are resolved when the file is generated, so every range
+ * already points to the most specific prefix fragment, and the longest prefix
+ * match is a binary search.
+ */
+
+#define ENRICH_STAGE_TYPE "enrich"
+
+#define ENRICH_TABLE_MAGIC "N2KE"
+#define ENRICH_TABLE_VERSION 1
+
+struct enrich_table_hdr{
+	char magic[4];
+	uint32_t version;
+	uint32_t ranges;
+	uint32_t reserved;
+};
+
+struct enrich_table_range{
+	/// First and last address (inclusive) of the range
+	uint32_t first,last;
+	/// Fragment offset, from the beginning of the file
+	uint32_t fragment_offset;
+	uint32_t fragment_length;
+};
+
+int enrich_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                    char *err,size_t errsize);
+int enrich_stage_opaque_reload(struct json_t *config,void *opaque);
+void enrich_stage_opaque_destructor(void *opaque);
+void enrich_stage_process(const struct stage *stage,char *buffer,size_t buf_size,
+                                                  const struct msg_meta *meta);
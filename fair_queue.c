@@ -0,0 +1,354 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fair_queue.h"
+#include "ack.h"
+#include "global_config.h"
+#include "kafka.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+/// Max number of listeners with queue
+#define FAIR_QUEUE_MAX_LISTENERS 64
+/// Bytes a queue can send per round and weight unit
+#define FAIR_QUEUE_QUANTUM 4096
+/// Time to wait for room in producer queue
+#define FAIR_QUEUE_FULL_WAIT_MS 5
+
+struct queued_msg{
+	TAILQ_ENTRY(queued_msg) entry;
+	rd_kafka_topic_t *rkt;
+	char *buf;
+	size_t size;
+	int flags;
+	void *opaque;
+	uint64_t queued_ms;
+	/// Header names and values, and key, are copied after the message
+	struct msg_meta meta;
+};
+
+TAILQ_HEAD(queued_msg_list,queued_msg);
+
+struct listener_queue{
+	uint16_t listener_port;
+	int priority;
+	unsigned weight;
+	size_t max_messages;
+
+	struct queued_msg_list msgs;
+	size_t count;
+	/// Deficit round robin bytes counter
+	size_t deficit;
+
+	struct {
+		uint64_t queued;
+		uint64_t produced;
+		uint64_t dropped;
+		uint64_t delay_ms;
+		uint64_t max_delay_ms;
+	} counters;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/// Queues are never removed, so lookups don't need the mutex
+	size_t count;
+	struct listener_queue queues[FAIR_QUEUE_MAX_LISTENERS];
+	/// Queued messages in all queues
+	size_t messages;
+	/// Round robin position
+	size_t current;
+	int current_visited;
+
+	pthread_t thread;
+	int running;
+	int stop;
+} fair_queue = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct listener_queue *listener_queue(uint16_t listener_port) {
+	size_t i;
+	const size_t count = __atomic_load_n(&fair_queue.count,__ATOMIC_ACQUIRE);
+
+	for(i=0;i<count;++i) {
+		if(fair_queue.queues[i].listener_port == listener_port)
+			return &fair_queue.queues[i];
+	}
+
+	return NULL;
+}
+
+/// Copy message and its meta headers
+static struct queued_msg *queued_msg_new(rd_kafka_topic_t *rkt,char *buf,
+                              size_t bufsize,int flags,
+                              const struct msg_meta *meta,void *opaque) {
+	size_t i,headers_size = meta->key_size;
+
+	for(i=0;i<meta->headers_count;++i) {
+		headers_size += strlen(meta->headers[i].name) + 1
+			+ meta->headers[i].value_size;
+	}
+
+	struct queued_msg *msg = malloc(sizeof(*msg) + headers_size);
+	if(NULL == msg)
+		return NULL;
+
+	msg->rkt = rkt;
+	msg->buf = buf;
+	msg->size = bufsize;
+	msg->flags = flags;
+	msg->opaque = opaque;
+	msg->queued_ms = monotonic_ms();
+	msg->meta = *meta;
+
+	char *cursor = (char *)&msg[1];
+	for(i=0;i<meta->headers_count;++i) {
+		const size_t name_size = strlen(meta->headers[i].name) + 1;
+		memcpy(cursor,meta->headers[i].name,name_size);
+		msg->meta.headers[i].name = cursor;
+		cursor += name_size;
+		memcpy(cursor,meta->headers[i].value,meta->headers[i].value_size);
+		msg->meta.headers[i].value = cursor;
+		cursor += meta->headers[i].value_size;
+	}
+
+	if(meta->key) {
+		memcpy(cursor,meta->key,meta->key_size);
+		msg->meta.key = cursor;
+	}
+
+	return msg;
+}
+
+/*
+ * Scheduler. All functions need fair_queue mutex.
+ */
+
+/// Next message to produce: highest priority, then deficit round robin
+static struct queued_msg *scheduler_pop(struct listener_queue **_queue) {
+	int priority = INT_MIN;
+	size_t i;
+
+	if(0 == fair_queue.messages)
+		return NULL;
+
+	for(i=0;i<fair_queue.count;++i) {
+		const struct listener_queue *queue = &fair_queue.queues[i];
+		if(queue->count > 0 && queue->priority > priority)
+			priority = queue->priority;
+	}
+
+	while(1) {
+		struct listener_queue *queue = &fair_queue.queues[fair_queue.current];
+		if(queue->count > 0 && queue->priority == priority) {
+			struct queued_msg *msg = TAILQ_FIRST(&queue->msgs);
+			if(!fair_queue.current_visited) {
+				queue->deficit += queue->weight*FAIR_QUEUE_QUANTUM;
+				fair_queue.current_visited = 1;
+			}
+
+			if(msg->size <= queue->deficit) {
+				queue->deficit -= msg->size;
+				TAILQ_REMOVE(&queue->msgs,msg,entry);
+				queue->count--;
+				fair_queue.messages--;
+				if(0 == queue->count)
+					queue->deficit = 0;
+				*_queue = queue;
+				return msg;
+			}
+		}
+
+		fair_queue.current = (fair_queue.current + 1) % fair_queue.count;
+		fair_queue.current_visited = 0;
+	}
+}
+
+/// Return a message that could not be produced to its queue head
+static void scheduler_unpop(struct listener_queue *queue,
+                            struct queued_msg *msg) {
+	TAILQ_INSERT_HEAD(&queue->msgs,msg,entry);
+	queue->count++;
+	queue->deficit += msg->size;
+	fair_queue.messages++;
+}
+
+static void *scheduler_main(void *unused RB_UNUSED) {
+	struct listener_queue *queue = NULL;
+
+	pthread_mutex_lock(&fair_queue.mutex);
+	while(1) {
+		struct queued_msg *msg = scheduler_pop(&queue);
+		if(NULL == msg) {
+			if(fair_queue.stop)
+				break;
+			pthread_cond_wait(&fair_queue.cond,&fair_queue.mutex);
+			continue;
+		}
+
+		const int stop = fair_queue.stop;
+		pthread_mutex_unlock(&fair_queue.mutex);
+
+		const int produce_rc = kafka_produce_queued(msg->rkt,msg->buf,
+			msg->size,msg->flags,&msg->meta,msg->opaque,!stop);
+		if(0 != produce_rc) {
+			/* Producer queue full: wait for room, keeping the message */
+			kafka_poll(FAIR_QUEUE_FULL_WAIT_MS);
+			pthread_mutex_lock(&fair_queue.mutex);
+			scheduler_unpop(queue,msg);
+			continue;
+		}
+
+		const uint64_t delay_ms = monotonic_ms() - msg->queued_ms;
+		ATOMIC_INC(queue->counters.produced);
+		ATOMIC_ADD(queue->counters.delay_ms,delay_ms);
+		if(delay_ms > ATOMIC_LOAD(queue->counters.max_delay_ms))
+			ATOMIC_STORE(queue->counters.max_delay_ms,delay_ms);
+		free(msg);
+
+		pthread_mutex_lock(&fair_queue.mutex);
+	}
+	pthread_mutex_unlock(&fair_queue.mutex);
+
+	return NULL;
+}
+
+/*
+ * Public
+ */
+
+int fair_queue_add_listener(uint16_t listener_port,int priority,
+                            unsigned weight,size_t max_messages) {
+	int rc = 0;
+
+	pthread_mutex_lock(&fair_queue.mutex);
+	struct listener_queue *queue = listener_queue(listener_port);
+	if(queue) {
+		/* Listener re-created in a reload */
+		queue->priority = priority;
+		queue->weight = weight;
+		queue->max_messages = max_messages;
+	} else if(fair_queue.count == FAIR_QUEUE_MAX_LISTENERS) {
+		rdlog(LOG_ERR,"Can't create listener %u queue: Too many listeners",
+			listener_port);
+		rc = -1;
+	} else if(!fair_queue.running && 0 != pthread_create(&fair_queue.thread,
+	                                        NULL,scheduler_main,NULL)) {
+		rdlog(LOG_ERR,"Can't create listener queues thread");
+		rc = -1;
+	} else {
+		fair_queue.running = 1;
+		queue = &fair_queue.queues[fair_queue.count];
+		queue->listener_port = listener_port;
+		queue->priority = priority;
+		queue->weight = weight;
+		queue->max_messages = max_messages;
+		TAILQ_INIT(&queue->msgs);
+		__atomic_store_n(&fair_queue.count,fair_queue.count + 1,
+			__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fair_queue.mutex);
+
+	return rc;
+}
+
+int fair_queue_push(rd_kafka_topic_t *rkt,char *buf,size_t bufsize,
+                    int flags,const struct msg_meta *meta,void *opaque) {
+	/* We need buffer ownership to delay it */
+	if(0 == ATOMIC_LOAD(fair_queue.count) || NULL == meta
+	                                || !(flags & RD_KAFKA_MSG_F_FREE))
+		return -1;
+
+	struct listener_queue *queue = listener_queue(meta->listener_port);
+	if(NULL == queue)
+		return -1;
+
+	struct queued_msg *msg = queued_msg_new(rkt,buf,bufsize,flags,meta,opaque);
+	if(NULL == msg)
+		rdlog(LOG_ERR,"Can't queue message (out of memory?)");
+
+	pthread_mutex_lock(&fair_queue.mutex);
+	const int full = queue->count >= queue->max_messages || fair_queue.stop;
+	if(msg && !full) {
+		TAILQ_INSERT_TAIL(&queue->msgs,msg,entry);
+		queue->count++;
+		fair_queue.messages++;
+		if(1 == fair_queue.messages)
+			pthread_cond_signal(&fair_queue.cond);
+	}
+	pthread_mutex_unlock(&fair_queue.mutex);
+
+	if(NULL == msg || full) {
+		ATOMIC_INC(queue->counters.dropped);
+		if(meta->ack)
+			ack_slot_release(meta->ack,1);
+		free(msg);
+		free(buf);
+	} else {
+		ATOMIC_INC(queue->counters.queued);
+	}
+
+	return 0;
+}
+
+void fair_queue_stats(uint16_t listener_port,json_t *stats) {
+	struct listener_queue *queue = listener_queue(listener_port);
+	if(NULL == queue)
+		return;
+
+	pthread_mutex_lock(&fair_queue.mutex);
+	const size_t count = queue->count;
+	pthread_mutex_unlock(&fair_queue.mutex);
+
+	const uint64_t produced = ATOMIC_LOAD(queue->counters.produced);
+	const uint64_t delay_ms = ATOMIC_LOAD(queue->counters.delay_ms);
+
+	json_object_set_new(stats,"queue_messages",json_integer((json_int_t)count));
+	json_object_set_new(stats,"queue_queued",
+		json_integer((json_int_t)ATOMIC_LOAD(queue->counters.queued)));
+	json_object_set_new(stats,"queue_dropped",
+		json_integer((json_int_t)ATOMIC_LOAD(queue->counters.dropped)));
+	json_object_set_new(stats,"queue_delay_avg_ms",
+		json_real(produced ? (double)delay_ms/(double)produced : 0.));
+	/* Max since last stats */
+	json_object_set_new(stats,"queue_delay_max_ms",json_integer((json_int_t)
+		__atomic_exchange_n(&queue->counters.max_delay_ms,0,
+			__ATOMIC_RELAXED)));
+}
+
+void fair_queue_done() {
+	pthread_mutex_lock(&fair_queue.mutex);
+	const int running = fair_queue.running;
+	fair_queue.stop = 1;
+	pthread_cond_signal(&fair_queue.cond);
+	pthread_mutex_unlock(&fair_queue.mutex);
+
+	if(running)
+		pthread_join(fair_queue.thread,NULL);
+}
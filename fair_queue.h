@@ -0,0 +1,64 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per listener queues in front of the kafka producer. Listeners with a
+ * `queue` config don't produce directly: their messages wait in their own
+ * queue, and one thread moves them to the producer:
+ *
+ *   {"proto":"tcp","port":2056,"queue":{"priority":1,"weight":4,
+ *    "max_messages":100000}}
+ *
+ * Queues with higher priority are always served first. Queues with the same
+ * priority share the producer by weight (deficit round robin over message
+ * bytes). When the producer queue is full messages wait in listener queues,
+ * so lower priority ones fill up and drop messages first.
+ */
+
+struct rd_kafka_topic_s;
+struct msg_meta;
+struct json_t;
+
+/** Create a listener queue.
+    @param listener_port Listener port
+    @param priority Queues with higher priority are served first
+    @param weight Share of the producer among queues of the same priority
+    @param max_messages Queue size. Messages over it are dropped.
+    @return 0 on success
+    */
+int fair_queue_add_listener(uint16_t listener_port,int priority,
+                            unsigned weight,size_t max_messages);
+
+/** Queue a message if its listener has a queue. Queue takes buffer ownership,
+    and copies meta.
+    @return 0 if message has been queued or dropped, -1 if listener has no
+            queue and message has to be produced by the caller.
+    */
+int fair_queue_push(struct rd_kafka_topic_s *rkt,char *buf,size_t bufsize,
+                    int flags,const struct msg_meta *meta,void *opaque);
+
+/// Add listener queue counters to stats
+void fair_queue_stats(uint16_t listener_port,struct json_t *stats);
+
+/// Send all queued messages and stop queues thread
+void fair_queue_done();
@@ -25,6 +25,11 @@
 #include "http.h"
 #endif
 #include "socket.h"
+#include "fair_queue.h"
+#include "spill.h"
+#include "mirror.h"
+#include "stage.h"
+#include "netflow.h"
 
 #include <errno.h>
 #include <librd/rdlog.h>
@@ -32,6 +37,7 @@
 #include <jansson.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <limits.h>
 
 #ifndef LIST_FOREACH_SAFE
 #define	LIST_FOREACH_SAFE(var, head, field, tvar)			\
@@ -51,6 +57,25 @@
 #define CONFIG_BLACKLIST_KEY "blacklist"
 #define CONFIG_RDKAFKA_KEY "rdkafka."
 #define CONFIG_TCP_KEEPALIVE "tcp_keepalive"
+#define CONFIG_STAGES_KEY "stages"
+#define CONFIG_MAX_AGE_KEY "max_age_ms"
+#define CONFIG_STALE_TOPIC_KEY "stale_topic"
+#define CONFIG_META_HEADERS_KEY "meta_headers"
+#define CONFIG_MAX_MESSAGE_SIZE_KEY "max_message_size"
+#define CONFIG_OVERSIZED_MESSAGES_KEY "oversized_messages"
+
+#define OVERSIZED_MESSAGES_DISCARD "discard"
+#define OVERSIZED_MESSAGES_SPLIT "split"
+
+#define CONFIG_QUEUE_KEY "queue"
+#define CONFIG_QUEUE_PRIORITY_KEY "priority"
+#define CONFIG_QUEUE_WEIGHT_KEY "weight"
+#define CONFIG_QUEUE_MAX_MESSAGES_KEY "max_messages"
+
+#define DEFAULT_QUEUE_MAX_MESSAGES 100000
+#define CONFIG_STATS_INTERVAL_KEY "stats_interval"
+#define CONFIG_SPILL_KEY "spill"
+#define CONFIG_MIRRORS_KEY "mirrors"
 
 #define CONFIG_PROTO_TCP  "tcp"
 #define CONFIG_PROTO_UDP  "udp"
@@ -67,8 +92,11 @@ static const struct registered_decoder{
 	listener_opaque_creator opaque_creator;
 	listener_opaque_reload opaque_reload;
 	listener_opaque_destructor opaque_destructor;
+	listener_opaque_stats opaque_stats;
 } registered_decoders[] = {
-	{CONFIG_DECODE_AS_NULL,NULL,dumb_decoder,NULL,NULL,NULL},
+	{CONFIG_DECODE_AS_NULL,NULL,dumb_decoder,NULL,NULL,NULL,NULL},
+	{NETFLOW_DECODE_AS,NULL,netflow_decode,netflow_opaque_creator,NULL,
+		netflow_opaque_destructor,netflow_opaque_stats},
 };
 
 static const struct registered_listener{
@@ -77,6 +105,9 @@ static const struct registered_listener{
 } registered_listeners[] = {
 #ifdef HAVE_LIBMICROHTTPD
 	{CONFIG_PROTO_HTTP, create_http_listener},
+#else
+	/* Only native engine is available */
+	{CONFIG_PROTO_HTTP, create_socket_listener},
 #endif
 	{CONFIG_PROTO_TCP, create_tcp_listener},
 	{CONFIG_PROTO_UDP, create_udp_listener},
@@ -215,13 +246,183 @@ static const struct registered_decoder *locate_registered_decoder(const char *de
 	return NULL;
 }
 
+/// Create listener queue in front of the producer
+static int parse_listener_queue(json_t *config,uint16_t listener_port){
+	json_int_t priority = 0,weight = 1;
+	json_int_t max_messages = DEFAULT_QUEUE_MAX_MESSAGES;
+	json_error_t json_err;
+
+	const int unpack_rc = json_unpack_ex(config,&json_err,0,"{s?I,s?I,s?I}",
+		CONFIG_QUEUE_PRIORITY_KEY,&priority,CONFIG_QUEUE_WEIGHT_KEY,&weight,
+		CONFIG_QUEUE_MAX_MESSAGES_KEY,&max_messages);
+	if(unpack_rc != 0) {
+		rdlog(LOG_ERR,"Can't parse listener %u queue: %s",listener_port,
+			json_err.text);
+		return -1;
+	}
+
+	if(weight <= 0 || max_messages <= 0 || priority < INT_MIN
+	                                                  || priority > INT_MAX) {
+		rdlog(LOG_ERR,"Invalid listener %u queue: weight and max_messages "
+			"have to be greater than 0",listener_port);
+		return -1;
+	}
+
+	return fair_queue_add_listener(listener_port,(int)priority,
+		(unsigned)weight,(size_t)max_messages);
+}
+
+int listener_callbacks_new(json_t *config,struct listener_callbacks *cb,
+                           char *err,size_t errsize){
+	const char *decode_as = "";
+	json_t *stages_config = NULL;
+	json_error_t json_err;
+
+	const int unpack_rc = json_unpack_ex(config,&json_err,0,"{s?s,s?o}",
+		"decode_as",&decode_as,CONFIG_STAGES_KEY,&stages_config);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"%s",json_err.text);
+		return -1;
+	}
+
+	assert(decode_as);
+	const struct registered_decoder *decoder = locate_registered_decoder(decode_as);
+	if(NULL == decoder){
+		snprintf(err,errsize,"Can't locate decoder type %s",decode_as);
+		return -1;
+	}
+
+	void *decoder_opaque = NULL;
+	if(decoder->opaque_creator) {
+		const int opaque_creator_rc = decoder->opaque_creator(config,
+			&decoder_opaque,err,errsize);
+		if(opaque_creator_rc != 0)
+			return -1;
+	}
+
+	cb->callback = decoder->cb;
+	cb->cb_opaque = decoder_opaque;
+	cb->cb_opaque_destructor = decoder->opaque_destructor;
+	cb->cb_opaque_reload = decoder->opaque_reload;
+	cb->cb_opaque_stats = decoder->opaque_stats;
+
+	if(stages_config) {
+		cb->cb_opaque = stage_chain_new(stages_config,decoder->cb,
+			decoder_opaque,decoder->opaque_reload,
+			decoder->opaque_destructor,decoder->opaque_stats,err,errsize);
+		if(NULL == cb->cb_opaque) {
+			if(decoder->opaque_destructor && decoder_opaque)
+				decoder->opaque_destructor(decoder_opaque);
+			return -1;
+		}
+
+		cb->callback = stage_chain_process;
+		cb->cb_opaque_destructor = stage_chain_done;
+		cb->cb_opaque_reload = stage_chain_reload;
+		cb->cb_opaque_stats = stage_chain_stats;
+	}
+
+	return 0;
+}
+
+/** Listener stages and decoder names, comma separated
+    @return Name length, or sizeof(buf) if it does not fit.
+    */
+static size_t decoder_chain_name(const json_t *stages_config,
+                                 const char *decode_as,char *buf,size_t size){
+	size_t i,len = 0;
+	json_t *stage_config = NULL;
+
+	json_array_foreach(stages_config,i,stage_config) {
+		const char *type = json_string_value(
+			json_object_get(stage_config,"type"));
+		if(type) {
+			len += (size_t)snprintf(buf+len,size-len,"%s,",type);
+			if(len >= size)
+				return size;
+		}
+	}
+
+	len += (size_t)snprintf(buf+len,size-len,"%s",
+		*decode_as ? decode_as : "dumb");
+	return len < size ? len : size;
+}
+
+/** Apply listener policies: max age, max message size, meta headers and
+    queue. Every one is set, so reloaded listeners lose removed ones.
+    @return 0 on success
+    */
+static int parse_listener_policies(json_t *config,uint16_t listener_port){
+	const char *decode_as = "";
+	const char *stale_topic = NULL,*oversized_messages = NULL;
+	json_int_t max_age_ms = 0,max_message_size = 0;
+	int meta_headers = 0,split_oversized = 0;
+	json_t *stages_config = NULL,*queue_config = NULL;
+	json_error_t json_err;
+
+	const int unpack_rc = json_unpack_ex(config,&json_err,0,"{s?s,s?o,s?I,s?s,s?b,s?o,s?I,s?s}",
+		"decode_as",&decode_as,CONFIG_STAGES_KEY,&stages_config,
+		CONFIG_MAX_AGE_KEY,&max_age_ms,CONFIG_STALE_TOPIC_KEY,&stale_topic,
+		CONFIG_META_HEADERS_KEY,&meta_headers,CONFIG_QUEUE_KEY,&queue_config,
+		CONFIG_MAX_MESSAGE_SIZE_KEY,&max_message_size,
+		CONFIG_OVERSIZED_MESSAGES_KEY,&oversized_messages);
+
+	if( unpack_rc != 0 ) {
+		rdlog(LOG_ERR,"Can't parse listener %u policies: %s",listener_port,
+			json_err.text);
+		return -1;
+	}
+
+	if(max_age_ms < 0 || max_message_size < 0) {
+		rdlog(LOG_ERR,"Listener " CONFIG_MAX_AGE_KEY " and "
+			CONFIG_MAX_MESSAGE_SIZE_KEY " can't be negative");
+		return -1;
+	}
+
+	if(oversized_messages && 0 == strcmp(OVERSIZED_MESSAGES_SPLIT,
+	                                                  oversized_messages)) {
+		split_oversized = 1;
+	} else if(oversized_messages && 0 != strcmp(OVERSIZED_MESSAGES_DISCARD,
+	                                                  oversized_messages)) {
+		rdlog(LOG_ERR,"Not a valid " CONFIG_OVERSIZED_MESSAGES_KEY
+			". Select one between(" OVERSIZED_MESSAGES_DISCARD ","
+			OVERSIZED_MESSAGES_SPLIT ")");
+		return -1;
+	}
+
+	if(0 != kafka_set_max_age(listener_port,(uint64_t)max_age_ms,stale_topic))
+		return -1;
+
+	if(0 != kafka_set_max_message_size(listener_port,(size_t)max_message_size,
+	                                                     split_oversized))
+		return -1;
+
+	if(meta_headers) {
+		char decoder_chain[BUFSIZ];
+		const size_t decoder_chain_len = decoder_chain_name(stages_config,
+			decode_as,decoder_chain,sizeof(decoder_chain));
+		if(0 != kafka_set_meta_headers(listener_port,1,
+		          decoder_chain_len < sizeof(decoder_chain) ? decoder_chain : NULL))
+			return -1;
+	} else if(0 != kafka_set_meta_headers(listener_port,0,NULL)) {
+		return -1;
+	}
+
+	/* Queues keep the order of the messages they hold, so a listener keeps
+	   its queue until restart even if it is removed from config */
+	if(queue_config && 0 != parse_listener_queue(queue_config,listener_port))
+		return -1;
+
+	return 0;
+}
+
 static void parse_listener(json_t *config){
-	char *proto = NULL,*decode_as="";
+	char *proto = NULL;
 	json_error_t json_err;
 	char err[BUFSIZ];
 
-	const int unpack_rc = json_unpack_ex(config,&json_err,0,"{s:s,s?s}",
-		"proto",&proto,"decode_as",&decode_as);
+	const int unpack_rc = json_unpack_ex(config,&json_err,0,"{s:s}",
+		"proto",&proto);
 
 	if( unpack_rc != 0 ) {
 		rdlog(LOG_ERR,"Can't parse listener: %s",json_err.text);
@@ -239,33 +440,26 @@ static void parse_listener(json_t *config){
 		return;
 	}
 
-	assert(decode_as);
-	const struct registered_decoder *decoder = locate_registered_decoder(decode_as);
-	if(NULL == decoder){
-		rdlog(LOG_ERR,"Can't locate decoder type %s",decode_as);
+	struct listener_callbacks cb;
+	if(0 != listener_callbacks_new(config,&cb,err,sizeof(err))) {
+		rdlog(LOG_ERR,"Can't create listener %s callback: %s",proto,err);
 		exit(-1);
 	}
 
-	void *decoder_opaque = NULL;
-	if(decoder->opaque_creator) {
-		const int opaque_creator_rc = decoder->opaque_creator(config,&decoder_opaque,err,
-			sizeof(err));
-		if(opaque_creator_rc != 0) {
-			rdlog(LOG_ERR,"Can't create opaque for listener %s: %s",proto,err);
-			exit(-1);
-		}
-	}
-
 	struct listener *listener = (*_listener_creator)(config,
-		decoder->cb,decoder_opaque,err,sizeof(err));
+		cb.callback,cb.cb_opaque,err,sizeof(err));
 
 	if( NULL == listener ) {
 		rdlog(LOG_ERR,"Can't create listener for proto %s: %s.",proto,err);
 		exit(-1);
 	}
 
-	listener->cb.cb_opaque_destructor = decoder->opaque_destructor;
-	listener->cb.cb_opaque_reload = decoder->opaque_reload;
+	listener->cb.cb_opaque_destructor = cb.cb_opaque_destructor;
+	listener->cb.cb_opaque_reload = cb.cb_opaque_reload;
+	listener->cb.cb_opaque_stats = cb.cb_opaque_stats;
+
+	if(0 != parse_listener_policies(config,listener->port))
+		exit(-1);
 
 	LIST_INSERT_HEAD(&global_config.listeners,listener,entry);
 }
@@ -281,7 +475,27 @@ static void parse_listeners_array(const char *key,const json_t *array){
 	}
 }
 
-static void parse_config_keyval(const char *key,const json_t *value){
+static void parse_spill(const char *key,json_t *value){
+	char err[BUFSIZ];
+
+	if(!json_is_object(value)){
+		fatal("%s value must be an object in config file\n",key);
+	}
+	if(0 != spill_config(value,err,sizeof(err))){
+		fatal("%s\n",err);
+	}
+}
+
+static void parse_mirrors(const char *key,json_t *value){
+	char err[BUFSIZ];
+
+	assert_json_array(key,value);
+	if(0 != mirror_config(value,err,sizeof(err))){
+		fatal("%s\n",err);
+	}
+}
+
+static void parse_config_keyval(const char *key,json_t *value){
 	if(!strcasecmp(key,CONFIG_TOPIC_KEY)){
 		global_config.topic = strdup(assert_json_string(key,value));
 	}else if(!strcasecmp(key,CONFIG_BROKERS_KEY)){
@@ -297,6 +511,12 @@ static void parse_config_keyval(const char *key,const json_t *value){
 		parse_rdkafka_config_json(key,value);
 	}else if(!strcasecmp(key,CONFIG_BLACKLIST_KEY)){
 		parse_blacklist(key,value);
+	}else if(!strcasecmp(key,CONFIG_STATS_INTERVAL_KEY)){
+		global_config.stats_interval = assert_json_integer(key,value);
+	}else if(!strcasecmp(key,CONFIG_SPILL_KEY)){
+		parse_spill(key,value);
+	}else if(!strcasecmp(key,CONFIG_MIRRORS_KEY)){
+		parse_mirrors(key,value);
 	}else{
 		fatal("Unknown config key %s\n",key);
 	}
@@ -383,6 +603,8 @@ static void reload_listeners_check_already_present(json_t *new_listeners,
 
 		if(found_value) {
 			i->reload(found_value,i->cb.cb_opaque_reload,i->cb.cb_opaque,i->private);
+			if(0 != parse_listener_policies(found_value,i_port))
+				rdlog(LOG_ERR,"Can't reload listener %u policies",i_port);
 		} else {
 			LIST_REMOVE(i,entry);
 			shutdown_listener(i);
@@ -463,6 +685,51 @@ void reload_config(struct n2kafka_config *config) {
 	json_decref(new_config_file);
 }
 
+/// Log the stats of a module that is not part of any listener, if it has any
+static void log_module_stats(const char *name,void (*stats_cb)(json_t *)){
+	json_t *stats = json_object();
+	if(NULL == stats) {
+		rdlog(LOG_ERR,"Can't allocate stats object (out of memory?)");
+		return;
+	}
+
+	stats_cb(stats);
+	char *stats_str = json_object_size(stats) > 0 ?
+		json_dumps(stats,JSON_COMPACT) : NULL;
+	if(stats_str) {
+		rdlog(LOG_INFO,"%s stats: %s",name,stats_str);
+		free(stats_str);
+	}
+	json_decref(stats);
+}
+
+void log_stats(struct n2kafka_config *config){
+	struct listener *i = NULL;
+	LIST_FOREACH(i,&config->listeners,entry) {
+		json_t *stats = json_object();
+		if(NULL == stats) {
+			rdlog(LOG_ERR,"Can't allocate stats object (out of memory?)");
+			return;
+		}
+
+		if(i->cb.cb_opaque_stats)
+			i->cb.cb_opaque_stats(i->cb.cb_opaque,stats);
+		kafka_policy_stats(i->port,stats);
+		fair_queue_stats(i->port,stats);
+
+		char *stats_str = json_object_size(stats) > 0 ?
+			json_dumps(stats,JSON_COMPACT) : NULL;
+		if(stats_str) {
+			rdlog(LOG_INFO,"Listener %d stats: %s",i->port,stats_str);
+			free(stats_str);
+		}
+		json_decref(stats);
+	}
+
+	log_module_stats("Spill",spill_stats);
+	log_module_stats("Mirror",mirror_stats);
+}
+
 void free_global_config(){
 	shutdown_listeners(&global_config);
 
@@ -26,11 +26,45 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/queue.h>
+#include <netinet/in.h>
 #include <librdkafka/rdkafka.h>
 
+/// Max number of kafka headers that can be attached to a message
+#define MSG_META_MAX_HEADERS 8
+
+/// Kafka message header. Value only needs to be valid until it is produced.
+struct msg_header{
+    const char *name;
+    const void *value;
+    size_t value_size;
+};
+
+/// Information about how a message was received. Filled by listeners.
+struct msg_meta{
+    /// Sender address. sin_family is AF_UNSPEC if it is not known.
+    struct sockaddr_in client_addr;
+    /// IPv6 sender address. sin6_family is AF_UNSPEC if sender is not IPv6.
+    struct sockaddr_in6 client_addr6;
+    /// Port of the listener that received the message
+    uint16_t listener_port;
+    /// Wall clock time the message was received, in seconds. 0 if unknown.
+    double receive_time;
+    /// Topic to send the message to. NULL for the default one.
+    struct rd_kafka_topic_s *topic;
+    /// Message key. NULL for no key.
+    const char *key;
+    size_t key_size;
+    /// Headers added by stages
+    size_t headers_count;
+    struct msg_header headers[MSG_META_MAX_HEADERS];
+    /// Delivery ack slot of acknowledged listeners records. NULL if none.
+    struct ack_slot *ack;
+};
+
 struct json_t;
 struct listener;
-typedef void (*listener_callback)(char *buffer,size_t buf_size,void *listener_callback_opaque);
+typedef void (*listener_callback)(char *buffer,size_t buf_size,
+                        const struct msg_meta *meta,void *listener_callback_opaque);
 typedef struct listener* (*listener_creator)(struct json_t *config,
                         listener_callback cb,void *cb_opaque,
                         char *err,size_t errsize);
@@ -38,20 +72,26 @@ typedef void (*listener_join)(void *listener_private);
 typedef int (*listener_opaque_creator)(struct json_t *config,void **opaque,char *err,size_t errsize);
 typedef int (*listener_opaque_reload)(struct json_t *config,void *opaque);
 typedef int (*listener_opaque_destructor)(void *opaque);
+/// Add opaque statistics to stats json object
+typedef void (*listener_opaque_stats)(void *opaque,struct json_t *stats);
 // @TODO we need this callback to split data acquiring || data processing
 // typedef void (*data_process)(void *data_process_private,const char *buffer,size_t bsize);
 typedef void (*listener_reload)(struct json_t *new_config,listener_opaque_reload opaque_reload,
                                                        void *cb_opaque,void *listener_private);
+/// Messages callback, built from decode_as and stages config
+struct listener_callbacks{
+    void *cb_opaque;
+    listener_callback callback;
+    listener_opaque_destructor cb_opaque_destructor;
+    listener_opaque_reload cb_opaque_reload;
+    listener_opaque_stats cb_opaque_stats;
+};
+
 struct listener{
     uint16_t port; // as listener ID
     void *private;
     
-    struct{
-        void *cb_opaque;
-        listener_callback callback;
-        listener_opaque_destructor cb_opaque_destructor;
-        listener_opaque_reload cb_opaque_reload;
-    }cb;
+    struct listener_callbacks cb;
     listener_creator create;
     listener_join join;
     listener_reload reload;
@@ -85,6 +125,9 @@ struct n2kafka_config{
 
     struct json_t *stream_enrichment;
 
+    /// Seconds between statistics logs. 0 disables them.
+    int stats_interval;
+
     bool debug;
 };
 
@@ -100,4 +143,12 @@ void parse_config(const char *config_file_path);
 
 void reload_config(struct n2kafka_config *config);
 
+void log_stats(struct n2kafka_config *config);
+
+/** Create messages callback from config decode_as and stages keys.
+    @return 0 on success
+    */
+int listener_callbacks_new(struct json_t *config,struct listener_callbacks *cb,
+                           char *err,size_t errsize);
+
 void free_global_config();
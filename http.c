@@ -28,31 +28,75 @@
 #define MODE_POLL "poll"
 #define MODE_EPOLL "epoll"
 
+#define HTTP_ENGINE_MICROHTTPD "microhttpd"
+
+#define FRAMING_NEWLINE "newline"
+#define FRAMING_LENGTH "length"
+
 #include "http.h"
 
+#include "content_encoding.h"
 #include "global_config.h"
+#include "http_routes.h"
+#include "socket.h"
+#include "util.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <jansson.h>
 #include <librd/rdlog.h>
 #include <microhttpd.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 
-#define STRING_INITIAL_SIZE 2048
+/// Body segment size, when body size is not known in advance
+#define BODY_SEGMENT_SIZE (16*1024)
+/// Max free segments kept for reuse
+#define BODY_SEGMENTS_POOL_SIZE 256
 
 struct string {
 	char *buf;
 	size_t allocated,used;
 };
 
+#ifndef MHD_HTTP_PAYLOAD_TOO_LARGE
+#define MHD_HTTP_PAYLOAD_TOO_LARGE MHD_HTTP_REQUEST_ENTITY_TOO_LARGE
+#endif
+
+/// Default max size of a streamed message
+#define HTTP_DEFAULT_MAX_RECORD_SIZE (1024*1024)
+
+/// Body data callbacks return code if a message exceeds its limit
+#define HTTP_BODY_TOO_LARGE 1
+
 #define HTTP_PRIVATE_MAGIC 0xC0B345FE
+/// How to split a streamed body in messages
+enum http_framing {
+	/// Whole body is one message, sent when request completes
+	HTTP_FRAMING_NONE,
+	/// Newline delimited messages
+	HTTP_FRAMING_NEWLINE,
+	/// Messages prefixed with their 4 bytes big endian length
+	HTTP_FRAMING_LENGTH,
+};
+
 struct http_private{
 #ifdef HTTP_PRIVATE_MAGIC
 	uint64_t magic;
 #endif
 	struct MHD_Daemon *d;
+	uint16_t port;
+	enum http_framing framing;
+	struct content_decoder_limits decompress_limits;
+	/// Max request body size, 0 for no limit. Not checked in streams.
+	size_t max_body_size;
+	/// Max size of a streamed message, that bounds the kept incomplete one
+	size_t max_record_size;
+	/// URL routes, NULL if there are no routes
+	struct http_routes *routes;
     listener_callback callback;
 	void *callback_opaque;
 };
@@ -66,7 +110,7 @@ static size_t smin(size_t n1, size_t n2) {
 }
 
 static int init_string(struct string *s,size_t size) {
-	s->buf = malloc(size);
+	s->buf = malloc(smax(size,1));
 	if(s->buf) {
 		s->allocated = size;
 		return 1;
@@ -78,26 +122,318 @@ static size_t string_free_space(const struct string *str) {
 	return str->allocated - str->used;
 }
 
-static size_t string_grow(struct string *str,size_t delta) {
-	const size_t newsize = smax(str->allocated + delta,str->allocated*2);
-	char *new_buf = realloc(str->buf,newsize);
-	if(NULL != new_buf) {
+static int string_append(struct string *str,const char *data,size_t size) {
+	if(size > string_free_space(str)) {
+		const size_t newsize = smax(str->used + size,str->allocated*2);
+		char *new_buf = realloc(str->buf,newsize);
+		if(NULL == new_buf)
+			return -1;
 		str->buf = new_buf;
 		str->allocated = newsize;
 	}
-	return str->allocated;
+
+	memcpy(&str->buf[str->used],data,size);
+	str->used += size;
+	return 0;
+}
+
+/*
+ * Chunked bodies are kept in a list of fixed size segments, so they are not
+ * copied every time they grow. They are only joined when the request ends.
+ */
+
+struct body_segment {
+	struct body_segment *next;
+	size_t used;
+	char data[BODY_SEGMENT_SIZE];
+};
+
+struct segment_list {
+	struct body_segment *first,*last;
+	/// Sum of segments used bytes
+	size_t size;
+};
+
+/// Free segments, reused between requests
+static struct {
+	pthread_mutex_t mutex;
+	struct body_segment *free;
+	size_t count;
+} segments_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct body_segment *body_segment_new() {
+	pthread_mutex_lock(&segments_pool.mutex);
+	struct body_segment *segment = segments_pool.free;
+	if(segment) {
+		segments_pool.free = segment->next;
+		segments_pool.count--;
+	}
+	pthread_mutex_unlock(&segments_pool.mutex);
+
+	if(NULL == segment)
+		segment = malloc(sizeof(*segment));
+	if(segment) {
+		segment->next = NULL;
+		segment->used = 0;
+	}
+	return segment;
+}
+
+static void segment_list_done(struct segment_list *list) {
+	struct body_segment *segment = list->first;
+
+	pthread_mutex_lock(&segments_pool.mutex);
+	while(segment && segments_pool.count < BODY_SEGMENTS_POOL_SIZE) {
+		struct body_segment *next = segment->next;
+		segment->next = segments_pool.free;
+		segments_pool.free = segment;
+		segments_pool.count++;
+		segment = next;
+	}
+	pthread_mutex_unlock(&segments_pool.mutex);
+
+	while(segment) {
+		struct body_segment *next = segment->next;
+		free(segment);
+		segment = next;
+	}
+
+	memset(list,0,sizeof(*list));
+}
+
+/// Append data to segments list. Return appended bytes.
+static size_t segment_list_append(struct segment_list *list,const char *data,
+                                                           size_t data_size) {
+	size_t appended = 0;
+
+	while(appended < data_size) {
+		if(NULL == list->last || BODY_SEGMENT_SIZE == list->last->used) {
+			struct body_segment *segment = body_segment_new();
+			if(NULL == segment) {
+				rdlog(LOG_ERR,"Can't allocate body segment (out of memory?)");
+				break;
+			}
+			if(list->last)
+				list->last->next = segment;
+			else
+				list->first = segment;
+			list->last = segment;
+		}
+
+		struct body_segment *segment = list->last;
+		const size_t ncopy = smin(data_size - appended,
+			BODY_SEGMENT_SIZE - segment->used);
+		memcpy(&segment->data[segment->used],&data[appended],ncopy);
+		segment->used += ncopy;
+		appended += ncopy;
+	}
+
+	list->size += appended;
+	return appended;
+}
+
+/// Join segments after str contents
+static int string_append_segments(struct string *str,
+                                  const struct segment_list *list) {
+	const struct body_segment *segment = NULL;
+
+	if(list->size > string_free_space(str)) {
+		const size_t newsize = str->used + list->size;
+		char *new_buf = realloc(str->buf,smax(newsize,1));
+		if(NULL == new_buf)
+			return -1;
+		str->buf = new_buf;
+		str->allocated = newsize;
+	}
+
+	for(segment = list->first;segment;segment = segment->next) {
+		memcpy(&str->buf[str->used],segment->data,segment->used);
+		str->used += segment->used;
+	}
+
+	return 0;
 }
 
 struct conn_info {
+	/// Body, that grows up to its Content-Length if it is known. In
+	/// streaming mode, the incomplete message after the last complete one.
 	struct string str;
+	/// Declared body size, 0 if not known
+	size_t content_length;
+	/// Body that does not fit in str
+	struct segment_list segments;
+	/// Length framing state
+	uint8_t length_prefix[4];
+	size_t length_prefix_used;
+	size_t message_left;
+	/// Content-Encoding decoder, NULL if body is not compressed
+	struct content_decoder *decoder;
+	/// Body is not valid, don't send it
+	int discard;
+	/// Received body bytes, before decompression
+	size_t received;
+	/// URL route, NULL if listener has no routes
+	struct http_route *route;
+	/// Copy of route key segment
+	char *key;
+	struct msg_meta meta;
 };
 
 static void free_con_info(struct conn_info *con_info) {
 	free(con_info->str.buf);
 	con_info->str.buf = NULL;
+	segment_list_done(&con_info->segments);
+	if(con_info->decoder)
+		content_decoder_release(con_info->decoder);
+	free(con_info->key);
 	free(con_info);
 }
 
+/// Send a message to request route callback, or to listener one
+static void http_callback(const struct http_private *h,
+                          const struct conn_info *con_info,char *buf,
+                          size_t buf_size) {
+	const struct listener_callbacks *cb = con_info->route ?
+		http_route_callbacks(con_info->route) : NULL;
+
+	if(cb)
+		cb->callback(buf,buf_size,&con_info->meta,cb->cb_opaque);
+	else
+		h->callback(buf,buf_size,&con_info->meta,h->callback_opaque);
+}
+
+/*
+ * Streaming mode: messages are sent as soon as they are complete, so only
+ * the incomplete tail is kept in memory.
+ */
+
+/// Send str contents plus data as one message
+static void stream_message(const struct http_private *h,
+                           struct conn_info *con_info,const char *data,
+                           size_t size) {
+	struct string *tail = &con_info->str;
+	char *buf = NULL;
+	size_t buf_size = 0;
+
+	if(tail->used > 0) {
+		if(0 != string_append(tail,data,size)) {
+			rdlog(LOG_ERR,"Can't allocate HTTP message (out of memory?)");
+			return;
+		}
+		buf = tail->buf;
+		buf_size = tail->used;
+		memset(tail,0,sizeof(*tail));
+	} else {
+		buf = malloc(smax(size,1));
+		if(NULL == buf) {
+			rdlog(LOG_ERR,"Can't allocate HTTP message (out of memory?)");
+			return;
+		}
+		memcpy(buf,data,size);
+		buf_size = size;
+	}
+
+	http_callback(h,con_info,buf,buf_size);
+}
+
+static int stream_message_too_large(size_t message_size) {
+	rdlog(LOG_WARNING,"HTTP stream message of %zu bytes exceeds max record "
+		"size, aborting upload",message_size);
+	return HTTP_BODY_TOO_LARGE;
+}
+
+static int stream_newline_messages(const struct http_private *h,
+                                   struct conn_info *con_info,
+                                   const char *data,size_t size) {
+	const char *end = data + size;
+
+	while(data < end) {
+		const char *newline = memchr(data,'\n',(size_t)(end - data));
+		const size_t message_size = con_info->str.used + (size_t)(
+			(newline ? newline : end) - data);
+		if(message_size > h->max_record_size)
+			return stream_message_too_large(message_size);
+
+		if(NULL == newline) {
+			if(0 != string_append(&con_info->str,data,(size_t)(end - data)))
+				rdlog(LOG_ERR,"Can't save HTTP message (out of memory?)");
+			return 0;
+		}
+
+		size_t data_size = (size_t)(newline - data);
+		if(data_size > 0 && '\r' == data[data_size-1])
+			data_size--;
+		if(data_size > 0 || con_info->str.used > 0)
+			stream_message(h,con_info,data,data_size);
+		data = newline + 1;
+	}
+
+	return 0;
+}
+
+static int stream_length_messages(const struct http_private *h,
+                                  struct conn_info *con_info,
+                                  const char *data,size_t size) {
+	const char *end = data + size;
+
+	while(data < end) {
+		if(con_info->length_prefix_used < sizeof(con_info->length_prefix)) {
+			const size_t ncopy = smin((size_t)(end - data),
+				sizeof(con_info->length_prefix) - con_info->length_prefix_used);
+			memcpy(&con_info->length_prefix[con_info->length_prefix_used],
+				data,ncopy);
+			con_info->length_prefix_used += ncopy;
+			data += ncopy;
+			if(con_info->length_prefix_used < sizeof(con_info->length_prefix))
+				return 0;
+
+			const uint8_t *prefix = con_info->length_prefix;
+			con_info->message_left = (size_t)prefix[0]<<24
+				| (size_t)prefix[1]<<16 | (size_t)prefix[2]<<8 | prefix[3];
+			/* Don't wait for the message to know it does not fit */
+			if(con_info->message_left > h->max_record_size)
+				return stream_message_too_large(con_info->message_left);
+		}
+
+		const size_t ncopy = smin((size_t)(end - data),con_info->message_left);
+		con_info->message_left -= ncopy;
+		if(0 == con_info->message_left) {
+			stream_message(h,con_info,data,ncopy);
+			con_info->length_prefix_used = 0;
+		} else if(0 != string_append(&con_info->str,data,ncopy)) {
+			rdlog(LOG_ERR,"Can't save HTTP message (out of memory?)");
+		}
+		data += ncopy;
+	}
+
+	return 0;
+}
+
+/// Send complete messages of data. Return 0 on success.
+static int stream_http_data(const struct http_private *h,
+                            struct conn_info *con_info,const char *data,
+                            size_t size) {
+	con_info->meta.receive_time = coarse_now();
+
+	return HTTP_FRAMING_NEWLINE == h->framing ?
+		stream_newline_messages(h,con_info,data,size) :
+		stream_length_messages(h,con_info,data,size);
+}
+
+/// Send the last message if the stream does not end with a delimiter
+static void stream_http_end(const struct http_private *h,
+                            struct conn_info *con_info) {
+	if(HTTP_FRAMING_LENGTH == h->framing && (con_info->length_prefix_used > 0)) {
+		rdlog(LOG_WARNING,"HTTP stream ended in the middle of a message, "
+			"discarding it");
+	} else if(con_info->str.used > 0) {
+		con_info->meta.receive_time = coarse_now();
+		stream_message(h,con_info,"",0);
+	}
+}
+
 static void request_completed (void *cls HTTP_UNUSED,
                                struct MHD_Connection *connection HTTP_UNUSED,
                                void **con_cls,
@@ -109,21 +445,53 @@ static void request_completed (void *cls HTTP_UNUSED,
 
 	struct conn_info *con_info = *con_cls;
 	struct http_private *h = cls;
-	
-	h->callback(con_info->str.buf,con_info->str.used,h->callback_opaque);
+
+	if(!con_info->discard && con_info->decoder
+	                      && !content_decoder_finished(con_info->decoder)) {
+		rdlog(LOG_WARNING,"HTTP compressed body is truncated, discarding it");
+		con_info->discard = 1;
+	}
+
+	if(con_info->discard) {
+		free_con_info(con_info);
+		*con_cls = NULL;
+		return;
+	}
+
+	if(HTTP_FRAMING_NONE != h->framing) {
+		stream_http_end(h,con_info);
+		free_con_info(con_info);
+		*con_cls = NULL;
+		return;
+	}
+
+	if(con_info->segments.size > 0
+	        && 0 != string_append_segments(&con_info->str,&con_info->segments)) {
+		rdlog(LOG_ERR,"Can't allocate HTTP body of %zu bytes (out of memory?)",
+			con_info->str.used + con_info->segments.size);
+		free_con_info(con_info);
+		*con_cls = NULL;
+		return;
+	}
+
+	con_info->meta.receive_time = coarse_now();
+	http_callback(h,con_info,con_info->str.buf,con_info->str.used);
 	con_info->str.buf = NULL; /* librdkafka will free it */
 	
 	free_con_info(con_info);
 	*con_cls = NULL;
 }
 
-static struct conn_info *create_connection_info(size_t string_size) {
+static struct conn_info *create_connection_info(size_t content_length) {
 	/* First call, creating all needed structs */
 	struct conn_info *con_info = calloc(1,sizeof(*con_info));
 	if( NULL == con_info )
 		return NULL; /* Doesn't have resources */
 
-	if ( !init_string(&con_info->str,string_size) ) {
+	/* Body buffer grows as data arrives, so clients can't make us allocate
+	   memory that they don't send */
+	con_info->content_length = content_length;
+	if ( !init_string(&con_info->str,smin(content_length,BODY_SEGMENT_SIZE)) ) {
 		free_con_info(con_info);
 		return NULL; /* Doesn't have resources */
 	}
@@ -131,7 +499,40 @@ static struct conn_info *create_connection_info(size_t string_size) {
 	return con_info;
 }
 
-static int send_http_ok(struct MHD_Connection *connection) {
+static void fill_connection_meta(struct msg_meta *meta,uint16_t listener_port,
+                                 struct MHD_Connection *connection) {
+	const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection,
+		MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+
+	meta->listener_port = listener_port;
+	if(info && info->client_addr && AF_INET == info->client_addr->sa_family)
+		memcpy(&meta->client_addr,info->client_addr,sizeof(meta->client_addr));
+	else if(info && info->client_addr
+	                         && AF_INET6 == info->client_addr->sa_family)
+		memcpy(&meta->client_addr6,info->client_addr,
+			sizeof(meta->client_addr6));
+}
+
+static int set_connection_route(struct conn_info *con_info,
+                                struct http_route *route,const char *key,
+                                size_t key_size) {
+	con_info->route = route;
+	con_info->meta.topic = http_route_topic(route);
+	if(key) {
+		con_info->key = strndup(key,key_size);
+		if(NULL == con_info->key) {
+			rdlog(LOG_ERR,"Can't allocate message key (out of memory?)");
+			return -1;
+		}
+		con_info->meta.key = con_info->key;
+		con_info->meta.key_size = key_size;
+	}
+
+	return 0;
+}
+
+static int send_http_response(struct MHD_Connection *connection,
+                              unsigned int status_code) {
 	struct MHD_Response *http_response = MHD_create_response_from_buffer(
 		0,NULL,MHD_RESPMEM_PERSISTENT);
 
@@ -139,7 +540,7 @@ static int send_http_ok(struct MHD_Connection *connection) {
 		rdlog(LOG_CRIT,"Can't create HTTP response");
 	}
 
-	const int ret = MHD_queue_response(connection,MHD_HTTP_OK,http_response);
+	const int ret = MHD_queue_response(connection,status_code,http_response);
 	MHD_destroy_response(http_response);
 	return ret;
 }
@@ -147,21 +548,91 @@ static int send_http_ok(struct MHD_Connection *connection) {
 static size_t append_http_data_to_connection_data(struct conn_info *con_info,
 												  const char *upload_data,
 												  size_t upload_data_size) {
-
-	if( upload_data_size > string_free_space(&con_info->str) ) {
-		/* TODO error handling */
-		string_grow(&con_info->str,upload_data_size);
+	struct string *str = &con_info->str;
+	if(0 == con_info->segments.size && upload_data_size > string_free_space(str)
+	                          && str->allocated < con_info->content_length) {
+		const size_t new_size = smin(con_info->content_length,
+			smax(str->used + upload_data_size,2*str->allocated));
+		char *new_buf = realloc(str->buf,new_size);
+		if(new_buf) {
+			str->buf = new_buf;
+			str->allocated = new_size;
+		}
 	}
 
-	size_t ncopy = smin(upload_data_size,string_free_space(&con_info->str));
-	strncpy(&con_info->str.buf[con_info->str.used],upload_data,ncopy);
+	/* Fill body buffer, and segments after it */
+	const size_t ncopy = con_info->segments.size > 0 ? 0 :
+		smin(upload_data_size,string_free_space(&con_info->str));
+	memcpy(&con_info->str.buf[con_info->str.used],upload_data,ncopy);
 	con_info->str.used += ncopy;
-	return ncopy;
+
+	return ncopy + segment_list_append(&con_info->segments,
+		&upload_data[ncopy],upload_data_size - ncopy);
+}
+
+/// Request body size, or 0 if it is not known
+static size_t request_content_length(struct MHD_Connection *connection) {
+	const char *content_length = MHD_lookup_connection_value(connection,
+		MHD_HEADER_KIND,MHD_HTTP_HEADER_CONTENT_LENGTH);
+	if(NULL == content_length)
+		return 0;
+
+	char *endptr = NULL;
+	errno = 0;
+	const unsigned long long ret = strtoull(content_length,&endptr,10);
+	if(0 != errno || endptr == content_length || *endptr != '\0'
+	                                                     || ret > SIZE_MAX)
+		return 0;
+
+	return (size_t)ret;
 }
 
-static int post_handle(void *_cls HTTP_UNUSED,
+struct http_body {
+	const struct http_private *h;
+	struct conn_info *con_info;
+};
+
+/// Process (decompressed) body data. Return 0 on success.
+static int http_body_data(const char *data,size_t size,void *_body) {
+	const struct http_body *body = _body;
+
+	if(HTTP_FRAMING_NONE != body->h->framing)
+		return stream_http_data(body->h,body->con_info,data,size);
+
+	return size == append_http_data_to_connection_data(body->con_info,data,
+		size) ? 0 : -1;
+}
+
+static int process_http_data(const struct http_private *h,
+                             struct conn_info *con_info,const char *data,
+                             size_t size) {
+	struct http_body body = {h,con_info};
+
+	if(NULL == con_info->decoder) {
+		const int rc = http_body_data(data,size,&body);
+		if(0 != rc)
+			con_info->discard = 1;
+		return rc;
+	}
+
+	const int rc = content_decoder_decode(con_info->decoder,data,size,
+		http_body_data,&body);
+	if(CONTENT_DECODER_LIMIT == rc) {
+		rdlog(LOG_WARNING,"HTTP body exceeds decompression limits, "
+			"discarding it");
+	} else if(CONTENT_DECODER_INVALID == rc) {
+		rdlog(LOG_WARNING,"HTTP body is not valid compressed data, "
+			"discarding it");
+	}
+
+	if(0 != rc)
+		con_info->discard = 1;
+	return rc;
+}
+
+static int post_handle(void *_cls,
 						 struct MHD_Connection *connection,
-						 const char *url HTTP_UNUSED,
+						 const char *url,
 						 const char *method,
 						 const char *version HTTP_UNUSED,
 						 const char *upload_data,
@@ -180,25 +651,92 @@ static int post_handle(void *_cls HTTP_UNUSED,
 		return MHD_NO;
 	}
 
+	const struct http_private *h = _cls;
+
 	if ( NULL == *ptr ) {
-		*ptr = create_connection_info(STRING_INITIAL_SIZE);
-		return (NULL == *ptr) ? MHD_NO : MHD_YES;
+		struct http_route *route = NULL;
+		const char *key = NULL;
+		size_t key_size = 0;
+		if(h->routes) {
+			route = http_routes_match(h->routes,url,&key,&key_size);
+			if(NULL == route)
+				return send_http_response(connection,MHD_HTTP_NOT_FOUND);
+		}
+
+		/* Streams are limited by message, not by body */
+		const size_t content_length = request_content_length(connection);
+		if(HTTP_FRAMING_NONE == h->framing && h->max_body_size > 0
+		                            && content_length > h->max_body_size) {
+			rdlog(LOG_WARNING,"HTTP body of %zu bytes exceeds max body size, "
+				"rejecting it",content_length);
+			return send_http_response(connection,MHD_HTTP_PAYLOAD_TOO_LARGE);
+		}
+
+		struct content_decoder *decoder = NULL;
+		const char *content_encoding = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND,MHD_HTTP_HEADER_CONTENT_ENCODING);
+		if(0 != content_decoder_get(content_encoding,&h->decompress_limits,
+		                                                        &decoder)) {
+			rdlog(LOG_WARNING,"Unsupported HTTP Content-Encoding %s",
+				content_encoding);
+			return send_http_response(connection,
+				MHD_HTTP_UNSUPPORTED_MEDIA_TYPE);
+		}
+
+		/* Content-Length is the compressed size if there is a decoder */
+		struct conn_info *con_info = create_connection_info(
+			HTTP_FRAMING_NONE == h->framing && NULL == decoder ?
+				content_length : 0);
+		if( NULL == con_info ) {
+			if(decoder)
+				content_decoder_release(decoder);
+			return MHD_NO;
+		}
+
+		con_info->decoder = decoder;
+		fill_connection_meta(&con_info->meta,h->port,connection);
+		if(route && 0 != set_connection_route(con_info,route,key,key_size)) {
+			free_con_info(con_info);
+			return MHD_NO;
+		}
+		*ptr = con_info;
+		return MHD_YES;
 	} else if ( *upload_data_size > 0 ) {
 		/* middle calls, process string sent */
 		struct conn_info *con_info = *ptr;
-		const size_t rc = append_http_data_to_connection_data(con_info,
-		                                upload_data,*upload_data_size);
-		(*upload_data_size) -= rc;
-		return (*upload_data_size != 0) ? MHD_NO : MHD_YES;
+		con_info->received += *upload_data_size;
+		if(HTTP_FRAMING_NONE == h->framing && h->max_body_size > 0
+		                       && con_info->received > h->max_body_size) {
+			/* Chunked upload, or bigger than its Content-Length */
+			rdlog(LOG_WARNING,"HTTP body exceeds max body size, "
+				"aborting upload");
+			con_info->discard = 1;
+			*upload_data_size = 0;
+			/* MHD doesn't read the rest of the body once a response is
+			   queued, and closes the connection if it can't be queued */
+			return send_http_response(connection,MHD_HTTP_PAYLOAD_TOO_LARGE);
+		}
+
+		const int rc = process_http_data(h,con_info,upload_data,
+			*upload_data_size);
+		*upload_data_size = 0;
+		if(HTTP_BODY_TOO_LARGE == rc || CONTENT_DECODER_LIMIT == rc)
+			return send_http_response(connection,MHD_HTTP_PAYLOAD_TOO_LARGE);
+		return 0 == rc ? MHD_YES : MHD_NO;
 
 	} else {
 		/* Send OK. Resources will be freed in request_completed */
-		return send_http_ok(connection);
+		return send_http_response(connection,MHD_HTTP_OK);
 	}
 }
 
 struct http_loop_args {
 	const char *mode;
+	enum http_framing framing;
+	struct content_decoder_limits decompress_limits;
+	size_t max_body_size;
+	size_t max_record_size;
+	struct http_routes *routes;
 	int port;
 	unsigned int num_threads;
 };
@@ -237,6 +775,12 @@ static struct http_private *start_http_loop(const struct http_loop_args *args,
 #ifdef HTTP_PRIVATE_MAGIC
 	h->magic = HTTP_PRIVATE_MAGIC;
 #endif
+	h->port = (uint16_t)args->port;
+	h->framing = args->framing;
+	h->decompress_limits = args->decompress_limits;
+	h->max_body_size = args->max_body_size;
+	h->max_record_size = args->max_record_size;
+	h->routes = args->routes;
 	h->callback = callback;
 	h->callback_opaque = cb_opaque;
 
@@ -276,13 +820,20 @@ static struct http_private *start_http_loop(const struct http_loop_args *args,
 }
 
 static void reload_listener_http(json_t *new_config,listener_opaque_reload opaque_reload,
-                               void *cb_opaque, void *_private __attribute__((unused))) {
-	opaque_reload(new_config,cb_opaque);
+                               void *cb_opaque, void *_private) {
+	struct http_private *h = _private;
+
+	if(opaque_reload)
+		opaque_reload(new_config,cb_opaque);
+	if(h->routes)
+		http_routes_reload(h->routes,json_object_get(new_config,"routes"));
 }
 
 static void break_http_loop(void *_h){
 	struct http_private *h = _h;
 	MHD_stop_daemon(h->d);
+	if(h->routes)
+		http_routes_done(h->routes);
 	free(h);
 }
 
@@ -290,30 +841,95 @@ struct listener *create_http_listener(struct json_t *config,listener_callback cb
 	size_t errsize) {
 
 	json_error_t error;
+	const char *engine = NULL,*framing = NULL;
+	json_t *routes_config = NULL;
+	json_int_t max_decompressed_size = CONTENT_DECODER_DEFAULT_MAX_SIZE;
+	json_int_t max_decompression_ratio = CONTENT_DECODER_DEFAULT_MAX_RATIO;
+	json_int_t max_body_size = 0;
+	json_int_t max_record_size = HTTP_DEFAULT_MAX_RECORD_SIZE;
+	int h2c = 0;
 
 	struct http_loop_args handler_args;
 	memset(&handler_args,0,sizeof(handler_args));
 	handler_args.num_threads = 1;
 
-	const int unpack_rc = json_unpack_ex(config,&error,0,"{s:i,s?s,s?i}",
-		"port",&handler_args.port,"mode",&handler_args.mode,
-		"num_threads",&handler_args.num_threads);
+	const int unpack_rc = json_unpack_ex(config,&error,0,"{s:i,s?s,s?s,s?i,s?s,s?I,s?I,s?I,s?I,s?b,s?o}",
+		"port",&handler_args.port,"engine",&engine,"mode",&handler_args.mode,
+		"num_threads",&handler_args.num_threads,"framing",&framing,
+		"max_decompressed_size",&max_decompressed_size,
+		"max_decompression_ratio",&max_decompression_ratio,
+		"max_body_size",&max_body_size,"max_record_size",&max_record_size,
+		"h2c",&h2c,"routes",&routes_config);
 	if( unpack_rc != 0 /* Failure */ ) {
 		snprintf(err,errsize,"Can't find server port: %s",error.text);
 	}
 
+	if(engine && 0 == strcmp(HTTP_ENGINE_LIBEV,engine)) {
+		return create_socket_listener(config,cb,cb_opaque,err,errsize);
+	} else if(engine && 0 != strcmp(HTTP_ENGINE_MICROHTTPD,engine)) {
+		snprintf(err,errsize,"Not a valid HTTP engine. Select one between("
+			HTTP_ENGINE_MICROHTTPD "," HTTP_ENGINE_LIBEV ")");
+		return NULL;
+	}
+
+	if(h2c) {
+		snprintf(err,errsize,"h2c is only supported by " HTTP_ENGINE_LIBEV
+			" engine");
+		return NULL;
+	}
+
+	if(NULL == framing) {
+		handler_args.framing = HTTP_FRAMING_NONE;
+	} else if(0 == strcmp(FRAMING_NEWLINE,framing)) {
+		handler_args.framing = HTTP_FRAMING_NEWLINE;
+	} else if(0 == strcmp(FRAMING_LENGTH,framing)) {
+		handler_args.framing = HTTP_FRAMING_LENGTH;
+	} else {
+		snprintf(err,errsize,"Not a valid HTTP framing. Select one between("
+			FRAMING_NEWLINE "," FRAMING_LENGTH ")");
+		return NULL;
+	}
+
+	if(max_decompressed_size < 0 || max_decompression_ratio < 0) {
+		snprintf(err,errsize,"Decompression limits can't be negative");
+		return NULL;
+	}
+
+	if(max_body_size < 0) {
+		snprintf(err,errsize,"Max body size can't be negative");
+		return NULL;
+	}
+	handler_args.max_body_size = (size_t)max_body_size;
+
+	if(max_record_size <= 0) {
+		snprintf(err,errsize,"Max record size must be positive");
+		return NULL;
+	}
+	handler_args.max_record_size = (size_t)max_record_size;
+
+	handler_args.decompress_limits.max_size = (size_t)max_decompressed_size;
+	handler_args.decompress_limits.max_ratio = (size_t)max_decompression_ratio;
+
 	if(NULL==handler_args.mode)
 		handler_args.mode = MODE_SELECT;
 
+	if(routes_config) {
+		handler_args.routes = http_routes_new(routes_config,err,errsize);
+		if(NULL == handler_args.routes)
+			return NULL;
+	}
+
 	struct http_private *priv = start_http_loop(&handler_args,err,errsize,cb,cb_opaque);
 	if( NULL == priv ) {
+		if(handler_args.routes)
+			http_routes_done(handler_args.routes);
 		return NULL;
 	}
 
 	struct listener *listener = calloc(1,sizeof(*listener));
 	if(!listener){
 		snprintf(err,errsize,"Can't create http listener (out of memory?)");
-		free(priv);
+		break_http_loop(priv);
 		return NULL;
 	}
 
@@ -0,0 +1,374 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "http1.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define HTTP1_VERSION_1_0 "HTTP/1.0"
+#define HTTP1_VERSION_1_1 "HTTP/1.1"
+
+size_t http1_head_size(const char *buf,size_t size,size_t *scanned) {
+	const char *end = buf + size;
+	const char *cursor = buf + *scanned;
+	const char *nl = NULL;
+
+	while((nl = memchr(cursor,'\n',(size_t)(end - cursor)))) {
+		const char *next = nl + 1;
+		if(next < end && '\r' == *next)
+			next++;
+
+		if(next >= end) {
+			/* Can't know yet if next line is the empty one */
+			*scanned = (size_t)(nl - buf);
+			return 0;
+		}
+
+		if('\n' == *next)
+			return (size_t)(next + 1 - buf);
+
+		cursor = nl + 1;
+	}
+
+	*scanned = size;
+	return 0;
+}
+
+/// Case insensitive comparison of a token with a string constant
+static int token_eq(const char *token,size_t token_size,const char *str) {
+	return strlen(str) == token_size && 0 == strncasecmp(token,str,token_size);
+}
+
+static int is_ows(char c) {
+	return ' ' == c || '\t' == c;
+}
+
+/// Check if a comma separated header value contains token
+static int header_has_token(const char *value,size_t value_size,
+                                                          const char *token) {
+	const char *end = value + value_size;
+
+	while(value < end) {
+		const char *comma = memchr(value,',',(size_t)(end - value));
+		const char *token_end = comma ? comma : end;
+		const char *token_start = value;
+
+		while(token_start < token_end && is_ows(*token_start))
+			token_start++;
+		while(token_end > token_start && is_ows(token_end[-1]))
+			token_end--;
+
+		if(token_eq(token_start,(size_t)(token_end - token_start),token))
+			return 1;
+
+		value = comma ? comma + 1 : end;
+	}
+
+	return 0;
+}
+
+/// Parse a Content-Length value. Return 0 on success.
+static int parse_content_length(const char *value,size_t value_size,
+                                                            uint64_t *ret) {
+	uint64_t n = 0;
+	size_t i;
+
+	if(0 == value_size)
+		return -1;
+
+	for(i=0;i<value_size;++i) {
+		if(value[i] < '0' || value[i] > '9')
+			return -1;
+		const uint64_t digit = (uint64_t)(value[i] - '0');
+		if(n > (UINT64_MAX - digit)/10)
+			return -1;
+		n = n*10 + digit;
+	}
+
+	*ret = n;
+	return 0;
+}
+
+static enum http1_rc parse_request_line(char *line,size_t line_size,
+                                                   struct http1_request *req) {
+	char *end = line + line_size;
+
+	char *method_end = memchr(line,' ',line_size);
+	if(NULL == method_end || method_end == line)
+		return HTTP1_INVALID;
+
+	char *target = method_end + 1;
+	char *target_end = memchr(target,' ',(size_t)(end - target));
+	if(NULL == target_end || target == target_end || '/' != *target)
+		return HTTP1_INVALID;
+
+	const char *version = target_end + 1;
+	const size_t version_size = (size_t)(end - version);
+	if(token_eq(version,version_size,HTTP1_VERSION_1_1)) {
+		req->keep_alive = 1;
+	} else if(token_eq(version,version_size,HTTP1_VERSION_1_0)) {
+		/* HTTP/1.0 keep-alive is not supported */
+		req->keep_alive = 0;
+	} else if(version_size > 5 && 0 == memcmp(version,"HTTP/",5)) {
+		return HTTP1_VERSION_NOT_SUPPORTED;
+	} else {
+		return HTTP1_INVALID;
+	}
+
+	char *query = memchr(target,'?',(size_t)(target_end - target));
+	char *path_end = query ? query : target_end;
+	*path_end = '\0';
+
+	req->method = line;
+	req->method_size = (size_t)(method_end - line);
+	req->path = target;
+	req->path_size = (size_t)(path_end - target);
+	return HTTP1_OK;
+}
+
+static enum http1_rc parse_header(char *line,size_t line_size,
+                                  struct http1_request *req,
+                                  int *has_content_length) {
+	char *end = line + line_size;
+
+	if(is_ows(*line))
+		return HTTP1_INVALID; /* Obsolete line folding */
+
+	char *colon = memchr(line,':',line_size);
+	if(NULL == colon || colon == line || is_ows(colon[-1]))
+		return HTTP1_INVALID;
+
+	const char *name = line;
+	const size_t name_size = (size_t)(colon - line);
+	char *value = colon + 1;
+	while(value < end && is_ows(*value))
+		value++;
+	while(end > value && is_ows(end[-1]))
+		end--;
+	const size_t value_size = (size_t)(end - value);
+
+	if(token_eq(name,name_size,"Content-Length")) {
+		uint64_t content_length = 0;
+		if(0 != parse_content_length(value,value_size,&content_length))
+			return HTTP1_INVALID;
+		if(*has_content_length && content_length != req->content_length)
+			return HTTP1_INVALID;
+		*has_content_length = 1;
+		req->content_length = content_length;
+	} else if(token_eq(name,name_size,"Transfer-Encoding")) {
+		if(!token_eq(value,value_size,"chunked"))
+			return HTTP1_NOT_IMPLEMENTED;
+		req->chunked = 1;
+	} else if(token_eq(name,name_size,"Content-Encoding")) {
+		*end = '\0'; /* Line terminator or whitespace */
+		req->content_encoding = value;
+	} else if(token_eq(name,name_size,"Connection")) {
+		if(header_has_token(value,value_size,"close"))
+			req->keep_alive = 0;
+	} else if(token_eq(name,name_size,"Expect")) {
+		req->expect_continue = token_eq(value,value_size,"100-continue");
+	}
+
+	return HTTP1_OK;
+}
+
+enum http1_rc http1_parse_head(char *buf,size_t head_size,
+                                                   struct http1_request *req) {
+	char *cursor = buf;
+	char *end = buf + head_size;
+	int has_content_length = 0;
+	int request_line = 1;
+
+	memset(req,0,sizeof(*req));
+
+	while(cursor < end) {
+		char *nl = memchr(cursor,'\n',(size_t)(end - cursor));
+		if(NULL == nl)
+			return HTTP1_INVALID;
+
+		char *line_end = nl;
+		if(line_end > cursor && '\r' == line_end[-1])
+			line_end--;
+		const size_t line_size = (size_t)(line_end - cursor);
+
+		if(0 == line_size)
+			break; /* End of head */
+
+		const enum http1_rc rc = request_line ?
+			parse_request_line(cursor,line_size,req) :
+			parse_header(cursor,line_size,req,&has_content_length);
+		if(HTTP1_OK != rc)
+			return rc;
+
+		request_line = 0;
+		cursor = nl + 1;
+	}
+
+	if(request_line)
+		return HTTP1_INVALID;
+
+	/* Both of them are a request smuggling attempt */
+	if(req->chunked && has_content_length)
+		return HTTP1_INVALID;
+
+	return HTTP1_OK;
+}
+
+enum chunked_state {
+	CHUNK_SIZE = 0,
+	CHUNK_EXTENSION,
+	CHUNK_SIZE_LF,
+	CHUNK_DATA,
+	CHUNK_DATA_CR,
+	CHUNK_DATA_LF,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LINE,
+	CHUNK_TRAILER_LF,
+};
+
+static int hex_digit(char c) {
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static void chunk_size_end(struct http1_chunked *chunked) {
+	chunked->state = chunked->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+	chunked->size_digits = 0;
+}
+
+int http1_chunked_parse(struct http1_chunked *chunked,const char *buf,
+                        size_t size,size_t *consumed,http1_data_cb cb,
+                        void *opaque) {
+	const char *cursor = buf;
+	const char *end = buf + size;
+	int rc = HTTP1_CHUNKED_MORE;
+
+	while(cursor < end && HTTP1_CHUNKED_MORE == rc) {
+		const char *nl = NULL;
+		size_t n = 0;
+		int digit = 0;
+
+		switch(chunked->state) {
+		case CHUNK_SIZE:
+			digit = hex_digit(*cursor);
+			if(digit >= 0) {
+				if(chunked->chunk_left > (UINT64_MAX >> 4))
+					return HTTP1_INVALID;
+				chunked->chunk_left = chunked->chunk_left << 4
+				                                      | (uint64_t)digit;
+				chunked->size_digits++;
+			} else if(0 == chunked->size_digits) {
+				return HTTP1_INVALID;
+			} else if(';' == *cursor || is_ows(*cursor)) {
+				chunked->state = CHUNK_EXTENSION;
+			} else if('\r' == *cursor) {
+				chunked->state = CHUNK_SIZE_LF;
+			} else if('\n' == *cursor) {
+				chunk_size_end(chunked);
+			} else {
+				return HTTP1_INVALID;
+			}
+			cursor++;
+			break;
+
+		case CHUNK_EXTENSION:
+			/* Chunk extensions are ignored */
+			nl = memchr(cursor,'\n',(size_t)(end - cursor));
+			if(NULL == nl) {
+				cursor = end;
+			} else {
+				cursor = nl + 1;
+				chunk_size_end(chunked);
+			}
+			break;
+
+		case CHUNK_SIZE_LF:
+			if('\n' != *cursor++)
+				return HTTP1_INVALID;
+			chunk_size_end(chunked);
+			break;
+
+		case CHUNK_DATA:
+			n = (size_t)(end - cursor);
+			if(n > chunked->chunk_left)
+				n = (size_t)chunked->chunk_left;
+			if(cb && 0 != cb(cursor,n,opaque))
+				return HTTP1_INVALID;
+			cursor += n;
+			chunked->chunk_left -= n;
+			if(0 == chunked->chunk_left)
+				chunked->state = CHUNK_DATA_CR;
+			break;
+
+		case CHUNK_DATA_CR:
+			if('\r' == *cursor)
+				chunked->state = CHUNK_DATA_LF;
+			else if('\n' == *cursor)
+				chunked->state = CHUNK_SIZE;
+			else
+				return HTTP1_INVALID;
+			cursor++;
+			break;
+
+		case CHUNK_DATA_LF:
+			if('\n' != *cursor++)
+				return HTTP1_INVALID;
+			chunked->state = CHUNK_SIZE;
+			break;
+
+		case CHUNK_TRAILER:
+			/* Trailer fields are ignored */
+			if('\r' == *cursor)
+				chunked->state = CHUNK_TRAILER_LF;
+			else if('\n' == *cursor)
+				rc = HTTP1_CHUNKED_DONE;
+			else
+				chunked->state = CHUNK_TRAILER_LINE;
+			cursor++;
+			break;
+
+		case CHUNK_TRAILER_LINE:
+			nl = memchr(cursor,'\n',(size_t)(end - cursor));
+			if(NULL == nl) {
+				cursor = end;
+			} else {
+				cursor = nl + 1;
+				chunked->state = CHUNK_TRAILER;
+			}
+			break;
+
+		case CHUNK_TRAILER_LF:
+			if('\n' != *cursor++)
+				return HTTP1_INVALID;
+			rc = HTTP1_CHUNKED_DONE;
+			break;
+
+		default:
+			return HTTP1_INVALID;
+		}
+	}
+
+	*consumed = (size_t)(cursor - buf);
+	return rc;
+}
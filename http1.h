@@ -0,0 +1,107 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Incremental HTTP/1.1 request parser, used by the native HTTP engine of
+ * socket listeners. Request heads are parsed in place in the connection read
+ * buffer: parsed fields point into it, and nothing is copied.
+ */
+
+/// Max request head size (request line plus headers)
+#define HTTP1_MAX_HEAD_SIZE 8192
+
+enum http1_rc {
+	HTTP1_OK = 0,
+	/// Malformed request
+	HTTP1_INVALID = -1,
+	/// Unknown HTTP version
+	HTTP1_VERSION_NOT_SUPPORTED = -2,
+	/// Unknown Transfer-Encoding
+	HTTP1_NOT_IMPLEMENTED = -3,
+};
+
+struct http1_request {
+	const char *method;
+	size_t method_size;
+	/// URL path, without query. Null terminated.
+	const char *path;
+	size_t path_size;
+	/// Content-Encoding, NULL if not present. Null terminated.
+	const char *content_encoding;
+	/// Body size if not chunked
+	uint64_t content_length;
+	/// Body uses chunked Transfer-Encoding
+	int chunked;
+	/// Connection can be used for more requests
+	int keep_alive;
+	/// Client waits for 100 Continue before sending body
+	int expect_continue;
+};
+
+/** Locate the end of a request head. Data can be added to buf between calls.
+    @param buf Request data
+    @param size Request data size
+    @param scanned Bytes already scanned in previous calls. Set it to 0 for
+                   a new request.
+    @return Head size, or 0 if head is not complete
+    */
+size_t http1_head_size(const char *buf,size_t size,size_t *scanned);
+
+/** Parse a complete request head. Buffer is modified to null terminate
+    request fields.
+    @param buf Request head
+    @param head_size Value returned by http1_head_size
+    @param req Parsed request
+    @return HTTP1_OK, or error code
+    */
+enum http1_rc http1_parse_head(char *buf,size_t head_size,
+                                                    struct http1_request *req);
+
+/// Decoded body data callback. Return 0 to continue.
+typedef int (*http1_data_cb)(const char *data,size_t size,void *opaque);
+
+/// Chunked body decoder state. Zero initialize it for a new body.
+struct http1_chunked {
+	int state;
+	int size_digits;
+	uint64_t chunk_left;
+};
+
+/// Return values of http1_chunked_parse, besides HTTP1_INVALID
+#define HTTP1_CHUNKED_MORE 0
+#define HTTP1_CHUNKED_DONE 1
+
+/** Decode chunked body data
+    @param chunked Decoder state
+    @param buf Body data
+    @param size Body data size
+    @param consumed Bytes of buf consumed. Bytes after the body are not.
+    @param cb Called with chunks data. It can be NULL to skip them.
+    @param opaque cb opaque
+    @return HTTP1_CHUNKED_DONE if body is complete, HTTP1_CHUNKED_MORE if
+            more data is needed, or HTTP1_INVALID if body is not valid or cb
+            failed.
+    */
+int http1_chunked_parse(struct http1_chunked *chunked,const char *buf,
+                        size_t size,size_t *consumed,http1_data_cb cb,
+                        void *opaque);
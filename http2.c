@@ -0,0 +1,444 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#ifdef HAVE_LIBNGHTTP2
+
+#include "http2.h"
+
+#include <librd/rdlog.h>
+#include <nghttp2/nghttp2.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#define HTTP2_SESSION_MAGIC 0x3248545450534EL
+
+/// Connection flow control window. Streams use a smaller one.
+#define HTTP2_CONNECTION_WINDOW_SIZE (16*1024*1024)
+#define HTTP2_STREAM_WINDOW_SIZE (1024*1024)
+
+#define HTTP2_STATUS_METHOD_NOT_ALLOWED 405
+#define HTTP2_STATUS_PAYLOAD_TOO_LARGE 413
+#define HTTP2_STATUS_INTERNAL_ERROR 500
+
+/// Request stream
+struct http2_stream {
+	LIST_ENTRY(http2_stream) entry;
+	int32_t id;
+	/// Request method is POST
+	int post;
+	char *path;
+	char *content_encoding;
+	/// content-length, if present
+	uint64_t content_length;
+	int has_content_length;
+	char *body;
+	size_t body_size;
+	size_t body_used;
+	/// Response already submitted. Rest of request is discarded.
+	int answered;
+	/// Reset stream after sending response, so client stops sending it
+	int reset;
+};
+
+LIST_HEAD(http2_stream_list,http2_stream);
+
+struct http2_session {
+#ifdef HTTP2_SESSION_MAGIC
+	uint64_t magic;
+#endif
+	nghttp2_session *session;
+	size_t max_body_size;
+	http2_request_cb cb;
+	void *cb_opaque;
+	/// Open streams. nghttp2 doesn't close them when session is deleted.
+	struct http2_stream_list streams;
+	/// Output returned by nghttp2 and not copied yet
+	const uint8_t *out;
+	size_t out_size;
+};
+
+static void http2_stream_done(struct http2_stream *stream) {
+	LIST_REMOVE(stream,entry);
+	free(stream->path);
+	free(stream->content_encoding);
+	free(stream->body);
+	free(stream);
+}
+
+/** Answer a stream
+    @param complete Request has been received completely. If not, client is
+                    told to stop sending it.
+    */
+static void http2_respond(struct http2_session *s,struct http2_stream *stream,
+                          int status,int complete) {
+	char status_str[sizeof("000")];
+	snprintf(status_str,sizeof(status_str),"%03d",status);
+
+	nghttp2_nv nv = {
+		.name = (uint8_t *)":status",
+		.value = (uint8_t *)status_str,
+		.namelen = strlen(":status"),
+		.valuelen = strlen(status_str),
+		.flags = NGHTTP2_NV_FLAG_NONE,
+	};
+
+	stream->answered = 1;
+	stream->reset = !complete;
+	free(stream->body);
+	stream->body = NULL;
+	stream->body_size = stream->body_used = 0;
+
+	const int rc = nghttp2_submit_response(s->session,stream->id,&nv,1,NULL);
+	if(0 != rc) {
+		rdlog(LOG_ERR,"Can't submit HTTP/2 response: %s",
+			nghttp2_strerror(rc));
+	}
+}
+
+/// Hand a complete request to session callback, and answer it
+static void http2_request_end(struct http2_session *s,
+                              struct http2_stream *stream) {
+	if(stream->answered)
+		return;
+
+	struct http2_request req = {
+		.path = stream->path ? stream->path : "/",
+		.content_encoding = stream->content_encoding,
+		.body = stream->body,
+		.body_size = stream->body_used,
+	};
+	stream->body = NULL;
+
+	const int status = s->cb(&req,s->cb_opaque);
+	http2_respond(s,stream,status,1);
+}
+
+static int http2_body_append(struct http2_stream *stream,const uint8_t *data,
+                                                                 size_t size) {
+	if(size > stream->body_size - stream->body_used) {
+		size_t new_size = stream->body_size > 0 ? stream->body_size : size;
+		while(new_size - stream->body_used < size)
+			new_size *= 2;
+
+		char *new_body = realloc(stream->body,new_size);
+		if(NULL == new_body) {
+			rdlog(LOG_ERR,"Can't allocate HTTP body of %zu bytes "
+				"(out of memory?)",new_size);
+			return -1;
+		}
+
+		stream->body = new_body;
+		stream->body_size = new_size;
+	}
+
+	memcpy(&stream->body[stream->body_used],data,size);
+	stream->body_used += size;
+	return 0;
+}
+
+static int header_eq(const uint8_t *name,size_t namelen,const char *str) {
+	return strlen(str) == namelen && 0 == memcmp(name,str,namelen);
+}
+
+static int on_begin_headers(nghttp2_session *session,
+                            const nghttp2_frame *frame,void *_s) {
+	struct http2_session *s = _s;
+
+	if(NGHTTP2_HEADERS != frame->hd.type
+	                        || NGHTTP2_HCAT_REQUEST != frame->headers.cat)
+		return 0;
+
+	struct http2_stream *stream = calloc(1,sizeof(*stream));
+	if(NULL == stream) {
+		rdlog(LOG_ERR,"Can't allocate HTTP/2 stream (out of memory?)");
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	}
+
+	stream->id = frame->hd.stream_id;
+	LIST_INSERT_HEAD(&s->streams,stream,entry);
+	nghttp2_session_set_stream_user_data(session,stream->id,stream);
+	return 0;
+}
+
+static int on_header(nghttp2_session *session,const nghttp2_frame *frame,
+                     const uint8_t *name,size_t namelen,
+                     const uint8_t *value,size_t valuelen,
+                     uint8_t flags,void *_s) {
+	(void)flags;
+	(void)_s;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,frame->hd.stream_id);
+	if(NULL == stream || NGHTTP2_HEADERS != frame->hd.type
+	                        || NGHTTP2_HCAT_REQUEST != frame->headers.cat)
+		return 0; /* Trailer fields are ignored */
+
+	if(header_eq(name,namelen,":method")) {
+		stream->post = 4 == valuelen && 0 == memcmp(value,"POST",4);
+	} else if(header_eq(name,namelen,":path")) {
+		const uint8_t *query = memchr(value,'?',valuelen);
+		free(stream->path);
+		stream->path = strndup((const char *)value,
+			query ? (size_t)(query - value) : valuelen);
+		if(NULL == stream->path)
+			return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	} else if(header_eq(name,namelen,"content-encoding")) {
+		free(stream->content_encoding);
+		stream->content_encoding = strndup((const char *)value,valuelen);
+		if(NULL == stream->content_encoding)
+			return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	} else if(header_eq(name,namelen,"content-length")) {
+		/* Value has been validated by nghttp2 */
+		size_t i;
+		stream->content_length = 0;
+		for(i=0;i<valuelen;++i)
+			stream->content_length = stream->content_length*10
+			                                     + (uint64_t)(value[i] - '0');
+		stream->has_content_length = 1;
+	}
+
+	return 0;
+}
+
+static int on_frame_recv(nghttp2_session *session,const nghttp2_frame *frame,
+                                                                   void *_s) {
+	struct http2_session *s = _s;
+
+	if(NGHTTP2_HEADERS != frame->hd.type && NGHTTP2_DATA != frame->hd.type)
+		return 0;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,frame->hd.stream_id);
+	if(NULL == stream)
+		return 0;
+
+	const int end_stream = frame->hd.flags & NGHTTP2_FLAG_END_STREAM;
+	if(NGHTTP2_HEADERS == frame->hd.type
+	                        && NGHTTP2_HCAT_REQUEST == frame->headers.cat) {
+		/* Request head checks, before receiving the body */
+		if(!stream->post) {
+			http2_respond(s,stream,HTTP2_STATUS_METHOD_NOT_ALLOWED,
+				end_stream);
+		} else if(s->max_body_size > 0 && stream->has_content_length
+		                  && stream->content_length > s->max_body_size) {
+			rdlog(LOG_WARNING,"HTTP body of %zu bytes exceeds max body "
+				"size, rejecting it",(size_t)stream->content_length);
+			http2_respond(s,stream,HTTP2_STATUS_PAYLOAD_TOO_LARGE,
+				end_stream);
+		}
+	}
+
+	if(end_stream)
+		http2_request_end(s,stream);
+
+	return 0;
+}
+
+static int on_data_chunk_recv(nghttp2_session *session,uint8_t flags,
+                              int32_t stream_id,const uint8_t *data,
+                              size_t len,void *_s) {
+	struct http2_session *s = _s;
+	(void)flags;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,stream_id);
+	if(NULL == stream || stream->answered)
+		return 0;
+
+	if(s->max_body_size > 0 && len > s->max_body_size - stream->body_used) {
+		rdlog(LOG_WARNING,"HTTP body exceeds max body size, "
+			"aborting upload");
+		http2_respond(s,stream,HTTP2_STATUS_PAYLOAD_TOO_LARGE,0);
+	} else if(0 != http2_body_append(stream,data,len)) {
+		http2_respond(s,stream,HTTP2_STATUS_INTERNAL_ERROR,0);
+	}
+
+	return 0;
+}
+
+static int on_frame_send(nghttp2_session *session,const nghttp2_frame *frame,
+                                                                   void *_s) {
+	(void)_s;
+
+	if(NGHTTP2_HEADERS != frame->hd.type)
+		return 0;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,frame->hd.stream_id);
+	if(stream && stream->reset) {
+		/* Not submitted with the response, or it could be sent first */
+		stream->reset = 0;
+		nghttp2_submit_rst_stream(session,NGHTTP2_FLAG_NONE,stream->id,
+			NGHTTP2_NO_ERROR);
+	}
+
+	return 0;
+}
+
+static int on_stream_close(nghttp2_session *session,int32_t stream_id,
+                           uint32_t error_code,void *_s) {
+	(void)error_code;
+	(void)_s;
+
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(
+		session,stream_id);
+	if(stream) {
+		nghttp2_session_set_stream_user_data(session,stream_id,NULL);
+		http2_stream_done(stream);
+	}
+
+	return 0;
+}
+
+struct http2_session *http2_session_new(size_t max_body_size,
+                                        http2_request_cb cb,void *opaque) {
+	nghttp2_session_callbacks *callbacks = NULL;
+	const nghttp2_settings_entry settings[] = {
+		{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+			HTTP2_MAX_CONCURRENT_STREAMS},
+		{NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE,HTTP2_STREAM_WINDOW_SIZE},
+	};
+
+	struct http2_session *s = calloc(1,sizeof(*s));
+	if(NULL == s) {
+		rdlog(LOG_ERR,"Can't allocate HTTP/2 session (out of memory?)");
+		return NULL;
+	}
+
+#ifdef HTTP2_SESSION_MAGIC
+	s->magic = HTTP2_SESSION_MAGIC;
+#endif
+	s->max_body_size = max_body_size;
+	s->cb = cb;
+	s->cb_opaque = opaque;
+	LIST_INIT(&s->streams);
+
+	int rc = nghttp2_session_callbacks_new(&callbacks);
+	if(0 != rc)
+		goto err;
+
+	nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
+		on_begin_headers);
+	nghttp2_session_callbacks_set_on_header_callback(callbacks,on_header);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+		on_frame_recv);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+		on_data_chunk_recv);
+	nghttp2_session_callbacks_set_on_frame_send_callback(callbacks,
+		on_frame_send);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+		on_stream_close);
+
+	rc = nghttp2_session_server_new(&s->session,callbacks,s);
+	nghttp2_session_callbacks_del(callbacks);
+	if(0 != rc)
+		goto err;
+
+	rc = nghttp2_submit_settings(s->session,NGHTTP2_FLAG_NONE,settings,
+		sizeof(settings)/sizeof(settings[0]));
+	if(0 == rc) {
+		rc = nghttp2_session_set_local_window_size(s->session,
+			NGHTTP2_FLAG_NONE,0,HTTP2_CONNECTION_WINDOW_SIZE);
+	}
+	if(0 != rc)
+		goto err;
+
+	return s;
+
+err:
+	rdlog(LOG_ERR,"Can't create HTTP/2 session: %s",nghttp2_strerror(rc));
+	if(s->session)
+		nghttp2_session_del(s->session);
+	free(s);
+	return NULL;
+}
+
+void http2_session_done(struct http2_session *s) {
+#ifdef HTTP2_SESSION_MAGIC
+	assert(HTTP2_SESSION_MAGIC == s->magic);
+#endif
+	nghttp2_session_del(s->session);
+	while(!LIST_EMPTY(&s->streams))
+		http2_stream_done(LIST_FIRST(&s->streams));
+	free(s);
+}
+
+int http2_session_recv(struct http2_session *s,const char *buf,size_t size) {
+#ifdef HTTP2_SESSION_MAGIC
+	assert(HTTP2_SESSION_MAGIC == s->magic);
+#endif
+
+	const ssize_t rc = nghttp2_session_mem_recv(s->session,
+		(const uint8_t *)buf,size);
+	if(rc < 0) {
+		rdlog(LOG_WARNING,"HTTP/2 connection error: %s",
+			nghttp2_strerror((int)rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t http2_session_send(struct http2_session *s,char *buf,size_t size) {
+	size_t copied = 0;
+
+#ifdef HTTP2_SESSION_MAGIC
+	assert(HTTP2_SESSION_MAGIC == s->magic);
+#endif
+
+	while(copied < size) {
+		if(0 == s->out_size) {
+			const uint8_t *data = NULL;
+			const ssize_t rc = nghttp2_session_mem_send(s->session,&data);
+			if(rc < 0) {
+				rdlog(LOG_ERR,"HTTP/2 connection error: %s",
+					nghttp2_strerror((int)rc));
+				return -1;
+			} else if(0 == rc) {
+				break;
+			}
+
+			/* Valid until next nghttp2_session_mem_send call */
+			s->out = data;
+			s->out_size = (size_t)rc;
+		}
+
+		const size_t n = size - copied < s->out_size ? size - copied
+		                                             : s->out_size;
+		memcpy(&buf[copied],s->out,n);
+		copied += n;
+		s->out += n;
+		s->out_size -= n;
+	}
+
+	return (ssize_t)copied;
+}
+
+int http2_session_finished(struct http2_session *s) {
+	return 0 == s->out_size && !nghttp2_session_want_read(s->session)
+	                        && !nghttp2_session_want_write(s->session);
+}
+
+#endif
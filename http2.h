@@ -0,0 +1,88 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "config.h"
+
+#ifdef HAVE_LIBNGHTTP2
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * HTTP/2 cleartext (h2c with prior knowledge) server sessions, used by the
+ * native HTTP engine of socket listeners. Many POST streams are multiplexed
+ * over one connection, and every complete one is handed to the caller as a
+ * request. Sessions do no I/O: caller feeds them received data, and writes
+ * the data they produce.
+ */
+
+/// Client connection preface. h2c connections start with it.
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_SIZE (sizeof(HTTP2_PREFACE) - 1)
+
+/// Max concurrent streams of a connection
+#define HTTP2_MAX_CONCURRENT_STREAMS 100
+
+/// Complete request stream
+struct http2_request {
+	/// URL path, without query. Null terminated.
+	const char *path;
+	/// content-encoding, NULL if not present. Null terminated.
+	const char *content_encoding;
+	/// Request body. Callback takes its ownership.
+	char *body;
+	size_t body_size;
+};
+
+/** Complete request callback
+    @return HTTP status of the response
+    */
+typedef int (*http2_request_cb)(struct http2_request *req,void *opaque);
+
+struct http2_session;
+
+/** Create a server session
+    @param max_body_size Streams with bigger bodies are answered with 413
+                         before receiving them completely. 0 for no limit.
+    @param cb Complete requests callback
+    @param opaque cb opaque
+    @return New session, or NULL on error
+    */
+struct http2_session *http2_session_new(size_t max_body_size,
+                                        http2_request_cb cb,void *opaque);
+
+void http2_session_done(struct http2_session *session);
+
+/** Process received data, client preface included
+    @return 0 on success, -1 if connection has to be closed
+    */
+int http2_session_recv(struct http2_session *session,const char *buf,
+                                                                 size_t size);
+
+/** Copy pending output to buf
+    @return Bytes copied, or -1 if connection has to be closed
+    */
+ssize_t http2_session_send(struct http2_session *session,char *buf,
+                                                                 size_t size);
+
+/// Session has nothing more to read nor to write
+int http2_session_finished(struct http2_session *session);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "http_routes.h"
+#include "global_config.h"
+#include "kafka.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_ROUTE_PATH_KEY "path"
+#define CONFIG_ROUTE_TOPIC_KEY "topic"
+#define CONFIG_ROUTE_KEY_KEY "key"
+
+#define HTTP_ROUTES_MAGIC 0x4077E5A04077E5A0L
+
+struct http_route {
+	char *path;
+	char *topic_name;
+	/// Resolved on first use, since kafka is started after listeners
+	struct rd_kafka_topic_s *topic;
+	/// Key segment index, or -1 if route has no key
+	int key_segment;
+	/// Callback to use instead of listener one
+	int has_callbacks;
+	struct listener_callbacks cb;
+};
+
+/// Trie node: one path segment
+struct route_node {
+	/// Literal segment. NULL for a braced (any segment) one.
+	char *segment;
+	size_t segment_len;
+	struct route_node **children;
+	size_t children_count;
+	/// Route that ends in this node
+	struct http_route *route;
+};
+
+struct http_routes {
+#ifdef HTTP_ROUTES_MAGIC
+	uint64_t magic;
+#endif
+	struct route_node root;
+	size_t count;
+	struct http_route *routes;
+};
+
+/// Path segment [begin,end). Return 0 if there are no more segments.
+static int next_segment(const char **cursor,const char **begin,
+                                             const char **end) {
+	const char *c = *cursor;
+	while('/' == *c)
+		c++;
+	if('\0' == *c || '?' == *c)
+		return 0;
+
+	*begin = c;
+	while('\0' != *c && '/' != *c && '?' != *c)
+		c++;
+	*end = *cursor = c;
+	return 1;
+}
+
+static int is_braced(const char *begin,const char *end) {
+	return end - begin >= 2 && '{' == begin[0] && '}' == end[-1];
+}
+
+/*
+ * Trie
+ */
+
+static void route_node_done(struct route_node *node) {
+	size_t i;
+	for(i=0;i<node->children_count;++i) {
+		route_node_done(node->children[i]);
+		free(node->children[i]);
+	}
+	free(node->children);
+	free(node->segment);
+}
+
+/// Get or create node child. Return NULL if out of memory.
+static struct route_node *route_node_child(struct route_node *node,
+                                           const char *begin,const char *end) {
+	const int braced = is_braced(begin,end);
+	const size_t len = (size_t)(end - begin);
+	size_t i;
+
+	for(i=0;i<node->children_count;++i) {
+		struct route_node *child = node->children[i];
+		if(braced ? NULL == child->segment : (child->segment
+		        && child->segment_len == len
+		        && 0 == memcmp(child->segment,begin,len)))
+			return child;
+	}
+
+	struct route_node **children = realloc(node->children,
+		(node->children_count + 1)*sizeof(children[0]));
+	if(NULL == children)
+		return NULL;
+	node->children = children;
+
+	struct route_node *child = calloc(1,sizeof(*child));
+	if(NULL == child)
+		return NULL;
+	if(!braced) {
+		child->segment = strndup(begin,len);
+		if(NULL == child->segment) {
+			free(child);
+			return NULL;
+		}
+		child->segment_len = len;
+	}
+
+	node->children[node->children_count++] = child;
+	return child;
+}
+
+/** Match remaining URL segments, preferring literal children
+    @param segments Matched segments, to extract key from
+    @param depth Current segment index
+    */
+static const struct route_node *route_node_match(const struct route_node *node,
+                    const char *cursor,const char *segments[][2],int depth) {
+	const char *begin = NULL,*end = NULL;
+	size_t i;
+
+	if(!next_segment(&cursor,&begin,&end))
+		return node->route ? node : NULL;
+
+	if(depth == HTTP_ROUTE_MAX_SEGMENTS)
+		return NULL;
+
+	segments[depth][0] = begin;
+	segments[depth][1] = end;
+
+	const size_t len = (size_t)(end - begin);
+	const struct route_node *any = NULL;
+	for(i=0;i<node->children_count;++i) {
+		const struct route_node *child = node->children[i];
+		if(NULL == child->segment) {
+			any = child;
+		} else if(child->segment_len == len
+		                     && 0 == memcmp(child->segment,begin,len)) {
+			const struct route_node *ret = route_node_match(child,cursor,
+				segments,depth+1);
+			if(ret)
+				return ret;
+		}
+	}
+
+	return any ? route_node_match(any,cursor,segments,depth+1) : NULL;
+}
+
+/*
+ * Routes
+ */
+
+static void http_route_done(struct http_route *route) {
+	if(route->has_callbacks && route->cb.cb_opaque_destructor)
+		route->cb.cb_opaque_destructor(route->cb.cb_opaque);
+	free(route->path);
+	free(route->topic_name);
+}
+
+static int http_route_init(struct http_routes *routes,
+                           struct http_route *route,json_t *config,
+                           char *err,size_t errsize) {
+	const char *path = NULL,*topic = NULL,*key = NULL;
+	const char *begin = NULL,*end = NULL;
+	json_error_t jerr;
+	int segment = 0;
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s:s,s?s,s?s}",
+		CONFIG_ROUTE_PATH_KEY,&path,CONFIG_ROUTE_TOPIC_KEY,&topic,
+		CONFIG_ROUTE_KEY_KEY,&key);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse route: %s",jerr.text);
+		return -1;
+	}
+
+	route->key_segment = -1;
+	route->path = strdup(path);
+	route->topic_name = topic ? strdup(topic) : NULL;
+	if(NULL == route->path || (topic && NULL == route->topic_name)) {
+		snprintf(err,errsize,"Can't allocate route (out of memory?)");
+		return -1;
+	}
+
+	struct route_node *node = &routes->root;
+	const char *cursor = path;
+	while(next_segment(&cursor,&begin,&end)) {
+		if(segment == HTTP_ROUTE_MAX_SEGMENTS) {
+			snprintf(err,errsize,"Route %s has too many segments",path);
+			return -1;
+		}
+
+		if(key && is_braced(begin,end) && strlen(key) == (size_t)(end-begin-2)
+		        && 0 == memcmp(key,begin+1,strlen(key)))
+			route->key_segment = segment;
+
+		node = route_node_child(node,begin,end);
+		if(NULL == node) {
+			snprintf(err,errsize,"Can't allocate route (out of memory?)");
+			return -1;
+		}
+		segment++;
+	}
+
+	if(key && -1 == route->key_segment) {
+		snprintf(err,errsize,"Route %s has no {%s} segment",path,key);
+		return -1;
+	}
+
+	if(node->route) {
+		snprintf(err,errsize,"Route %s is the same as %s",path,
+			node->route->path);
+		return -1;
+	}
+
+	if(json_object_get(config,"decode_as") || json_object_get(config,"stages")) {
+		if(0 != listener_callbacks_new(config,&route->cb,err,errsize))
+			return -1;
+		route->has_callbacks = 1;
+	}
+
+	node->route = route;
+	return 0;
+}
+
+struct http_routes *http_routes_new(json_t *config,char *err,size_t errsize) {
+	json_t *route_config = NULL;
+	size_t i;
+
+	if(!json_is_array(config)) {
+		snprintf(err,errsize,"Routes are not an array");
+		return NULL;
+	}
+
+	struct http_routes *routes = calloc(1,sizeof(*routes));
+	if(routes)
+		routes->routes = calloc(json_array_size(config),
+			sizeof(routes->routes[0]));
+	if(NULL == routes || (NULL == routes->routes && json_array_size(config))) {
+		snprintf(err,errsize,"Can't allocate routes (out of memory?)");
+		free(routes);
+		return NULL;
+	}
+
+#ifdef HTTP_ROUTES_MAGIC
+	routes->magic = HTTP_ROUTES_MAGIC;
+#endif
+
+	json_array_foreach(config,i,route_config) {
+		struct http_route *route = &routes->routes[i];
+		routes->count++;
+		if(0 != http_route_init(routes,route,route_config,err,errsize)) {
+			http_routes_done(routes);
+			return NULL;
+		}
+	}
+
+	return routes;
+}
+
+void http_routes_reload(struct http_routes *routes,json_t *config) {
+	json_t *route_config = NULL;
+	size_t i,j;
+#ifdef HTTP_ROUTES_MAGIC
+	assert(HTTP_ROUTES_MAGIC == routes->magic);
+#endif
+
+	json_array_foreach(config,i,route_config) {
+		const char *path = json_string_value(json_object_get(route_config,
+			CONFIG_ROUTE_PATH_KEY));
+		for(j=0;path && j<routes->count;++j) {
+			struct http_route *route = &routes->routes[j];
+			if(0 == strcmp(path,route->path) && route->has_callbacks
+			                            && route->cb.cb_opaque_reload) {
+				route->cb.cb_opaque_reload(route_config,route->cb.cb_opaque);
+			}
+		}
+	}
+
+	if(json_array_size(config) != routes->count) {
+		rdlog(LOG_ERR,"Can't change HTTP routes in reload."
+			" Restart n2kafka to apply changes.");
+	}
+}
+
+void http_routes_done(struct http_routes *routes) {
+	size_t i;
+#ifdef HTTP_ROUTES_MAGIC
+	assert(HTTP_ROUTES_MAGIC == routes->magic);
+#endif
+
+	for(i=0;i<routes->count;++i)
+		http_route_done(&routes->routes[i]);
+	route_node_done(&routes->root);
+	free(routes->routes);
+	free(routes);
+}
+
+struct http_route *http_routes_match(const struct http_routes *routes,
+                                     const char *url,const char **key,
+                                     size_t *key_size) {
+	const char *segments[HTTP_ROUTE_MAX_SEGMENTS][2];
+#ifdef HTTP_ROUTES_MAGIC
+	assert(HTTP_ROUTES_MAGIC == routes->magic);
+#endif
+
+	const struct route_node *node = route_node_match(&routes->root,url,
+		segments,0);
+	if(NULL == node)
+		return NULL;
+
+	struct http_route *route = node->route;
+	if(route->key_segment >= 0) {
+		*key = segments[route->key_segment][0];
+		*key_size = (size_t)(segments[route->key_segment][1] - *key);
+	} else {
+		*key = NULL;
+		*key_size = 0;
+	}
+
+	return route;
+}
+
+const struct listener_callbacks *http_route_callbacks(
+                                             const struct http_route *route) {
+	return route->has_callbacks ? &route->cb : NULL;
+}
+
+struct rd_kafka_topic_s *http_route_topic(struct http_route *route) {
+	if(NULL == route->topic_name)
+		return NULL;
+
+	struct rd_kafka_topic_s *topic = __atomic_load_n(&route->topic,
+		__ATOMIC_ACQUIRE);
+	if(NULL == topic) {
+		topic = kafka_topic(route->topic_name);
+		__atomic_store_n(&route->topic,topic,__ATOMIC_RELEASE);
+	}
+	return topic;
+}
@@ -0,0 +1,72 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * HTTP listener URL routes. Every route can send messages to its own topic,
+ * with its own decoder and stages:
+ *
+ *   "routes":[
+ *     {"path":"/v1/flows","topic":"flows","decode_as":"netflow"},
+ *     {"path":"/v1/events/{sensor}","topic":"events","key":"sensor",
+ *      "stages":[{"type":"validate"}]}
+ *   ]
+ *
+ * Path segments in braces match any segment, and the one named by `key` is
+ * used as kafka message key. Routes are compiled into a trie of path
+ * segments, and literal segments are preferred over braced ones.
+ */
+
+struct json_t;
+struct http_routes;
+struct http_route;
+struct listener_callbacks;
+struct rd_kafka_topic_s;
+
+/// Max path segments of a route
+#define HTTP_ROUTE_MAX_SEGMENTS 32
+
+/// Compile routes config array. Return NULL in case of error.
+struct http_routes *http_routes_new(struct json_t *config,char *err,
+                                                        size_t errsize);
+
+/// Reload routes decoders and stages. Routes can't be added or removed.
+void http_routes_reload(struct http_routes *routes,struct json_t *config);
+
+void http_routes_done(struct http_routes *routes);
+
+/** Match an URL path
+    @param routes Routes
+    @param url URL path
+    @param key Route key segment, pointing into url (NULL if route has no key)
+    @param key_size Key size
+    @return Matched route, or NULL if no route matches url
+    */
+struct http_route *http_routes_match(const struct http_routes *routes,
+                                     const char *url,const char **key,
+                                     size_t *key_size);
+
+/// Route messages callback, or NULL to use listener one
+const struct listener_callbacks *http_route_callbacks(
+                                             const struct http_route *route);
+
+/// Route topic, or NULL to use the default one
+struct rd_kafka_topic_s *http_route_topic(struct http_route *route);
@@ -0,0 +1,772 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "json_scan.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int is_json_space(uint8_t c) {
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static int is_digit(uint8_t c) {
+	return c >= '0' && c <= '9';
+}
+
+static int is_hex_digit(uint8_t c) {
+	return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/** Search the first quote or backslash. If strict, control and non-ASCII
+    chars are searched too, so they can be validated.
+    */
+static const uint8_t *string_special_char(const uint8_t *cursor,
+                                          const uint8_t *end,int strict) {
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i space = _mm_set1_epi8(' ');
+
+	for(;cursor + sizeof(__m128i) <= end;cursor += sizeof(__m128i)) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *)cursor);
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk,quote),
+			_mm_cmpeq_epi8(chunk,backslash));
+		if(strict) {
+			/* Signed comparison: bytes >= 0x80 are negative */
+			special = _mm_or_si128(special,_mm_cmplt_epi8(chunk,space));
+		}
+
+		const int mask = _mm_movemask_epi8(special);
+		if(mask)
+			return cursor + __builtin_ctz((unsigned)mask);
+	}
+#endif
+
+	for(;cursor < end;++cursor) {
+		if(*cursor == '"' || *cursor == '\\')
+			return cursor;
+		if(strict && (*cursor < 0x20 || *cursor >= 0x80))
+			return cursor;
+	}
+
+	return end;
+}
+
+/// Skip a whitespace run, 16 bytes at a time
+static const uint8_t *skip_space_run(const uint8_t *cursor,const uint8_t *end) {
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i carriage_return = _mm_set1_epi8('\r');
+
+	for(;cursor + sizeof(__m128i) <= end;cursor += sizeof(__m128i)) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *)cursor);
+		const __m128i spaces = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk,space),_mm_cmpeq_epi8(chunk,tab)),
+			_mm_or_si128(_mm_cmpeq_epi8(chunk,newline),
+			             _mm_cmpeq_epi8(chunk,carriage_return)));
+		const int mask = ~_mm_movemask_epi8(spaces) & 0xFFFF;
+		if(mask)
+			return cursor + __builtin_ctz((unsigned)mask);
+	}
+#endif
+
+	while(cursor < end && is_json_space(*cursor))
+		cursor++;
+	return cursor;
+}
+
+/** Skip whitespace. Compact JSON has no whitespace between tokens, or just
+    one space, so only longer runs (indentation) use skip_space_run. */
+static inline const uint8_t *skip_spaces(const uint8_t *cursor,
+                                         const uint8_t *end) {
+	if(cursor == end || !is_json_space(*cursor))
+		return cursor;
+	if(++cursor == end || !is_json_space(*cursor))
+		return cursor;
+	return skip_space_run(cursor + 1,end);
+}
+
+/// Validate an UTF-8 multibyte sequence. Return pointer after it, or NULL.
+static const uint8_t *utf8_sequence_end(const uint8_t *cursor,
+                                                   const uint8_t *end) {
+	const uint8_t c = cursor[0];
+	uint8_t min = 0x80,max = 0xBF;
+	size_t len = 0,i;
+
+	if(c >= 0xC2 && c <= 0xDF) {
+		len = 2;
+	} else if(c >= 0xE0 && c <= 0xEF) {
+		len = 3;
+		if(c == 0xE0)
+			min = 0xA0; /* Overlong */
+		else if(c == 0xED)
+			max = 0x9F; /* Surrogates */
+	} else if(c >= 0xF0 && c <= 0xF4) {
+		len = 4;
+		if(c == 0xF0)
+			min = 0x90; /* Overlong */
+		else if(c == 0xF4)
+			max = 0x8F; /* > U+10FFFF */
+	} else {
+		return NULL;
+	}
+
+	if((size_t)(end - cursor) < len)
+		return NULL;
+
+	if(cursor[1] < min || cursor[1] > max)
+		return NULL;
+
+	for(i=2;i<len;++i) {
+		if(cursor[i] < 0x80 || cursor[i] > 0xBF)
+			return NULL;
+	}
+
+	return cursor + len;
+}
+
+/// Validate an escape sequence. Return pointer after it, or NULL.
+static const uint8_t *escape_sequence_end(const uint8_t *cursor,
+                                                     const uint8_t *end) {
+	size_t i;
+
+	/* cursor[0] is the backslash */
+	if(end - cursor < 2)
+		return NULL;
+
+	switch(cursor[1]) {
+	case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r':
+	case 't':
+		return cursor + 2;
+	case 'u':
+		if(end - cursor < 6)
+			return NULL;
+		for(i=2;i<6;++i) {
+			if(!is_hex_digit(cursor[i]))
+				return NULL;
+		}
+		return cursor + 6;
+	default:
+		return NULL;
+	};
+}
+
+const char *json_scan_spaces(const char *cursor,const char *end) {
+	return (const char *)skip_spaces((const uint8_t *)cursor,
+		(const uint8_t *)end);
+}
+
+const char *json_scan_string(const char *_cursor,const char *_end) {
+	const uint8_t *cursor = (const uint8_t *)_cursor;
+	const uint8_t *end = (const uint8_t *)_end;
+
+	while(cursor < end) {
+		cursor = string_special_char(cursor,end,0);
+		if(cursor == end)
+			break;
+		if(*cursor == '"')
+			return (const char *)cursor;
+		cursor += 2; /* Skip escaped char */
+	}
+
+	return NULL;
+}
+
+static int hex_value(uint8_t c) {
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/// Read the 4 hex digits of an unicode escape. Return -1 if not valid.
+static long read_u_escape(const uint8_t *cursor,const uint8_t *end) {
+	long ret = 0;
+	size_t i;
+
+	if(end - cursor < 6 || cursor[0] != '\\' || cursor[1] != 'u')
+		return -1;
+
+	for(i=2;i<6;++i) {
+		const int digit = hex_value(cursor[i]);
+		if(digit < 0)
+			return -1;
+		ret = ret*16 + digit;
+	}
+
+	return ret;
+}
+
+/** Decode an escape sequence.
+    @param cursor Pointer to the backslash
+    @param end End of string
+    @param codepoint Decoded unicode codepoint
+    @return Pointer after the escape sequence, or NULL if it is not valid
+    */
+static const uint8_t *decode_escape(const uint8_t *cursor,const uint8_t *end,
+                                                       long *codepoint) {
+	if(end - cursor < 2)
+		return NULL;
+
+	switch(cursor[1]) {
+	case '"':  *codepoint = '"';  return cursor + 2;
+	case '\\': *codepoint = '\\'; return cursor + 2;
+	case '/':  *codepoint = '/';  return cursor + 2;
+	case 'b':  *codepoint = '\b'; return cursor + 2;
+	case 'f':  *codepoint = '\f'; return cursor + 2;
+	case 'n':  *codepoint = '\n'; return cursor + 2;
+	case 'r':  *codepoint = '\r'; return cursor + 2;
+	case 't':  *codepoint = '\t'; return cursor + 2;
+	case 'u':
+		break;
+	default:
+		return NULL;
+	};
+
+	*codepoint = read_u_escape(cursor,end);
+	if(*codepoint < 0)
+		return NULL;
+	cursor += 6;
+
+	if(*codepoint >= 0xD800 && *codepoint <= 0xDBFF) {
+		const long low = read_u_escape(cursor,end);
+		if(low >= 0xDC00 && low <= 0xDFFF) {
+			*codepoint = 0x10000 + ((*codepoint - 0xD800) << 10) + (low - 0xDC00);
+			return cursor + 6;
+		}
+	}
+
+	if(*codepoint >= 0xD800 && *codepoint <= 0xDFFF)
+		*codepoint = 0xFFFD; /* Lone surrogate */
+
+	return cursor;
+}
+
+static size_t utf8_length(long codepoint) {
+	if(codepoint < 0x80)
+		return 1;
+	if(codepoint < 0x800)
+		return 2;
+	if(codepoint < 0x10000)
+		return 3;
+	return 4;
+}
+
+size_t json_unescaped_length(const char *_cursor,const char *_string_end) {
+	const uint8_t *cursor = (const uint8_t *)_cursor;
+	const uint8_t *end = (const uint8_t *)_string_end;
+	size_t ret = 0;
+
+	while(cursor < end) {
+		const uint8_t *backslash = string_special_char(cursor,end,0);
+		ret += (size_t)(backslash - cursor);
+		if(backslash == end)
+			break;
+
+		long codepoint = 0;
+		cursor = decode_escape(backslash,end,&codepoint);
+		if(NULL == cursor)
+			return (size_t)-1;
+		ret += utf8_length(codepoint);
+	}
+
+	return ret;
+}
+
+char *json_unescape(char *_out,const char *_cursor,const char *_string_end) {
+	uint8_t *out = (uint8_t *)_out;
+	const uint8_t *cursor = (const uint8_t *)_cursor;
+	const uint8_t *end = (const uint8_t *)_string_end;
+
+	while(cursor < end) {
+		const uint8_t *backslash = string_special_char(cursor,end,0);
+		memcpy(out,cursor,(size_t)(backslash - cursor));
+		out += backslash - cursor;
+		if(backslash == end)
+			break;
+
+		long codepoint = 0;
+		cursor = decode_escape(backslash,end,&codepoint);
+		if(NULL == cursor)
+			return NULL;
+
+		switch(utf8_length(codepoint)) {
+		case 1:
+			*out++ = (uint8_t)codepoint;
+			break;
+		case 2:
+			*out++ = (uint8_t)(0xC0 | (codepoint >> 6));
+			*out++ = (uint8_t)(0x80 | (codepoint & 0x3F));
+			break;
+		case 3:
+			*out++ = (uint8_t)(0xE0 | (codepoint >> 12));
+			*out++ = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+			*out++ = (uint8_t)(0x80 | (codepoint & 0x3F));
+			break;
+		default:
+			*out++ = (uint8_t)(0xF0 | (codepoint >> 18));
+			*out++ = (uint8_t)(0x80 | ((codepoint >> 12) & 0x3F));
+			*out++ = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+			*out++ = (uint8_t)(0x80 | (codepoint & 0x3F));
+			break;
+		};
+	}
+
+	return (char *)out;
+}
+
+/// Longest JSON number accepted by json_parse_number
+#define JSON_NUMBER_MAX_LENGTH 64
+
+static int is_number_char(uint8_t c) {
+	return is_digit(c) || c == '-' || c == '+' || c == '.' || c == 'e'
+	                                                           || c == 'E';
+}
+
+enum json_number_type json_parse_number(const char *cursor,const char *end,
+                    int64_t *integer,double *real,const char **number_end) {
+	char number[JSON_NUMBER_MAX_LENGTH];
+	char *strto_end = NULL;
+	int is_integer = 1;
+	size_t len = 0;
+
+	for(len = 0;cursor + len < end && is_number_char((uint8_t)cursor[len]);++len) {
+		if(!is_digit((uint8_t)cursor[len]) && cursor[len] != '-')
+			is_integer = 0;
+	}
+
+	if(0 == len || len >= sizeof(number))
+		return JSON_NUMBER_INVALID;
+
+	memcpy(number,cursor,len);
+	number[len] = '\0';
+	*number_end = cursor + len;
+
+	if(is_integer) {
+		errno = 0;
+		const long long value = strtoll(number,&strto_end,10);
+		if(0 == errno && '\0' == *strto_end) {
+			*integer = value;
+			return JSON_NUMBER_INTEGER;
+		}
+	}
+
+	*real = strtod(number,&strto_end);
+	return '\0' == *strto_end ? JSON_NUMBER_REAL : JSON_NUMBER_INVALID;
+}
+
+const char *json_scan_value(const char *cursor,const char *end) {
+	size_t depth = 0;
+
+	while(cursor < end) {
+		switch(*cursor) {
+		case '"':
+			cursor = json_scan_string(cursor + 1,end);
+			if(NULL == cursor)
+				return NULL;
+			cursor++;
+			if(0 == depth)
+				return cursor;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			cursor++;
+			break;
+		case '}':
+		case ']':
+			if(0 == depth)
+				return cursor; /* End of enclosing container */
+			cursor++;
+			if(0 == --depth)
+				return cursor;
+			break;
+		case ',':
+			if(0 == depth)
+				return cursor;
+			cursor++;
+			break;
+		default:
+			if(0 == depth && is_json_space((uint8_t)*cursor))
+				return cursor;
+			cursor++;
+			break;
+		};
+	}
+
+	return 0 == depth ? cursor : NULL;
+}
+
+const char *json_scan_member(const char *buffer,size_t buf_size,
+                             const char *key,size_t key_len,
+                             const char **value_end) {
+	const char *end = buffer + buf_size;
+	const char *cursor = json_scan_spaces(buffer,end);
+
+	if(cursor == end || *cursor != '{')
+		return NULL;
+
+	cursor = json_scan_spaces(cursor + 1,end);
+	while(cursor < end && *cursor == '"') {
+		const char *member_key = cursor + 1;
+		const char *member_key_end = json_scan_string(member_key,end);
+		if(NULL == member_key_end)
+			return NULL;
+
+		cursor = json_scan_spaces(member_key_end + 1,end);
+		if(cursor == end || *cursor != ':')
+			return NULL;
+
+		const char *value = json_scan_spaces(cursor + 1,end);
+		const char *member_end = json_scan_value(value,end);
+		if(NULL == member_end || member_end == value)
+			return NULL;
+
+		if((size_t)(member_key_end - member_key) == key_len
+		                    && 0 == memcmp(member_key,key,key_len)) {
+			*value_end = member_end;
+			return value;
+		}
+
+		cursor = json_scan_spaces(member_end,end);
+		if(cursor == end || *cursor != ',')
+			return NULL;
+		cursor = json_scan_spaces(cursor + 1,end);
+	}
+
+	return NULL;
+}
+
+/// Validate a string. Return pointer after the closing quote, or NULL.
+static const uint8_t *validate_string(const uint8_t *cursor,
+                                                 const uint8_t *end) {
+	while(cursor < end) {
+		cursor = string_special_char(cursor,end,1);
+		if(cursor == end)
+			return NULL;
+
+		switch(*cursor) {
+		case '"':
+			return cursor + 1;
+		case '\\':
+			cursor = escape_sequence_end(cursor,end);
+			break;
+		default:
+			cursor = *cursor >= 0x80 ? utf8_sequence_end(cursor,end) : NULL;
+			break;
+		};
+
+		if(NULL == cursor)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static const uint8_t *validate_digits(const uint8_t *cursor,const uint8_t *end) {
+	if(cursor == end || !is_digit(*cursor))
+		return NULL;
+	while(cursor < end && is_digit(*cursor))
+		cursor++;
+	return cursor;
+}
+
+/// Validate a number. Return pointer after it, or NULL.
+static const uint8_t *validate_number(const uint8_t *cursor,const uint8_t *end) {
+	if(*cursor == '-')
+		cursor++;
+
+	if(cursor < end && *cursor == '0')
+		cursor++;
+	else
+		cursor = validate_digits(cursor,end);
+
+	if(cursor && cursor < end && *cursor == '.')
+		cursor = validate_digits(cursor + 1,end);
+
+	if(cursor && cursor < end && (*cursor == 'e' || *cursor == 'E')) {
+		cursor++;
+		if(cursor < end && (*cursor == '+' || *cursor == '-'))
+			cursor++;
+		cursor = validate_digits(cursor,end);
+	}
+
+	return cursor;
+}
+
+static const uint8_t *validate_literal(const uint8_t *cursor,const uint8_t *end,
+                                       const char *literal,size_t literal_len) {
+	if((size_t)(end - cursor) < literal_len
+	                          || 0 != memcmp(cursor,literal,literal_len))
+		return NULL;
+	return cursor + literal_len;
+}
+
+#define validate_literal_const(cursor,end,literal) \
+	validate_literal(cursor,end,literal,strlen(literal))
+
+int json_validate(const char *buffer,size_t buf_size) {
+	const uint8_t *cursor = (const uint8_t *)buffer;
+	const uint8_t *end = cursor + buf_size;
+	/* Open containers: '{' or '[' */
+	uint8_t stack[JSON_SCAN_MAX_DEPTH];
+	size_t depth = 0;
+	int expect_key = 0;
+
+	cursor = skip_spaces(cursor,end);
+	while(1) {
+		/* Value (or object key) */
+		if(cursor == end)
+			return 0;
+
+		if(expect_key) {
+			if(*cursor != '"')
+				return 0;
+			cursor = validate_string(cursor + 1,end);
+			if(NULL == cursor)
+				return 0;
+			cursor = skip_spaces(cursor,end);
+			if(cursor == end || *cursor != ':')
+				return 0;
+			cursor = skip_spaces(cursor + 1,end);
+			expect_key = 0;
+			continue;
+		}
+
+		switch(*cursor) {
+		case '{':
+		case '[':
+			if(depth == JSON_SCAN_MAX_DEPTH)
+				return 0;
+			stack[depth++] = *cursor;
+			cursor = skip_spaces(cursor + 1,end);
+			if(cursor < end && *cursor == (stack[depth-1] == '{' ? '}' : ']')) {
+				/* Empty container */
+				depth--;
+				cursor++;
+				break;
+			}
+			expect_key = stack[depth-1] == '{';
+			continue;
+		case '"':
+			cursor = validate_string(cursor + 1,end);
+			break;
+		case 't':
+			cursor = validate_literal_const(cursor,end,"true");
+			break;
+		case 'f':
+			cursor = validate_literal_const(cursor,end,"false");
+			break;
+		case 'n':
+			cursor = validate_literal_const(cursor,end,"null");
+			break;
+		default:
+			if(*cursor == '-' || is_digit(*cursor))
+				cursor = validate_number(cursor,end);
+			else
+				cursor = NULL;
+			break;
+		};
+
+		/* After a value: close containers until a comma is found */
+		while(1) {
+			if(NULL == cursor)
+				return 0;
+
+			cursor = skip_spaces(cursor,end);
+			if(depth == 0)
+				return cursor == end;
+			if(cursor == end)
+				return 0;
+
+			if(*cursor == ',') {
+				expect_key = stack[depth-1] == '{';
+				cursor = skip_spaces(cursor + 1,end);
+				break;
+			}
+
+			if(*cursor != (stack[depth-1] == '{' ? '}' : ']'))
+				return 0;
+
+			depth--;
+			cursor++;
+		}
+	}
+}
+
+/// Move n bytes from in to out, if they are not already there.
+static uint8_t *minify_copy(uint8_t *out,const uint8_t *in,size_t n) {
+	if(out != in)
+		memmove(out,in,n);
+	return out + n;
+}
+
+/** Validate a JSON value and write it without whitespace at *out, that can't
+    be after cursor. Tokens are written once they are validated.
+    @param kept First byte not written yet if value is not valid, so the rest
+                can be kept as it is (whitespace before the bad token
+                included)
+    @return Pointer after the value, or NULL if it is not valid
+    */
+static const uint8_t *minify_value(const uint8_t *cursor,const uint8_t *end,
+                                   uint8_t **_out,const uint8_t **kept) {
+	/* Open containers: '{' or '[' */
+	uint8_t stack[JSON_SCAN_MAX_DEPTH];
+	uint8_t *out = *_out;
+	const uint8_t *pending = cursor,*token_end;
+	size_t depth = 0;
+	int expect_key = 0;
+
+	while(1) {
+		/* Value (or object key) */
+		if(cursor == end)
+			goto invalid;
+
+		if(expect_key) {
+			if(*cursor != '"')
+				goto invalid;
+			token_end = validate_string(cursor + 1,end);
+			if(NULL == token_end)
+				goto invalid;
+			out = minify_copy(out,cursor,(size_t)(token_end - cursor));
+			pending = token_end;
+			cursor = skip_spaces(token_end,end);
+			if(cursor == end || *cursor != ':')
+				goto invalid;
+			*out++ = ':';
+			pending = cursor + 1;
+			cursor = skip_spaces(cursor + 1,end);
+			expect_key = 0;
+			continue;
+		}
+
+		switch(*cursor) {
+		case '{':
+		case '[':
+			if(depth == JSON_SCAN_MAX_DEPTH)
+				goto invalid;
+			stack[depth++] = *cursor;
+			*out++ = *cursor;
+			pending = cursor + 1;
+			cursor = skip_spaces(cursor + 1,end);
+			if(cursor < end && *cursor == (stack[depth-1] == '{' ? '}' : ']')) {
+				/* Empty container */
+				depth--;
+				token_end = cursor + 1;
+				break;
+			}
+			expect_key = stack[depth-1] == '{';
+			continue;
+		case '"':
+			token_end = validate_string(cursor + 1,end);
+			break;
+		case 't':
+			token_end = validate_literal_const(cursor,end,"true");
+			break;
+		case 'f':
+			token_end = validate_literal_const(cursor,end,"false");
+			break;
+		case 'n':
+			token_end = validate_literal_const(cursor,end,"null");
+			break;
+		default:
+			if(*cursor == '-' || is_digit(*cursor))
+				token_end = validate_number(cursor,end);
+			else
+				token_end = NULL;
+			break;
+		};
+
+		/* After a value: close containers until a comma is found */
+		while(1) {
+			if(NULL == token_end)
+				goto invalid;
+
+			out = minify_copy(out,cursor,(size_t)(token_end - cursor));
+			pending = token_end;
+			if(depth == 0) {
+				*_out = out;
+				return token_end;
+			}
+
+			cursor = skip_spaces(token_end,end);
+			if(cursor == end)
+				goto invalid;
+
+			if(*cursor == ',') {
+				expect_key = stack[depth-1] == '{';
+				*out++ = ',';
+				pending = cursor + 1;
+				cursor = skip_spaces(cursor + 1,end);
+				break;
+			}
+
+			if(*cursor != (stack[depth-1] == '{' ? '}' : ']'))
+				goto invalid;
+
+			depth--;
+			token_end = cursor + 1;
+		}
+	}
+
+invalid:
+	*_out = out;
+	*kept = pending;
+	return NULL;
+}
+
+size_t json_minify(char *buffer,size_t buf_size) {
+	uint8_t *out = (uint8_t *)buffer;
+	const uint8_t *end = out + buf_size;
+	const uint8_t *cursor = skip_spaces(out,end);
+
+	while(cursor < end) {
+		const uint8_t *kept = NULL;
+		const uint8_t *value_end = minify_value(cursor,end,&out,&kept);
+		if(NULL == value_end) {
+			/* Keep the rest of the record as it is, from the first error */
+			const uint8_t *newline = memchr(kept,'\n',(size_t)(end - kept));
+			value_end = newline ? newline : end;
+			out = minify_copy(out,kept,(size_t)(value_end - kept));
+		}
+
+		/* Values are separated by one newline, or one space if they were
+		   on the same line. Trailing newline is kept as record terminator */
+		cursor = skip_spaces(value_end,end);
+		if(cursor == value_end)
+			continue;
+		if(memchr(value_end,'\n',(size_t)(cursor - value_end)))
+			*out++ = '\n';
+		else if(cursor < end)
+			*out++ = ' ';
+	}
+
+	return (size_t)(out - (uint8_t *)buffer);
+}
@@ -0,0 +1,107 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * Raw JSON text scanning, without building any object. String contents and
+ * whitespace runs are scanned 16 bytes at a time when SSE2 is available.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Max nesting level accepted by json_validate
+#define JSON_SCAN_MAX_DEPTH 1024
+
+/// Skip JSON insignificant whitespace
+const char *json_scan_spaces(const char *cursor,const char *end);
+
+/** Locate the end of a string.
+    @param cursor Pointer just after the opening quote
+    @param end End of buffer
+    @return Pointer to the closing quote, or NULL if string is not closed.
+    */
+const char *json_scan_string(const char *cursor,const char *end);
+
+/** Length of a string once unescaped.
+    @param cursor Pointer just after the opening quote
+    @param string_end Pointer to the closing quote
+    @return Unescaped length, or (size_t)-1 if an escape sequence is invalid
+    */
+size_t json_unescaped_length(const char *cursor,const char *string_end);
+
+/** Unescape a string. Lone surrogates are replaced with U+FFFD.
+    @param out Output buffer, with json_unescaped_length bytes
+    @param cursor Pointer just after the opening quote
+    @param string_end Pointer to the closing quote
+    @return Pointer after the last written byte, or NULL if a escape sequence
+            is not valid.
+    */
+char *json_unescape(char *out,const char *cursor,const char *string_end);
+
+enum json_number_type{
+	JSON_NUMBER_INVALID,
+	JSON_NUMBER_INTEGER,
+	JSON_NUMBER_REAL,
+};
+
+/** Parse a JSON number.
+    @param cursor Number first char
+    @param end End of buffer
+    @param integer Number value, if it is an integer that fits in 64 bits
+    @param real Number value, if it is not an integer
+    @param number_end Pointer after the number
+    @return Number type
+    */
+enum json_number_type json_parse_number(const char *cursor,const char *end,
+                     int64_t *integer,double *real,const char **number_end);
+
+/** Locate the end of a JSON value. It only checks structure, so it will
+    accept some invalid values.
+    @param cursor Pointer to the value first char
+    @param end End of buffer
+    @return Pointer just after the value, or NULL if value is not complete.
+    */
+const char *json_scan_value(const char *cursor,const char *end);
+
+/** Locate a top level member value of a JSON object. Key is compared with
+    the raw (escaped) member name.
+    @param buffer JSON text
+    @param buf_size JSON text size
+    @param key Member name
+    @param key_len Member name length
+    @param value_end Pointer just after the value
+    @return Pointer to the value first char, or NULL if not found
+    */
+const char *json_scan_member(const char *buffer,size_t buf_size,
+                             const char *key,size_t key_len,
+                             const char **value_end);
+
+/** Remove insignificant whitespace, in place, validating the JSON text in
+    the same pass. Buffer can hold many concatenated values (newline
+    delimited records, or pretty printed ones): every one is written on its
+    own line, or after one space if they were on the same line. Invalid
+    values are kept as they are, from their first error to the end of that
+    line.
+    @return New buffer size
+    */
+size_t json_minify(char *buffer,size_t buf_size);
+
+/// Check that buffer is a valid UTF-8 JSON text. Return 1 if valid.
+int json_validate(const char *buffer,size_t buf_size);
@@ -20,18 +20,83 @@
 #include "util.h"
 #include "parse.h"
 #include "global_config.h"
+#include "fair_queue.h"
+#include "reassemble.h"
+#include "ack.h"
+#include "spill.h"
+#include "mirror.h"
+
+#include <jansson.h>
 
 #include <pthread.h>
+#include <sys/queue.h>
 
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 
 static rd_kafka_t *rk = NULL;
 static rd_kafka_topic_t *rkt = NULL;
 
+/// Topics other than default one, created on demand
+struct extra_topic {
+	rd_kafka_topic_t *rkt;
+	LIST_ENTRY(extra_topic) entry;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	rd_kafka_topic_conf_t *conf;
+	LIST_HEAD(,extra_topic) list;
+} extra_topics = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// Max number of listeners with produce policy
+#define LISTENER_POLICIES 64
+
+/// Listener header names
+#define CLIENT_ADDR_HEADER "client_addr"
+#define LISTENER_PORT_HEADER "listener_port"
+#define DECODER_CHAIN_HEADER "decoder_chain"
+
+/// How to produce a listener messages
+struct listener_policy {
+	uint16_t listener_port;
+	/// Max age of messages when they are produced
+	uint64_t max_age_ms;
+	char *stale_topic;
+	rd_kafka_topic_t *stale_rkt;
+	/// Add message meta as kafka headers
+	int meta_headers;
+	char *decoder_chain;
+	/// Max produced message size, 0 for no limit
+	size_t max_message_size;
+	/// Split oversized messages in chunks instead of discarding them
+	int split_oversized;
+	struct {
+		uint64_t discarded;
+		uint64_t diverted;
+		uint64_t oversized_discarded;
+		uint64_t oversized_split;
+	} counters;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	/// Policies are never removed, so readers don't need the mutex
+	size_t count;
+	struct listener_policy policies[LISTENER_POLICIES];
+} listener_policies = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// Id of the next split message
+static uint64_t chunked_message_id = 0;
+
 #define ERROR_BUFFER_SIZE   256
 #define RDKAFKA_ERRSTR_SIZE ERROR_BUFFER_SIZE
 
@@ -43,13 +108,17 @@ static rd_kafka_topic_t *rkt = NULL;
 static void msg_delivered (rd_kafka_t *_rk RB_UNUSED,
 void *payload, size_t len,
 int error_code,
-void *opaque RB_UNUSED, void *msg_opaque RB_UNUSED) {
+void *opaque RB_UNUSED, void *msg_opaque) {
 
 	if (error_code){
 		rblog(LOG_ERR,   "Message delivery failed: %s\n",rd_kafka_err2str(error_code));
 	}else{
 		rblog(LOG_DEBUG, "Message delivered (%zd bytes): %*.*s\n", len, (int)len,(int)len, (char *)payload);
 	}
+
+	/* Message opaque is the ack slot of its record, if any */
+	if (msg_opaque)
+		ack_slot_release(msg_opaque,error_code != 0);
 }
 
 
@@ -65,6 +134,13 @@ void init_rdkafka(){
 	}
 
 	rd_kafka_conf_set_dr_cb(global_config.kafka_conf, msg_delivered);
+
+	/* Mirrors config is based on main producer one, that rd_kafka_new takes */
+	if(0 != mirror_start(global_config.kafka_conf,
+	                     global_config.kafka_topic_conf,errstr,sizeof(errstr))){
+		fatal("%% Failed to create mirror producer: %s\n",errstr);
+	}
+
 	rk = rd_kafka_new(RD_KAFKA_PRODUCER,global_config.kafka_conf,errstr,RDKAFKA_ERRSTR_SIZE);
 
 	if(!rk){
@@ -88,6 +164,8 @@ void init_rdkafka(){
 		fatal("%% No valid topic specified\n");
 	}
 
+	/* rd_kafka_topic_new takes conf ownership */
+	extra_topics.conf = rd_kafka_topic_conf_dup(global_config.kafka_topic_conf);
 	rkt = rd_kafka_topic_new(rk, global_config.topic, global_config.kafka_topic_conf);
 	if(rkt == NULL){
 		fatal("%% Cannot create kafka topic\n");
@@ -95,35 +173,648 @@ void init_rdkafka(){
 
 	/* Security measure: If we start n2kafka while sending data, it will give a SIGSEGV */
 	sleep(1); 
+
+	spill_start();
 }
 
 static void flush_kafka0(int timeout_ms){
 	rd_kafka_poll(rk,timeout_ms);
 }
 
+rd_kafka_topic_t *kafka_topic(const char *name){
+	struct extra_topic *i = NULL;
+
+	if(NULL == rk)
+		return NULL;
+
+	if(0 == strcmp(name,global_config.topic))
+		return rkt;
+
+	pthread_mutex_lock(&extra_topics.mutex);
+	LIST_FOREACH(i,&extra_topics.list,entry) {
+		if(0 == strcmp(name,rd_kafka_topic_name(i->rkt)))
+			break;
+	}
+
+	if(NULL == i) {
+		i = calloc(1,sizeof(*i));
+		if(NULL == i) {
+			rblog(LOG_ERR,"Can't allocate topic %s (out of memory?)",name);
+		} else {
+			i->rkt = rd_kafka_topic_new(rk,name,
+				rd_kafka_topic_conf_dup(extra_topics.conf));
+			if(NULL == i->rkt) {
+				rblog(LOG_ERR,"Can't create kafka topic %s",name);
+				free(i);
+				i = NULL;
+			} else {
+				LIST_INSERT_HEAD(&extra_topics.list,i,entry);
+			}
+		}
+	}
+	pthread_mutex_unlock(&extra_topics.mutex);
+
+	return i ? i->rkt : NULL;
+}
+
+static struct listener_policy *listener_policy(uint16_t listener_port){
+	size_t i;
+	const size_t count = __atomic_load_n(&listener_policies.count,
+		__ATOMIC_ACQUIRE);
+
+	for(i=0;i<count;++i) {
+		if(listener_policies.policies[i].listener_port == listener_port)
+			return &listener_policies.policies[i];
+	}
+
+	return NULL;
+}
+
+/// Get or create a listener policy. Need listener_policies mutex.
+static struct listener_policy *listener_policy_get(uint16_t listener_port){
+	struct listener_policy *policy = listener_policy(listener_port);
+	if(policy)
+		return policy;
+
+	if(listener_policies.count == LISTENER_POLICIES) {
+		rblog(LOG_ERR,"Can't set listener %u policy: Too many listeners",
+			listener_port);
+		return NULL;
+	}
+
+	policy = &listener_policies.policies[listener_policies.count];
+	policy->listener_port = listener_port;
+	__atomic_store_n(&listener_policies.count,listener_policies.count + 1,
+		__ATOMIC_RELEASE);
+	return policy;
+}
+
+/// Readers don't take the mutex, so strings can only be set once
+static int policy_set_string(char **dst,const char *src,
+                             uint16_t listener_port,const char *what){
+	if(*dst || NULL == src) {
+		if((NULL == src) != (NULL == *dst) || (src && 0 != strcmp(src,*dst))) {
+			rblog(LOG_WARNING,"Listener %u %s can't be changed without a "
+				"restart",listener_port,what);
+		}
+		return 0;
+	}
+
+	char *dup = strdup(src);
+	if(NULL == dup) {
+		rblog(LOG_ERR,"Can't strdup %s (out of memory?)",what);
+		return -1;
+	}
+
+	__atomic_store_n(dst,dup,__ATOMIC_RELEASE);
+	return 0;
+}
+
+int kafka_set_max_age(uint16_t listener_port,uint64_t max_age_ms,
+                                                   const char *stale_topic){
+	int rc = -1;
+
+	const int enabled = max_age_ms > 0 || stale_topic;
+
+	pthread_mutex_lock(&listener_policies.mutex);
+	struct listener_policy *policy = enabled ?
+		listener_policy_get(listener_port) : listener_policy(listener_port);
+	if(NULL == policy && !enabled) {
+		rc = 0;
+	} else if(policy) {
+		rc = policy_set_string(&policy->stale_topic,stale_topic,
+			listener_port,"stale topic");
+		ATOMIC_STORE(policy->max_age_ms,max_age_ms);
+	}
+	pthread_mutex_unlock(&listener_policies.mutex);
+
+	return rc;
+}
+
+int kafka_set_meta_headers(uint16_t listener_port,int enabled,
+                                                 const char *decoder_chain){
+	int rc = -1;
+
+	pthread_mutex_lock(&listener_policies.mutex);
+	struct listener_policy *policy = enabled ?
+		listener_policy_get(listener_port) : listener_policy(listener_port);
+	if(NULL == policy && !enabled) {
+		rc = 0;
+	} else if(policy) {
+		rc = policy_set_string(&policy->decoder_chain,decoder_chain,
+			listener_port,"decoder chain");
+		ATOMIC_STORE(policy->meta_headers,enabled);
+	}
+	pthread_mutex_unlock(&listener_policies.mutex);
+
+	return rc;
+}
+
+int kafka_set_max_message_size(uint16_t listener_port,size_t max_message_size,
+                                                                 int split){
+	int rc = -1;
+
+	pthread_mutex_lock(&listener_policies.mutex);
+	struct listener_policy *policy = max_message_size > 0 ?
+		listener_policy_get(listener_port) : listener_policy(listener_port);
+	if(policy) {
+		ATOMIC_STORE(policy->split_oversized,split);
+		ATOMIC_STORE(policy->max_message_size,max_message_size);
+		rc = 0;
+	} else if(0 == max_message_size) {
+		rc = 0;
+	}
+	pthread_mutex_unlock(&listener_policies.mutex);
+
+	return rc;
+}
+
+void kafka_policy_stats(uint16_t listener_port,json_t *stats){
+	struct listener_policy *policy = listener_policy(listener_port);
+	if(NULL == policy)
+		return;
+
+	if(policy->stale_topic || 0 != ATOMIC_LOAD(policy->max_age_ms)) {
+		json_object_set_new(stats,"stale_discarded",
+			json_integer((json_int_t)ATOMIC_LOAD(policy->counters.discarded)));
+		json_object_set_new(stats,"stale_diverted",
+			json_integer((json_int_t)ATOMIC_LOAD(policy->counters.diverted)));
+	}
+
+	if(0 != ATOMIC_LOAD(policy->max_message_size)) {
+		json_object_set_new(stats,"oversized_discarded",json_integer(
+			(json_int_t)ATOMIC_LOAD(policy->counters.oversized_discarded)));
+		json_object_set_new(stats,"oversized_split",json_integer(
+			(json_int_t)ATOMIC_LOAD(policy->counters.oversized_split)));
+	}
+}
+
+static rd_kafka_topic_t *stale_rkt(struct listener_policy *policy){
+	rd_kafka_topic_t *stale = __atomic_load_n(&policy->stale_rkt,
+		__ATOMIC_ACQUIRE);
+	if(NULL == stale) {
+		stale = kafka_topic(policy->stale_topic);
+		__atomic_store_n(&policy->stale_rkt,stale,__ATOMIC_RELEASE);
+	}
+	return stale;
+}
+
+/** Check message age against its listener max age. Discarded messages are
+    counted here, and diverted ones by the caller once they are produced.
+    @param diverted Set to the policy if message is diverted to stale topic
+    @return Topic to send message to, or NULL if it has to be discarded
+    */
+static rd_kafka_topic_t *max_age_check(rd_kafka_topic_t *topic,
+                                       const struct msg_meta *meta,
+                                       struct listener_policy *policy,
+                                       struct listener_policy **diverted){
+	const uint64_t max_age_ms = ATOMIC_LOAD(policy->max_age_ms);
+	if(0 == max_age_ms || meta->receive_time <= 0)
+		return topic;
+
+	const double age = coarse_now() - meta->receive_time;
+	if(age*1000 <= (double)max_age_ms)
+		return topic;
+
+	rd_kafka_topic_t *stale = policy->stale_topic ? stale_rkt(policy) : NULL;
+	if(stale)
+		*diverted = policy;
+	else
+		ATOMIC_INC(policy->counters.discarded);
+	return stale;
+}
+
 void send_to_kafka(char *buf,const size_t bufsize,int flags,void *opaque){
+	send_to_kafka_topic(rkt,buf,bufsize,flags,NULL,opaque);
+}
+
+/// Add listener meta headers: client address, listener port and decoders
+static void add_meta_headers(rd_kafka_headers_t *headers,
+                             const struct msg_meta *meta,
+                             const struct listener_policy *policy){
+	char buf[INET6_ADDRSTRLEN + sizeof("[]:65535")];
+
+	if(AF_INET == meta->client_addr.sin_family
+	        && inet_ntop(AF_INET,&meta->client_addr.sin_addr,buf,sizeof(buf))) {
+		const size_t addr_len = strlen(buf);
+		const int port_len = snprintf(buf + addr_len,sizeof(buf) - addr_len,
+			":%u",ntohs(meta->client_addr.sin_port));
+		rd_kafka_header_add(headers,CLIENT_ADDR_HEADER,-1,buf,
+			(ssize_t)addr_len + port_len);
+	} else if(AF_INET6 == meta->client_addr6.sin6_family
+	        && inet_ntop(AF_INET6,&meta->client_addr6.sin6_addr,buf + 1,
+	                                                      sizeof(buf) - 1)) {
+		/* Brackets keep the port apart from the address colons */
+		buf[0] = '[';
+		const size_t addr_len = strlen(buf);
+		const int port_len = snprintf(buf + addr_len,sizeof(buf) - addr_len,
+			"]:%u",ntohs(meta->client_addr6.sin6_port));
+		rd_kafka_header_add(headers,CLIENT_ADDR_HEADER,-1,buf,
+			(ssize_t)addr_len + port_len);
+	}
+
+	const int port_len = snprintf(buf,sizeof(buf),"%u",meta->listener_port);
+	rd_kafka_header_add(headers,LISTENER_PORT_HEADER,-1,buf,port_len);
+
+	const char *decoder_chain = __atomic_load_n(&policy->decoder_chain,
+		__ATOMIC_ACQUIRE);
+	if(decoder_chain) {
+		rd_kafka_header_add(headers,DECODER_CHAIN_HEADER,-1,decoder_chain,-1);
+	}
+}
+
+/// Stages headers and listener meta headers (if policy says so), or NULL
+static rd_kafka_headers_t *msg_headers(const struct msg_meta *meta,
+                                  const struct listener_policy *policy){
+	rd_kafka_headers_t *headers = NULL;
+	size_t i;
+
+	const int meta_headers = policy && ATOMIC_LOAD(policy->meta_headers);
+	if(meta->headers_count > 0 || meta_headers) {
+		headers = rd_kafka_headers_new(meta->headers_count + 3);
+		for(i=0;i<meta->headers_count;++i) {
+			rd_kafka_header_add(headers,meta->headers[i].name,-1,
+				meta->headers[i].value,
+				(ssize_t)meta->headers[i].value_size);
+		}
+		if(meta_headers)
+			add_meta_headers(headers,meta,policy);
+	}
+
+	return headers;
+}
+
+/// Message timestamp: receive time, or 0 (produce time)
+static int64_t msg_timestamp(const struct msg_meta *meta){
+	return meta && meta->receive_time > 0 ?
+		(int64_t)(meta->receive_time*1000) : 0;
+}
+
+/** Produce with stages headers, listener meta headers (if policy says so)
+    and receive time as message timestamp */
+static rd_kafka_resp_err_t produce_with_meta(rd_kafka_topic_t *topic,
+                   char *buf,const size_t bufsize,int flags,
+                   const struct msg_meta *meta,
+                   const struct listener_policy *policy,void *opaque){
+	rd_kafka_headers_t *headers = msg_headers(meta,policy);
+	const int64_t timestamp = msg_timestamp(meta);
+
+	/* librdkafka owns headers only if produce succeeds */
+	const rd_kafka_resp_err_t err = rd_kafka_producev(rk,
+		RD_KAFKA_V_RKT(topic),
+		RD_KAFKA_V_PARTITION(RD_KAFKA_PARTITION_UA),
+		RD_KAFKA_V_MSGFLAGS(flags),
+		RD_KAFKA_V_VALUE(buf,bufsize),
+		RD_KAFKA_V_KEY(meta->key,meta->key_size),
+		RD_KAFKA_V_HEADERS(headers),
+		RD_KAFKA_V_TIMESTAMP(timestamp),
+		RD_KAFKA_V_OPAQUE(opaque),
+		RD_KAFKA_V_END);
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != err && headers)
+		rd_kafka_headers_destroy(headers);
+
+	return err;
+}
+
+/// Produce a message once. Buffer is not freed in case of error.
+static rd_kafka_resp_err_t produce0(rd_kafka_topic_t *topic,char *buf,
+                   const size_t bufsize,int flags,
+                   const struct msg_meta *meta,
+                   const struct listener_policy *policy,void *opaque){
+	if(meta && (meta->headers_count > 0 || meta->receive_time > 0 || meta->key
+	                    || (policy && ATOMIC_LOAD(policy->meta_headers)))) {
+		return produce_with_meta(topic,buf,bufsize,flags,meta,policy,opaque);
+	}
+
+	if(0 != rd_kafka_produce(topic,RD_KAFKA_PARTITION_UA,flags,buf,bufsize,
+	                                                          NULL,0,opaque))
+		return rd_kafka_errno2err(errno);
+
+	return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+/** Append a message to spill queue, as it would have been produced
+    @return 0 if message has been spilled
+    */
+static int produce_spill(rd_kafka_topic_t *topic,char *buf,
+                   const size_t bufsize,int flags,
+                   const struct msg_meta *meta,
+                   const struct listener_policy *policy,void *opaque){
+	rd_kafka_headers_t *headers = meta ? msg_headers(meta,policy) : NULL;
+
+	const int rc = spill_push(rd_kafka_topic_name(topic),buf,bufsize,flags,
+		meta ? meta->key : NULL,meta ? meta->key_size : 0,headers,
+		msg_timestamp(meta),opaque);
+	if(headers)
+		rd_kafka_headers_destroy(headers);
+	return rc;
+}
+
+/** Produce a message, retrying once if producer queue is full.
+    @param opaque Ack slot reference of the message, or NULL. Delivery report
+                  releases it, or it is released here if message is discarded.
+    @param keep_if_full Return the message to the caller if producer queue is
+                        full, instead of retrying once and discarding it
+    @return 0 if message has been produced, 1 if it has been discarded, -1 if
+            it has been kept
+    */
+static int produce_retry(rd_kafka_topic_t *topic,char *buf,
+                   const size_t bufsize,int flags,
+                   const struct msg_meta *meta,
+                   const struct listener_policy *policy,void *opaque,
+                   int keep_if_full){
 	int retried = 0;
-	char errbuf[ERROR_BUFFER_SIZE];
+
+	/* Producer is behind: keep message in disk until it catches up */
+	if(spill_wanted(kafka_outq_len())
+	             && 0 == produce_spill(topic,buf,bufsize,flags,meta,policy,opaque))
+		return 0;
 
 	do{
-		const int produce_ret = rd_kafka_produce(rkt,RD_KAFKA_PARTITION_UA,flags,
-			buf,bufsize,NULL,0,opaque);
+		const rd_kafka_resp_err_t err = produce0(topic,buf,bufsize,flags,
+			meta,policy,opaque);
 
-		if(produce_ret == 0)
-			break;
+		if(err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+			return 0;
+		}
 
-		if(ENOBUFS==errno && !(retried++)){
+		if(RD_KAFKA_RESP_ERR__QUEUE_FULL==err && keep_if_full) {
+			return -1;
+		}else if(RD_KAFKA_RESP_ERR__QUEUE_FULL==err && !(retried++)){
 			rd_kafka_poll(rk,5); // backpressure
+		}else if(RD_KAFKA_RESP_ERR__QUEUE_FULL==err && 0 == produce_spill(
+		                     topic,buf,bufsize,flags,meta,policy,opaque)){
+			return 0;
 		}else{
-			//rdbg(LOG_ERR, "Failed to produce message: %s\n",rd_kafka_errno2err(errno));
-			rblog(LOG_ERR, "Failed to produce message: %s\n",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
-			if(flags | RD_KAFKA_MSG_F_FREE)
+			rblog(LOG_ERR, "Failed to produce message: %s\n",rd_kafka_err2str(err));
+			if(flags & RD_KAFKA_MSG_F_FREE)
 				free(buf);
-			break;
+			if(opaque)
+				ack_slot_release(opaque,1);
+			return 1;
 		}
 	}while(1);
 }
 
+/// Message payload shared by main producer and mirror targets messages
+struct mirror_payload {
+	char *buf;
+	/// Message ack slot reference, released along with payload
+	struct ack_slot *ack;
+	/// Main producer path kept the message, so caller still owns it
+	int kept;
+};
+
+/// Last reference of a mirrored message payload has been released
+static void mirror_payload_done(void *opaque,int failed){
+	struct mirror_payload *payload = opaque;
+
+	if(!payload->kept) {
+		free(payload->buf);
+		if(payload->ack)
+			ack_slot_release(payload->ack,failed);
+	}
+	free(payload);
+}
+
+/** Produce a message to main producer and to mirror targets, without copying
+    its payload: every message holds a reference of a payload slot, and the
+    last delivery report frees it. Message ack slot is released then, failed
+    if main producer could not deliver it.
+    @return Same as produce_retry
+    */
+static int produce_mirrored(rd_kafka_topic_t *topic,char *buf,
+                   const size_t bufsize,int flags,
+                   const struct msg_meta *meta,
+                   const struct listener_policy *policy,void *opaque,
+                   int keep_if_full){
+	if(0 == mirror_count()) {
+		return produce_retry(topic,buf,bufsize,flags,meta,policy,opaque,
+			keep_if_full);
+	}
+
+	/* Payload has to outlive the caller buffer if it is not ours */
+	const int owned = flags & RD_KAFKA_MSG_F_FREE;
+	struct mirror_payload *payload = calloc(1,sizeof(*payload));
+	char *payload_buf = owned ? buf : malloc(bufsize + 1);
+	struct ack_slot *slot = payload && payload_buf ?
+		ack_slot_new(mirror_payload_done,payload) : NULL;
+	if(NULL == slot) {
+		rblog(LOG_ERR,"Can't allocate mirrored message (out of memory?)");
+		free(payload);
+		if(!owned)
+			free(payload_buf);
+		return produce_retry(topic,buf,bufsize,flags,meta,policy,opaque,
+			keep_if_full);
+	}
+
+	if(!owned)
+		memcpy(payload_buf,buf,bufsize);
+	payload->buf = payload_buf;
+	payload->ack = opaque;
+
+	/* Main producer message consumes slot reference, and this function holds
+	   another one while mirroring it */
+	ack_slot_ref(slot);
+	const int rc = produce_retry(topic,payload_buf,bufsize,0,meta,policy,slot,
+		keep_if_full);
+	if(-1 == rc) {
+		payload->kept = 1;
+		ack_slot_release(slot,0);
+		ack_slot_release(slot,0);
+		if(!owned)
+			free(payload_buf);
+		return -1;
+	}
+
+	rd_kafka_headers_t *headers = meta ? msg_headers(meta,policy) : NULL;
+	mirror_produce(rd_kafka_topic_name(topic),payload_buf,bufsize,
+		meta ? meta->key : NULL,meta ? meta->key_size : 0,headers,
+		msg_timestamp(meta),slot);
+	if(headers)
+		rd_kafka_headers_destroy(headers);
+
+	ack_slot_release(slot,0);
+	return rc;
+}
+
+/** Split a message in reassemble stage chunks, and produce them. Chunks of
+    messages without key use message id as key, so they are produced to the
+    same partition.
+    @return 0 if message has been produced or discarded, -1 if it has been
+            kept
+    */
+static int produce_chunks(rd_kafka_topic_t *topic,char *buf,
+                   const size_t bufsize,int flags,
+                   const struct msg_meta *meta,
+                   struct listener_policy *policy,void *opaque,
+                   size_t max_message_size,int keep_if_full){
+	const size_t chunk_payload = max_message_size > GELF_HEADER_LENGTH ?
+		max_message_size - GELF_HEADER_LENGTH : 0;
+	const size_t chunks = chunk_payload > 0 ?
+		(bufsize + chunk_payload - 1)/chunk_payload : 0;
+	size_t i;
+
+	if(0 == chunks || chunks > GELF_MAX_CHUNKS) {
+		rblog(LOG_WARNING,"Can't split message of %zu bytes in chunks of "
+			"%zu bytes, discarding it",bufsize,max_message_size);
+		ATOMIC_INC(policy->counters.oversized_discarded);
+		if(flags & RD_KAFKA_MSG_F_FREE)
+			free(buf);
+		if(opaque)
+			ack_slot_release(opaque,0);
+		return 0;
+	}
+
+	const uint64_t id = ATOMIC_INC(chunked_message_id);
+	struct msg_meta chunk_meta = *meta;
+	if(NULL == chunk_meta.key) {
+		chunk_meta.key = (const char *)&id;
+		chunk_meta.key_size = sizeof(id);
+	}
+
+	/* Every chunk holds its own reference of message ack slot */
+	int failed = 0;
+	for(i=0;i<chunks;++i) {
+		const size_t offset = i*chunk_payload;
+		const size_t len = bufsize - offset < chunk_payload ?
+			bufsize - offset : chunk_payload;
+
+		char *chunk = malloc(GELF_HEADER_LENGTH + len);
+		if(NULL == chunk) {
+			rblog(LOG_ERR,"Can't allocate message chunk (out of memory?)");
+			failed = 1;
+			break;
+		}
+
+		chunk[0] = GELF_MAGIC_0;
+		chunk[1] = GELF_MAGIC_1;
+		memcpy(&chunk[2],&id,sizeof(id));
+		chunk[10] = (char)i;
+		chunk[11] = (char)chunks;
+		memcpy(&chunk[GELF_HEADER_LENGTH],&buf[offset],len);
+
+		if(opaque)
+			ack_slot_ref(opaque);
+
+		/* Only the whole message can be kept */
+		if(-1 == produce_mirrored(topic,chunk,GELF_HEADER_LENGTH + len,
+		                       RD_KAFKA_MSG_F_FREE,&chunk_meta,policy,opaque,
+		                       keep_if_full && 0 == i)) {
+			free(chunk);
+			if(opaque)
+				ack_slot_release(opaque,0);
+			return -1;
+		}
+	}
+
+	ATOMIC_INC(policy->counters.oversized_split);
+	if(flags & RD_KAFKA_MSG_F_FREE)
+		free(buf);
+	if(opaque)
+		ack_slot_release(opaque,failed);
+	return 0;
+}
+
+/** Produce a message following its listener policy.
+    @param meta Message meta. Its ack slot reference, if any, is owned by the
+                message: it is released when message is delivered or
+                discarded, or kept with the message.
+    @param keep_if_full Return the message to the caller if producer queue is
+                        full, instead of retrying once and discarding it
+    @return 0 if message has been produced or discarded, -1 if it has been
+            kept
+    */
+static int produce_with_policy(rd_kafka_topic_t *topic,char *buf,
+                   const size_t bufsize,int flags,
+                   const struct msg_meta *meta,int keep_if_full){
+	struct listener_policy *policy = NULL,*diverted = NULL;
+	/* Delivery report only needs the message ack slot */
+	void *opaque = meta ? meta->ack : NULL;
+
+	if(meta && ATOMIC_LOAD(listener_policies.count) > 0)
+		policy = listener_policy(meta->listener_port);
+
+	if(policy) {
+		topic = max_age_check(topic,meta,policy,&diverted);
+		if(NULL == topic) {
+			if(flags & RD_KAFKA_MSG_F_FREE)
+				free(buf);
+			if(opaque)
+				ack_slot_release(opaque,0);
+			return 0;
+		}
+
+		const size_t max_message_size = ATOMIC_LOAD(policy->max_message_size);
+		if(max_message_size > 0 && bufsize > max_message_size) {
+			if(ATOMIC_LOAD(policy->split_oversized)) {
+				return produce_chunks(topic,buf,bufsize,flags,meta,policy,
+					opaque,max_message_size,keep_if_full);
+			}
+
+			ATOMIC_INC(policy->counters.oversized_discarded);
+			if(flags & RD_KAFKA_MSG_F_FREE)
+				free(buf);
+			if(opaque)
+				ack_slot_release(opaque,0);
+			return 0;
+		}
+	}
+
+	const int rc = produce_mirrored(topic,buf,bufsize,flags,meta,policy,opaque,
+		keep_if_full);
+	if(0 == rc && diverted)
+		ATOMIC_INC(diverted->counters.diverted);
+	return rc < 0 ? -1 : 0;
+}
+
+void send_to_kafka_topic(rd_kafka_topic_t *topic,char *buf,const size_t bufsize,
+                         int flags,const struct msg_meta *meta,void *opaque){
+	/* Listener holds record ack slot only while handing it over */
+	if(meta && meta->ack)
+		ack_slot_ref(meta->ack);
+
+	/* Listener queue will produce it later */
+	if(0 == fair_queue_push(topic,buf,bufsize,flags,meta,opaque))
+		return;
+
+	produce_with_policy(topic,buf,bufsize,flags,meta,0);
+}
+
+int kafka_produce_spilled(const char *topic_name,char *buf,size_t bufsize,
+                          const void *key,size_t key_size,
+                          rd_kafka_headers_t *headers,int64_t timestamp,
+                          struct ack_slot *ack){
+	rd_kafka_topic_t *topic = kafka_topic(topic_name);
+	if(NULL == topic) {
+		if(headers)
+			rd_kafka_headers_destroy(headers);
+		return RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC;
+	}
+
+	/* librdkafka owns headers only if produce succeeds */
+	const rd_kafka_resp_err_t err = rd_kafka_producev(rk,
+		RD_KAFKA_V_RKT(topic),
+		RD_KAFKA_V_PARTITION(RD_KAFKA_PARTITION_UA),
+		RD_KAFKA_V_MSGFLAGS(0),
+		RD_KAFKA_V_VALUE(buf,bufsize),
+		RD_KAFKA_V_KEY(key_size > 0 ? key : NULL,key_size),
+		RD_KAFKA_V_HEADERS(headers),
+		RD_KAFKA_V_TIMESTAMP(timestamp),
+		RD_KAFKA_V_OPAQUE(ack),
+		RD_KAFKA_V_END);
+	if(RD_KAFKA_RESP_ERR_NO_ERROR != err && headers)
+		rd_kafka_headers_destroy(headers);
+
+	return err;
+}
+
+int kafka_produce_queued(rd_kafka_topic_t *topic,char *buf,const size_t bufsize,
+                         int flags,const struct msg_meta *meta,
+                         void *opaque RB_UNUSED,int keep_if_full){
+	return produce_with_policy(topic,buf,bufsize,flags,meta,keep_if_full);
+}
+
 struct kafka_message_array *new_kafka_message_array(size_t size){
 	const size_t memsize = sizeof(struct kafka_message_array) + size*sizeof(rd_kafka_message_t);
 	struct kafka_message_array *ret = calloc(1,memsize);
@@ -172,19 +863,46 @@ void send_array_to_kafka(struct kafka_message_array *msgs) {
 }
 
 
-void dumb_decoder(char *buffer,size_t buf_size,void *listener_callback_opaque){
-	send_to_kafka(buffer,buf_size,RD_KAFKA_MSG_F_FREE,listener_callback_opaque);
+void dumb_decoder(char *buffer,size_t buf_size,const struct msg_meta *meta,
+                                               void *listener_callback_opaque){
+	send_to_kafka_topic(meta && meta->topic ? meta->topic : rkt,buffer,
+		buf_size,RD_KAFKA_MSG_F_FREE,meta,listener_callback_opaque);
 }
 
 void flush_kafka(){
 	flush_kafka0(1000);
 }
 
+size_t kafka_outq_len(){
+	return rk ? (size_t)rd_kafka_outq_len(rk) : 0;
+}
+
 void kafka_poll(int timeout_ms){
 	rd_kafka_poll(rk,timeout_ms);
 }
 
 void stop_rdkafka(){
+	struct extra_topic *i = NULL;
+	size_t j;
+
+	fair_queue_done();
+	spill_stop();
+	mirror_stop();
+
+	while((i = LIST_FIRST(&extra_topics.list))) {
+		LIST_REMOVE(i,entry);
+		rd_kafka_topic_destroy(i->rkt);
+		free(i);
+	}
+	if(extra_topics.conf)
+		rd_kafka_topic_conf_destroy(extra_topics.conf);
+
+	for(j=0;j<listener_policies.count;++j) {
+		free(listener_policies.policies[j].stale_topic);
+		free(listener_policies.policies[j].decoder_chain);
+	}
+
 	rd_kafka_destroy(rk);
 	rd_kafka_topic_destroy(rkt);
+	spill_done();
 }
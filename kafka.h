@@ -19,10 +19,16 @@
 #pragma once
 #include "parse.h"
 
+#include <stdint.h>
 #include <string.h>
 
 /* Private data */
 struct rd_kafka_message_s;
+struct rd_kafka_topic_s;
+struct rd_kafka_headers_s;
+struct msg_meta;
+struct ack_slot;
+struct json_t;
 
 struct kafka_message_array{
 	size_t count; /* Number of used elements in msgs */
@@ -32,12 +38,79 @@ struct kafka_message_array{
 
 void init_rdkafka();
 void send_to_kafka(char *buffer,const size_t bufsize,int flags,void *opaque);
-void dumb_decoder(char *buffer,size_t buf_size,void *listener_callback_opaque);
+
+/// Get a handler of a topic different than the default one. NULL if error.
+struct rd_kafka_topic_s *kafka_topic(const char *name);
+/** Set max age of a listener messages when they are produced. Older ones are
+    sent to stale_topic, or discarded if it is NULL.
+    @param listener_port Listener port
+    @param max_age_ms Max age, 0 to disable the check
+    @param stale_topic Topic to send stale messages (can be NULL)
+    @return 0 on success
+    */
+int kafka_set_max_age(uint16_t listener_port,uint64_t max_age_ms,
+                                                   const char *stale_topic);
+
+/** Add message meta to a listener messages as kafka headers: client_addr
+    ("ip:port", or "[ip]:port" for IPv6), listener_port and decoder_chain.
+    @param listener_port Listener port
+    @param enabled Add headers
+    @param decoder_chain Stages and decoder names, comma separated (can be
+                         NULL)
+    @return 0 on success
+    */
+int kafka_set_meta_headers(uint16_t listener_port,int enabled,
+                                                 const char *decoder_chain);
+
+/** Set max size of a listener messages when they are produced. Bigger ones
+    are discarded, or split in reassemble stage chunks (see reassemble.h) of
+    max_message_size bytes at most.
+    @param listener_port Listener port
+    @param max_message_size Max message size, 0 to disable the check
+    @param split Split oversized messages instead of discarding them
+    @return 0 on success
+    */
+int kafka_set_max_message_size(uint16_t listener_port,size_t max_message_size,
+                                                                 int split);
+
+/// Add listener stale and oversized messages counters to stats
+void kafka_policy_stats(uint16_t listener_port,struct json_t *stats);
+
+/** Send a message to rkt, with meta headers and receive time as timestamp if
+    meta is not NULL. If meta listener has a max age, stale messages are
+    diverted or discarded. If meta has an ack slot, message holds a reference
+    of it until its delivery report, so caller can release its own one. opaque
+    is not used by delivery reports. */
+void send_to_kafka_topic(struct rd_kafka_topic_s *rkt,char *buffer,
+                         const size_t bufsize,int flags,
+                         const struct msg_meta *meta,void *opaque);
+/** Produce a message from a listener queue.
+    @param keep_if_full If producer queue is full, don't retry and keep message
+    @return 0 if message has been produced or discarded, -1 if producer queue
+            is full and message has been kept.
+    */
+int kafka_produce_queued(struct rd_kafka_topic_s *rkt,char *buffer,
+                         const size_t bufsize,int flags,
+                         const struct msg_meta *meta,void *opaque,
+                         int keep_if_full);
+/** Produce a message replayed from spill. Payload is not copied nor freed,
+    and headers are owned by the producer, or destroyed if produce fails.
+    @param ack Ack slot reference released by message delivery report
+    @return rdkafka error code
+    */
+int kafka_produce_spilled(const char *topic,char *buffer,size_t bufsize,
+                          const void *key,size_t key_size,
+                          struct rd_kafka_headers_s *headers,int64_t timestamp,
+                          struct ack_slot *ack);
+void dumb_decoder(char *buffer,size_t buf_size,const struct msg_meta *meta,
+                                               void *listener_callback_opaque);
 
 struct kafka_message_array *new_kafka_message_array(size_t size);
 int save_kafka_msg_in_array(struct kafka_message_array *array,char *buffer,size_t buf_size,void *opaque);
 void send_array_to_kafka(struct kafka_message_array *);
 
+/// Messages waiting in producer queue, or waiting for delivery report
+size_t kafka_outq_len();
 
 void kafka_poll();
 
@@ -0,0 +1,96 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "minify.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <jansson.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define MINIFY_PRIVATE_MAGIC 0x3141F73141F7L
+
+struct minify_private{
+#ifdef MINIFY_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	struct {
+		uint64_t messages;
+		uint64_t bytes_in;
+		uint64_t bytes_saved;
+	} counters;
+};
+
+int minify_stage_opaque_creator(json_t *config RB_UNUSED,void **_opaque,
+                                               char *err,size_t errsize) {
+	assert(_opaque);
+
+	struct minify_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate minify private (out of memory?)");
+		return -1;
+	}
+
+#ifdef MINIFY_PRIVATE_MAGIC
+	priv->magic = MINIFY_PRIVATE_MAGIC;
+#endif
+
+	*_opaque = priv;
+	return 0;
+}
+
+void minify_stage_opaque_destructor(void *opaque) {
+	struct minify_private *priv = opaque;
+#ifdef MINIFY_PRIVATE_MAGIC
+	assert(MINIFY_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	free(priv);
+}
+
+void minify_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct minify_private *priv = opaque;
+#ifdef MINIFY_PRIVATE_MAGIC
+	assert(MINIFY_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"bytes_in",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_in)));
+	json_object_set_new(stats,"bytes_saved",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_saved)));
+}
+
+void minify_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta) {
+	struct minify_private *priv = stage->opaque;
+#ifdef MINIFY_PRIVATE_MAGIC
+	assert(MINIFY_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const size_t new_size = json_minify(buffer,buf_size);
+
+	ATOMIC_INC(priv->counters.messages);
+	ATOMIC_ADD(priv->counters.bytes_in,buf_size);
+	ATOMIC_ADD(priv->counters.bytes_saved,buf_size - new_size);
+
+	stage_forward(stage,buffer,new_size,meta);
+}
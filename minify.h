@@ -0,0 +1,38 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * JSON minification stage. Removes whitespace outside strings, in place, of
+ * the message or of every newline delimited JSON record in it. Non JSON
+ * records and the newlines between records are kept:
+ *
+ *   {"type":"minify"}
+ */
+
+#define MINIFY_STAGE_TYPE "minify"
+
+int minify_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void minify_stage_opaque_destructor(void *opaque);
+void minify_stage_opaque_stats(void *opaque,struct json_t *stats);
+void minify_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta);
@@ -0,0 +1,352 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mirror.h"
+#include "ack.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Max number of mirror targets
+#define MIRROR_MAX_TARGETS 16
+/// Poll threads serve delivery reports with this timeout
+#define MIRROR_POLL_MS 100
+/// Time to wait for queued messages at stop, before purging them
+#define MIRROR_FLUSH_MS 1000
+
+#define MIRROR_BROKERS_KEY "brokers"
+#define MIRROR_TOPIC_KEY "topic"
+#define MIRROR_RDKAFKA_KEY "rdkafka."
+
+struct mirror_target {
+	char *brokers;
+	/// Topic of every mirrored message, NULL to keep message one
+	char *topic;
+	/// Target config object, with its rdkafka overrides
+	json_t *config;
+
+	rd_kafka_t *rk;
+	pthread_t poller;
+
+	struct {
+		uint64_t produced;
+		/// Messages not produced (target queue full, or error)
+		uint64_t dropped;
+		uint64_t delivered;
+		uint64_t failed;
+	} counters;
+};
+
+static struct {
+	size_t count;
+	/// Targets with a running producer
+	size_t running;
+	int stop;
+	struct mirror_target targets[MIRROR_MAX_TARGETS];
+} mirrors;
+
+/** Apply a target "rdkafka." overrides. "topic." ones go to topic config if
+    they are topic properties.
+    @return 0 on success
+    */
+static int mirror_conf_set(rd_kafka_conf_t *conf,
+                           rd_kafka_topic_conf_t *topic_conf,
+                           json_t *config,char *err,size_t errsize) {
+	const char *key = NULL;
+	json_t *value = NULL;
+
+	json_object_foreach(config,key,value) {
+		if(0 == strcmp(key,MIRROR_BROKERS_KEY)
+		                          || 0 == strcmp(key,MIRROR_TOPIC_KEY))
+			continue;
+
+		if(0 != strncmp(key,MIRROR_RDKAFKA_KEY,strlen(MIRROR_RDKAFKA_KEY))) {
+			snprintf(err,errsize,"Unknown mirror key %s",key);
+			return -1;
+		}
+
+		if(!json_is_string(value)) {
+			snprintf(err,errsize,"Mirror %s value must be a string",key);
+			return -1;
+		}
+
+		const char *name = key + strlen(MIRROR_RDKAFKA_KEY);
+		rd_kafka_conf_res_t res = RD_KAFKA_CONF_UNKNOWN;
+		if(0 == strncmp(name,"topic.",strlen("topic.")))
+			res = rd_kafka_topic_conf_set(topic_conf,name + strlen("topic."),
+				json_string_value(value),err,errsize);
+		if(RD_KAFKA_CONF_UNKNOWN == res)
+			res = rd_kafka_conf_set(conf,name,json_string_value(value),err,
+				errsize);
+		if(RD_KAFKA_CONF_OK != res)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void mirror_target_done(struct mirror_target *target) {
+	free(target->brokers);
+	free(target->topic);
+	json_decref(target->config);
+	memset(target,0,sizeof(*target));
+}
+
+int mirror_config(json_t *targets,char *err,size_t errsize) {
+	json_error_t jerr;
+	json_t *config = NULL;
+	size_t i;
+
+	if(mirrors.count > 0) {
+		snprintf(err,errsize,"Mirrors can only be configured once");
+		return -1;
+	}
+
+	if(json_array_size(targets) > MIRROR_MAX_TARGETS) {
+		snprintf(err,errsize,"Too many mirrors (max %d)",MIRROR_MAX_TARGETS);
+		return -1;
+	}
+
+	json_array_foreach(targets,i,config) {
+		struct mirror_target *target = &mirrors.targets[i];
+		const char *brokers = NULL,*topic = NULL;
+
+		const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s:s,s?s}",
+			MIRROR_BROKERS_KEY,&brokers,MIRROR_TOPIC_KEY,&topic);
+		if(0 != unpack_rc) {
+			snprintf(err,errsize,"Can't decode mirror %zu config: %s",i,
+				jerr.text);
+			goto err;
+		}
+
+		/* Check overrides now, instead of when producers are created */
+		rd_kafka_conf_t *conf = rd_kafka_conf_new();
+		rd_kafka_topic_conf_t *topic_conf = rd_kafka_topic_conf_new();
+		const int conf_rc = mirror_conf_set(conf,topic_conf,config,err,
+			errsize);
+		rd_kafka_topic_conf_destroy(topic_conf);
+		rd_kafka_conf_destroy(conf);
+		if(0 != conf_rc)
+			goto err;
+
+		target->brokers = strdup(brokers);
+		target->topic = topic ? strdup(topic) : NULL;
+		target->config = json_incref(config);
+		if(NULL == target->brokers || (topic && NULL == target->topic)) {
+			snprintf(err,errsize,"Can't allocate mirror (out of memory?)");
+			mirror_target_done(target);
+			goto err;
+		}
+	}
+
+	mirrors.count = json_array_size(targets);
+	return 0;
+
+err:
+	while(i-- > 0)
+		mirror_target_done(&mirrors.targets[i]);
+	return -1;
+}
+
+/// Delivery report of a mirrored message. Its opaque is the payload slot.
+static void mirror_delivered(rd_kafka_t *rk RB_UNUSED,void *payload RB_UNUSED,
+                             size_t len RB_UNUSED,rd_kafka_resp_err_t err,
+                             void *opaque,void *msg_opaque) {
+	struct mirror_target *target = opaque;
+
+	if(err) {
+		rdlog(LOG_DEBUG,"Mirror %s delivery failed: %s",target->brokers,
+			rd_kafka_err2str(err));
+		ATOMIC_INC(target->counters.failed);
+	} else {
+		ATOMIC_INC(target->counters.delivered);
+	}
+
+	/* Mirrors don't fail the message, main producer delivery does */
+	ack_slot_release(msg_opaque,0);
+}
+
+static void *mirror_poll_main(void *opaque) {
+	struct mirror_target *target = opaque;
+
+	while(!ATOMIC_LOAD(mirrors.stop))
+		rd_kafka_poll(target->rk,MIRROR_POLL_MS);
+
+	return NULL;
+}
+
+/// Create a target producer and its poll thread
+static int mirror_target_start(struct mirror_target *target,
+                               const rd_kafka_conf_t *base_conf,
+                               const rd_kafka_topic_conf_t *base_topic_conf,
+                               char *err,size_t errsize) {
+	rd_kafka_conf_t *conf = rd_kafka_conf_dup(base_conf);
+	rd_kafka_topic_conf_t *topic_conf =
+		rd_kafka_topic_conf_dup(base_topic_conf);
+
+	if(0 != mirror_conf_set(conf,topic_conf,target->config,err,errsize)
+	        || RD_KAFKA_CONF_OK != rd_kafka_conf_set(conf,
+	                 "metadata.broker.list",target->brokers,err,errsize)) {
+		rd_kafka_topic_conf_destroy(topic_conf);
+		rd_kafka_conf_destroy(conf);
+		return -1;
+	}
+
+	rd_kafka_conf_set_dr_cb(conf,mirror_delivered);
+	rd_kafka_conf_set_opaque(conf,target);
+	/* Messages are produced by topic name, with this config */
+	rd_kafka_conf_set_default_topic_conf(conf,topic_conf);
+
+	/* rd_kafka_new takes conf ownership only on success */
+	target->rk = rd_kafka_new(RD_KAFKA_PRODUCER,conf,err,errsize);
+	if(NULL == target->rk) {
+		rd_kafka_conf_destroy(conf);
+		return -1;
+	}
+
+	if(0 != pthread_create(&target->poller,NULL,mirror_poll_main,target)) {
+		snprintf(err,errsize,"Can't create mirror %s poll thread",
+			target->brokers);
+		rd_kafka_destroy(target->rk);
+		target->rk = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int mirror_start(const rd_kafka_conf_t *conf,
+                 const rd_kafka_topic_conf_t *topic_conf,
+                 char *err,size_t errsize) {
+	size_t i;
+
+	for(i=0;i<mirrors.count;++i) {
+		if(0 != mirror_target_start(&mirrors.targets[i],conf,topic_conf,err,
+		                                                         errsize)) {
+			mirror_stop();
+			return -1;
+		}
+
+		/* mirror_produce() readers only see started targets */
+		__atomic_store_n(&mirrors.running,i + 1,__ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+size_t mirror_count() {
+	return __atomic_load_n(&mirrors.running,__ATOMIC_ACQUIRE);
+}
+
+void mirror_produce(const char *topic,char *buf,size_t size,
+                    const void *key,size_t key_size,
+                    const rd_kafka_headers_t *headers,int64_t timestamp,
+                    struct ack_slot *payload) {
+	size_t i;
+	const size_t running = mirror_count();
+
+	for(i=0;i<running;++i) {
+		struct mirror_target *target = &mirrors.targets[i];
+		rd_kafka_headers_t *target_headers = headers ?
+			rd_kafka_headers_copy(headers) : NULL;
+
+		ack_slot_ref(payload);
+
+		/* librdkafka owns headers only if produce succeeds */
+		const rd_kafka_resp_err_t err = rd_kafka_producev(target->rk,
+			RD_KAFKA_V_TOPIC(target->topic ? target->topic : topic),
+			RD_KAFKA_V_PARTITION(RD_KAFKA_PARTITION_UA),
+			RD_KAFKA_V_MSGFLAGS(0),
+			RD_KAFKA_V_VALUE(buf,size),
+			RD_KAFKA_V_KEY(key_size > 0 ? key : NULL,key_size),
+			RD_KAFKA_V_HEADERS(target_headers),
+			RD_KAFKA_V_TIMESTAMP(timestamp),
+			RD_KAFKA_V_OPAQUE(payload),
+			RD_KAFKA_V_END);
+
+		if(RD_KAFKA_RESP_ERR_NO_ERROR != err) {
+			/* Don't wait for a slow target */
+			if(target_headers)
+				rd_kafka_headers_destroy(target_headers);
+			ack_slot_release(payload,0);
+			ATOMIC_INC(target->counters.dropped);
+		} else {
+			ATOMIC_INC(target->counters.produced);
+		}
+	}
+}
+
+void mirror_stats(json_t *stats) {
+	size_t i;
+	const size_t running = mirror_count();
+
+	for(i=0;i<running;++i) {
+		const struct mirror_target *target = &mirrors.targets[i];
+		json_t *target_stats = json_object();
+		if(NULL == target_stats) {
+			rdlog(LOG_ERR,"Can't allocate mirror stats (out of memory?)");
+			return;
+		}
+
+		json_object_set_new(target_stats,"produced",
+			json_integer((json_int_t)ATOMIC_LOAD(target->counters.produced)));
+		json_object_set_new(target_stats,"dropped",
+			json_integer((json_int_t)ATOMIC_LOAD(target->counters.dropped)));
+		json_object_set_new(target_stats,"delivered",
+			json_integer((json_int_t)ATOMIC_LOAD(target->counters.delivered)));
+		json_object_set_new(target_stats,"failed",
+			json_integer((json_int_t)ATOMIC_LOAD(target->counters.failed)));
+		json_object_set_new(target_stats,"outq",
+			json_integer(rd_kafka_outq_len(target->rk)));
+		json_object_set_new(stats,target->brokers,target_stats);
+	}
+}
+
+void mirror_stop() {
+	size_t i;
+	const size_t running = mirror_count();
+
+	__atomic_store_n(&mirrors.running,0,__ATOMIC_RELEASE);
+	for(i=0;i<running;++i) {
+		struct mirror_target *target = &mirrors.targets[i];
+		rd_kafka_flush(target->rk,MIRROR_FLUSH_MS);
+
+		/* rd_kafka_destroy drops messages without delivery report, and
+		   they would keep their payload slot reference forever */
+		rd_kafka_purge(target->rk,
+			RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+		while(rd_kafka_outq_len(target->rk) > 0)
+			rd_kafka_poll(target->rk,MIRROR_POLL_MS);
+	}
+
+	ATOMIC_STORE(mirrors.stop,1);
+	for(i=0;i<running;++i) {
+		struct mirror_target *target = &mirrors.targets[i];
+		pthread_join(target->poller,NULL);
+		rd_kafka_destroy(target->rk);
+	}
+
+	for(i=0;i<mirrors.count;++i)
+		mirror_target_done(&mirrors.targets[i]);
+	mirrors.count = 0;
+}
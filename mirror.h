@@ -0,0 +1,80 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <librdkafka/rdkafka.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Mirror targets: other kafka clusters that get a copy of every produced
+ * message.
+ *
+ *   "mirrors":[{"brokers":"central:9092","topic":"events",
+ *               "rdkafka.queue.buffering.max.messages":"500000"}]
+ *
+ * Every target has its own producer, with the main producer config plus its
+ * "rdkafka." overrides, and its own poll thread. Messages keep their topic,
+ * unless the target has one. They are produced without copying their
+ * payload, that is shared with the main producer message, and they are
+ * dropped if target producer queue is full, so a slow target never blocks
+ * the others.
+ */
+
+struct ack_slot;
+struct json_t;
+
+/** Configure mirror targets from mirrors config array
+    @return 0 on success
+    */
+int mirror_config(struct json_t *targets,char *err,size_t errsize);
+
+/** Create mirror producers
+    @param conf Main producer config, that targets config overrides
+    @param topic_conf Main producer topic config
+    @return 0 on success
+    */
+int mirror_start(const rd_kafka_conf_t *conf,
+                 const rd_kafka_topic_conf_t *topic_conf,
+                 char *err,size_t errsize);
+
+/// Number of running mirror targets
+size_t mirror_count();
+
+/** Produce a message to all mirror targets
+    @param topic Message topic name
+    @param buf Message payload. It is not copied, so it must be valid until
+               payload slot is released.
+    @param headers Message headers, or NULL. They are copied.
+    @param timestamp Message timestamp, 0 for produce time
+    @param payload Payload slot. Every produced message holds a reference
+                   until its delivery report.
+    */
+void mirror_produce(const char *topic,char *buf,size_t size,
+                    const void *key,size_t key_size,
+                    const rd_kafka_headers_t *headers,int64_t timestamp,
+                    struct ack_slot *payload);
+
+/// Add every target counters to stats, by target brokers
+void mirror_stats(struct json_t *stats);
+
+/** Flush and destroy mirror producers. Messages not delivered in time are
+    purged, so their payload slot references are released anyway. */
+void mirror_stop();
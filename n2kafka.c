@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <jansson.h>
 
 #define DEFAULT_PORT 2057
@@ -58,7 +59,8 @@ static void show_usage(const char *progname){
 	fprintf(stdout,"\t\"topic\":\"kafka topic\",\n");
 	fprintf(stdout,"\t\"rdkafka.socket.max.fails\":\"3\",\n");
 	fprintf(stdout,"\t\"rdkafka.socket.keepalive.enable\":\"true\",\n");
-	fprintf(stdout,"\t\"blacklist\":[\"192.168.101.3\"]\n");
+	fprintf(stdout,"\t\"blacklist\":[\"192.168.101.3\"],\n");
+	fprintf(stdout,"\t\"stats_interval\":60\n");
 	fprintf(stdout,"}\n\n");
 	fprintf(stdout,"(1) Modes can be:\n");
 	fprintf(stdout,
@@ -92,8 +94,13 @@ int main(int argc,char *argv[]){
 	if(!only_stdout_output())
 		init_rdkafka();
 
+	time_t next_stats = time(NULL) + global_config.stats_interval;
 	while(!do_shutdown){
 		kafka_poll(1000 /* ms */);
+		if(global_config.stats_interval > 0 && time(NULL) >= next_stats){
+			log_stats(&global_config);
+			next_stats = time(NULL) + global_config.stats_interval;
+		}
 		if(do_reload){
 			reload_config(&global_config);
 			do_reload = 0;
@@ -0,0 +1,909 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "netflow.h"
+#include "kafka.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define CONFIG_NETFLOW_MAX_TEMPLATES_KEY "netflow_max_templates"
+#define NETFLOW_DEFAULT_MAX_TEMPLATES 4096
+
+#define NETFLOW_PRIVATE_MAGIC 0xF10BF10BF10BF10BL
+
+/// Template cache buckets and locks. Bucket i is protected by lock i%locks.
+#define NF_CACHE_BUCKETS 1024
+#define NF_CACHE_LOCKS 64
+
+#define NF_V5_HEADER_LENGTH 24
+#define NF_V5_RECORD_LENGTH 48
+#define NF_V9_HEADER_LENGTH 20
+#define NF_IPFIX_HEADER_LENGTH 16
+#define NF_SET_HEADER_LENGTH 4
+/// Sets are padded with zeros up to this boundary
+#define NF_SET_ALIGNMENT 4
+
+#define NF_V9_TEMPLATE_SET_ID 0
+#define NF_IPFIX_TEMPLATE_SET_ID 2
+#define NF_MIN_DATA_SET_ID 256
+
+/// IPFIX variable length element
+#define NF_VARIABLE_LENGTH 0xffff
+/// IPFIX enterprise bit in element id
+#define NF_ENTERPRISE_BIT 0x8000
+
+/// Longest JSON rendered value: quoted IPv6 address
+#define NF_MAX_VALUE_LENGTH (INET6_ADDRSTRLEN + 2)
+/// Longest record prefix: type, sensor_ip and timestamp
+#define NF_MAX_PREFIX_LENGTH 128
+
+enum nf_format{
+	NF_SKIP,
+	NF_UINT,
+	NF_IPV4,
+	NF_IPV6,
+	NF_MAC,
+	/// Milliseconds since exporter boot, rendered as epoch seconds
+	NF_UPTIME,
+	/// Epoch milliseconds, rendered as epoch seconds
+	NF_MILLISECONDS,
+};
+
+struct nf_element{
+	uint16_t id;
+	enum nf_format format;
+	/// Rendered JSON key, with quotes and colon
+	const char *key;
+	size_t key_len;
+};
+
+#define NF_ELEMENT(id,format,name) \
+	{id,format,"\"" name "\":",sizeof("\"" name "\":")-1}
+
+/// Known IANA information elements (v9 field types are the same for 1-127)
+static const struct nf_element nf_elements[] = {
+	NF_ELEMENT(1,   NF_UINT,         "bytes"),
+	NF_ELEMENT(2,   NF_UINT,         "pkts"),
+	NF_ELEMENT(4,   NF_UINT,         "l4_proto"),
+	NF_ELEMENT(5,   NF_UINT,         "tos"),
+	NF_ELEMENT(6,   NF_UINT,         "tcp_flags"),
+	NF_ELEMENT(7,   NF_UINT,         "src_port"),
+	NF_ELEMENT(8,   NF_IPV4,         "src"),
+	NF_ELEMENT(9,   NF_UINT,         "src_mask"),
+	NF_ELEMENT(10,  NF_UINT,         "input_snmp"),
+	NF_ELEMENT(11,  NF_UINT,         "dst_port"),
+	NF_ELEMENT(12,  NF_IPV4,         "dst"),
+	NF_ELEMENT(13,  NF_UINT,         "dst_mask"),
+	NF_ELEMENT(14,  NF_UINT,         "output_snmp"),
+	NF_ELEMENT(15,  NF_IPV4,         "next_hop"),
+	NF_ELEMENT(16,  NF_UINT,         "src_as"),
+	NF_ELEMENT(17,  NF_UINT,         "dst_as"),
+	NF_ELEMENT(21,  NF_UPTIME,       "last_switched"),
+	NF_ELEMENT(22,  NF_UPTIME,       "first_switched"),
+	NF_ELEMENT(23,  NF_UINT,         "out_bytes"),
+	NF_ELEMENT(24,  NF_UINT,         "out_pkts"),
+	NF_ELEMENT(27,  NF_IPV6,         "src_ipv6"),
+	NF_ELEMENT(28,  NF_IPV6,         "dst_ipv6"),
+	NF_ELEMENT(29,  NF_UINT,         "src_ipv6_mask"),
+	NF_ELEMENT(30,  NF_UINT,         "dst_ipv6_mask"),
+	NF_ELEMENT(32,  NF_UINT,         "icmp_type"),
+	NF_ELEMENT(56,  NF_MAC,          "src_mac"),
+	NF_ELEMENT(57,  NF_MAC,          "post_dst_mac"),
+	NF_ELEMENT(58,  NF_UINT,         "src_vlan"),
+	NF_ELEMENT(59,  NF_UINT,         "dst_vlan"),
+	NF_ELEMENT(61,  NF_UINT,         "direction"),
+	NF_ELEMENT(62,  NF_IPV6,         "next_hop_ipv6"),
+	NF_ELEMENT(80,  NF_MAC,          "dst_mac"),
+	NF_ELEMENT(81,  NF_MAC,          "post_src_mac"),
+	NF_ELEMENT(136, NF_UINT,         "flow_end_reason"),
+	NF_ELEMENT(150, NF_UINT,         "first_switched"),
+	NF_ELEMENT(151, NF_UINT,         "last_switched"),
+	NF_ELEMENT(152, NF_MILLISECONDS, "first_switched"),
+	NF_ELEMENT(153, NF_MILLISECONDS, "last_switched"),
+	NF_ELEMENT(234, NF_UINT,         "input_vrf"),
+	NF_ELEMENT(235, NF_UINT,         "output_vrf"),
+};
+
+/// Precompiled template field
+struct nf_field_op{
+	const struct nf_element *element;
+	uint16_t length;
+	enum nf_format format;
+};
+
+struct nf_template{
+	/// Cache entry and every data set being decoded with it hold a
+	/// reference
+	size_t refs;
+	/// Min record length. Variable length fields count as one byte.
+	size_t record_min_length;
+	/// Upper bound of rendered fields length
+	size_t max_json_length;
+	size_t fields_count;
+	struct nf_field_op ops[];
+};
+
+struct nf_template_entry{
+	struct in6_addr exporter;
+	uint32_t domain;
+	uint16_t version;
+	uint16_t template_id;
+	struct nf_template *template;
+	struct nf_template_entry *next;
+};
+
+struct nf_template_cache{
+	pthread_rwlock_t locks[NF_CACHE_LOCKS];
+	struct nf_template_entry *buckets[NF_CACHE_BUCKETS];
+	size_t count;
+	size_t max;
+};
+
+struct netflow_private{
+#ifdef NETFLOW_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	struct nf_template_cache cache;
+	/// NetFlow v5 fixed record layout
+	struct nf_template *v5_template;
+	struct {
+		uint64_t packets;
+		uint64_t records;
+		uint64_t templates_received;
+		uint64_t missing_template;
+		uint64_t malformed;
+		uint64_t unknown_version;
+	} counters;
+};
+
+/// Decoding packet information
+struct nf_packet{
+	uint16_t version;
+	/// Exporter address. IPv4 ones are IPv4-mapped.
+	struct in6_addr exporter;
+	uint32_t domain;
+	/// Export time
+	uint32_t unix_secs;
+	/// Exporter uptime (ms) at export time. Only in v5 and v9.
+	uint32_t sys_uptime;
+	/// Rendered record prefix
+	char prefix[NF_MAX_PREFIX_LENGTH];
+	size_t prefix_len;
+	const struct msg_meta *meta;
+};
+
+static uint16_t read_u16(const uint8_t *p) {
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t read_u32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8
+	                                                          | (uint32_t)p[3];
+}
+
+static uint64_t read_uint(const uint8_t *p,size_t len) {
+	uint64_t value = 0;
+	size_t i;
+	for(i=0;i<len;++i)
+		value = value << 8 | p[i];
+	return value;
+}
+
+/*
+ * Rendering
+ */
+
+static char *render_uint(char *out,uint64_t value) {
+	char digits[20];
+	size_t n = 0;
+
+	do {
+		digits[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while(value);
+
+	while(n)
+		*out++ = digits[--n];
+	return out;
+}
+
+static char *render_ipv4(char *out,const uint8_t *addr) {
+	size_t i;
+	for(i=0;i<4;++i) {
+		if(i)
+			*out++ = '.';
+		out = render_uint(out,addr[i]);
+	}
+	return out;
+}
+
+static char *render_mac(char *out,const uint8_t *mac) {
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	for(i=0;i<6;++i) {
+		if(i)
+			*out++ = ':';
+		*out++ = hex[mac[i] >> 4];
+		*out++ = hex[mac[i] & 0xf];
+	}
+	return out;
+}
+
+/// Render a field value. Value has op->length bytes.
+static char *render_value(char *out,const struct nf_field_op *op,
+                          const uint8_t *value,const struct nf_packet *packet) {
+	uint64_t number = 0;
+
+	switch(op->format) {
+	case NF_IPV4:
+		*out++ = '"';
+		out = render_ipv4(out,value);
+		*out++ = '"';
+		return out;
+
+	case NF_IPV6:
+		*out++ = '"';
+		inet_ntop(AF_INET6,value,out,INET6_ADDRSTRLEN);
+		out += strlen(out);
+		*out++ = '"';
+		return out;
+
+	case NF_MAC:
+		*out++ = '"';
+		out = render_mac(out,value);
+		*out++ = '"';
+		return out;
+
+	case NF_UPTIME:
+		number = read_uint(value,op->length);
+		if(packet->sys_uptime) {
+			/* Exporter boot time + value */
+			const int64_t ms_before_export = (int64_t)packet->sys_uptime
+				- (int64_t)number;
+			number = (uint64_t)((int64_t)packet->unix_secs
+				- ms_before_export/1000);
+		}
+		return render_uint(out,number);
+
+	case NF_MILLISECONDS:
+		return render_uint(out,read_uint(value,op->length)/1000);
+
+	case NF_UINT:
+		return render_uint(out,read_uint(value,op->length));
+
+	case NF_SKIP:
+	default:
+		return out;
+	};
+}
+
+/*
+ * Templates
+ */
+
+static const struct nf_element *nf_element(uint16_t id) {
+	size_t i;
+	for(i=0;i<sizeof(nf_elements)/sizeof(nf_elements[0]);++i) {
+		if(nf_elements[i].id == id)
+			return &nf_elements[i];
+	}
+	return NULL;
+}
+
+/// Format to use with an element and a length, NF_SKIP if they don't fit
+static enum nf_format nf_op_format(const struct nf_element *element,
+                                                             uint16_t length) {
+	if(NULL == element || NF_VARIABLE_LENGTH == length || 0 == length)
+		return NF_SKIP;
+
+	switch(element->format) {
+	case NF_IPV4:
+		return 4 == length ? NF_IPV4 : NF_SKIP;
+	case NF_IPV6:
+		return 16 == length ? NF_IPV6 : NF_SKIP;
+	case NF_MAC:
+		return 6 == length ? NF_MAC : NF_SKIP;
+	case NF_UINT:
+	case NF_UPTIME:
+	case NF_MILLISECONDS:
+		return length <= 8 ? element->format : NF_SKIP;
+	case NF_SKIP:
+	default:
+		return NF_SKIP;
+	};
+}
+
+/** Compile template fields.
+    @param fields Template fields, as (id,length) pairs. Enterprise elements
+                  ids have to be 0.
+    @param fields_count Number of fields
+    @return New template, or NULL if error
+    */
+static struct nf_template *nf_template_compile(const uint16_t (*fields)[2],
+                                                        size_t fields_count) {
+	size_t i;
+
+	struct nf_template *template = calloc(1,sizeof(*template)
+		+ fields_count*sizeof(template->ops[0]));
+	if(NULL == template) {
+		rdlog(LOG_ERR,"Can't allocate netflow template (out of memory?)");
+		return NULL;
+	}
+
+	template->refs = 1;
+	template->fields_count = fields_count;
+	for(i=0;i<fields_count;++i) {
+		struct nf_field_op *op = &template->ops[i];
+		op->element = nf_element(fields[i][0]);
+		op->length = fields[i][1];
+		op->format = nf_op_format(op->element,op->length);
+
+		template->record_min_length += NF_VARIABLE_LENGTH == op->length ?
+			1 : op->length;
+		if(NF_SKIP != op->format) {
+			template->max_json_length += strlen(",") + op->element->key_len
+				+ NF_MAX_VALUE_LENGTH;
+		}
+	}
+
+	return template;
+}
+
+static void nf_template_release(struct nf_template *template) {
+	if(0 == ATOMIC_ADD(template->refs,(size_t)-1))
+		free(template);
+}
+
+static struct nf_template *nf_v5_template() {
+	static const uint16_t v5_fields[][2] = {
+		{8,4},  {12,4}, {15,4}, {10,2}, {14,2}, {2,4},  {1,4},
+		{22,4}, {21,4}, {7,2},  {11,2}, {0,1},  {6,1},  {4,1},
+		{5,1},  {16,2}, {17,2}, {9,1},  {13,1}, {0,2},
+	};
+
+	return nf_template_compile(v5_fields,sizeof(v5_fields)/sizeof(v5_fields[0]));
+}
+
+/*
+ * Template cache
+ */
+
+static size_t nf_cache_bucket(const struct in6_addr *exporter,uint32_t domain,
+                                          uint16_t version,uint16_t template_id) {
+	uint64_t exporter_words[2];
+	memcpy(exporter_words,exporter->s6_addr,sizeof(exporter_words));
+
+	uint64_t hash = exporter_words[0] ^ exporter_words[1];
+	hash ^= (uint64_t)domain << 32 | (uint64_t)version << 16 | template_id;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	return (size_t)(hash >> 32) % NF_CACHE_BUCKETS;
+}
+
+static pthread_rwlock_t *nf_cache_lock(struct nf_template_cache *cache,
+                                                              size_t bucket) {
+	return &cache->locks[bucket % NF_CACHE_LOCKS];
+}
+
+/// Need bucket lock
+static struct nf_template_entry **nf_cache_find(struct nf_template_cache *cache,
+                               size_t bucket,const struct nf_packet *packet,
+                               uint16_t template_id) {
+	struct nf_template_entry **entry = &cache->buckets[bucket];
+	for(;*entry;entry = &(*entry)->next) {
+		if(0 == memcmp(&(*entry)->exporter,&packet->exporter,
+		                                          sizeof(packet->exporter))
+		        && (*entry)->domain == packet->domain
+		        && (*entry)->version == packet->version
+		        && (*entry)->template_id == template_id)
+			break;
+	}
+	return entry;
+}
+
+/// Add or replace a template. Template is owned by cache after this call.
+static void nf_cache_put(struct netflow_private *priv,
+                         const struct nf_packet *packet,uint16_t template_id,
+                         struct nf_template *template) {
+	struct nf_template_cache *cache = &priv->cache;
+	struct nf_template *old_template = NULL;
+	const size_t bucket = nf_cache_bucket(&packet->exporter,packet->domain,
+		packet->version,template_id);
+
+	pthread_rwlock_wrlock(nf_cache_lock(cache,bucket));
+	struct nf_template_entry **entry = nf_cache_find(cache,bucket,packet,
+		template_id);
+	if(*entry) {
+		old_template = (*entry)->template;
+		(*entry)->template = template;
+	} else if(ATOMIC_LOAD(cache->count) >= cache->max) {
+		old_template = template;
+	} else {
+		struct nf_template_entry *new_entry = calloc(1,sizeof(*new_entry));
+		if(NULL == new_entry) {
+			old_template = template;
+		} else {
+			new_entry->exporter = packet->exporter;
+			new_entry->domain = packet->domain;
+			new_entry->version = packet->version;
+			new_entry->template_id = template_id;
+			new_entry->template = template;
+			new_entry->next = cache->buckets[bucket];
+			cache->buckets[bucket] = new_entry;
+			ATOMIC_INC(cache->count);
+		}
+	}
+	pthread_rwlock_unlock(nf_cache_lock(cache,bucket));
+
+	if(old_template == template)
+		rdlog(LOG_ERR,"Can't cache netflow template %u: cache full",
+			template_id);
+	if(old_template)
+		nf_template_release(old_template);
+}
+
+/// IPFIX template withdrawal
+static void nf_cache_remove(struct netflow_private *priv,
+                         const struct nf_packet *packet,uint16_t template_id) {
+	struct nf_template_cache *cache = &priv->cache;
+	struct nf_template_entry *removed = NULL;
+	const size_t bucket = nf_cache_bucket(&packet->exporter,packet->domain,
+		packet->version,template_id);
+
+	pthread_rwlock_wrlock(nf_cache_lock(cache,bucket));
+	struct nf_template_entry **entry = nf_cache_find(cache,bucket,packet,
+		template_id);
+	if(*entry) {
+		removed = *entry;
+		*entry = removed->next;
+		ATOMIC_ADD(cache->count,(size_t)-1);
+	}
+	pthread_rwlock_unlock(nf_cache_lock(cache,bucket));
+
+	if(removed) {
+		nf_template_release(removed->template);
+		free(removed);
+	}
+}
+
+static void nf_cache_done(struct nf_template_cache *cache) {
+	size_t i;
+	for(i=0;i<NF_CACHE_BUCKETS;++i) {
+		struct nf_template_entry *entry = cache->buckets[i];
+		while(entry) {
+			struct nf_template_entry *next = entry->next;
+			nf_template_release(entry->template);
+			free(entry);
+			entry = next;
+		}
+	}
+	for(i=0;i<NF_CACHE_LOCKS;++i)
+		pthread_rwlock_destroy(&cache->locks[i]);
+}
+
+/*
+ * Decoding
+ */
+
+/** Decode and send one record.
+    @return Record length, or 0 if record is malformed
+    */
+static size_t nf_send_record(struct netflow_private *priv,
+                             const struct nf_template *template,
+                             const struct nf_packet *packet,
+                             const uint8_t *record,const uint8_t *end) {
+	const uint8_t *cursor = record;
+	size_t i;
+
+	char *message = malloc(packet->prefix_len + template->max_json_length + 1);
+	if(NULL == message) {
+		rdlog(LOG_ERR,"Can't allocate netflow record (out of memory?)");
+		return 0;
+	}
+
+	char *out = message;
+	memcpy(out,packet->prefix,packet->prefix_len);
+	out += packet->prefix_len;
+
+	for(i=0;i<template->fields_count;++i) {
+		const struct nf_field_op *op = &template->ops[i];
+		size_t length = op->length;
+
+		if(NF_VARIABLE_LENGTH == length) {
+			if(cursor >= end)
+				goto malformed;
+			length = *cursor++;
+			if(255 == length) {
+				if(end - cursor < 2)
+					goto malformed;
+				length = read_u16(cursor);
+				cursor += 2;
+			}
+		}
+
+		if((size_t)(end - cursor) < length)
+			goto malformed;
+
+		if(NF_SKIP != op->format) {
+			*out++ = ',';
+			memcpy(out,op->element->key,op->element->key_len);
+			out += op->element->key_len;
+			out = render_value(out,op,cursor,packet);
+		}
+		cursor += length;
+	}
+
+	*out++ = '}';
+	ATOMIC_INC(priv->counters.records);
+	dumb_decoder(message,(size_t)(out - message),packet->meta,NULL);
+	return (size_t)(cursor - record);
+
+malformed:
+	free(message);
+	return 0;
+}
+
+/** Check if set remaining bytes are its padding. Only needed for templates
+    whose records can be as short as the padding, like variable length ones:
+    padding is never a whole 4 bytes group of zeros. */
+static int nf_is_padding(const uint8_t *cursor,const uint8_t *end) {
+	if(end - cursor >= NF_SET_ALIGNMENT)
+		return 0;
+	for(;cursor < end;++cursor)
+		if(*cursor)
+			return 0;
+	return 1;
+}
+
+static void nf_decode_records(struct netflow_private *priv,
+                              const struct nf_template *template,
+                              const struct nf_packet *packet,
+                              const uint8_t *cursor,const uint8_t *end,
+                              size_t max_records) {
+	size_t records = 0;
+
+	/* Sets can have padding at the end */
+	while(records++ < max_records
+	        && (size_t)(end - cursor) >= template->record_min_length
+	        && !(template->record_min_length < NF_SET_ALIGNMENT
+	                                  && nf_is_padding(cursor,end))) {
+		const size_t record_length = nf_send_record(priv,template,packet,
+			cursor,end);
+		if(0 == record_length) {
+			ATOMIC_INC(priv->counters.malformed);
+			return;
+		}
+		cursor += record_length;
+	}
+}
+
+static void nf_decode_data_set(struct netflow_private *priv,
+                               const struct nf_packet *packet,uint16_t set_id,
+                               const uint8_t *cursor,const uint8_t *end) {
+	struct nf_template_cache *cache = &priv->cache;
+	const size_t bucket = nf_cache_bucket(&packet->exporter,packet->domain,
+		packet->version,set_id);
+
+	/* Records are produced without the lock, so template updates don't
+	   wait for producer queue. Replaced template lives until they are
+	   done. */
+	pthread_rwlock_rdlock(nf_cache_lock(cache,bucket));
+	const struct nf_template_entry *entry = *nf_cache_find(cache,bucket,packet,
+		set_id);
+	struct nf_template *template = entry ? entry->template : NULL;
+	if(template)
+		ATOMIC_INC(template->refs);
+	pthread_rwlock_unlock(nf_cache_lock(cache,bucket));
+
+	if(NULL == template) {
+		ATOMIC_INC(priv->counters.missing_template);
+		return;
+	}
+
+	nf_decode_records(priv,template,packet,cursor,end,(size_t)(end - cursor));
+	nf_template_release(template);
+}
+
+/// Parse a v9 or IPFIX template set
+static void nf_decode_template_set(struct netflow_private *priv,
+                                   const struct nf_packet *packet,
+                                   const uint8_t *cursor,const uint8_t *end) {
+	/* Every field uses 4 bytes at least */
+	const size_t max_fields = (size_t)(end - cursor)/4;
+	if(0 == max_fields)
+		return;
+
+	uint16_t (*fields)[2] = malloc(max_fields*sizeof(fields[0]));
+	if(NULL == fields) {
+		rdlog(LOG_ERR,"Can't allocate netflow template fields "
+			"(out of memory?)");
+		return;
+	}
+
+	while(end - cursor >= 4) {
+		const uint16_t template_id = read_u16(cursor);
+		const uint16_t fields_count = read_u16(cursor + 2);
+		size_t i;
+		cursor += 4;
+
+		if(template_id < NF_MIN_DATA_SET_ID
+		                   || fields_count > (size_t)(end - cursor)/4) {
+			ATOMIC_INC(priv->counters.malformed);
+			goto done;
+		}
+
+		if(0 == fields_count) {
+			nf_cache_remove(priv,packet,template_id);
+			continue;
+		}
+
+		for(i=0;i<fields_count;++i) {
+			if(end - cursor < 4) {
+				ATOMIC_INC(priv->counters.malformed);
+				goto done;
+			}
+			fields[i][0] = read_u16(cursor);
+			fields[i][1] = read_u16(cursor + 2);
+			cursor += 4;
+
+			if(fields[i][0] & NF_ENTERPRISE_BIT) {
+				/* Only in IPFIX. Skip enterprise number. */
+				if(packet->version != 10 || end - cursor < 4) {
+					ATOMIC_INC(priv->counters.malformed);
+					goto done;
+				}
+				fields[i][0] = 0;
+				cursor += 4;
+			}
+		}
+
+		struct nf_template *template = nf_template_compile(fields,fields_count);
+		if(NULL == template)
+			continue;
+
+		if(0 == template->record_min_length) {
+			ATOMIC_INC(priv->counters.malformed);
+			free(template);
+			continue;
+		}
+
+		ATOMIC_INC(priv->counters.templates_received);
+		nf_cache_put(priv,packet,template_id,template);
+	}
+
+done:
+	free(fields);
+}
+
+static void nf_render_prefix(struct nf_packet *packet) {
+	char *out = packet->prefix;
+
+	out += sprintf(out,"{\"type\":\"%s\",\"sensor_ip\":\"",
+		5 == packet->version ? "netflowv5" :
+		9 == packet->version ? "netflowv9" : "ipfix");
+	if(IN6_IS_ADDR_V4MAPPED(&packet->exporter)) {
+		out = render_ipv4(out,&packet->exporter.s6_addr[12]);
+	} else {
+		inet_ntop(AF_INET6,&packet->exporter,out,INET6_ADDRSTRLEN);
+		out += strlen(out);
+	}
+	out += sprintf(out,"\",\"timestamp\":");
+	out = render_uint(out,packet->unix_secs);
+	packet->prefix_len = (size_t)(out - packet->prefix);
+}
+
+static void nf_decode_v5(struct netflow_private *priv,struct nf_packet *packet,
+                                 const uint8_t *buffer,size_t buf_size) {
+	if(buf_size < NF_V5_HEADER_LENGTH) {
+		ATOMIC_INC(priv->counters.malformed);
+		return;
+	}
+
+	const size_t count = read_u16(&buffer[2]);
+	packet->sys_uptime = read_u32(&buffer[4]);
+	packet->unix_secs = read_u32(&buffer[8]);
+	nf_render_prefix(packet);
+
+	if(NF_V5_HEADER_LENGTH + count*NF_V5_RECORD_LENGTH > buf_size)
+		ATOMIC_INC(priv->counters.malformed);
+
+	nf_decode_records(priv,priv->v5_template,packet,
+		buffer + NF_V5_HEADER_LENGTH,buffer + buf_size,count);
+}
+
+/// v9 and IPFIX
+static void nf_decode_sets(struct netflow_private *priv,struct nf_packet *packet,
+                                    const uint8_t *buffer,size_t buf_size) {
+	const size_t header_length = 9 == packet->version ?
+		NF_V9_HEADER_LENGTH : NF_IPFIX_HEADER_LENGTH;
+	const uint16_t template_set_id = 9 == packet->version ?
+		NF_V9_TEMPLATE_SET_ID : NF_IPFIX_TEMPLATE_SET_ID;
+
+	if(buf_size < header_length) {
+		ATOMIC_INC(priv->counters.malformed);
+		return;
+	}
+
+	if(9 == packet->version) {
+		packet->sys_uptime = read_u32(&buffer[4]);
+		packet->unix_secs = read_u32(&buffer[8]);
+		packet->domain = read_u32(&buffer[16]);
+	} else {
+		/* IPFIX message length can be smaller than datagram */
+		const size_t length = read_u16(&buffer[2]);
+		if(length < buf_size)
+			buf_size = length;
+		packet->unix_secs = read_u32(&buffer[4]);
+		packet->domain = read_u32(&buffer[12]);
+	}
+	nf_render_prefix(packet);
+
+	const uint8_t *cursor = buffer + header_length;
+	const uint8_t *end = buffer + buf_size;
+	while(end - cursor >= NF_SET_HEADER_LENGTH) {
+		const uint16_t set_id = read_u16(cursor);
+		const uint16_t set_length = read_u16(cursor + 2);
+		if(set_length < NF_SET_HEADER_LENGTH
+		                       || set_length > (size_t)(end - cursor)) {
+			ATOMIC_INC(priv->counters.malformed);
+			return;
+		}
+
+		const uint8_t *set = cursor + NF_SET_HEADER_LENGTH;
+		const uint8_t *set_end = cursor + set_length;
+		if(set_id == template_set_id)
+			nf_decode_template_set(priv,packet,set,set_end);
+		else if(set_id >= NF_MIN_DATA_SET_ID)
+			nf_decode_data_set(priv,packet,set_id,set,set_end);
+		/* else options template, skipped */
+
+		cursor = set_end;
+	}
+}
+
+void netflow_decode(char *buffer,size_t buf_size,const struct msg_meta *meta,
+                                                                  void *opaque) {
+	struct netflow_private *priv = opaque;
+	const uint8_t *packet_buf = (const uint8_t *)buffer;
+	struct nf_packet packet;
+
+#ifdef NETFLOW_PRIVATE_MAGIC
+	assert(NETFLOW_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.packets);
+
+	memset(&packet,0,sizeof(packet));
+	packet.meta = meta;
+	if(AF_INET6 == meta->client_addr6.sin6_family) {
+		packet.exporter = meta->client_addr6.sin6_addr;
+	} else {
+		/* IPv4-mapped, 0.0.0.0 if sender is not known */
+		packet.exporter.s6_addr[10] = packet.exporter.s6_addr[11] = 0xff;
+		if(AF_INET == meta->client_addr.sin_family)
+			memcpy(&packet.exporter.s6_addr[12],
+				&meta->client_addr.sin_addr,4);
+	}
+	if(buf_size >= 2)
+		packet.version = read_u16(packet_buf);
+
+	switch(packet.version) {
+	case 5:
+		nf_decode_v5(priv,&packet,packet_buf,buf_size);
+		break;
+	case 9:
+	case 10:
+		nf_decode_sets(priv,&packet,packet_buf,buf_size);
+		break;
+	default:
+		ATOMIC_INC(priv->counters.unknown_version);
+		break;
+	};
+
+	free(buffer);
+}
+
+int netflow_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	json_int_t max_templates = NETFLOW_DEFAULT_MAX_TEMPLATES;
+	json_error_t jerr;
+	size_t i;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?I}",
+		CONFIG_NETFLOW_MAX_TEMPLATES_KEY,&max_templates);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse netflow decoder config: %s",
+			jerr.text);
+		return -1;
+	}
+
+	struct netflow_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate netflow private (out of memory?)");
+		return -1;
+	}
+
+#ifdef NETFLOW_PRIVATE_MAGIC
+	priv->magic = NETFLOW_PRIVATE_MAGIC;
+#endif
+
+	priv->v5_template = nf_v5_template();
+	if(NULL == priv->v5_template) {
+		snprintf(err,errsize,"Can't allocate netflow v5 template");
+		free(priv);
+		return -1;
+	}
+
+	priv->cache.max = max_templates > 0 ? (size_t)max_templates : 0;
+	for(i=0;i<NF_CACHE_LOCKS;++i)
+		pthread_rwlock_init(&priv->cache.locks[i],NULL);
+
+	*_opaque = priv;
+	return 0;
+}
+
+int netflow_opaque_destructor(void *opaque) {
+	struct netflow_private *priv = opaque;
+#ifdef NETFLOW_PRIVATE_MAGIC
+	assert(NETFLOW_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	nf_cache_done(&priv->cache);
+	free(priv->v5_template);
+	free(priv);
+	return 0;
+}
+
+void netflow_opaque_stats(void *opaque,json_t *stats) {
+	struct netflow_private *priv = opaque;
+#ifdef NETFLOW_PRIVATE_MAGIC
+	assert(NETFLOW_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_t *netflow_stats = json_object();
+	if(NULL == netflow_stats) {
+		rdlog(LOG_ERR,"Can't allocate netflow stats (out of memory?)");
+		return;
+	}
+
+	json_object_set_new(netflow_stats,"packets",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.packets)));
+	json_object_set_new(netflow_stats,"records",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.records)));
+	json_object_set_new(netflow_stats,"templates",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->cache.count)));
+	json_object_set_new(netflow_stats,"templates_received",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.templates_received)));
+	json_object_set_new(netflow_stats,"missing_template",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.missing_template)));
+	json_object_set_new(netflow_stats,"malformed",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.malformed)));
+	json_object_set_new(netflow_stats,"unknown_version",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.unknown_version)));
+
+	json_object_set_new(stats,"netflow",netflow_stats);
+}
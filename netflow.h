@@ -0,0 +1,42 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "global_config.h"
+
+/*
+ * NetFlow v5, v9 and IPFIX decoder:
+ *
+ *   {"proto":"udp","port":2055,"decode_as":"netflow"}
+ *
+ * Every flow record is sent as a JSON message. Templates are cached per
+ * exporter address and observation domain (v9 source id). Options templates,
+ * enterprise elements and variable length elements are skipped.
+ *
+ * Listener stages see the binary packets, not the decoded records.
+ */
+
+#define NETFLOW_DECODE_AS "netflow"
+
+int netflow_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+int netflow_opaque_destructor(void *opaque);
+void netflow_opaque_stats(void *opaque,struct json_t *stats);
+void netflow_decode(char *buffer,size_t buf_size,const struct msg_meta *meta,
+                                                                  void *opaque);
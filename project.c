@@ -0,0 +1,252 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "project.h"
+#include "json_scan.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_PROJECT_ALLOW_KEY "allow"
+#define CONFIG_PROJECT_DENY_KEY "deny"
+
+#define PROJECT_PRIVATE_MAGIC 0x960EC7960EC7L
+
+struct project_key{
+	char *key;
+	size_t len;
+};
+
+struct project_private{
+#ifdef PROJECT_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	/// If 1, keys are the allowed ones. If 0, the denied ones.
+	int allow;
+	size_t keys_count;
+	struct project_key *keys;
+
+	struct {
+		uint64_t messages;
+		uint64_t malformed;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+	} counters;
+};
+
+static void free_project_private(struct project_private *priv) {
+	size_t i;
+	for(i=0;i<priv->keys_count;++i)
+		free(priv->keys[i].key);
+	free(priv->keys);
+	free(priv);
+}
+
+int project_stage_opaque_creator(json_t *config,void **_opaque,
+                                               char *err,size_t errsize) {
+	json_t *allow = NULL,*deny = NULL,*value = NULL;
+	json_error_t jerr;
+	size_t i;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?o,s?o}",
+		CONFIG_PROJECT_ALLOW_KEY,&allow,CONFIG_PROJECT_DENY_KEY,&deny);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse project stage: %s",jerr.text);
+		return -1;
+	}
+
+	if((NULL == allow) == (NULL == deny)) {
+		snprintf(err,errsize,"project stage needs one of "
+			CONFIG_PROJECT_ALLOW_KEY " or " CONFIG_PROJECT_DENY_KEY);
+		return -1;
+	}
+
+	json_t *keys = allow ? allow : deny;
+	if(!json_is_array(keys)) {
+		snprintf(err,errsize,"project stage keys must be an array");
+		return -1;
+	}
+
+	struct project_private *priv = calloc(1,sizeof(*priv));
+	if(priv)
+		priv->keys = calloc(json_array_size(keys)+1,sizeof(priv->keys[0]));
+	if(NULL == priv || NULL == priv->keys) {
+		snprintf(err,errsize,"Can't allocate project private (out of memory?)");
+		free(priv);
+		return -1;
+	}
+
+#ifdef PROJECT_PRIVATE_MAGIC
+	priv->magic = PROJECT_PRIVATE_MAGIC;
+#endif
+	priv->allow = NULL != allow;
+
+	json_array_foreach(keys,i,value) {
+		const char *key = json_string_value(value);
+		if(NULL == key) {
+			snprintf(err,errsize,"project stage keys must be strings");
+			free_project_private(priv);
+			return -1;
+		}
+
+		priv->keys[i].key = strdup(key);
+		if(NULL == priv->keys[i].key) {
+			snprintf(err,errsize,"Can't strdup project key (out of memory?)");
+			free_project_private(priv);
+			return -1;
+		}
+		priv->keys[i].len = strlen(key);
+		priv->keys_count++;
+	}
+
+	*_opaque = priv;
+	return 0;
+}
+
+void project_stage_opaque_destructor(void *opaque) {
+	struct project_private *priv = opaque;
+#ifdef PROJECT_PRIVATE_MAGIC
+	assert(PROJECT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	free_project_private(priv);
+}
+
+void project_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct project_private *priv = opaque;
+#ifdef PROJECT_PRIVATE_MAGIC
+	assert(PROJECT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"malformed",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.malformed)));
+	json_object_set_new(stats,"bytes_in",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_in)));
+	json_object_set_new(stats,"bytes_out",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_out)));
+}
+
+static int keep_key(const struct project_private *priv,const char *key,
+                                                          size_t key_len) {
+	size_t i;
+	for(i=0;i<priv->keys_count;++i) {
+		if(key_len == priv->keys[i].len
+		                  && 0 == memcmp(key,priv->keys[i].key,key_len))
+			return priv->allow;
+	}
+	return !priv->allow;
+}
+
+/** Scan object members, and copy the kept ones to out
+    @param cursor Pointer after the object opening brace
+    @param out Output cursor, or NULL to only check object members
+    @return Pointer to the object closing brace, or NULL if malformed
+    */
+static const char *project_members(const struct project_private *priv,
+                                   const char *cursor,const char *end,
+                                   char **out) {
+	int first_member = 1,kept_members = 0;
+
+	while(1) {
+		cursor = json_scan_spaces(cursor,end);
+		if(cursor < end && *cursor == '}' && first_member)
+			return cursor; /* Empty object */
+
+		if(cursor == end || *cursor != '"')
+			return NULL;
+
+		const char *member = cursor;
+		const char *key = cursor + 1;
+		const char *key_end = json_scan_string(key,end);
+		if(NULL == key_end)
+			return NULL;
+
+		cursor = json_scan_spaces(key_end + 1,end);
+		if(cursor == end || *cursor != ':')
+			return NULL;
+
+		cursor = json_scan_spaces(cursor + 1,end);
+		const char *member_end = json_scan_value(cursor,end);
+		if(NULL == member_end || member_end == cursor)
+			return NULL;
+
+		if(out && keep_key(priv,key,(size_t)(key_end - key))) {
+			if(kept_members++)
+				*(*out)++ = ',';
+			memmove(*out,member,(size_t)(member_end - member));
+			*out += member_end - member;
+		}
+
+		first_member = 0;
+		cursor = json_scan_spaces(member_end,end);
+		if(cursor < end && *cursor == ',') {
+			cursor++;
+		} else if(cursor < end && *cursor == '}') {
+			return cursor;
+		} else {
+			return NULL;
+		}
+	}
+}
+
+/** Project buffer JSON object in place.
+    @return New size. Malformed messages are not modified.
+    */
+static size_t project_buffer(struct project_private *priv,char *buffer,
+                                                           size_t buf_size) {
+	const char *end = buffer + buf_size;
+	const char *cursor = json_scan_spaces(buffer,end);
+
+	/* Kept members overwrite skipped ones, so the whole object is checked
+	   before */
+	if(cursor == end || *cursor != '{'
+	                 || NULL == project_members(priv,cursor + 1,end,NULL)) {
+		ATOMIC_INC(priv->counters.malformed);
+		return buf_size;
+	}
+
+	char *out = buffer + (++cursor - buffer);
+	project_members(priv,cursor,end,&out);
+	*out++ = '}';
+	return (size_t)(out - buffer);
+}
+
+void project_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta) {
+	struct project_private *priv = stage->opaque;
+#ifdef PROJECT_PRIVATE_MAGIC
+	assert(PROJECT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const size_t new_size = project_buffer(priv,buffer,buf_size);
+
+	ATOMIC_INC(priv->counters.messages);
+	ATOMIC_ADD(priv->counters.bytes_in,buf_size);
+	ATOMIC_ADD(priv->counters.bytes_out,new_size);
+
+	stage_forward(stage,buffer,new_size,meta);
+}
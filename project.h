@@ -0,0 +1,44 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * Field projection stage. Keeps only allowed top level keys of a JSON object,
+ * or removes denied ones:
+ *
+ *   {"type":"project","allow":["timestamp","src","dst","bytes"]}
+ *   {"type":"project","deny":["raw_payload"]}
+ *
+ * Kept members are moved in place in the same buffer, so no allocation is
+ * needed. Object members are checked before moving any of them, so
+ * malformed messages are forwarded unchanged. Keys are compared as they
+ * appear in the message, so keys with escape sequences have to be written
+ * the same way in config.
+ */
+
+#define PROJECT_STAGE_TYPE "project"
+
+int project_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void project_stage_opaque_destructor(void *opaque);
+void project_stage_opaque_stats(void *opaque,struct json_t *stats);
+void project_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta);
@@ -0,0 +1,496 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "reassemble.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#define CONFIG_REASSEMBLE_TIMEOUT_KEY "timeout_ms"
+#define CONFIG_REASSEMBLE_MAX_MESSAGES_KEY "max_messages"
+#define CONFIG_REASSEMBLE_MAX_BYTES_KEY "max_bytes"
+
+#define REASSEMBLE_DEFAULT_TIMEOUT_MS 5000
+#define REASSEMBLE_DEFAULT_MAX_MESSAGES 1024
+#define REASSEMBLE_DEFAULT_MAX_BYTES (8*1024*1024)
+
+/// Independent tables, to reduce lock contention
+#define REASSEMBLE_SHARDS 16
+
+/// Timer wheel slots. Timeout is split in WHEEL_TIMEOUT_TICKS ticks, so a
+/// message always expires the first time its slot is visited.
+#define WHEEL_SLOTS 256
+#define WHEEL_TIMEOUT_TICKS 128
+
+#define REASSEMBLE_PRIVATE_MAGIC 0x4EA55E4B4EA55E4BL
+
+struct chunk{
+	char *data;
+	size_t len;
+};
+
+struct pending_message{
+	/* Key */
+	uint32_t addr;
+	uint16_t port;
+	uint64_t id;
+
+	uint8_t chunks_count;
+	uint8_t received;
+	size_t bytes;
+	uint64_t deadline_tick;
+	/// First chunk meta
+	struct msg_meta meta;
+	/// Hash bucket, or free list if message is not in use
+	LIST_ENTRY(pending_message) entry;
+	LIST_ENTRY(pending_message) wheel_entry;
+	struct chunk chunks[GELF_MAX_CHUNKS];
+};
+
+LIST_HEAD(pending_message_list,pending_message);
+
+struct reassemble_shard{
+	pthread_mutex_t mutex;
+	/// Preallocated messages
+	struct pending_message *pool;
+	struct pending_message_list free_list;
+	struct pending_message_list *buckets;
+	size_t buckets_mask;
+	struct pending_message_list wheel[WHEEL_SLOTS];
+	uint64_t current_tick;
+	/// Pending messages
+	size_t in_use;
+};
+
+struct reassemble_private{
+#ifdef REASSEMBLE_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	uint64_t tick_ms;
+	uint64_t timeout_ticks;
+	size_t shard_capacity;
+	/// Buffered chunks bytes of all shards
+	size_t bytes;
+	size_t max_bytes;
+	struct reassemble_shard shards[REASSEMBLE_SHARDS];
+	struct {
+		uint64_t chunks;
+		uint64_t messages;
+		uint64_t passthrough;
+		uint64_t expired_messages;
+		uint64_t expired_chunks;
+		uint64_t dropped_chunks;
+		uint64_t duplicated_chunks;
+		uint64_t malformed;
+	} counters;
+};
+
+static uint64_t message_hash(uint32_t addr,uint16_t port,uint64_t id) {
+	uint64_t hash = id ^ ((uint64_t)addr << 16 | port);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/** Account chunk bytes in the limit shared by all shards.
+    @return 0 if they fit
+    */
+static int reserve_bytes(struct reassemble_private *priv,size_t bytes) {
+	if(ATOMIC_ADD(priv->bytes,bytes) <= priv->max_bytes)
+		return 0;
+	__atomic_sub_fetch(&priv->bytes,bytes,__ATOMIC_RELAXED);
+	return -1;
+}
+
+/*
+ * Shard. All functions need shard mutex.
+ */
+
+static void free_chunks(struct pending_message *message) {
+	size_t i;
+	for(i=0;i<message->chunks_count;++i)
+		free(message->chunks[i].data);
+}
+
+/// Return message to free list. Chunks are not freed.
+static void release_message(struct reassemble_private *priv,
+                            struct reassemble_shard *shard,
+                            struct pending_message *message) {
+	LIST_REMOVE(message,entry);
+	LIST_REMOVE(message,wheel_entry);
+	__atomic_sub_fetch(&priv->bytes,message->bytes,__ATOMIC_RELAXED);
+	shard->in_use--;
+	LIST_INSERT_HEAD(&shard->free_list,message,entry);
+}
+
+static void expire_slot(struct reassemble_private *priv,
+                        struct reassemble_shard *shard,
+                        struct pending_message_list *slot) {
+	struct pending_message *message = LIST_FIRST(slot);
+	while(message) {
+		struct pending_message *next = LIST_NEXT(message,wheel_entry);
+		if(message->deadline_tick <= shard->current_tick) {
+			ATOMIC_INC(priv->counters.expired_messages);
+			ATOMIC_ADD(priv->counters.expired_chunks,message->received);
+			free_chunks(message);
+			release_message(priv,shard,message);
+		}
+		message = next;
+	}
+}
+
+/// Advance timer wheel to now, expiring messages
+static void wheel_advance(struct reassemble_private *priv,
+                          struct reassemble_shard *shard,uint64_t now_tick) {
+	if(now_tick - shard->current_tick > WHEEL_SLOTS) {
+		/* Idle for a full turn: visit every slot once */
+		size_t i;
+		shard->current_tick = now_tick;
+		for(i=0;i<WHEEL_SLOTS;++i)
+			expire_slot(priv,shard,&shard->wheel[i]);
+		return;
+	}
+
+	while(shard->current_tick < now_tick) {
+		shard->current_tick++;
+		expire_slot(priv,shard,
+			&shard->wheel[shard->current_tick % WHEEL_SLOTS]);
+	}
+}
+
+static struct pending_message *lookup_message(struct reassemble_shard *shard,
+                                              uint64_t hash,uint32_t addr,
+                                              uint16_t port,uint64_t id) {
+	struct pending_message *message = NULL;
+	LIST_FOREACH(message,&shard->buckets[hash & shard->buckets_mask],entry) {
+		if(message->id == id && message->addr == addr && message->port == port)
+			return message;
+	}
+	return NULL;
+}
+
+static struct pending_message *new_message(struct reassemble_private *priv,
+                     struct reassemble_shard *shard,uint64_t hash,
+                     uint32_t addr,uint16_t port,uint64_t id,
+                     uint8_t chunks_count,const struct msg_meta *meta) {
+	struct pending_message *message = LIST_FIRST(&shard->free_list);
+	if(NULL == message)
+		return NULL;
+
+	LIST_REMOVE(message,entry);
+	memset(message,0,sizeof(*message));
+	message->addr = addr;
+	message->port = port;
+	message->id = id;
+	message->chunks_count = chunks_count;
+	message->deadline_tick = shard->current_tick + priv->timeout_ticks;
+	message->meta = *meta;
+	message->meta.headers_count = 0;
+	message->meta.key = NULL;
+	message->meta.key_size = 0;
+	/* Record is acked once handed over */
+	message->meta.ack = NULL;
+
+	LIST_INSERT_HEAD(&shard->buckets[hash & shard->buckets_mask],message,entry);
+	LIST_INSERT_HEAD(&shard->wheel[message->deadline_tick % WHEEL_SLOTS],
+		message,wheel_entry);
+	shard->in_use++;
+	return message;
+}
+
+static int reassemble_shard_init(struct reassemble_shard *shard,
+                                 size_t capacity) {
+	size_t i,buckets = 1;
+
+	while(buckets < 2*capacity)
+		buckets *= 2;
+
+	shard->pool = calloc(capacity,sizeof(shard->pool[0]));
+	shard->buckets = calloc(buckets,sizeof(shard->buckets[0]));
+	if(NULL == shard->pool || NULL == shard->buckets)
+		return -1;
+
+	shard->buckets_mask = buckets - 1;
+	for(i=0;i<buckets;++i)
+		LIST_INIT(&shard->buckets[i]);
+	for(i=0;i<WHEEL_SLOTS;++i)
+		LIST_INIT(&shard->wheel[i]);
+	LIST_INIT(&shard->free_list);
+	for(i=0;i<capacity;++i)
+		LIST_INSERT_HEAD(&shard->free_list,&shard->pool[i],entry);
+
+	pthread_mutex_init(&shard->mutex,NULL);
+	return 0;
+}
+
+static void reassemble_shard_done(struct reassemble_shard *shard) {
+	size_t i;
+
+	if(shard->buckets) {
+		for(i=0;i<=shard->buckets_mask;++i) {
+			struct pending_message *message = NULL;
+			LIST_FOREACH(message,&shard->buckets[i],entry)
+				free_chunks(message);
+		}
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	free(shard->buckets);
+	free(shard->pool);
+}
+
+/*
+ * Stage
+ */
+
+int reassemble_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	json_int_t timeout_ms = REASSEMBLE_DEFAULT_TIMEOUT_MS;
+	json_int_t max_messages = REASSEMBLE_DEFAULT_MAX_MESSAGES;
+	json_int_t max_bytes = REASSEMBLE_DEFAULT_MAX_BYTES;
+	json_error_t jerr;
+	size_t i;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?I,s?I,s?I}",
+		CONFIG_REASSEMBLE_TIMEOUT_KEY,&timeout_ms,
+		CONFIG_REASSEMBLE_MAX_MESSAGES_KEY,&max_messages,
+		CONFIG_REASSEMBLE_MAX_BYTES_KEY,&max_bytes);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse reassemble stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(timeout_ms <= 0 || max_messages <= 0 || max_bytes <= 0) {
+		snprintf(err,errsize,"Reassemble timeout_ms, max_messages and "
+			"max_bytes have to be greater than 0");
+		return -1;
+	}
+
+	struct reassemble_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,
+			"Can't allocate reassemble private (out of memory?)");
+		return -1;
+	}
+
+#ifdef REASSEMBLE_PRIVATE_MAGIC
+	priv->magic = REASSEMBLE_PRIVATE_MAGIC;
+#endif
+
+	priv->tick_ms = (uint64_t)timeout_ms / WHEEL_TIMEOUT_TICKS;
+	if(0 == priv->tick_ms)
+		priv->tick_ms = 1;
+	priv->timeout_ticks = ((uint64_t)timeout_ms + priv->tick_ms - 1)
+		/ priv->tick_ms;
+
+	priv->max_bytes = (size_t)max_bytes;
+	priv->shard_capacity = ((size_t)max_messages + REASSEMBLE_SHARDS - 1)
+		/ REASSEMBLE_SHARDS;
+	const uint64_t now_tick = monotonic_ms() / priv->tick_ms;
+	for(i=0;i<REASSEMBLE_SHARDS;++i) {
+		priv->shards[i].current_tick = now_tick;
+		if(0 != reassemble_shard_init(&priv->shards[i],priv->shard_capacity)) {
+			snprintf(err,errsize,
+				"Can't allocate reassemble table (out of memory?)");
+			reassemble_stage_opaque_destructor(priv);
+			return -1;
+		}
+	}
+
+	*_opaque = priv;
+	return 0;
+}
+
+void reassemble_stage_opaque_destructor(void *opaque) {
+	struct reassemble_private *priv = opaque;
+	size_t i;
+#ifdef REASSEMBLE_PRIVATE_MAGIC
+	assert(REASSEMBLE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	for(i=0;i<REASSEMBLE_SHARDS;++i)
+		reassemble_shard_done(&priv->shards[i]);
+	free(priv);
+}
+
+void reassemble_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct reassemble_private *priv = opaque;
+	size_t i,incomplete = 0;
+#ifdef REASSEMBLE_PRIVATE_MAGIC
+	assert(REASSEMBLE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const uint64_t now_tick = monotonic_ms() / priv->tick_ms;
+	for(i=0;i<REASSEMBLE_SHARDS;++i) {
+		pthread_mutex_lock(&priv->shards[i].mutex);
+		wheel_advance(priv,&priv->shards[i],now_tick);
+		incomplete += priv->shards[i].in_use;
+		pthread_mutex_unlock(&priv->shards[i].mutex);
+	}
+
+	json_object_set_new(stats,"chunks",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.chunks)));
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"passthrough",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.passthrough)));
+	json_object_set_new(stats,"incomplete",json_integer((json_int_t)incomplete));
+	json_object_set_new(stats,"buffered_bytes",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->bytes)));
+	json_object_set_new(stats,"expired_messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.expired_messages)));
+	json_object_set_new(stats,"expired_chunks",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.expired_chunks)));
+	json_object_set_new(stats,"dropped_chunks",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.dropped_chunks)));
+	json_object_set_new(stats,"duplicated_chunks",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.duplicated_chunks)));
+	json_object_set_new(stats,"malformed",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.malformed)));
+}
+
+/// Join chunks in a new buffer, and free them
+static char *join_chunks(struct chunk *chunks,size_t chunks_count,
+                                                           size_t bytes) {
+	size_t i;
+
+	char *message = malloc(bytes);
+	if(NULL == message)
+		rdlog(LOG_ERR,"Can't allocate reassembled message (out of memory?)");
+
+	char *cursor = message;
+	for(i=0;i<chunks_count;++i) {
+		if(message) {
+			memcpy(cursor,chunks[i].data,chunks[i].len);
+			cursor += chunks[i].len;
+		}
+		free(chunks[i].data);
+	}
+
+	return message;
+}
+
+void reassemble_stage_process(const struct stage *stage,char *buffer,
+                              size_t buf_size,const struct msg_meta *meta) {
+	struct reassemble_private *priv = stage->opaque;
+	struct chunk complete_chunks[GELF_MAX_CHUNKS];
+	struct msg_meta complete_meta;
+	size_t complete_count = 0,complete_bytes = 0;
+	uint64_t id = 0;
+
+#ifdef REASSEMBLE_PRIVATE_MAGIC
+	assert(REASSEMBLE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	const uint8_t *header = (const uint8_t *)buffer;
+	if(buf_size < 2 || GELF_MAGIC_0 != header[0] || GELF_MAGIC_1 != header[1]) {
+		ATOMIC_INC(priv->counters.passthrough);
+		stage_forward(stage,buffer,buf_size,meta);
+		return;
+	}
+
+	ATOMIC_INC(priv->counters.chunks);
+
+	const uint8_t seq = buf_size >= GELF_HEADER_LENGTH ? header[10] : 0;
+	const uint8_t chunks_count = buf_size >= GELF_HEADER_LENGTH ? header[11] : 0;
+	if(0 == chunks_count || chunks_count > GELF_MAX_CHUNKS
+	                                              || seq >= chunks_count) {
+		ATOMIC_INC(priv->counters.malformed);
+		free(buffer);
+		return;
+	}
+
+	const size_t payload_len = buf_size - GELF_HEADER_LENGTH;
+	if(1 == chunks_count) {
+		ATOMIC_INC(priv->counters.messages);
+		memmove(buffer,buffer + GELF_HEADER_LENGTH,payload_len);
+		stage_forward(stage,buffer,payload_len,meta);
+		return;
+	}
+
+	memcpy(&id,&header[2],sizeof(id));
+	const uint32_t addr = meta->client_addr.sin_addr.s_addr;
+	const uint16_t port = meta->client_addr.sin_port;
+	const uint64_t hash = message_hash(addr,port,id);
+	struct reassemble_shard *shard = &priv->shards[hash % REASSEMBLE_SHARDS];
+
+	/* Copy payload out of the lock */
+	char *payload = malloc(payload_len ? payload_len : 1);
+	if(NULL == payload) {
+		rdlog(LOG_ERR,"Can't allocate chunk (out of memory?)");
+		ATOMIC_INC(priv->counters.dropped_chunks);
+		free(buffer);
+		return;
+	}
+	memcpy(payload,buffer + GELF_HEADER_LENGTH,payload_len);
+	free(buffer);
+
+	pthread_mutex_lock(&shard->mutex);
+	wheel_advance(priv,shard,monotonic_ms() / priv->tick_ms);
+
+	struct pending_message *message = lookup_message(shard,hash,addr,port,id);
+	if(message && message->chunks_count != chunks_count) {
+		ATOMIC_INC(priv->counters.malformed);
+	} else if(message && message->chunks[seq].data) {
+		ATOMIC_INC(priv->counters.duplicated_chunks);
+	} else if(0 != reserve_bytes(priv,payload_len)) {
+		ATOMIC_INC(priv->counters.dropped_chunks);
+	} else if(NULL == message && NULL == (message = new_message(priv,shard,
+	                              hash,addr,port,id,chunks_count,meta))) {
+		/* Table full */
+		__atomic_sub_fetch(&priv->bytes,payload_len,__ATOMIC_RELAXED);
+		ATOMIC_INC(priv->counters.dropped_chunks);
+	} else {
+		message->chunks[seq].data = payload;
+		message->chunks[seq].len = payload_len;
+		message->received++;
+		message->bytes += payload_len;
+		payload = NULL;
+
+		if(message->received == message->chunks_count) {
+			complete_count = message->chunks_count;
+			complete_bytes = message->bytes;
+			complete_meta = message->meta;
+			memcpy(complete_chunks,message->chunks,
+				complete_count*sizeof(complete_chunks[0]));
+			release_message(priv,shard,message);
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	free(payload);
+
+	if(complete_count) {
+		char *complete = join_chunks(complete_chunks,complete_count,
+			complete_bytes);
+		if(complete) {
+			ATOMIC_INC(priv->counters.messages);
+			stage_forward(stage,complete,complete_bytes,&complete_meta);
+		}
+	}
+}
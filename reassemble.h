@@ -0,0 +1,53 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * GELF style chunked messages reassembly. Chunks start with magic bytes
+ * 0x1e 0x0f, an 8 bytes message id, the chunk sequence number and the number
+ * of chunks (up to 128):
+ *
+ *   {"type":"reassemble","timeout_ms":5000,"max_messages":1024,
+ *    "max_bytes":8388608}
+ *
+ * Only complete messages are forwarded. Messages are identified by sender
+ * address and message id, and they are discarded if they are not complete
+ * after timeout_ms. At most max_messages incomplete messages and max_bytes of
+ * their chunks are kept; chunks of new messages are dropped over that.
+ * Datagrams without magic bytes are forwarded as they are.
+ *
+ * This stage needs to be the first one, since chunks are not JSON.
+ */
+
+#define REASSEMBLE_STAGE_TYPE "reassemble"
+
+/// Chunk header: magic bytes, message id, sequence number, number of chunks
+#define GELF_MAGIC_0 0x1e
+#define GELF_MAGIC_1 0x0f
+#define GELF_HEADER_LENGTH 12
+#define GELF_MAX_CHUNKS 128
+
+int reassemble_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void reassemble_stage_opaque_destructor(void *opaque);
+void reassemble_stage_opaque_stats(void *opaque,struct json_t *stats);
+void reassemble_stage_process(const struct stage *stage,char *buffer,
+                              size_t buf_size,const struct msg_meta *meta);
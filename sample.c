@@ -0,0 +1,329 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sample.h"
+#include "kafka.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_SAMPLE_HIGH_WATERMARK_KEY "high_watermark"
+#define CONFIG_SAMPLE_LOW_WATERMARK_KEY "low_watermark"
+#define CONFIG_SAMPLE_INTERVAL_KEY "interval_ms"
+#define CONFIG_SAMPLE_MIN_RATE_KEY "min_rate"
+#define CONFIG_SAMPLE_BUCKETS_KEY "buckets"
+#define CONFIG_SAMPLE_HEADER_KEY "header"
+
+#define SAMPLE_DEFAULT_HIGH_WATERMARK 80000
+#define SAMPLE_DEFAULT_LOW_WATERMARK 40000
+#define SAMPLE_DEFAULT_INTERVAL_MS 1000
+#define SAMPLE_DEFAULT_MIN_RATE 0.01
+#define SAMPLE_DEFAULT_BUCKETS 4096
+#define SAMPLE_DEFAULT_HEADER "sample-rate"
+
+/// Keep threshold meaning "keep every message"
+#define SAMPLE_KEEP_ALL (UINT64_C(1) << 32)
+
+#define SAMPLE_PRIVATE_MAGIC 0x5A5A5A3E5A5A5A3EL
+
+struct sample_bucket{
+	/// Messages in current interval
+	uint64_t count;
+	/// Message is kept if a 32 bits random number is lower than this
+	uint64_t threshold;
+};
+
+struct sample_private{
+#ifdef SAMPLE_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	size_t high_watermark;
+	size_t low_watermark;
+	uint64_t interval_ms;
+	double min_rate;
+	char *header;
+
+	struct sample_bucket *buckets;
+	size_t buckets_mask;
+
+	/// Only one thread updates rates
+	pthread_mutex_t rotate_mutex;
+	uint64_t next_rotation_ms;
+	/// Kept traffic fraction. Protected by rotate_mutex.
+	double rate;
+	/// Last interval counts. Protected by rotate_mutex.
+	uint64_t *counts;
+
+	struct {
+		uint64_t messages;
+		uint64_t sampled;
+		uint64_t dropped;
+		uint64_t dropped_bytes;
+		/// Rate, in millionths
+		uint64_t rate_ppm;
+		uint64_t queue;
+	} counters;
+};
+
+static __thread uint64_t rng_state;
+
+/// xorshift64*
+static uint32_t sample_random() {
+	if(unlikely(0 == rng_state))
+		rng_state = (uint64_t)(uintptr_t)&rng_state ^ monotonic_ms()
+			^ 0x9e3779b97f4a7c15ULL;
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static size_t source_bucket(const struct sample_private *priv,
+                            const struct msg_meta *meta) {
+	uint64_t hash = meta->client_addr.sin_addr.s_addr;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	return (size_t)(hash >> 32) & priv->buckets_mask;
+}
+
+/// Max per bucket messages so the sum of kept messages is budget
+static double fair_share(const uint64_t *counts,size_t n,uint64_t max_count,
+                                                                double budget) {
+	double lo = 0,hi = (double)max_count;
+	size_t i,iter;
+
+	for(iter=0;iter<40;++iter) {
+		const double cap = (lo + hi)/2;
+		double kept = 0;
+		for(i=0;i<n;++i)
+			kept += (double)counts[i] < cap ? (double)counts[i] : cap;
+		if(kept < budget)
+			lo = cap;
+		else
+			hi = cap;
+	}
+
+	return lo;
+}
+
+/// Update kept fraction from producer queue, and bucket rates from counts
+static void sample_rotate(struct sample_private *priv,uint64_t now_ms) {
+	const size_t buckets = priv->buckets_mask + 1;
+	uint64_t total = 0,max_count = 0;
+	size_t i;
+
+	const size_t queue = kafka_outq_len();
+	if(queue > priv->high_watermark) {
+		priv->rate /= 2;
+		if(priv->rate < priv->min_rate)
+			priv->rate = priv->min_rate;
+	} else if(queue < priv->low_watermark && priv->rate < 1) {
+		priv->rate *= 2;
+		if(priv->rate > 1)
+			priv->rate = 1;
+	}
+
+	for(i=0;i<buckets;++i) {
+		priv->counts[i] = __atomic_exchange_n(&priv->buckets[i].count,0,
+			__ATOMIC_RELAXED);
+		total += priv->counts[i];
+		if(priv->counts[i] > max_count)
+			max_count = priv->counts[i];
+	}
+
+	const double cap = priv->rate < 1 ? fair_share(priv->counts,buckets,
+		max_count,priv->rate*(double)total) : (double)max_count;
+	for(i=0;i<buckets;++i) {
+		uint64_t threshold = SAMPLE_KEEP_ALL;
+		if((double)priv->counts[i] > cap) {
+			threshold = (uint64_t)(cap/(double)priv->counts[i]
+				*(double)SAMPLE_KEEP_ALL);
+		}
+		ATOMIC_STORE(priv->buckets[i].threshold,threshold);
+	}
+
+	ATOMIC_STORE(priv->counters.rate_ppm,(uint64_t)(priv->rate*1000000));
+	ATOMIC_STORE(priv->counters.queue,(uint64_t)queue);
+	ATOMIC_STORE(priv->next_rotation_ms,now_ms + priv->interval_ms);
+}
+
+/*
+ * Stage
+ */
+
+static void sample_private_done(struct sample_private *priv) {
+	pthread_mutex_destroy(&priv->rotate_mutex);
+	free(priv->buckets);
+	free(priv->counts);
+	free(priv->header);
+	free(priv);
+}
+
+int sample_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	json_int_t high_watermark = SAMPLE_DEFAULT_HIGH_WATERMARK;
+	json_int_t low_watermark = SAMPLE_DEFAULT_LOW_WATERMARK;
+	json_int_t interval_ms = SAMPLE_DEFAULT_INTERVAL_MS;
+	json_int_t buckets = SAMPLE_DEFAULT_BUCKETS;
+	double min_rate = SAMPLE_DEFAULT_MIN_RATE;
+	const char *header = SAMPLE_DEFAULT_HEADER;
+	json_error_t jerr;
+	size_t i,buckets_count = 1;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?I,s?I,s?I,s?F,s?I,s?s}",
+		CONFIG_SAMPLE_HIGH_WATERMARK_KEY,&high_watermark,
+		CONFIG_SAMPLE_LOW_WATERMARK_KEY,&low_watermark,
+		CONFIG_SAMPLE_INTERVAL_KEY,&interval_ms,
+		CONFIG_SAMPLE_MIN_RATE_KEY,&min_rate,
+		CONFIG_SAMPLE_BUCKETS_KEY,&buckets,
+		CONFIG_SAMPLE_HEADER_KEY,&header);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse sample stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(high_watermark <= 0 || low_watermark < 0
+	        || low_watermark > high_watermark) {
+		snprintf(err,errsize,"Sample high_watermark has to be greater than 0 "
+			"and low_watermark");
+		return -1;
+	}
+
+	if(interval_ms <= 0 || buckets <= 0 || !(min_rate > 0 && min_rate <= 1)) {
+		snprintf(err,errsize,"Sample interval_ms and buckets have to be "
+			"greater than 0, and min_rate in (0,1]");
+		return -1;
+	}
+
+	while(buckets_count < (size_t)buckets)
+		buckets_count *= 2;
+
+	struct sample_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate sample private (out of memory?)");
+		return -1;
+	}
+
+#ifdef SAMPLE_PRIVATE_MAGIC
+	priv->magic = SAMPLE_PRIVATE_MAGIC;
+#endif
+	priv->high_watermark = (size_t)high_watermark;
+	priv->low_watermark = (size_t)low_watermark;
+	priv->interval_ms = (uint64_t)interval_ms;
+	priv->min_rate = min_rate;
+	priv->rate = 1;
+	priv->counters.rate_ppm = 1000000;
+	priv->buckets_mask = buckets_count - 1;
+	priv->next_rotation_ms = monotonic_ms() + priv->interval_ms;
+	pthread_mutex_init(&priv->rotate_mutex,NULL);
+
+	priv->header = strdup(header);
+	priv->buckets = calloc(buckets_count,sizeof(priv->buckets[0]));
+	priv->counts = calloc(buckets_count,sizeof(priv->counts[0]));
+	if(NULL == priv->header || NULL == priv->buckets || NULL == priv->counts) {
+		snprintf(err,errsize,"Can't allocate sample buckets (out of memory?)");
+		sample_private_done(priv);
+		return -1;
+	}
+
+	for(i=0;i<buckets_count;++i)
+		priv->buckets[i].threshold = SAMPLE_KEEP_ALL;
+
+	*_opaque = priv;
+	return 0;
+}
+
+void sample_stage_opaque_destructor(void *opaque) {
+	struct sample_private *priv = opaque;
+#ifdef SAMPLE_PRIVATE_MAGIC
+	assert(SAMPLE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	sample_private_done(priv);
+}
+
+void sample_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct sample_private *priv = opaque;
+#ifdef SAMPLE_PRIVATE_MAGIC
+	assert(SAMPLE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"sampled",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.sampled)));
+	json_object_set_new(stats,"dropped",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.dropped)));
+	json_object_set_new(stats,"dropped_bytes",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.dropped_bytes)));
+	json_object_set_new(stats,"queue",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.queue)));
+	json_object_set_new(stats,"rate",
+		json_real((double)ATOMIC_LOAD(priv->counters.rate_ppm)/1000000));
+}
+
+void sample_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta) {
+	struct sample_private *priv = stage->opaque;
+	struct msg_meta sampled_meta;
+	char rate[32];
+
+#ifdef SAMPLE_PRIVATE_MAGIC
+	assert(SAMPLE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.messages);
+
+	const uint64_t now_ms = monotonic_ms();
+	if(now_ms >= ATOMIC_LOAD(priv->next_rotation_ms)
+	        && 0 == pthread_mutex_trylock(&priv->rotate_mutex)) {
+		if(now_ms >= ATOMIC_LOAD(priv->next_rotation_ms))
+			sample_rotate(priv,now_ms);
+		pthread_mutex_unlock(&priv->rotate_mutex);
+	}
+
+	struct sample_bucket *bucket = &priv->buckets[source_bucket(priv,meta)];
+	ATOMIC_INC(bucket->count);
+	const uint64_t threshold = ATOMIC_LOAD(bucket->threshold);
+	if(likely(threshold >= SAMPLE_KEEP_ALL)) {
+		stage_forward(stage,buffer,buf_size,meta);
+		return;
+	}
+
+	if(sample_random() >= threshold) {
+		ATOMIC_INC(priv->counters.dropped);
+		ATOMIC_ADD(priv->counters.dropped_bytes,buf_size);
+		free(buffer);
+		return;
+	}
+
+	ATOMIC_INC(priv->counters.sampled);
+	const int rate_len = snprintf(rate,sizeof(rate),"%.6g",
+		(double)threshold/(double)SAMPLE_KEEP_ALL);
+	sampled_meta = *meta;
+	msg_meta_add_header(&sampled_meta,priv->header,rate,(size_t)rate_len);
+	stage_forward(stage,buffer,buf_size,&sampled_meta);
+}
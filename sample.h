@@ -0,0 +1,49 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * Overload sampling stage. When the kafka producer queue goes over
+ * high_watermark messages, it starts sampling messages per sender, thinning
+ * the heaviest senders first:
+ *
+ *   {"type":"sample","high_watermark":80000,"low_watermark":40000,
+ *    "interval_ms":1000,"min_rate":0.01,"buckets":4096,
+ *    "header":"sample-rate"}
+ *
+ * Every interval_ms the kept fraction of the traffic is halved while queue is
+ * over high_watermark, and doubled while it is under low_watermark. Senders
+ * get the same share of that fraction: the ones that sent less than the share
+ * in the last interval are not sampled. Sampled messages carry their sampling
+ * rate in the `header` kafka header, so consumers can weight them.
+ *
+ * Senders are counted in `buckets` counters by address hash, so memory is
+ * fixed and senders that share a bucket are sampled together.
+ */
+
+#define SAMPLE_STAGE_TYPE "sample"
+
+int sample_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void sample_stage_opaque_destructor(void *opaque);
+void sample_stage_opaque_stats(void *opaque,struct json_t *stats);
+void sample_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta);
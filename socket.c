@@ -17,7 +17,12 @@
 */
 
 #include "socket.h"
+#include "ack.h"
+#include "content_encoding.h"
 #include "global_config.h"
+#include "http1.h"
+#include "http2.h"
+#include "http_routes.h"
 #include "util.h"
 
 #include <librd/rdthread.h>
@@ -30,6 +35,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <fcntl.h>
@@ -43,6 +49,11 @@
 
 #define N2KAFKA_TCP "tcp"
 #define N2KAFKA_UDP "udp"
+/// TCP with native HTTP/1.1 engine
+#define N2KAFKA_NATIVE_HTTP "http"
+
+/// TCP records with sequence numbers, acked when delivered
+#define TCP_FRAMING_ACKED "acked"
 
 #define CONFIG_NUM_THREADS "threads"
 
@@ -61,6 +72,7 @@ enum thread_mode{
 struct udp_thread_info{
 	pthread_mutex_t listenfd_mutex;
 	int listenfd;
+	uint16_t listen_port;
 	listener_callback callback;
 	void *callback_opaque;
 };
@@ -94,7 +106,7 @@ static int createListenSocket(const char *proto,uint16_t listen_port) {
 
 	if (0 == strcmp(N2KAFKA_UDP,proto)) {
 		listenfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK,0);
-	} else if (0 == strcmp(N2KAFKA_TCP,proto)) {
+	} else if (0 == strcmp(N2KAFKA_TCP,proto) || 0 == strcmp(N2KAFKA_NATIVE_HTTP,proto)) {
 		listenfd = socket(AF_INET,SOCK_STREAM,0);
 	} else {
 		rdlog(LOG_ERR,"Can't create socket: Unknown type");
@@ -127,7 +139,7 @@ static int createListenSocket(const char *proto,uint16_t listen_port) {
 		return -1;
 	}
 	
-	if(0 == strcmp(N2KAFKA_TCP,proto)) {
+	if(0 != strcmp(N2KAFKA_UDP,proto)) {
 		const int listen_ret = listen(listenfd,SOMAXCONN);
 		if(listen_ret == -1){
 			rdlog(LOG_ERR,"Error in listen: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
@@ -192,6 +204,7 @@ static int receive_from_socket(int fd,struct sockaddr_in6 *addr,char *buffer,con
 }
 
 static void process_data_received_from_socket(char *buffer,const size_t recv_result,
+                                              const struct msg_meta *meta,
                                               listener_callback callback,
                                               void *callback_opaque){
 	if(unlikely(global_config.debug))
@@ -200,7 +213,7 @@ static void process_data_received_from_socket(char *buffer,const size_t recv_res
 	if(unlikely(only_stdout_output())){
 		free(buffer);
 	} else {
-		callback(buffer,recv_result,callback_opaque);
+		callback(buffer,recv_result,meta,callback_opaque);
 	}
 }
 
@@ -219,18 +232,47 @@ static int send_to_socket(int fd,const char *data,size_t len){
 	}
 }
 
+/// Native HTTP engine listener config
+struct http_engine_config {
+	struct content_decoder_limits decompress_limits;
+	/// Max request body size, 0 for no limit
+	size_t max_body_size;
+	/// Accept HTTP/2 connections with prior knowledge
+	int h2c;
+	/// URL routes, NULL if listener has no routes
+	struct http_routes *routes;
+};
+
+struct http_connection;
+struct acked_connection;
+
 struct connection_private {
 	#ifdef CONNECTION_PRIVATE_MAGIC
 	uint64_t magic;
 	#endif
 	int first_response_sent;
+	struct msg_meta meta;
 	void *callback_opaque;
     listener_callback callback;
+	/// HTTP state, NULL if connection is not HTTP
+	struct http_connection *http;
+	/// Acked framing state, NULL if connection is not acked
+	struct acked_connection *acked;
 };
 
+static void http_connection_done(struct http_connection *http);
+static void acked_connection_done(struct ev_loop *loop,
+                                  struct acked_connection *acked);
+
 static void close_socket_and_stop_watcher(struct ev_loop *loop,struct ev_io *watcher){
+	struct connection_private *connection = watcher->data;
+
 	ev_io_stop(loop,watcher);
 
+	if(connection->http)
+		http_connection_done(connection->http);
+	if(connection->acked)
+		acked_connection_done(loop,connection->acked);
 	close(watcher->fd);
 	free(watcher);
 }
@@ -252,8 +294,10 @@ static void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 	char *buffer = calloc(READ_BUFFER_SIZE,sizeof(char));
 	const int recv_result = receive_from_socket(watcher->fd,&saddr,buffer,READ_BUFFER_SIZE);
 	if(recv_result > 0){
+		connection->meta.receive_time = ev_now(loop);
 		process_data_received_from_socket(buffer,(size_t)recv_result,
-		            connection->callback,connection->callback_opaque);
+		            &connection->meta,connection->callback,
+		            connection->callback_opaque);
 	}else if(recv_result < 0){
 		if(errno == EAGAIN){
 			rdbg("Socket not ready. re-trying");
@@ -292,6 +336,1107 @@ static void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 	}
 }
 
+/*
+ * Acked TCP framing. Every record is prefixed with its sequence number (8
+ * bytes) and its length (4 bytes), both big endian, and the connection sends
+ * back cumulative acks: the 8 bytes big endian sequence number of the last
+ * record delivered to kafka, once all the previous ones have been delivered
+ * too. Sender can pipeline up to ack_window records not acked yet, and reading
+ * stops while the window is full. If a record can't be delivered, the records
+ * before it are acked and the connection is closed, so sender has to resend
+ * from it.
+ *
+ * Acks are written by an ev_io write watcher when delivery reports, notified
+ * through an ev_async from any thread, make them advance.
+ */
+
+#define ACKED_HEADER_SIZE 12
+#define ACKED_ACK_SIZE 8
+/// Bigger records close the connection
+#define ACKED_MAX_RECORD_SIZE (64*1024*1024)
+#define ACKED_DEFAULT_WINDOW 1024
+#define ACKED_MAX_WINDOW (1024*1024)
+
+struct acked_connection {
+	/// Connection read watcher
+	struct ev_io *watcher;
+	/// Worker loop, set when connection is started on it
+	struct ev_loop *loop;
+	/// Writes acks when socket is writable
+	struct ev_io ack_watcher;
+	/// Delivery reports advanced the window
+	struct ev_async ack_async;
+	struct ack_window *window;
+
+	/// Input is not read nor processed until window has room
+	int paused;
+	/// Sender will not send more records
+	int eof;
+	/// Received data not processed yet
+	char in[READ_BUFFER_SIZE];
+	size_t in_start,in_used;
+
+	/// Record being received
+	char header[ACKED_HEADER_SIZE];
+	size_t header_used;
+	char *record;
+	size_t record_size,record_used;
+	/// Sequence number of the next record
+	uint64_t next_seq;
+	int records_pushed;
+
+	/// Ack being written
+	char out[ACKED_ACK_SIZE];
+	size_t out_start,out_used;
+	/// Last sequence number acked to sender
+	uint64_t last_ack;
+	int acks_sent;
+};
+
+static uint64_t acked_decode_be(const char *buf,size_t size) {
+	uint64_t ret = 0;
+	size_t i;
+
+	for(i=0;i<size;++i)
+		ret = ret<<8 | (uint8_t)buf[i];
+	return ret;
+}
+
+/// Called from delivery reports threads
+static void acked_notify(void *opaque) {
+	struct acked_connection *acked = opaque;
+	ev_async_send(acked->loop,&acked->ack_async);
+}
+
+/// Record header is complete. Return -1 if connection has to be closed.
+static int acked_record_start(struct acked_connection *acked) {
+	const uint64_t seq = acked_decode_be(acked->header,8);
+	const size_t size = (size_t)acked_decode_be(&acked->header[8],4);
+
+	if(acked->records_pushed && seq != acked->next_seq) {
+		rdlog(LOG_ERR,"Acked record %"PRIu64" received, %"PRIu64
+			" expected. Closing connection.",seq,acked->next_seq);
+		return -1;
+	}
+
+	if(size > ACKED_MAX_RECORD_SIZE) {
+		rdlog(LOG_ERR,"Acked record of %zu bytes exceeds max size. Closing "
+			"connection.",size);
+		return -1;
+	}
+
+	acked->next_seq = seq;
+	acked->record_size = size;
+	acked->record_used = 0;
+	if(size > 0) {
+		acked->record = malloc(size);
+		if(NULL == acked->record) {
+			rdlog(LOG_ERR,"Can't allocate acked record (out of memory?)");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/// Hand over complete record. Return -1 if connection has to be closed.
+static int acked_record_end(struct connection_private *connection) {
+	struct acked_connection *acked = connection->acked;
+
+	struct ack_slot *slot = ack_window_push(acked->window,acked->next_seq);
+	if(NULL == slot) {
+		rdlog(LOG_ERR,"Can't track acked record %"PRIu64". Closing "
+			"connection.",acked->next_seq);
+		return -1;
+	}
+
+	acked->records_pushed = 1;
+	acked->next_seq++;
+	acked->header_used = 0;
+
+	/* Empty records are acked without sending them */
+	if(acked->record_size > 0) {
+		connection->meta.ack = slot;
+		process_data_received_from_socket(acked->record,acked->record_size,
+			&connection->meta,connection->callback,
+			connection->callback_opaque);
+		connection->meta.ack = NULL;
+	}
+
+	/* Messages produced from the record hold their own references. Records
+	   not produced (dropped or kept by stages) are done here. */
+	ack_slot_release(slot,0);
+	acked->record = NULL;
+	acked->record_size = acked->record_used = 0;
+	return 0;
+}
+
+/// Process buffered input. Return -1 if connection has to be closed.
+static int acked_process_input(struct connection_private *connection) {
+	struct acked_connection *acked = connection->acked;
+
+	while(acked->in_start < acked->in_used) {
+		const char *data = &acked->in[acked->in_start];
+		const size_t size = acked->in_used - acked->in_start;
+		size_t consumed;
+
+		if(acked->header_used < ACKED_HEADER_SIZE) {
+			if(0 == acked->header_used && ack_window_full(acked->window)) {
+				acked->paused = 1;
+				return 0;
+			}
+
+			consumed = ACKED_HEADER_SIZE - acked->header_used;
+			if(consumed > size)
+				consumed = size;
+			memcpy(&acked->header[acked->header_used],data,consumed);
+			acked->header_used += consumed;
+			acked->in_start += consumed;
+			if(acked->header_used < ACKED_HEADER_SIZE)
+				continue;
+
+			if(0 != acked_record_start(acked))
+				return -1;
+		} else {
+			consumed = acked->record_size - acked->record_used;
+			if(consumed > size)
+				consumed = size;
+			memcpy(&acked->record[acked->record_used],data,consumed);
+			acked->record_used += consumed;
+			acked->in_start += consumed;
+		}
+
+		if(acked->record_used == acked->record_size
+		                           && 0 != acked_record_end(connection))
+			return -1;
+	}
+
+	acked->in_start = acked->in_used = 0;
+	return 0;
+}
+
+/// Write pending acks. Return -1 if connection was closed.
+static int acked_flush(struct ev_loop *loop,
+                       struct connection_private *connection) {
+	struct acked_connection *acked = connection->acked;
+	uint64_t acked_seq = 0;
+	int failed = 0;
+	const int any_acked = ack_window_acked(acked->window,&acked_seq,&failed);
+
+	while(1) {
+		if(acked->out_start == acked->out_used) {
+			if(!any_acked || (acked->acks_sent && acked_seq == acked->last_ack))
+				break;
+
+			size_t i;
+			for(i=0;i<ACKED_ACK_SIZE;++i)
+				acked->out[i] = (char)(acked_seq >> (8*(ACKED_ACK_SIZE-1-i)));
+			acked->out_start = 0;
+			acked->out_used = ACKED_ACK_SIZE;
+			acked->last_ack = acked_seq;
+			acked->acks_sent = 1;
+		}
+
+		const ssize_t send_result = send(acked->watcher->fd,
+			&acked->out[acked->out_start],
+			acked->out_used - acked->out_start,MSG_NOSIGNAL);
+		if(send_result < 0) {
+			if(EINTR == errno)
+				continue;
+			if(EAGAIN == errno) {
+				ev_io_start(loop,&acked->ack_watcher);
+				return 0;
+			}
+
+			rdlog(LOG_ERR,"Error writing ack to socket: %s",
+				mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+			close_socket_and_stop_watcher(loop,acked->watcher);
+			return -1;
+		}
+		acked->out_start += (size_t)send_result;
+	}
+
+	ev_io_stop(loop,&acked->ack_watcher);
+
+	if(failed) {
+		rdlog(LOG_WARNING,"Acked record %"PRIu64" not delivered. Closing "
+			"connection.",any_acked ? acked_seq + 1 : acked->next_seq);
+		close_socket_and_stop_watcher(loop,acked->watcher);
+		return -1;
+	}
+
+	const int all_acked = !acked->records_pushed
+		|| (any_acked && acked_seq + 1 == acked->next_seq);
+	if(acked->eof && all_acked) {
+		close_socket_and_stop_watcher(loop,acked->watcher);
+		return -1;
+	}
+
+	if(acked->paused && !ack_window_full(acked->window)) {
+		acked->paused = 0;
+		if(0 != acked_process_input(connection)) {
+			close_socket_and_stop_watcher(loop,acked->watcher);
+			return -1;
+		}
+		if(!acked->paused && !acked->eof)
+			ev_io_start(loop,acked->watcher);
+	}
+
+	return 0;
+}
+
+static void acked_async_cb(struct ev_loop *loop,struct ev_async *w,
+                                               int revents __attribute__((unused))) {
+	acked_flush(loop,w->data);
+}
+
+static void acked_write_cb(struct ev_loop *loop,struct ev_io *w,int revents) {
+	if(EV_ERROR & revents) {
+		rdlog(LOG_ERR,"Ack write callback error: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+	}
+
+	acked_flush(loop,w->data);
+}
+
+static void acked_read_cb(struct ev_loop *loop,struct ev_io *watcher,
+                                                                int revents) {
+	struct connection_private *connection = watcher->data;
+	struct acked_connection *acked = connection->acked;
+
+#ifdef CONNECTION_PRIVATE_MAGIC
+	assert(connection->magic == CONNECTION_PRIVATE_MAGIC);
+#endif
+
+	if(EV_ERROR & revents) {
+		rdlog(LOG_ERR,"Read callback error: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+	}
+
+	/* Record bodies are received in the message buffer itself */
+	const int body_read = ACKED_HEADER_SIZE == acked->header_used
+	                                  && acked->record_used < acked->record_size;
+	char *buffer = body_read ? &acked->record[acked->record_used] : acked->in;
+	const size_t buffer_size = body_read ?
+		acked->record_size - acked->record_used : sizeof(acked->in);
+
+	const ssize_t recv_result = recv(watcher->fd,buffer,buffer_size,0);
+	if(recv_result < 0) {
+		if(EAGAIN == errno || EINTR == errno)
+			return;
+
+		rdlog(LOG_ERR,"Recv error: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+		close_socket_and_stop_watcher(loop,watcher);
+		return;
+	}
+
+	if(0 == recv_result) {
+		/* Sender can still wait for its acks. Incomplete record is
+		   discarded. */
+		free(acked->record);
+		acked->record = NULL;
+		acked->eof = 1;
+		ev_io_stop(loop,watcher);
+		acked_flush(loop,connection);
+		return;
+	}
+
+	connection->meta.receive_time = ev_now(loop);
+	if(body_read) {
+		acked->record_used += (size_t)recv_result;
+		if(acked->record_used == acked->record_size
+		                           && 0 != acked_record_end(connection)) {
+			close_socket_and_stop_watcher(loop,watcher);
+		}
+		return;
+	}
+
+	acked->in_used = (size_t)recv_result;
+	if(0 != acked_process_input(connection)) {
+		close_socket_and_stop_watcher(loop,watcher);
+	} else if(acked->paused) {
+		ev_io_stop(loop,watcher);
+	}
+}
+
+static int acked_connection_init(struct acked_connection *acked,
+                                 struct ev_io *watcher,size_t window_size) {
+	acked->window = ack_window_new(window_size,acked_notify,acked);
+	if(NULL == acked->window)
+		return -1;
+
+	acked->watcher = watcher;
+	ev_async_init(&acked->ack_async,acked_async_cb);
+	acked->ack_async.data = watcher->data;
+	ev_io_init(&acked->ack_watcher,acked_write_cb,watcher->fd,EV_WRITE);
+	acked->ack_watcher.data = watcher->data;
+	return 0;
+}
+
+/// Start acked connection watchers on its worker loop
+static void acked_connection_start(struct ev_loop *loop,
+                                   struct acked_connection *acked) {
+	acked->loop = loop;
+	ev_async_start(loop,&acked->ack_async);
+}
+
+static void acked_connection_done(struct ev_loop *loop,
+                                  struct acked_connection *acked) {
+	/* No more notifications after closing window. Records still in kafka
+	   keep it until their delivery reports. */
+	ack_window_close(acked->window);
+	ev_async_stop(loop,&acked->ack_async);
+	ev_io_stop(loop,&acked->ack_watcher);
+	free(acked->record);
+}
+
+/*
+ * Native HTTP/1.1 engine. HTTP connections are served by the same worker
+ * loops as TCP ones. Requests can be pipelined, and responses are
+ * preencoded. Connection is closed after an error response, so the body of
+ * a rejected request never has to be read.
+ */
+
+#define HTTP_READ_BUFFER_SIZE (HTTP1_MAX_HEAD_SIZE + READ_BUFFER_SIZE)
+#define HTTP_WRITE_BUFFER_SIZE 4096
+/// Max size of the responses of one request (100 Continue plus final one)
+#define HTTP_REQUEST_RESPONSES_MAX_SIZE 256
+
+struct http_response {
+	const char *buf;
+	size_t size;
+	/// Status code, for HTTP/2 responses
+	int status;
+};
+
+#define HTTP_RESPONSE_STR(code,reason,headers) \
+	"HTTP/1.1 " #code " " reason "\r\nContent-Length: 0\r\n" headers "\r\n"
+#define HTTP_RESPONSE(code,reason,headers) \
+	{HTTP_RESPONSE_STR(code,reason,headers), \
+	sizeof(HTTP_RESPONSE_STR(code,reason,headers)) - 1,code}
+#define HTTP_CLOSE "Connection: close\r\n"
+
+static const struct http_response http_response_continue = {
+	"HTTP/1.1 100 Continue\r\n\r\n",
+	sizeof("HTTP/1.1 100 Continue\r\n\r\n") - 1,100};
+static const struct http_response http_response_ok =
+	HTTP_RESPONSE(200,"OK","");
+static const struct http_response http_response_ok_close =
+	HTTP_RESPONSE(200,"OK",HTTP_CLOSE);
+static const struct http_response http_response_bad_request =
+	HTTP_RESPONSE(400,"Bad Request",HTTP_CLOSE);
+static const struct http_response http_response_not_found =
+	HTTP_RESPONSE(404,"Not Found",HTTP_CLOSE);
+static const struct http_response http_response_method_not_allowed =
+	HTTP_RESPONSE(405,"Method Not Allowed","Allow: POST\r\n" HTTP_CLOSE);
+static const struct http_response http_response_payload_too_large =
+	HTTP_RESPONSE(413,"Payload Too Large",HTTP_CLOSE);
+static const struct http_response http_response_unsupported_media_type =
+	HTTP_RESPONSE(415,"Unsupported Media Type",HTTP_CLOSE);
+static const struct http_response http_response_header_too_large =
+	HTTP_RESPONSE(431,"Request Header Fields Too Large",HTTP_CLOSE);
+static const struct http_response http_response_internal_error =
+	HTTP_RESPONSE(500,"Internal Server Error",HTTP_CLOSE);
+static const struct http_response http_response_not_implemented =
+	HTTP_RESPONSE(501,"Not Implemented",HTTP_CLOSE);
+static const struct http_response http_response_version_not_supported =
+	HTTP_RESPONSE(505,"HTTP Version Not Supported",HTTP_CLOSE);
+
+/// Message being received
+struct http_body {
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+enum http_connection_state {
+	/// Waiting for a request head
+	HTTP_STATE_HEAD,
+	/// Receiving a Content-Length body
+	HTTP_STATE_BODY,
+	/// Receiving a chunked body
+	HTTP_STATE_CHUNKED,
+	/// Connection is closed when pending responses are written
+	HTTP_STATE_CLOSE,
+	/// Connection switched to HTTP/2
+	HTTP_STATE_H2,
+};
+
+struct http_connection {
+	enum http_connection_state state;
+	const struct http_engine_config *config;
+	/// Close connection after current request
+	int close;
+	/// Connection has received an HTTP/1.1 request, so it can't be HTTP/2
+	int http1;
+	/// Read buffer. Request heads are parsed in place.
+	char in[HTTP_READ_BUFFER_SIZE];
+	size_t in_start;
+	size_t in_used;
+	/// Bytes of current request head already scanned
+	size_t head_scanned;
+	/// Current request body, decompressed as it arrives if it is compressed
+	struct http_body body;
+	/// Body bytes received, before decompression
+	size_t body_received;
+	/// Content-Length of current request body
+	size_t content_length;
+	struct http1_chunked chunked;
+	/// Error response of a body that can't be received
+	const struct http_response *body_error;
+	/// Content-Encoding decoder, NULL if body is not compressed
+	struct content_decoder *decoder;
+	/// Route callbacks, NULL to use listener ones
+	const struct listener_callbacks *cb;
+	/// Copy of route key segment
+	char *key;
+	/// Responses not written yet
+	char out[HTTP_WRITE_BUFFER_SIZE];
+	size_t out_used;
+#ifdef HAVE_LIBNGHTTP2
+	/// HTTP/2 session, if connection switched to it
+	struct http2_session *h2;
+#endif
+};
+
+static int http_body_append(const char *data,size_t size,void *_body) {
+	struct http_body *body = _body;
+
+	if(size > body->size - body->used) {
+		size_t new_size = body->size > 0 ? body->size : READ_BUFFER_SIZE;
+		while(new_size - body->used < size)
+			new_size *= 2;
+
+		char *new_buf = realloc(body->buf,new_size);
+		if(NULL == new_buf) {
+			rdlog(LOG_ERR,"Can't allocate HTTP body of %zu bytes "
+				"(out of memory?)",new_size);
+			return -1;
+		}
+
+		body->buf = new_buf;
+		body->size = new_size;
+	}
+
+	memcpy(&body->buf[body->used],data,size);
+	body->used += size;
+	return 0;
+}
+
+/** Make room for more Content-Length body data. Buffer grows as data arrives,
+    up to the declared length, so clients can't make us allocate memory that
+    they don't send.
+    @return 0 on success
+    */
+static int http_body_reserve(struct http_connection *http) {
+	struct http_body *body = &http->body;
+	if(body->used < body->size)
+		return 0;
+
+	size_t new_size = body->size > 0 ? 2*body->size : READ_BUFFER_SIZE;
+	if(new_size > http->content_length)
+		new_size = http->content_length;
+
+	char *new_buf = realloc(body->buf,new_size);
+	if(NULL == new_buf) {
+		rdlog(LOG_ERR,"Can't allocate HTTP body of %zu bytes "
+			"(out of memory?)",new_size);
+		return -1;
+	}
+
+	body->buf = new_buf;
+	body->size = new_size;
+	return 0;
+}
+
+/// Log a body decompression error and return its response
+static const struct http_response *http_decode_error(int rc) {
+	if(CONTENT_DECODER_LIMIT == rc) {
+		rdlog(LOG_WARNING,"HTTP body exceeds decompression limits, "
+			"discarding it");
+		return &http_response_payload_too_large;
+	} else {
+		rdlog(LOG_WARNING,"HTTP body is not valid compressed data, "
+			"discarding it");
+		return &http_response_bad_request;
+	}
+}
+
+/** Add received body data. Compressed data is decompressed right away, so
+    only the decompressed body is kept.
+    @return 0 on success. Otherwise, body_error is set.
+    */
+static int http_body_data(struct http_connection *http,const char *data,
+                                                              size_t size) {
+	http->body_received += size;
+	if(NULL == http->decoder) {
+		if(0 == http_body_append(data,size,&http->body))
+			return 0;
+		http->body_error = &http_response_internal_error;
+		return -1;
+	}
+
+	const int rc = content_decoder_decode(http->decoder,data,size,
+		http_body_append,&http->body);
+	if(CONTENT_DECODER_OK == rc)
+		return 0;
+
+	http->body_error = http_decode_error(rc);
+	return -1;
+}
+
+/// Chunked body data
+static int http_chunk_data(const char *data,size_t size,void *_http) {
+	struct http_connection *http = _http;
+	const size_t max_body_size = http->config->max_body_size;
+
+	if(max_body_size > 0 && size > max_body_size - http->body_received) {
+		rdlog(LOG_WARNING,"HTTP body exceeds max body size, "
+			"aborting upload");
+		http->body_error = &http_response_payload_too_large;
+		return -1;
+	}
+
+	return http_body_data(http,data,size);
+}
+
+/// Free current request resources
+static void http_request_done(struct http_connection *http) {
+	free(http->body.buf);
+	memset(&http->body,0,sizeof(http->body));
+	http->body_received = 0;
+	http->body_error = NULL;
+	if(http->decoder) {
+		content_decoder_release(http->decoder);
+		http->decoder = NULL;
+	}
+	free(http->key);
+	http->key = NULL;
+	http->cb = NULL;
+}
+
+static void http_connection_done(struct http_connection *http) {
+	http_request_done(http);
+#ifdef HAVE_LIBNGHTTP2
+	if(http->h2)
+		http2_session_done(http->h2);
+#endif
+}
+
+static void http_queue_response(struct http_connection *http,
+                                const struct http_response *response) {
+	assert(response->size <= sizeof(http->out) - http->out_used);
+	memcpy(&http->out[http->out_used],response->buf,response->size);
+	http->out_used += response->size;
+}
+
+/// Answer current request with an error, and close connection after it
+static void http_fail(struct http_connection *http,
+                      const struct http_response *response) {
+	http_queue_response(http,response);
+	http_request_done(http);
+	http->state = HTTP_STATE_CLOSE;
+}
+
+/// Send a decompressed request body
+static void http_send_body(struct connection_private *connection,
+                                                     struct http_body body) {
+	const struct listener_callbacks *cb = connection->http->cb;
+
+	if(body.used > 0) {
+		process_data_received_from_socket(body.buf,body.used,
+			&connection->meta,
+			cb ? cb->callback : connection->callback,
+			cb ? cb->cb_opaque : connection->callback_opaque);
+	} else {
+		free(body.buf);
+	}
+}
+
+/// Send current request body and answer it
+static void http_request_end(struct ev_loop *loop,
+                             struct connection_private *connection) {
+	struct http_connection *http = connection->http;
+
+	if(http->decoder && !content_decoder_finished(http->decoder)) {
+		/* Truncated */
+		http_fail(http,http_decode_error(CONTENT_DECODER_INVALID));
+		return;
+	}
+
+	struct http_body body = http->body;
+	memset(&http->body,0,sizeof(http->body));
+
+	connection->meta.receive_time = ev_now(loop);
+	http_send_body(connection,body);
+
+	http_request_done(http);
+	if(http->close) {
+		http_queue_response(http,&http_response_ok_close);
+		http->state = HTTP_STATE_CLOSE;
+	} else {
+		http_queue_response(http,&http_response_ok);
+		http->state = HTTP_STATE_HEAD;
+	}
+}
+
+/// Set request route. Return error response, or NULL if found.
+static const struct http_response *http_set_route(
+                  struct connection_private *connection,const char *path) {
+	struct http_connection *http = connection->http;
+	const char *key = NULL;
+	size_t key_size = 0;
+
+	struct http_route *route = http_routes_match(http->config->routes,path,
+		&key,&key_size);
+	if(NULL == route)
+		return &http_response_not_found;
+
+	http->cb = http_route_callbacks(route);
+	connection->meta.topic = http_route_topic(route);
+	if(key) {
+		http->key = strndup(key,key_size);
+		if(NULL == http->key) {
+			rdlog(LOG_ERR,"Can't allocate message key (out of memory?)");
+			return &http_response_internal_error;
+		}
+		connection->meta.key = http->key;
+		connection->meta.key_size = key_size;
+	}
+
+	return NULL;
+}
+
+/** Prepare request delivery from its head
+    @return Error response, or NULL if request body can be delivered
+    */
+static const struct http_response *http_request_start(
+                  struct connection_private *connection,const char *path,
+                  const char *content_encoding) {
+	struct http_connection *http = connection->http;
+
+	connection->meta.topic = NULL;
+	connection->meta.key = NULL;
+	connection->meta.key_size = 0;
+
+	if(http->config->routes) {
+		const struct http_response *error = http_set_route(connection,path);
+		if(error)
+			return error;
+	}
+
+	if(0 != content_decoder_get(content_encoding,
+	                      &http->config->decompress_limits,&http->decoder)) {
+		rdlog(LOG_WARNING,"Unsupported HTTP Content-Encoding %s",
+			content_encoding);
+		return &http_response_unsupported_media_type;
+	}
+
+	return NULL;
+}
+
+/// Process a request head. Return 0 if it is not complete yet.
+static int http_process_head(struct ev_loop *loop,
+                             struct connection_private *connection) {
+	struct http_connection *http = connection->http;
+	char *head = &http->in[http->in_start];
+	const size_t size = http->in_used - http->in_start;
+	struct http1_request req;
+
+	if(0 == http->head_scanned && ('\r' == *head || '\n' == *head)) {
+		/* Empty lines before a request line are ignored */
+		http->in_start++;
+		return 1;
+	}
+
+	const size_t head_size = http1_head_size(head,size,&http->head_scanned);
+	if(0 == head_size && size < HTTP1_MAX_HEAD_SIZE)
+		return 0;
+
+	if(0 == head_size || head_size > HTTP1_MAX_HEAD_SIZE) {
+		http_fail(http,&http_response_header_too_large);
+		return 1;
+	}
+
+	http->in_start += head_size;
+	http->head_scanned = 0;
+	http->http1 = 1;
+
+	switch(http1_parse_head(head,head_size,&req)) {
+	case HTTP1_OK:
+		break;
+	case HTTP1_VERSION_NOT_SUPPORTED:
+		http_fail(http,&http_response_version_not_supported);
+		return 1;
+	case HTTP1_NOT_IMPLEMENTED:
+		http_fail(http,&http_response_not_implemented);
+		return 1;
+	case HTTP1_INVALID:
+	default:
+		http_fail(http,&http_response_bad_request);
+		return 1;
+	}
+
+	if(4 != req.method_size || 0 != memcmp(req.method,"POST",4)) {
+		http_fail(http,&http_response_method_not_allowed);
+		return 1;
+	}
+
+	if(http->config->max_body_size > 0 && !req.chunked
+	                   && req.content_length > http->config->max_body_size) {
+		rdlog(LOG_WARNING,"HTTP body of %zu bytes exceeds max body size, "
+			"rejecting it",(size_t)req.content_length);
+		http_fail(http,&http_response_payload_too_large);
+		return 1;
+	}
+
+	http->close = !req.keep_alive;
+	const struct http_response *error = http_request_start(connection,
+		req.path,req.content_encoding);
+	if(error) {
+		http_fail(http,error);
+		return 1;
+	}
+
+	if(req.chunked) {
+		memset(&http->chunked,0,sizeof(http->chunked));
+		http->state = HTTP_STATE_CHUNKED;
+	} else if(req.content_length > 0) {
+		/* Body is received (or decompressed) in the message buffer itself */
+		if(req.content_length > SIZE_MAX) {
+			http_fail(http,&http_response_payload_too_large);
+			return 1;
+		}
+
+		http->content_length = (size_t)req.content_length;
+		http->state = HTTP_STATE_BODY;
+	} else {
+		http_request_end(loop,connection);
+		return 1;
+	}
+
+	if(req.expect_continue)
+		http_queue_response(http,&http_response_continue);
+
+	return 1;
+}
+
+#ifdef HAVE_LIBNGHTTP2
+/** Decompress a whole request body and send it
+    @return Error response, or NULL if body has been sent
+    */
+static const struct http_response *http_deliver(
+                 struct connection_private *connection,struct http_body body) {
+	struct http_connection *http = connection->http;
+
+	if(http->decoder) {
+		struct http_body decoded = {NULL,0,0};
+		int rc = content_decoder_decode(http->decoder,body.buf,body.used,
+			http_body_append,&decoded);
+		if(CONTENT_DECODER_OK == rc
+		                     && !content_decoder_finished(http->decoder)) {
+			rc = CONTENT_DECODER_INVALID; /* Truncated */
+		}
+		free(body.buf);
+
+		if(CONTENT_DECODER_OK != rc) {
+			free(decoded.buf);
+			return http_decode_error(rc);
+		}
+
+		body = decoded;
+	}
+
+	http_send_body(connection,body);
+	return NULL;
+}
+
+/// Send a complete HTTP/2 request stream. Return response status.
+static int http2_request(struct http2_request *req,void *_connection) {
+	struct connection_private *connection = _connection;
+	struct http_connection *http = connection->http;
+	struct http_body body = {req->body,req->body_size,req->body_size};
+
+	const struct http_response *error = http_request_start(connection,
+		req->path,req->content_encoding);
+	if(error)
+		free(body.buf);
+	else
+		error = http_deliver(connection,body);
+
+	http_request_done(http);
+	return error ? error->status : http_response_ok.status;
+}
+
+/// Switch connection to HTTP/2. Its preface is still in the read buffer.
+static void http_start_h2(struct connection_private *connection) {
+	struct http_connection *http = connection->http;
+
+	http->h2 = http2_session_new(http->config->max_body_size,http2_request,
+		connection);
+	if(NULL == http->h2) {
+		/* Client doesn't expect an HTTP/1.1 response */
+		http->state = HTTP_STATE_CLOSE;
+		return;
+	}
+
+	http->state = HTTP_STATE_H2;
+}
+
+/// Input can be an HTTP/2 preface. Return 0 if more data is needed.
+static int http_is_h2_preface(const struct http_connection *http,
+                              const char *data,size_t size) {
+	return http->config->h2c && !http->http1 && 0 == memcmp(data,
+		HTTP2_PREFACE,size < HTTP2_PREFACE_SIZE ? size : HTTP2_PREFACE_SIZE);
+}
+#endif
+
+/** Process buffered input
+    @return 1 if processing stopped because responses are not written yet
+    */
+static int http_process_input(struct ev_loop *loop,
+                              struct connection_private *connection) {
+	struct http_connection *http = connection->http;
+	int stalled = 0,need_data = 0;
+
+	while(http->in_start < http->in_used && !stalled && !need_data) {
+		const char *data = &http->in[http->in_start];
+		const size_t size = http->in_used - http->in_start;
+		size_t consumed = 0;
+		int rc = 0;
+
+		switch(http->state) {
+		case HTTP_STATE_HEAD:
+#ifdef HAVE_LIBNGHTTP2
+			if(http_is_h2_preface(http,data,size)) {
+				if(size < HTTP2_PREFACE_SIZE)
+					need_data = 1;
+				else
+					http_start_h2(connection);
+				break;
+			}
+#endif
+			if(sizeof(http->out) - http->out_used
+			                        < HTTP_REQUEST_RESPONSES_MAX_SIZE) {
+				/* Pipelined requests wait for previous responses */
+				stalled = 1;
+			} else {
+				need_data = !http_process_head(loop,connection);
+			}
+			break;
+
+		case HTTP_STATE_BODY:
+			if(http->decoder) {
+				/* Compressed body is decompressed from the read buffer */
+				consumed = http->content_length - http->body_received;
+				if(consumed > size)
+					consumed = size;
+				http->in_start += consumed;
+				if(0 != http_body_data(http,data,consumed))
+					http_fail(http,http->body_error);
+				else if(http->body_received == http->content_length)
+					http_request_end(loop,connection);
+				break;
+			}
+
+			if(0 != http_body_reserve(http)) {
+				http_fail(http,&http_response_payload_too_large);
+				break;
+			}
+			consumed = http->body.size - http->body.used;
+			if(consumed > size)
+				consumed = size;
+			memcpy(&http->body.buf[http->body.used],data,consumed);
+			http->body.used += consumed;
+			http->in_start += consumed;
+			if(http->body.used == http->content_length)
+				http_request_end(loop,connection);
+			break;
+
+		case HTTP_STATE_CHUNKED:
+			rc = http1_chunked_parse(&http->chunked,data,size,&consumed,
+				http_chunk_data,http);
+			http->in_start += consumed;
+			if(HTTP1_INVALID == rc && http->body_error) {
+				http_fail(http,http->body_error);
+			} else if(HTTP1_INVALID == rc) {
+				http_fail(http,&http_response_bad_request);
+			} else if(HTTP1_CHUNKED_DONE == rc) {
+				http_request_end(loop,connection);
+			}
+			break;
+
+#ifdef HAVE_LIBNGHTTP2
+		case HTTP_STATE_H2:
+			/* Output is pulled from the session when connection is
+			   writable, so it never stalls input */
+			connection->meta.receive_time = ev_now(loop);
+			if(0 != http2_session_recv(http->h2,data,size))
+				http->state = HTTP_STATE_CLOSE;
+			http->in_start = http->in_used;
+			break;
+#endif
+
+		case HTTP_STATE_CLOSE:
+		default:
+			/* Input after an error or Connection: close is ignored */
+			http->in_start = http->in_used;
+			break;
+		}
+	}
+
+	/* Keep unprocessed input at buffer start */
+	if(http->in_start > 0) {
+		memmove(http->in,&http->in[http->in_start],
+			http->in_used - http->in_start);
+		http->in_used -= http->in_start;
+		http->in_start = 0;
+	}
+
+	return stalled;
+}
+
+/// Read from connection. Return -1 if connection was closed.
+static int http_read(struct ev_loop *loop,struct ev_io *watcher) {
+	struct connection_private *connection = watcher->data;
+	struct http_connection *http = connection->http;
+
+	/* Content-Length bodies are received in the message buffer itself,
+	   unless they have to be decompressed */
+	const int body_read = HTTP_STATE_BODY == http->state
+	             && NULL == http->decoder && http->in_start == http->in_used;
+	if(body_read && 0 != http_body_reserve(http)) {
+		http_fail(http,&http_response_payload_too_large);
+		return 0;
+	}
+
+	char *buffer = body_read ? &http->body.buf[http->body.used]
+	                         : &http->in[http->in_used];
+	const size_t buffer_size = body_read ? http->body.size - http->body.used
+	                                     : sizeof(http->in) - http->in_used;
+	if(0 == buffer_size)
+		return 0;
+
+	const ssize_t recv_result = recv(watcher->fd,buffer,buffer_size,0);
+	if(recv_result < 0) {
+		if(EAGAIN == errno || EINTR == errno)
+			return 0;
+
+		rdlog(LOG_ERR,"Recv error: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+		close_socket_and_stop_watcher(loop,watcher);
+		return -1;
+	}
+
+	if(0 == recv_result) {
+		/* Client will not send more data. Incomplete request is discarded,
+		   and connection is closed after pending responses */
+		http_request_done(http);
+		http->state = HTTP_STATE_CLOSE;
+		return 0;
+	}
+
+	if(body_read) {
+		http->body.used += (size_t)recv_result;
+		if(http->body.used == http->content_length)
+			http_request_end(loop,connection);
+	} else {
+		http->in_used += (size_t)recv_result;
+	}
+
+	return 0;
+}
+
+static void http_watch(struct ev_loop *loop,struct ev_io *watcher,
+                                                                int events) {
+	if((watcher->events & (EV_READ | EV_WRITE)) != events) {
+		ev_io_stop(loop,watcher);
+		ev_io_set(watcher,watcher->fd,events);
+		ev_io_start(loop,watcher);
+	}
+}
+
+/// Write pending responses. Return -1 if connection was closed.
+static int http_flush(struct ev_loop *loop,struct ev_io *watcher) {
+	struct connection_private *connection = watcher->data;
+	struct http_connection *http = connection->http;
+	ssize_t pulled = 0;
+	int finished = HTTP_STATE_CLOSE == http->state;
+
+	do {
+		size_t written = 0;
+
+#ifdef HAVE_LIBNGHTTP2
+		if(http->h2) {
+			pulled = http2_session_send(http->h2,&http->out[http->out_used],
+				sizeof(http->out) - http->out_used);
+			if(pulled < 0) {
+				close_socket_and_stop_watcher(loop,watcher);
+				return -1;
+			}
+			http->out_used += (size_t)pulled;
+			finished = finished || http2_session_finished(http->h2);
+		}
+#endif
+
+		while(written < http->out_used) {
+			const ssize_t send_result = send(watcher->fd,
+				&http->out[written],http->out_used - written,MSG_NOSIGNAL);
+			if(send_result < 0) {
+				if(EINTR == errno)
+					continue;
+				if(EAGAIN == errno)
+					break;
+
+				rdlog(LOG_ERR,"Error writing to socket: %s",
+					mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
+				close_socket_and_stop_watcher(loop,watcher);
+				return -1;
+			}
+			written += (size_t)send_result;
+		}
+
+		memmove(http->out,&http->out[written],http->out_used - written);
+		http->out_used -= written;
+	} while(pulled > 0 && 0 == http->out_used);
+
+	if(http->out_used > 0) {
+		/* Client is not reading responses: stop reading its requests */
+		http_watch(loop,watcher,EV_WRITE);
+	} else if(finished) {
+		close_socket_and_stop_watcher(loop,watcher);
+		return -1;
+	} else {
+		http_watch(loop,watcher,EV_READ);
+	}
+
+	return 0;
+}
+
+static void http_cb(struct ev_loop *loop,struct ev_io *watcher,int revents) {
+	struct connection_private *connection = watcher->data;
+	int stalled = 0;
+
+#ifdef CONNECTION_PRIVATE_MAGIC
+	assert(connection->magic == CONNECTION_PRIVATE_MAGIC);
+#endif
+
+	if(EV_ERROR & revents) {
+		rdlog(LOG_ERR,"HTTP callback error: %s",mystrerror(errno,errbuf,
+			ERROR_BUFFER_SIZE));
+	}
+
+	if((EV_READ & revents) && 0 != http_read(loop,watcher))
+		return;
+
+	do {
+		stalled = http_process_input(loop,connection);
+		if(0 != http_flush(loop,watcher))
+			return;
+	} while(stalled && 0 == connection->http->out_used);
+}
+
 #define SOCKET_LISTENER_PRIVATE_MAGIC 0xB0C31331AEA1CL
 
 struct socket_listener_private {
@@ -310,6 +1455,11 @@ struct socket_listener_private {
 		enum thread_mode thread_mode;
 		listener_callback callback;
 		void *callback_opaque;
+		/// Connections are served by the native HTTP engine
+		bool http;
+		struct http_engine_config http_engine;
+		/// Acked framing window, 0 if connections are not acked
+		size_t ack_window;
 	} config;
 
 	pthread_t threads[MAX_NUM_THREADS];
@@ -362,19 +1512,43 @@ static void accept_cb(struct ev_loop *loop __attribute__((unused)),
 		rdlog(LOG_ERR,"Mode " STR_MODE_THREAD_PER_CONNECTION "still not implemented");
 		exit(-1);
 	} else {
-		/* Set watcher. Private data just after watcher */
-		struct ev_io *w_client = calloc(1,
-			sizeof(struct ev_io)+sizeof(struct connection_private));
+		/* Set watcher. Private data just after watcher, and HTTP or acked
+		   state just after private data */
+		const size_t http_size = accept_private->config.http ?
+			sizeof(struct http_connection) : 0;
+		const size_t acked_size = accept_private->config.ack_window > 0 ?
+			sizeof(struct acked_connection) : 0;
+		struct ev_io *w_client = calloc(1,sizeof(struct ev_io)
+			+ sizeof(struct connection_private) + http_size + acked_size);
 		if(unlikely(NULL == w_client)) {
 			rdlog(LOG_ERR,"Can't allocate client private data");
+			close(client_sd);
 		} else {
 			struct connection_private *conn_priv = NULL;
 			w_client->data = conn_priv = (struct connection_private *)&w_client[1];
 #if CONNECTION_PRIVATE_MAGIC
 			conn_priv->magic = CONNECTION_PRIVATE_MAGIC;
 #endif
+			conn_priv->meta.client_addr = client_addr;
+			conn_priv->meta.listener_port = accept_private->config.listen_port;
 			conn_priv->callback = accept_private->config.callback;
 			conn_priv->callback_opaque = accept_private->config.callback_opaque;
+			if(http_size > 0) {
+				conn_priv->http = (struct http_connection *)&conn_priv[1];
+				conn_priv->http->config = &accept_private->config.http_engine;
+			}
+
+			ev_io_init(w_client, conn_priv->http ? http_cb :
+				acked_size > 0 ? acked_read_cb : read_cb, client_sd, EV_READ);
+			if(acked_size > 0) {
+				conn_priv->acked = (struct acked_connection *)&conn_priv[1];
+				if(0 != acked_connection_init(conn_priv->acked,w_client,
+				                      accept_private->config.ack_window)) {
+					close(client_sd);
+					free(w_client);
+					return;
+				}
+			}
 
 			const size_t cur_idx = accept_private->accept_current_worker_idx++;
 			if(accept_private->accept_current_worker_idx >= accept_private->config.threads)
@@ -382,7 +1556,6 @@ static void accept_cb(struct ev_loop *loop __attribute__((unused)),
 
 			rdbg("Sent connection to worker thread %zu",cur_idx);
 
-			ev_io_init(w_client, read_cb, client_sd, EV_READ);
 			rd_fifoq_add(&accept_private->watchers_queue[cur_idx],w_client);
 			ev_async_send(accept_private->event_loops[cur_idx],
 				&accept_private->event_asyncs[cur_idx]);
@@ -419,6 +1592,9 @@ static void async_cb(struct ev_loop *loop, ev_async *w __attribute__((unused)),
 		while((qelm = rd_fifoq_pop(&args->accept_private->watchers_queue[i]))){
 			struct ev_io *w_client = qelm->rfqe_ptr;
 			if(NULL != w_client) {
+				struct connection_private *connection = w_client->data;
+				if(connection->acked)
+					acked_connection_start(loop,connection->acked);
 				ev_io_start(loop, w_client);
 			}
 
@@ -507,6 +1683,7 @@ static void *main_consumer_loop_udp(void *_thread_info){
 	struct udp_thread_info *thread_info = _thread_info;
 	while(!do_shutdown){
 		int recv_result = 0;
+		struct sockaddr_in6 addr;
 		struct timeval tv = {.tv_sec = 1,.tv_usec = 0};
 		char *buffer = calloc(READ_BUFFER_SIZE,sizeof(char));
 		pthread_mutex_lock(&thread_info->listenfd_mutex);
@@ -515,7 +1692,6 @@ static void *main_consumer_loop_udp(void *_thread_info){
 			if(select_result==-1 && errno!=EINTR){ /* NOT INTERRUPTED */
 				rdlog(LOG_ERR,"listen select error: %s",mystrerror(errno,errbuf,ERROR_BUFFER_SIZE));
 			}else if(select_result>0){
-				struct sockaddr_in6 addr;
 				recv_result = receive_from_socket(thread_info->listenfd,&addr,buffer,READ_BUFFER_SIZE);
 			}
 		}
@@ -531,19 +1707,30 @@ static void *main_consumer_loop_udp(void *_thread_info){
 				break;
 			}
 		} else {
+			struct msg_meta meta;
+			memset(&meta,0,sizeof(meta));
+			meta.listener_port = thread_info->listen_port;
+			meta.receive_time = coarse_now();
+			if(recv_result > 0 && AF_INET == addr.sin6_family)
+				memcpy(&meta.client_addr,&addr,sizeof(meta.client_addr));
+			else if(recv_result > 0 && AF_INET6 == addr.sin6_family)
+				meta.client_addr6 = addr;
+
 			process_data_received_from_socket(buffer,(size_t)recv_result,
-				thread_info->callback,thread_info->callback_opaque);
+				&meta,thread_info->callback,thread_info->callback_opaque);
 		}
 	}
 
 	return NULL;
 }
 
-static void main_udp_loop(int listenfd,size_t udp_threads,listener_callback callback,void *callback_opaque){
+static void main_udp_loop(int listenfd,uint16_t listen_port,size_t udp_threads,
+                          listener_callback callback,void *callback_opaque){
 	/* Lots of threads listening  and processing*/
 	unsigned int i;
 	struct udp_thread_info udp_thread_info;
 	udp_thread_info.listenfd = listenfd;
+	udp_thread_info.listen_port = listen_port;
 	udp_thread_info.callback = callback;
 	udp_thread_info.callback_opaque = callback_opaque;
 
@@ -581,8 +1768,8 @@ static void *main_socket_loop(void *_params) {
 	*/
 
 	if( 0 == strcmp(N2KAFKA_UDP,params->config.proto) ){
-		main_udp_loop(listenfd,params->config.threads,params->config.callback,
-		    params->config.callback_opaque);
+		main_udp_loop(listenfd,params->config.listen_port,params->config.threads,
+		    params->config.callback,params->config.callback_opaque);
 	}else{
 		main_tcp_loop(listenfd,params);
 	}
@@ -593,19 +1780,95 @@ static void *main_socket_loop(void *_params) {
 	return NULL;
 }
 
+static int http_engine_config_init(struct http_engine_config *http_config,
+                                   json_t *config,char *err,size_t errsize) {
+	json_error_t error;
+	const char *engine = NULL,*framing = NULL;
+	json_t *routes_config = NULL;
+	json_int_t max_decompressed_size = CONTENT_DECODER_DEFAULT_MAX_SIZE;
+	json_int_t max_decompression_ratio = CONTENT_DECODER_DEFAULT_MAX_RATIO;
+	json_int_t max_body_size = 0;
+	int h2c = 0;
+
+	const int unpack_rc = json_unpack_ex(config,&error,0,"{s?s,s?s,s?I,s?I,s?I,s?b,s?o}",
+		"engine",&engine,"framing",&framing,
+		"max_decompressed_size",&max_decompressed_size,
+		"max_decompression_ratio",&max_decompression_ratio,
+		"max_body_size",&max_body_size,"h2c",&h2c,"routes",&routes_config);
+	if( unpack_rc != 0 /* Failure */ ) {
+		snprintf(err,errsize,"Can't decode HTTP listener: %s",error.text);
+		return -1;
+	}
+
+	if(engine && 0 != strcmp(HTTP_ENGINE_LIBEV,engine)) {
+		snprintf(err,errsize,"HTTP engine %s is not available",engine);
+		return -1;
+	}
+
+	if(framing) {
+		snprintf(err,errsize,"HTTP framing is not supported by "
+			HTTP_ENGINE_LIBEV " engine");
+		return -1;
+	}
+
+	if(max_decompressed_size < 0 || max_decompression_ratio < 0) {
+		snprintf(err,errsize,"Decompression limits can't be negative");
+		return -1;
+	}
+
+	if(max_body_size < 0) {
+		snprintf(err,errsize,"Max body size can't be negative");
+		return -1;
+	}
+
+#ifndef HAVE_LIBNGHTTP2
+	if(h2c) {
+		snprintf(err,errsize,"h2c needs n2kafka built with nghttp2 "
+			"(--enable-nghttp2)");
+		return -1;
+	}
+#endif
+
+	http_config->h2c = h2c;
+	http_config->max_body_size = (size_t)max_body_size;
+	http_config->decompress_limits.max_size = (size_t)max_decompressed_size;
+	http_config->decompress_limits.max_ratio = (size_t)max_decompression_ratio;
+
+	if(routes_config) {
+		http_config->routes = http_routes_new(routes_config,err,errsize);
+		if(NULL == http_config->routes)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void http_engine_config_done(struct http_engine_config *http_config) {
+	if(http_config->routes)
+		http_routes_done(http_config->routes);
+}
+
 static void join_listener_socket(void *_private){
 	struct socket_listener_private *private = _private;
 
 	do_shutdown = 1;
 	ev_async_send (private->event_loop,&private->w_async);
 	pthread_join(private->main_loop,NULL);
+	http_engine_config_done(&private->config.http_engine);
 	free(private);
 }
 
-static void reload_listener_socket(json_t *new_config __attribute__((unused)),
+static void reload_listener_socket(json_t *new_config,
                                          listener_opaque_reload opaque_reload,
-                      void *cb_opaque,void *_private __attribute__((unused))) {
-	opaque_reload(new_config,cb_opaque);
+                      void *cb_opaque,void *_private) {
+	struct socket_listener_private *priv = _private;
+
+	if(opaque_reload)
+		opaque_reload(new_config,cb_opaque);
+	if(priv->config.http_engine.routes) {
+		http_routes_reload(priv->config.http_engine.routes,
+			json_object_get(new_config,"routes"));
+	}
 }
 
 struct listener *create_socket_listener(struct json_t *config,listener_callback callback,void *callback_opaque,char *err,size_t errsize){
@@ -622,13 +1885,14 @@ struct listener *create_socket_listener(struct json_t *config,listener_callback
 	priv->config.threads = 1; 
 	priv->config.tcp_keepalive = 0;
 	priv->config.thread_mode = MODE_EPOLL;
-	const char *mode=NULL;
+	const char *mode=NULL,*framing=NULL;
+	json_int_t ack_window = ACKED_DEFAULT_WINDOW;
 
 	const int unpack_rc = json_unpack_ex(config,&error,0,
-		"{s:s,s:i,s?i,s?b,s?s}",
+		"{s:s,s:i,s?i,s?b,s?s,s?s,s?I}",
 		"proto",&proto,"port",&priv->config.listen_port,
 		"num_threads",&priv->config.threads,"tcp_keepalive",&priv->config.tcp_keepalive,
-		"mode",&mode);
+		"mode",&mode,"framing",&framing,"ack_window",&ack_window);
 
 	if( unpack_rc != 0 /* Failure */ ) {
 		snprintf(err,errsize,"Can't decode listener: %s",error.text);
@@ -651,9 +1915,43 @@ struct listener *create_socket_listener(struct json_t *config,listener_callback
 		priv->config.thread_mode = thread_mode_str(mode);
 	}
 
+	/* HTTP framing is checked by HTTP engine */
+	if(framing && 0 == strcmp(N2KAFKA_UDP,proto)) {
+		snprintf(err,errsize,"UDP listeners don't support framing");
+		free(priv);
+		return NULL;
+	} else if(framing && 0 == strcmp(N2KAFKA_TCP,proto)) {
+		if(0 != strcmp(TCP_FRAMING_ACKED,framing)) {
+			snprintf(err,errsize,"Not a valid TCP framing. Select one "
+				"between(" TCP_FRAMING_ACKED ")");
+			free(priv);
+			return NULL;
+		}
+
+		if(ack_window <= 0 || ack_window > ACKED_MAX_WINDOW) {
+			snprintf(err,errsize,"ack_window has to be between 1 and %d",
+				ACKED_MAX_WINDOW);
+			free(priv);
+			return NULL;
+		}
+		priv->config.ack_window = (size_t)ack_window;
+	}
+
+	if(0 == strcmp(N2KAFKA_NATIVE_HTTP,proto)) {
+		if(0 != http_engine_config_init(&priv->config.http_engine,config,
+		                                                    err,errsize)) {
+			free(priv);
+			return NULL;
+		}
+		priv->config.http = 1;
+		/* mode is a libmicrohttpd one. Event loops are always used. */
+		priv->config.thread_mode = MODE_EPOLL;
+	}
+
 	priv->config.proto = strdup(proto);
 	if( NULL == priv->config.proto) {
 		snprintf(err,errsize,"Error: Can't strdup protocol (out of memory?)");
+		http_engine_config_done(&priv->config.http_engine);
 		free(priv);
 		return NULL;
 	}
@@ -661,6 +1959,7 @@ struct listener *create_socket_listener(struct json_t *config,listener_callback
 	struct listener *l = calloc(1,sizeof(*l));
 	if( NULL == l ) {
 		snprintf(err,errsize,"Can't allocate listener (out of memory?)");
+		http_engine_config_done(&priv->config.http_engine);
 		free(priv);
 		return NULL;
 	}
@@ -678,6 +1977,7 @@ struct listener *create_socket_listener(struct json_t *config,listener_callback
 		main_socket_loop,priv);
 	if (pcreate_rc != 0) {
 		strerror_r(pcreate_rc,err,errsize);
+		http_engine_config_done(&priv->config.http_engine);
 		free(priv);
 		free(l);
 		return NULL;
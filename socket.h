@@ -21,6 +21,9 @@
 #include "global_config.h"
 struct http_handler;
 struct json_t;
+/// HTTP listener engine served by socket listener worker loops
+#define HTTP_ENGINE_LIBEV "libev"
+
 struct listener *create_socket_listener(struct json_t *config,listener_callback callback,void *callback_opaque,char *err,size_t errsize);
 
 #define create_tcp_listener create_socket_listener
@@ -0,0 +1,1024 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "spill.h"
+#include "ack.h"
+#include "kafka.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define SPILL_DEFAULT_HIGH_WATERMARK 80000
+#define SPILL_DEFAULT_SEGMENT_SIZE (64*1024*1024)
+#define SPILL_DEFAULT_REPLAY_RATE 10000
+/// Active segment is sealed, so it can be replayed, after this idle time
+#define SPILL_SEAL_IDLE_MS 1000
+/// Replay thread checks producer queue with this interval
+#define SPILL_REPLAY_WAIT_MS 100
+/// Wait for room in producer queue while replaying
+#define SPILL_FULL_WAIT_MS 5
+/// Wait before replaying again a segment with undelivered messages
+#define SPILL_RETRY_MS 5000
+/// Replays of a message that fails to be delivered, before skipping it
+#define SPILL_MAX_ATTEMPTS 5
+/// Max iovecs of one writev call. Every message uses 2.
+#define SPILL_IOV_MAX 1024
+
+#define SPILL_SEGMENT_SUFFIX ".spill"
+/// Segment file names are their base offset, zero padded
+#define SPILL_SEGMENT_OFFSET_DIGITS 20
+
+/** Segment record, followed by topic (null terminated), key, headers and
+    payload. Headers are serialized as name size (2 bytes), name, value size
+    (4 bytes) and value. Segments are local, so host byte order is used. */
+struct spill_record_header {
+	uint64_t offset;
+	int64_t timestamp;
+	/// Record size, without this header
+	uint32_t size;
+	uint32_t key_size;
+	uint32_t headers_size;
+	/// Topic name size, null terminator included
+	uint16_t topic_size;
+	uint16_t headers_count;
+};
+
+struct spill_record {
+	struct spill_record_header header;
+	const char *topic;
+	const char *key;
+	const char *headers;
+	const char *payload;
+	size_t payload_size;
+};
+
+struct spill_segment {
+	TAILQ_ENTRY(spill_segment) entry;
+	uint64_t base_offset;
+	size_t size;
+	/// Segment file if it's being written, -1 if it's sealed
+	int fd;
+
+	/// Replay state
+	char *map;
+	size_t map_size;
+	/// One slot per replayed record, in segment order
+	struct ack_window *window;
+	/// Every record after replay_pos has been produced
+	int replayed;
+	/// Position of the first record not delivered yet
+	size_t replay_pos;
+	/// Failed replays of the record at replay_pos
+	unsigned attempts;
+
+	char path[];
+};
+
+TAILQ_HEAD(spill_segment_list,spill_segment);
+
+struct spill_entry {
+	TAILQ_ENTRY(spill_entry) entry;
+	char *payload;
+	struct ack_slot *ack;
+	/// Topic, key and headers size
+	size_t meta_size;
+	/// Record header. Topic, key and headers follow entry, so they are
+	/// written along with it.
+	struct spill_record_header header;
+};
+
+TAILQ_HEAD(spill_entry_list,spill_entry);
+
+static struct {
+	pthread_mutex_t mutex;
+	/// Writer thread waits for pending messages
+	pthread_cond_t writer_cond;
+	/// Replay thread waits for sealed segments and delivery reports
+	pthread_cond_t replay_cond;
+
+	struct {
+		char *dir;
+		size_t high_watermark;
+		size_t low_watermark;
+		size_t segment_size;
+		/// Max bytes in disk, 0 for no limit
+		size_t max_bytes;
+		/// Replayed messages per second, 0 for no limit
+		size_t replay_rate;
+	} config;
+
+	int configured;
+	int running;
+	int stop;
+	pthread_t writer;
+	pthread_t replayer;
+
+	/// Messages waiting for writer thread
+	struct spill_entry_list pending;
+	size_t pending_bytes;
+	uint64_t next_offset;
+	uint64_t last_push_ms;
+	/// Bytes of segments and pending messages
+	size_t disk_bytes;
+
+	/// Segment being written. Only writer thread uses it.
+	struct spill_segment *active;
+	/// Sealed segments, oldest first
+	struct spill_segment_list sealed;
+
+	struct {
+		uint64_t spilled;
+		/// Messages that did not fit
+		uint64_t rejected;
+		/// Messages that could not be written
+		uint64_t write_failed;
+		uint64_t replayed;
+		uint64_t replay_failed;
+	} counters;
+} spill = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.writer_cond = PTHREAD_COND_INITIALIZER,
+	.replay_cond = PTHREAD_COND_INITIALIZER,
+	.pending = TAILQ_HEAD_INITIALIZER(spill.pending),
+	.sealed = TAILQ_HEAD_INITIALIZER(spill.sealed),
+};
+
+static __thread char errbuf[256];
+
+/// Wait on cond for ms milliseconds at most. Needs spill mutex.
+static void spill_cond_wait_ms(pthread_cond_t *cond,unsigned ms) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	ts.tv_sec += ms/1000;
+	ts.tv_nsec += (long)(ms%1000)*1000000;
+	if(ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond,&spill.mutex,&ts);
+}
+
+/*
+ * Segments
+ */
+
+static struct spill_segment *spill_segment_new(uint64_t base_offset) {
+	const size_t dir_len = strlen(spill.config.dir);
+	const size_t path_size = dir_len + 1 + SPILL_SEGMENT_OFFSET_DIGITS
+		+ sizeof(SPILL_SEGMENT_SUFFIX);
+
+	struct spill_segment *segment = calloc(1,sizeof(*segment) + path_size);
+	if(NULL == segment) {
+		rdlog(LOG_ERR,"Can't allocate spill segment (out of memory?)");
+		return NULL;
+	}
+
+	segment->base_offset = base_offset;
+	segment->fd = -1;
+	snprintf(segment->path,path_size,"%s/%0*" PRIu64 SPILL_SEGMENT_SUFFIX,
+		spill.config.dir,SPILL_SEGMENT_OFFSET_DIGITS,base_offset);
+	return segment;
+}
+
+/// Release segment memory. Its replayed messages can't be in producer.
+static void spill_segment_free(struct spill_segment *segment) {
+	if(segment->window)
+		ack_window_close(segment->window);
+	if(segment->map)
+		munmap(segment->map,segment->map_size);
+	if(segment->fd >= 0)
+		close(segment->fd);
+	free(segment);
+}
+
+/** Parse the record at cursor
+    @return Next record, or NULL if there is not a complete record
+    */
+static const char *spill_record_parse(const char *cursor,const char *end,
+                                      struct spill_record *record) {
+	struct spill_record_header *header = &record->header;
+
+	if((size_t)(end - cursor) < sizeof(*header))
+		return NULL;
+
+	memcpy(header,cursor,sizeof(*header));
+	cursor += sizeof(*header);
+
+	const size_t meta_size = (size_t)header->topic_size + header->key_size
+		+ header->headers_size;
+	if(header->size > (size_t)(end - cursor) || meta_size > header->size
+	                                            || 0 == header->topic_size)
+		return NULL;
+
+	record->topic = cursor;
+	if('\0' != record->topic[header->topic_size - 1])
+		return NULL;
+	record->key = record->topic + header->topic_size;
+	record->headers = record->key + header->key_size;
+	record->payload = record->headers + header->headers_size;
+	record->payload_size = header->size - meta_size;
+
+	return cursor + header->size;
+}
+
+/// Kafka headers of a record, or NULL if it has none
+static rd_kafka_headers_t *spill_record_headers(
+                                         const struct spill_record *record) {
+	const char *cursor = record->headers;
+	const char *end = cursor + record->header.headers_size;
+	uint16_t name_size;
+	uint32_t value_size;
+	size_t i;
+
+	if(0 == record->header.headers_count)
+		return NULL;
+
+	rd_kafka_headers_t *headers =
+		rd_kafka_headers_new(record->header.headers_count);
+	for(i=0;i<record->header.headers_count;++i) {
+		if((size_t)(end - cursor) < sizeof(name_size))
+			break;
+		memcpy(&name_size,cursor,sizeof(name_size));
+		cursor += sizeof(name_size);
+		if((size_t)(end - cursor) < name_size + sizeof(value_size))
+			break;
+
+		const char *name = cursor;
+		cursor += name_size;
+		memcpy(&value_size,cursor,sizeof(value_size));
+		cursor += sizeof(value_size);
+		if((size_t)(end - cursor) < value_size)
+			break;
+
+		rd_kafka_header_add(headers,name,name_size,cursor,value_size);
+		cursor += value_size;
+	}
+
+	return headers;
+}
+
+/// Map a sealed segment. Return 0 on success.
+static int spill_segment_map(struct spill_segment *segment) {
+	struct stat st;
+
+	const int fd = open(segment->path,O_RDONLY | O_CLOEXEC);
+	if(fd < 0 || 0 != fstat(fd,&st)) {
+		rdlog(LOG_ERR,"Can't open spill segment %s: %s",segment->path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	segment->map_size = (size_t)st.st_size;
+	segment->map = segment->map_size > 0 ? mmap(NULL,segment->map_size,
+		PROT_READ,MAP_SHARED,fd,0) : NULL;
+	close(fd);
+
+	if(MAP_FAILED == segment->map) {
+		rdlog(LOG_ERR,"Can't map spill segment %s: %s",segment->path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		segment->map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/// Offset after the last complete record of a segment
+static uint64_t spill_segment_end_offset(struct spill_segment *segment) {
+	struct spill_record record;
+	uint64_t end_offset = segment->base_offset;
+
+	if(0 != spill_segment_map(segment))
+		return end_offset;
+
+	const char *cursor = segment->map;
+	const char *end = cursor + segment->map_size;
+	while(cursor && cursor < end) {
+		cursor = spill_record_parse(cursor,end,&record);
+		if(cursor)
+			end_offset = record.header.offset + 1;
+	}
+
+	if(segment->map)
+		munmap(segment->map,segment->map_size);
+	segment->map = NULL;
+	return end_offset;
+}
+
+/// Add segments of previous runs, so they are replayed
+static int spill_scan(char *err,size_t errsize) {
+	const size_t name_len = SPILL_SEGMENT_OFFSET_DIGITS
+		+ strlen(SPILL_SEGMENT_SUFFIX);
+	struct dirent *dirent;
+	struct stat st;
+
+	DIR *dir = opendir(spill.config.dir);
+	if(NULL == dir) {
+		snprintf(err,errsize,"Can't open spill dir %s: %s",spill.config.dir,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	while((dirent = readdir(dir))) {
+		const char *name = dirent->d_name;
+		if(strlen(name) != name_len || strspn(name,"0123456789")
+		                                    != SPILL_SEGMENT_OFFSET_DIGITS
+		        || 0 != strcmp(&name[SPILL_SEGMENT_OFFSET_DIGITS],
+		                       SPILL_SEGMENT_SUFFIX))
+			continue;
+
+		struct spill_segment *segment = spill_segment_new(
+			strtoull(name,NULL,10));
+		if(NULL == segment)
+			continue;
+
+		if(0 != stat(segment->path,&st) || 0 == st.st_size) {
+			unlink(segment->path);
+			free(segment);
+			continue;
+		}
+
+		/* Oldest first */
+		struct spill_segment *i = NULL;
+		segment->size = (size_t)st.st_size;
+		spill.disk_bytes += segment->size;
+		TAILQ_FOREACH(i,&spill.sealed,entry) {
+			if(i->base_offset > segment->base_offset)
+				break;
+		}
+		if(i)
+			TAILQ_INSERT_BEFORE(i,segment,entry);
+		else
+			TAILQ_INSERT_TAIL(&spill.sealed,segment,entry);
+	}
+	closedir(dir);
+
+	struct spill_segment *last = TAILQ_LAST(&spill.sealed,spill_segment_list);
+	if(last) {
+		spill.next_offset = spill_segment_end_offset(last);
+		rdlog(LOG_INFO,"%zu bytes of spilled messages will be replayed",
+			spill.disk_bytes);
+	}
+
+	return 0;
+}
+
+/*
+ * Writer thread
+ */
+
+/// Seal active segment, so it can be replayed. Needs spill mutex.
+static void spill_seal_active() {
+	struct spill_segment *segment = spill.active;
+
+	spill.active = NULL;
+	close(segment->fd);
+	segment->fd = -1;
+	if(0 == segment->size) {
+		unlink(segment->path);
+		free(segment);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&spill.sealed,segment,entry);
+	pthread_cond_signal(&spill.replay_cond);
+}
+
+/// Write all iovecs, continuing after partial writes
+static int spill_writev(int fd,struct iovec *iov,int iovcnt) {
+	while(iovcnt > 0) {
+		const ssize_t written = writev(fd,iov,iovcnt);
+		if(written < 0) {
+			if(EINTR == errno)
+				continue;
+			return -1;
+		}
+
+		size_t left = (size_t)written;
+		while(iovcnt > 0 && left >= iov->iov_len) {
+			left -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + left;
+			iov->iov_len -= left;
+		}
+	}
+
+	return 0;
+}
+
+/** Append a batch of messages to active segment, and sync it. Segments are
+    rotated between batches.
+    @return 0 on success
+    */
+static int spill_write_batch(struct spill_entry_list *batch) {
+	struct iovec iov[SPILL_IOV_MAX];
+	struct spill_entry *entry = NULL;
+	size_t batch_size = 0;
+	int iovcnt = 0,rc = 0;
+
+	if(spill.active && spill.active->size >= spill.config.segment_size) {
+		pthread_mutex_lock(&spill.mutex);
+		spill_seal_active();
+		pthread_mutex_unlock(&spill.mutex);
+	}
+
+	if(NULL == spill.active) {
+		struct spill_segment *segment = spill_segment_new(
+			TAILQ_FIRST(batch)->header.offset);
+		if(NULL == segment)
+			return -1;
+
+		segment->fd = open(segment->path,
+			O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,0640);
+		if(segment->fd < 0) {
+			rdlog(LOG_ERR,"Can't create spill segment %s: %s",segment->path,
+				mystrerror(errno,errbuf,sizeof(errbuf)));
+			free(segment);
+			return -1;
+		}
+		spill.active = segment;
+	}
+
+	TAILQ_FOREACH(entry,batch,entry) {
+		iov[iovcnt].iov_base = &entry->header;
+		iov[iovcnt].iov_len = sizeof(entry->header) + entry->meta_size;
+		iov[iovcnt+1].iov_base = entry->payload;
+		iov[iovcnt+1].iov_len = entry->header.size - entry->meta_size;
+		batch_size += sizeof(entry->header) + entry->header.size;
+		iovcnt += 2;
+
+		if(SPILL_IOV_MAX == iovcnt) {
+			rc = spill_writev(spill.active->fd,iov,iovcnt);
+			iovcnt = 0;
+			if(0 != rc)
+				break;
+		}
+	}
+
+	if(0 == rc && iovcnt > 0)
+		rc = spill_writev(spill.active->fd,iov,iovcnt);
+	if(0 == rc)
+		rc = fdatasync(spill.active->fd);
+
+	if(0 != rc) {
+		rdlog(LOG_ERR,"Can't write spill segment %s: %s",spill.active->path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		/* Don't leave an incomplete record */
+		if(0 != ftruncate(spill.active->fd,(off_t)spill.active->size)) {
+			pthread_mutex_lock(&spill.mutex);
+			spill_seal_active();
+			pthread_mutex_unlock(&spill.mutex);
+		}
+		return -1;
+	}
+
+	spill.active->size += batch_size;
+	return 0;
+}
+
+/// Release written (or not) messages
+static void spill_batch_done(struct spill_entry_list *batch,int failed) {
+	struct spill_entry *entry = NULL;
+	size_t count = 0,bytes = 0;
+
+	while((entry = TAILQ_FIRST(batch))) {
+		TAILQ_REMOVE(batch,entry,entry);
+		if(entry->ack)
+			ack_slot_release(entry->ack,failed);
+		count++;
+		bytes += sizeof(entry->header) + entry->header.size;
+		free(entry->payload);
+		free(entry);
+	}
+
+	if(failed) {
+		ATOMIC_ADD(spill.counters.write_failed,count);
+		pthread_mutex_lock(&spill.mutex);
+		spill.disk_bytes -= bytes;
+		pthread_mutex_unlock(&spill.mutex);
+	}
+}
+
+static void *spill_writer_main(void *unused RB_UNUSED) {
+	struct spill_entry_list batch = TAILQ_HEAD_INITIALIZER(batch);
+
+	pthread_mutex_lock(&spill.mutex);
+	while(1) {
+		if(TAILQ_EMPTY(&spill.pending)) {
+			if(spill.stop)
+				break;
+
+			if(spill.active && monotonic_ms() - spill.last_push_ms
+			                                       >= SPILL_SEAL_IDLE_MS)
+				spill_seal_active();
+			spill_cond_wait_ms(&spill.writer_cond,SPILL_SEAL_IDLE_MS);
+			continue;
+		}
+
+		TAILQ_CONCAT(&batch,&spill.pending,entry);
+		spill.pending_bytes = 0;
+		pthread_mutex_unlock(&spill.mutex);
+
+		const int rc = spill_write_batch(&batch);
+		spill_batch_done(&batch,0 != rc);
+
+		pthread_mutex_lock(&spill.mutex);
+	}
+
+	/* Next run will replay it */
+	if(spill.active)
+		spill_seal_active();
+	pthread_mutex_unlock(&spill.mutex);
+
+	return NULL;
+}
+
+/*
+ * Replay thread
+ */
+
+/// Position of the record that follows count records of pos
+static size_t spill_segment_skip(const struct spill_segment *segment,
+                                 size_t pos,uint64_t count) {
+	struct spill_record record;
+	const char *cursor = segment->map + pos;
+	const char *end = segment->map + segment->map_size;
+
+	while(count-- > 0 && cursor && cursor < end)
+		cursor = spill_record_parse(cursor,end,&record);
+
+	return cursor ? (size_t)(cursor - segment->map) : segment->map_size;
+}
+
+/** A replay stopped at the record at replay_pos, because it was not
+    delivered. Skip it if it has failed too many times. */
+static void spill_segment_record_failed(struct spill_segment *segment) {
+	struct spill_record record;
+	const char *end = segment->map + segment->map_size;
+
+	if(++segment->attempts < SPILL_MAX_ATTEMPTS)
+		return;
+
+	if(spill_record_parse(segment->map + segment->replay_pos,end,&record)) {
+		rdlog(LOG_ERR,"Spilled message %" PRIu64 " has not been delivered "
+			"after %d attempts, skipping it",record.header.offset,
+			SPILL_MAX_ATTEMPTS);
+		ATOMIC_INC(spill.counters.replay_failed);
+	}
+	segment->replay_pos = spill_segment_skip(segment,segment->replay_pos,1);
+	segment->attempts = 0;
+}
+
+/** Produce segment messages from its first undelivered one, and wait for
+    their delivery reports. Every message has its own ack slot, so next
+    replay starts from the first one that has not been delivered. Messages
+    that can't be produced (unknown topic, too large) are skipped.
+    @return 0 if all messages have been delivered
+    */
+static int spill_replay_segment(struct spill_segment *segment) {
+	struct spill_record record;
+	struct ack_slot *slot = NULL;
+	uint64_t acked = 0;
+	int failed = 0;
+	size_t produced = 0;
+
+	if(0 != spill_segment_map(segment))
+		return -1;
+
+	/* Records not acked yet are in producer queue, that replay keeps under
+	   high watermark */
+	segment->replayed = 0;
+	segment->window = ack_window_new(spill.config.high_watermark,NULL,NULL);
+	if(NULL == segment->window) {
+		munmap(segment->map,segment->map_size);
+		segment->map = NULL;
+		return -1;
+	}
+
+	const uint64_t start_ms = monotonic_ms();
+	const char *cursor = segment->map + segment->replay_pos;
+	const char *end = segment->map + segment->map_size;
+	while(cursor < end && !ATOMIC_LOAD(spill.stop)) {
+		const char *next = spill_record_parse(cursor,end,&record);
+		if(NULL == next) {
+			rdlog(LOG_WARNING,"Spill segment %s has an incomplete record "
+				"after %zu messages, skipping it",segment->path,produced);
+			cursor = end;
+			break;
+		}
+
+		/* Next records would be replayed again anyway */
+		ack_window_acked(segment->window,&acked,&failed);
+		if(failed)
+			break;
+
+		if(spill.config.replay_rate > 0) {
+			const uint64_t due_ms = start_ms
+				+ produced*1000/spill.config.replay_rate;
+			const uint64_t now_ms = monotonic_ms();
+			if(due_ms > now_ms)
+				usleep((useconds_t)(due_ms - now_ms)*1000);
+		}
+
+		/* Keep room in producer queue, or live messages would be spilled
+		   again */
+		if(kafka_outq_len() >= spill.config.high_watermark
+		        || (NULL == slot && ack_window_full(segment->window))) {
+			usleep(SPILL_FULL_WAIT_MS*1000);
+			continue;
+		}
+
+		/* Payload stays mapped until segment is delivered */
+		if(NULL == slot)
+			slot = ack_window_push(segment->window,produced);
+		ack_slot_ref(slot);
+		const int err = kafka_produce_spilled(record.topic,
+			(char *)(uintptr_t)record.payload,record.payload_size,record.key,
+			record.header.key_size,spill_record_headers(&record),
+			record.header.timestamp,slot);
+		if(RD_KAFKA_RESP_ERR__QUEUE_FULL == err) {
+			ack_slot_release(slot,0);
+			usleep(SPILL_FULL_WAIT_MS*1000);
+			continue;
+		}
+
+		if(RD_KAFKA_RESP_ERR_NO_ERROR != err) {
+			/* It would fail again in every replay */
+			rdlog(LOG_ERR,"Can't replay spilled message %" PRIu64 ": %s, "
+				"skipping it",record.header.offset,rd_kafka_err2str(err));
+			ack_slot_release(slot,0);
+			ATOMIC_INC(spill.counters.replay_failed);
+		} else {
+			ATOMIC_INC(spill.counters.replayed);
+		}
+
+		ack_slot_release(slot,0);
+		slot = NULL;
+		produced++;
+		cursor = next;
+	}
+
+	/* Record that could not be produced before stopping */
+	if(slot)
+		ack_slot_release(slot,1);
+	segment->replayed = cursor == end;
+
+	while(!ack_window_idle(segment->window) && !ATOMIC_LOAD(spill.stop))
+		usleep(SPILL_FULL_WAIT_MS*1000);
+
+	/* Messages still in producer keep it mapped until spill_done() */
+	if(!ack_window_idle(segment->window))
+		return -1;
+
+	const int any_acked = ack_window_acked(segment->window,&acked,&failed);
+	ack_window_close(segment->window);
+	segment->window = NULL;
+
+	if(any_acked) {
+		segment->replay_pos = spill_segment_skip(segment,segment->replay_pos,
+			acked + 1);
+		segment->attempts = 0;
+	}
+	if(failed && !ATOMIC_LOAD(spill.stop))
+		spill_segment_record_failed(segment);
+
+	const int done = segment->replay_pos == segment->map_size
+		|| (segment->replayed && !failed);
+	if(segment->map)
+		munmap(segment->map,segment->map_size);
+	segment->map = NULL;
+
+	return done ? 0 : -1;
+}
+
+static void *spill_replay_main(void *unused RB_UNUSED) {
+	uint64_t retry_ms = 0;
+
+	pthread_mutex_lock(&spill.mutex);
+	while(!spill.stop) {
+		struct spill_segment *segment = TAILQ_FIRST(&spill.sealed);
+		if(NULL == segment || monotonic_ms() < retry_ms
+		           || kafka_outq_len() >= spill.config.low_watermark) {
+			spill_cond_wait_ms(&spill.replay_cond,SPILL_REPLAY_WAIT_MS);
+			continue;
+		}
+
+		pthread_mutex_unlock(&spill.mutex);
+		const int rc = spill_replay_segment(segment);
+		pthread_mutex_lock(&spill.mutex);
+
+		if(0 == rc) {
+			TAILQ_REMOVE(&spill.sealed,segment,entry);
+			spill.disk_bytes -= segment->size;
+			unlink(segment->path);
+			spill_segment_free(segment);
+		} else if(!spill.stop) {
+			rdlog(LOG_WARNING,"Spill segment %s has undelivered messages, "
+				"replaying it again in %d ms",segment->path,SPILL_RETRY_MS);
+			retry_ms = monotonic_ms() + SPILL_RETRY_MS;
+		}
+	}
+	pthread_mutex_unlock(&spill.mutex);
+
+	return NULL;
+}
+
+/*
+ * Public
+ */
+
+int spill_config(json_t *config,char *err,size_t errsize) {
+	json_error_t jerr;
+	const char *dir = NULL;
+	json_int_t high_watermark = SPILL_DEFAULT_HIGH_WATERMARK;
+	json_int_t low_watermark = -1;
+	json_int_t segment_size = SPILL_DEFAULT_SEGMENT_SIZE;
+	json_int_t max_bytes = 0;
+	json_int_t replay_rate = SPILL_DEFAULT_REPLAY_RATE;
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,
+		"{s:s,s?I,s?I,s?I,s?I,s?I}","dir",&dir,
+		"high_watermark",&high_watermark,"low_watermark",&low_watermark,
+		"segment_size",&segment_size,"max_bytes",&max_bytes,
+		"replay_rate",&replay_rate);
+	if(0 != unpack_rc) {
+		snprintf(err,errsize,"Can't decode spill config: %s",jerr.text);
+		return -1;
+	}
+
+	if(low_watermark < 0)
+		low_watermark = high_watermark/2;
+
+	if(high_watermark <= 0 || low_watermark > high_watermark) {
+		snprintf(err,errsize,"Spill high_watermark has to be > 0, and "
+			"greater than low_watermark");
+		return -1;
+	}
+
+	if(segment_size <= 0 || segment_size > UINT32_MAX) {
+		snprintf(err,errsize,"Spill segment_size has to be > 0 and < 4GB");
+		return -1;
+	}
+
+	if(max_bytes < 0 || replay_rate < 0) {
+		snprintf(err,errsize,"Spill max_bytes and replay_rate can't be "
+			"negative");
+		return -1;
+	}
+
+	if(spill.configured) {
+		snprintf(err,errsize,"Spill can only be configured once");
+		return -1;
+	}
+
+	if(0 != mkdir(dir,0750) && EEXIST != errno) {
+		snprintf(err,errsize,"Can't create spill dir %s: %s",dir,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	spill.config.dir = strdup(dir);
+	if(NULL == spill.config.dir) {
+		snprintf(err,errsize,"Can't allocate spill dir (out of memory?)");
+		return -1;
+	}
+
+	spill.config.high_watermark = (size_t)high_watermark;
+	spill.config.low_watermark = (size_t)low_watermark;
+	spill.config.segment_size = (size_t)segment_size;
+	spill.config.max_bytes = (size_t)max_bytes;
+	spill.config.replay_rate = (size_t)replay_rate;
+
+	if(0 != spill_scan(err,errsize)) {
+		free(spill.config.dir);
+		spill.config.dir = NULL;
+		return -1;
+	}
+
+	spill.configured = 1;
+	return 0;
+}
+
+void spill_start() {
+	if(!spill.configured)
+		return;
+
+	if(0 != pthread_create(&spill.writer,NULL,spill_writer_main,NULL)) {
+		rdlog(LOG_ERR,"Can't create spill writer thread");
+		return;
+	}
+
+	if(0 != pthread_create(&spill.replayer,NULL,spill_replay_main,NULL)) {
+		rdlog(LOG_ERR,"Can't create spill replay thread");
+		pthread_mutex_lock(&spill.mutex);
+		spill.stop = 1;
+		pthread_cond_signal(&spill.writer_cond);
+		pthread_mutex_unlock(&spill.mutex);
+		pthread_join(spill.writer,NULL);
+		return;
+	}
+
+	ATOMIC_STORE(spill.running,1);
+}
+
+int spill_wanted(size_t outq_len) {
+	return ATOMIC_LOAD(spill.running)
+		&& outq_len >= spill.config.high_watermark;
+}
+
+int spill_push(const char *topic,char *buf,size_t size,int flags,
+               const void *key,size_t key_size,rd_kafka_headers_t *headers,
+               int64_t timestamp,struct ack_slot *ack) {
+	const char *name = NULL;
+	const void *value = NULL;
+	size_t i,value_size = 0,headers_size = 0,headers_count = 0;
+
+	for(i=0;headers && 0 == rd_kafka_header_get_all(headers,i,&name,&value,
+	                                                 &value_size);++i) {
+		headers_size += sizeof(uint16_t) + strlen(name)
+			+ sizeof(uint32_t) + value_size;
+		headers_count++;
+	}
+
+	const size_t topic_size = strlen(topic) + 1;
+	const size_t meta_size = topic_size + key_size + headers_size;
+	const size_t record_size = sizeof(struct spill_record_header) + meta_size
+		+ size;
+	if(topic_size > UINT16_MAX || headers_count > UINT16_MAX
+	                       || record_size > spill.config.segment_size) {
+		ATOMIC_INC(spill.counters.rejected);
+		return -1;
+	}
+
+	struct spill_entry *entry = malloc(sizeof(*entry) + meta_size);
+	char *payload = (flags & RD_KAFKA_MSG_F_FREE) ? buf : malloc(size + 1);
+	if(NULL == entry || NULL == payload) {
+		rdlog(LOG_ERR,"Can't allocate spilled message (out of memory?)");
+		free(entry);
+		if(payload != buf)
+			free(payload);
+		return -1;
+	}
+
+	if(payload != buf)
+		memcpy(payload,buf,size);
+	entry->payload = payload;
+	entry->ack = ack;
+	entry->meta_size = meta_size;
+	entry->header.timestamp = timestamp;
+	entry->header.size = (uint32_t)(meta_size + size);
+	entry->header.key_size = (uint32_t)key_size;
+	entry->header.headers_size = (uint32_t)headers_size;
+	entry->header.topic_size = (uint16_t)topic_size;
+	entry->header.headers_count = (uint16_t)headers_count;
+
+	char *cursor = (char *)&entry[1];
+	memcpy(cursor,topic,topic_size);
+	cursor += topic_size;
+	if(key_size > 0)
+		memcpy(cursor,key,key_size);
+	cursor += key_size;
+	for(i=0;i<headers_count;++i) {
+		rd_kafka_header_get_all(headers,i,&name,&value,&value_size);
+		const uint16_t name_size = (uint16_t)strlen(name);
+		const uint32_t value_size32 = (uint32_t)value_size;
+		memcpy(cursor,&name_size,sizeof(name_size));
+		cursor += sizeof(name_size);
+		memcpy(cursor,name,name_size);
+		cursor += name_size;
+		memcpy(cursor,&value_size32,sizeof(value_size32));
+		cursor += sizeof(value_size32);
+		if(value_size > 0)
+			memcpy(cursor,value,value_size);
+		cursor += value_size;
+	}
+
+	pthread_mutex_lock(&spill.mutex);
+	/* Writer can't keep up, or disk is full */
+	const int full = spill.stop
+		|| spill.pending_bytes + record_size > spill.config.segment_size
+		|| (spill.config.max_bytes > 0
+		    && spill.disk_bytes + record_size > spill.config.max_bytes);
+	if(!full) {
+		entry->header.offset = spill.next_offset++;
+		if(TAILQ_EMPTY(&spill.pending))
+			pthread_cond_signal(&spill.writer_cond);
+		TAILQ_INSERT_TAIL(&spill.pending,entry,entry);
+		spill.pending_bytes += record_size;
+		spill.disk_bytes += record_size;
+		spill.last_push_ms = monotonic_ms();
+	}
+	pthread_mutex_unlock(&spill.mutex);
+
+	if(full) {
+		ATOMIC_INC(spill.counters.rejected);
+		if(payload != buf)
+			free(payload);
+		free(entry);
+		return -1;
+	}
+
+	ATOMIC_INC(spill.counters.spilled);
+	return 0;
+}
+
+void spill_stats(json_t *stats) {
+	struct spill_segment *i = NULL;
+	size_t segments = 0;
+
+	if(!spill.configured)
+		return;
+
+	pthread_mutex_lock(&spill.mutex);
+	TAILQ_FOREACH(i,&spill.sealed,entry)
+		segments++;
+	const size_t disk_bytes = spill.disk_bytes;
+	pthread_mutex_unlock(&spill.mutex);
+
+	json_object_set_new(stats,"spill_segments",
+		json_integer((json_int_t)segments));
+	json_object_set_new(stats,"spill_bytes",
+		json_integer((json_int_t)disk_bytes));
+	json_object_set_new(stats,"spilled",
+		json_integer((json_int_t)ATOMIC_LOAD(spill.counters.spilled)));
+	json_object_set_new(stats,"spill_rejected",
+		json_integer((json_int_t)ATOMIC_LOAD(spill.counters.rejected)));
+	json_object_set_new(stats,"spill_write_failed",
+		json_integer((json_int_t)ATOMIC_LOAD(spill.counters.write_failed)));
+	json_object_set_new(stats,"replayed",
+		json_integer((json_int_t)ATOMIC_LOAD(spill.counters.replayed)));
+	json_object_set_new(stats,"replay_failed",
+		json_integer((json_int_t)ATOMIC_LOAD(spill.counters.replay_failed)));
+}
+
+void spill_stop() {
+	if(!ATOMIC_LOAD(spill.running))
+		return;
+
+	pthread_mutex_lock(&spill.mutex);
+	ATOMIC_STORE(spill.stop,1);
+	pthread_cond_signal(&spill.writer_cond);
+	pthread_cond_signal(&spill.replay_cond);
+	pthread_mutex_unlock(&spill.mutex);
+
+	pthread_join(spill.writer,NULL);
+	pthread_join(spill.replayer,NULL);
+	ATOMIC_STORE(spill.running,0);
+}
+
+void spill_done() {
+	struct spill_segment *segment = NULL;
+	uint64_t acked = 0;
+	int failed = 0;
+
+	while((segment = TAILQ_FIRST(&spill.sealed))) {
+		TAILQ_REMOVE(&spill.sealed,segment,entry);
+		/* Replay delivered while stopping */
+		if(segment->window && segment->replayed
+		        && ack_window_idle(segment->window)
+		        && 1 == ack_window_acked(segment->window,&acked,&failed)
+		        && !failed)
+			unlink(segment->path);
+		spill_segment_free(segment);
+	}
+
+	free(spill.config.dir);
+	spill.config.dir = NULL;
+	spill.configured = 0;
+}
@@ -0,0 +1,80 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <librdkafka/rdkafka.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Local disk spill queue. When the producer queue goes over a high
+ * watermark (a broker outage, or a slow cluster), messages are appended to
+ * segment files instead of being discarded:
+ *
+ *   "spill":{"dir":"/var/spool/n2kafka","high_watermark":80000,
+ *            "segment_size":67108864,"max_bytes":10737418240,
+ *            "replay_rate":10000}
+ *
+ * One thread writes messages in batches (writev and fdatasync), and one
+ * thread replays sealed segments into the producer, mmap'd, when its queue
+ * is under the low watermark. A segment is deleted once all its messages
+ * have been delivered. Segments are named after the offset of their first
+ * message, and they are kept across restarts.
+ */
+
+struct ack_slot;
+struct json_t;
+
+/** Configure spill from its config object. Pending segments of previous runs
+    will be replayed.
+    @return 0 on success
+    */
+int spill_config(struct json_t *config,char *err,size_t errsize);
+
+/// Start spill threads, if spill has been configured
+void spill_start();
+
+/// Spill is running and producer queue (outq_len) is over high watermark
+int spill_wanted(size_t outq_len);
+
+/** Append a message to spill queue.
+    @param topic Message topic name
+    @param buf Message payload. Spill takes its ownership if flags has
+               RD_KAFKA_MSG_F_FREE, and copies it otherwise.
+    @param headers Message headers, or NULL. They are copied.
+    @param timestamp Message timestamp, 0 for produce time
+    @param ack Ack slot reference, or NULL. It is released when message is on
+               disk.
+    @return 0 if message has been spilled, -1 if it has to be produced by
+            caller (spill is full or stopped)
+    */
+int spill_push(const char *topic,char *buf,size_t size,int flags,
+               const void *key,size_t key_size,rd_kafka_headers_t *headers,
+               int64_t timestamp,struct ack_slot *ack);
+
+/// Add spill counters to stats
+void spill_stats(struct json_t *stats);
+
+/// Write pending messages and stop spill threads. Producer must still exist.
+void spill_stop();
+
+/** Release spill resources. Called after producer destruction, so no more
+    delivery reports are pending. */
+void spill_done();
@@ -0,0 +1,321 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stage.h"
+#include "util.h"
+
+#include "enrich.h"
+#include "validate.h"
+#include "project.h"
+#include "minify.h"
+#include "encode.h"
+#include "zstd_dict.h"
+#include "batch.h"
+#include "reassemble.h"
+#include "dedup.h"
+#include "aggregate.h"
+#include "sample.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_STAGE_TYPE_KEY "type"
+
+static const struct registered_stage registered_stages[] = {
+	{ENRICH_STAGE_TYPE,enrich_stage_process,enrich_stage_opaque_creator,
+		enrich_stage_opaque_reload,enrich_stage_opaque_destructor,NULL},
+	{VALIDATE_STAGE_TYPE,validate_stage_process,validate_stage_opaque_creator,
+		NULL,validate_stage_opaque_destructor,validate_stage_opaque_stats},
+	{PROJECT_STAGE_TYPE,project_stage_process,project_stage_opaque_creator,
+		NULL,project_stage_opaque_destructor,project_stage_opaque_stats},
+	{MINIFY_STAGE_TYPE,minify_stage_process,minify_stage_opaque_creator,
+		NULL,minify_stage_opaque_destructor,minify_stage_opaque_stats},
+	{ENCODE_STAGE_TYPE,encode_stage_process,encode_stage_opaque_creator,
+		NULL,encode_stage_opaque_destructor,encode_stage_opaque_stats},
+	{BATCH_STAGE_TYPE,batch_stage_process,batch_stage_opaque_creator,
+		NULL,batch_stage_opaque_destructor,batch_stage_opaque_stats},
+	{REASSEMBLE_STAGE_TYPE,reassemble_stage_process,
+		reassemble_stage_opaque_creator,NULL,
+		reassemble_stage_opaque_destructor,reassemble_stage_opaque_stats},
+	{DEDUP_STAGE_TYPE,dedup_stage_process,dedup_stage_opaque_creator,
+		NULL,dedup_stage_opaque_destructor,dedup_stage_opaque_stats},
+	{AGGREGATE_STAGE_TYPE,aggregate_stage_process,
+		aggregate_stage_opaque_creator,NULL,
+		aggregate_stage_opaque_destructor,aggregate_stage_opaque_stats},
+	{SAMPLE_STAGE_TYPE,sample_stage_process,sample_stage_opaque_creator,
+		NULL,sample_stage_opaque_destructor,sample_stage_opaque_stats},
+#ifdef HAVE_LIBZSTD
+	{ZSTD_DICT_STAGE_TYPE,zstd_dict_stage_process,
+		zstd_dict_stage_opaque_creator,zstd_dict_stage_opaque_reload,
+		zstd_dict_stage_opaque_destructor,zstd_dict_stage_opaque_stats},
+#endif
+};
+
+#define STAGE_CHAIN_MAGIC 0x5A6EC4A1A5E1L
+
+struct stage_chain{
+#ifdef STAGE_CHAIN_MAGIC
+	uint64_t magic;
+#endif
+	struct {
+		listener_callback cb;
+		void *opaque;
+		listener_opaque_reload reload;
+		listener_opaque_destructor destructor;
+		listener_opaque_stats stats;
+	} decoder;
+
+	size_t count;
+	struct stage *stages;
+};
+
+static const struct registered_stage *locate_registered_stage(const char *type) {
+	size_t i;
+	const size_t stages_length
+	    = sizeof(registered_stages)/sizeof(registered_stages[0]);
+
+	for(i=0;i<stages_length;++i) {
+		assert( NULL!=registered_stages[i].type );
+
+		if( 0 == strcmp(registered_stages[i].type, type) ) {
+			return &registered_stages[i];
+		}
+	}
+
+	return NULL;
+}
+
+void stage_forward(const struct stage *stage,char *buffer,size_t buf_size,
+                                                const struct msg_meta *meta) {
+	if(stage->next) {
+		stage->next->type->process(stage->next,buffer,buf_size,meta);
+	} else {
+		stage->chain->decoder.cb(buffer,buf_size,meta,stage->chain->decoder.opaque);
+	}
+}
+
+int msg_meta_add_header(struct msg_meta *meta,const char *name,
+                                         const void *value,size_t value_size) {
+	if(meta->headers_count == MSG_META_MAX_HEADERS)
+		return -1;
+
+	struct msg_header *header = &meta->headers[meta->headers_count++];
+	header->name = name;
+	header->value = value;
+	header->value_size = value_size;
+	return 0;
+}
+
+void stage_chain_process(char *buffer,size_t buf_size,const struct msg_meta *meta,
+                                                              void *_chain) {
+	const struct stage_chain *chain = _chain;
+#ifdef STAGE_CHAIN_MAGIC
+	assert(STAGE_CHAIN_MAGIC == chain->magic);
+#endif
+
+	if(chain->count > 0) {
+		chain->stages[0].type->process(&chain->stages[0],buffer,buf_size,meta);
+	} else {
+		chain->decoder.cb(buffer,buf_size,meta,chain->decoder.opaque);
+	}
+}
+
+static void destroy_stages(struct stage_chain *chain) {
+	size_t i;
+	for(i=0;i<chain->count;++i) {
+		struct stage *stage = &chain->stages[i];
+		if(stage->type->opaque_destructor)
+			stage->type->opaque_destructor(stage->opaque);
+	}
+	free(chain->stages);
+}
+
+static int create_stage(struct stage_chain *chain,size_t idx,json_t *config,
+                                                   char *err,size_t errsize) {
+	const char *type = NULL;
+	json_error_t jerr;
+	struct stage *stage = &chain->stages[idx];
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s:s}",
+		CONFIG_STAGE_TYPE_KEY,&type);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse stage %zu: %s",idx,jerr.text);
+		return -1;
+	}
+
+	stage->type = locate_registered_stage(type);
+	if(NULL == stage->type) {
+		snprintf(err,errsize,"Can't locate stage type %s",type);
+		return -1;
+	}
+
+	if(stage->type->opaque_creator) {
+		const int creator_rc = stage->type->opaque_creator(config,&stage->opaque,
+			err,errsize);
+		if(creator_rc != 0)
+			return -1;
+	}
+
+	stage->chain = chain;
+	if(idx > 0)
+		chain->stages[idx-1].next = stage;
+
+	return 0;
+}
+
+struct stage_chain *stage_chain_new(json_t *stages_config,
+	listener_callback decoder,void *decoder_opaque,
+	listener_opaque_reload decoder_reload,
+	listener_opaque_destructor decoder_destructor,
+	listener_opaque_stats decoder_stats,
+	char *err,size_t errsize) {
+
+	size_t i;
+	json_t *value = NULL;
+
+	if(!json_is_array(stages_config)) {
+		snprintf(err,errsize,"stages must be an array");
+		return NULL;
+	}
+
+	struct stage_chain *chain = calloc(1,sizeof(*chain));
+	if(NULL == chain) {
+		snprintf(err,errsize,"Can't allocate stage chain (out of memory?)");
+		return NULL;
+	}
+
+#ifdef STAGE_CHAIN_MAGIC
+	chain->magic = STAGE_CHAIN_MAGIC;
+#endif
+	chain->decoder.cb = decoder;
+	chain->decoder.opaque = decoder_opaque;
+	chain->decoder.reload = decoder_reload;
+	chain->decoder.destructor = decoder_destructor;
+	chain->decoder.stats = decoder_stats;
+
+	const size_t count = json_array_size(stages_config);
+	if(count > 0) {
+		chain->stages = calloc(count,sizeof(chain->stages[0]));
+		if(NULL == chain->stages) {
+			snprintf(err,errsize,"Can't allocate stages (out of memory?)");
+			free(chain);
+			return NULL;
+		}
+	}
+
+	json_array_foreach(stages_config,i,value) {
+		if(0 != create_stage(chain,i,value,err,errsize)) {
+			destroy_stages(chain);
+			free(chain);
+			return NULL;
+		}
+		chain->count++;
+	}
+
+	return chain;
+}
+
+int stage_chain_reload(json_t *listener_config,void *_chain) {
+	size_t i;
+	int rc = 0;
+	json_t *stages_config = NULL;
+	struct stage_chain *chain = _chain;
+#ifdef STAGE_CHAIN_MAGIC
+	assert(STAGE_CHAIN_MAGIC == chain->magic);
+#endif
+
+	stages_config = json_object_get(listener_config,"stages");
+	if(json_array_size(stages_config) != chain->count) {
+		rdlog(LOG_ERR,"Can't change number of stages in reload."
+			" Restart n2kafka to apply changes.");
+		rc = -1;
+	} else {
+		for(i=0;i<chain->count;++i) {
+			const struct stage *stage = &chain->stages[i];
+			json_t *stage_config = json_array_get(stages_config,i);
+			const char *type = json_string_value(
+				json_object_get(stage_config,CONFIG_STAGE_TYPE_KEY));
+
+			if(NULL == type || 0 != strcmp(type,stage->type->type)) {
+				rdlog(LOG_ERR,"Can't change stage %zu type in reload."
+					" Restart n2kafka to apply changes.",i);
+				rc = -1;
+			} else if(stage->type->opaque_reload &&
+			      0 != stage->type->opaque_reload(stage_config,stage->opaque)) {
+				rdlog(LOG_ERR,"Can't reload stage %zu (%s)",i,type);
+				rc = -1;
+			}
+		}
+	}
+
+	if(chain->decoder.reload)
+		rc |= chain->decoder.reload(listener_config,chain->decoder.opaque);
+
+	return rc;
+}
+
+void stage_chain_stats(void *_chain,json_t *stats) {
+	size_t i;
+	const struct stage_chain *chain = _chain;
+#ifdef STAGE_CHAIN_MAGIC
+	assert(STAGE_CHAIN_MAGIC == chain->magic);
+#endif
+
+	json_t *stages_stats = json_array();
+	if(NULL == stages_stats) {
+		rdlog(LOG_ERR,"Can't allocate stages stats (out of memory?)");
+		return;
+	}
+
+	for(i=0;i<chain->count;++i) {
+		const struct stage *stage = &chain->stages[i];
+		json_t *stage_stats = json_object();
+		if(NULL == stage_stats) {
+			rdlog(LOG_ERR,"Can't allocate stage stats (out of memory?)");
+			break;
+		}
+
+		json_object_set_new(stage_stats,CONFIG_STAGE_TYPE_KEY,
+			json_string(stage->type->type));
+		if(stage->type->opaque_stats)
+			stage->type->opaque_stats(stage->opaque,stage_stats);
+		json_array_append_new(stages_stats,stage_stats);
+	}
+
+	json_object_set_new(stats,"stages",stages_stats);
+
+	if(chain->decoder.stats)
+		chain->decoder.stats(chain->decoder.opaque,stats);
+}
+
+int stage_chain_done(void *_chain) {
+	struct stage_chain *chain = _chain;
+#ifdef STAGE_CHAIN_MAGIC
+	assert(STAGE_CHAIN_MAGIC == chain->magic);
+#endif
+
+	destroy_stages(chain);
+	if(chain->decoder.destructor)
+		chain->decoder.destructor(chain->decoder.opaque);
+	free(chain);
+	return 0;
+}
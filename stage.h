@@ -0,0 +1,111 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "global_config.h"
+
+#include <stddef.h>
+
+/*
+ * Stages are optional steps that every message goes through between the
+ * listener and the decoder. They are configured per listener, in order:
+ *
+ *   {"proto":"udp","port":2058,
+ *    "stages":[{"type":"enrich","table":"/etc/n2kafka/sites.bin"}]}
+ *
+ * Stage process callbacks are called concurrently from all listener threads,
+ * so stage opaques have to be thread safe.
+ */
+
+struct json_t;
+struct stage;
+struct stage_chain;
+
+/// Create stage private data from its config. Return 0 on success.
+typedef int (*stage_opaque_creator)(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+/// Reload stage private data. Return 0 on success.
+typedef int (*stage_opaque_reload)(struct json_t *config,void *opaque);
+typedef void (*stage_opaque_destructor)(void *opaque);
+/// Add stage counters to stats json object
+typedef void (*stage_opaque_stats)(void *opaque,struct json_t *stats);
+
+/** Process a message. Stage owns buffer: it has to pass it to the next one
+    with stage_forward, or free it.
+    */
+typedef void (*stage_process)(const struct stage *stage,char *buffer,
+                             size_t buf_size,const struct msg_meta *meta);
+
+struct registered_stage{
+	const char *type;
+	stage_process process;
+	stage_opaque_creator opaque_creator;
+	stage_opaque_reload opaque_reload;
+	stage_opaque_destructor opaque_destructor;
+	stage_opaque_stats opaque_stats;
+};
+
+struct stage{
+	const struct registered_stage *type;
+	void *opaque;
+	const struct stage_chain *chain;
+	/// Next stage, or NULL if the next step is the decoder
+	const struct stage *next;
+};
+
+/// Pass a message to the next stage, or to the decoder if this is the last one
+void stage_forward(const struct stage *stage,char *buffer,size_t buf_size,
+                                                 const struct msg_meta *meta);
+
+/** Add a kafka header to a message meta.
+    @return 0 on success, -1 if there is no room for more headers
+    */
+int msg_meta_add_header(struct msg_meta *meta,const char *name,
+                                          const void *value,size_t value_size);
+
+/** Creates a stage chain.
+    @param stages_config JSON array with stages config.
+    @param decoder Decoder to send messages after all stages.
+    @param decoder_opaque Decoder opaque.
+    @param decoder_reload Decoder opaque reload function (can be NULL)
+    @param decoder_destructor Decoder opaque destructor (can be NULL)
+    @param decoder_stats Decoder opaque stats (can be NULL)
+    @param err Error buffer
+    @param errsize Error buffer size
+    @return New stage chain, or NULL in case of error
+    */
+struct stage_chain *stage_chain_new(struct json_t *stages_config,
+	listener_callback decoder,void *decoder_opaque,
+	listener_opaque_reload decoder_reload,
+	listener_opaque_destructor decoder_destructor,
+	listener_opaque_stats decoder_stats,
+	char *err,size_t errsize);
+
+/// Stage chain entry point. Use it as listener callback with chain as opaque
+void stage_chain_process(char *buffer,size_t buf_size,const struct msg_meta *meta,
+                                                               void *chain);
+
+/// Reload stages and decoder with new listener config
+int stage_chain_reload(struct json_t *listener_config,void *chain);
+
+/// Add stages and decoder counters to listener stats
+void stage_chain_stats(void *chain,struct json_t *stats);
+
+/// Destroy stages and decoder opaque
+int stage_chain_done(void *chain);
@@ -0,0 +1,229 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measure encode stage throughput against pass-through (copy the message and
+ * forward it as it is), over a newline delimited JSON corpus. Every message
+ * goes through the same encode_stage_process() that listeners use, in one
+ * thread, and it's freed by the next stage like the decoder would do.
+ *
+ * Build it from the repository root, after ./configure:
+ *
+ *   cc -O2 -std=gnu99 -I. -o encode_bench tools/encode_bench.c \
+ *       encode.c avro.c json_scan.c ack.c -ljansson -lrd -lpthread
+ *
+ * Usage: encode_bench [-n passes] [-s schema.avsc] corpus.ndjson
+ *
+ * Avro is only measured with a schema, and corpus messages that don't fit it
+ * are counted as errors.
+ */
+
+#include "encode.h"
+#include "stage.h"
+
+#include <jansson.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PASSES 20
+
+struct corpus {
+	char **messages;
+	size_t *sizes;
+	size_t count;
+	size_t bytes;
+};
+
+/// Forwarded messages and bytes of the running measurement
+static struct {
+	size_t messages;
+	size_t bytes;
+} forwarded;
+
+/// Last stage of the benchmark chain: count the message and free it
+void stage_forward(const struct stage *stage,char *buffer,size_t buf_size,
+                                                const struct msg_meta *meta) {
+	(void)stage;
+	(void)meta;
+
+	forwarded.messages++;
+	forwarded.bytes += buf_size;
+	free(buffer);
+}
+
+static int corpus_load(const char *path,struct corpus *corpus) {
+	char *line = NULL;
+	size_t line_cap = 0,cap = 0;
+	ssize_t line_size;
+
+	FILE *file = fopen(path,"r");
+	if(NULL == file) {
+		perror(path);
+		return -1;
+	}
+
+	memset(corpus,0,sizeof(*corpus));
+	while((line_size = getline(&line,&line_cap,file)) > 0) {
+		while(line_size > 0 && ('\n' == line[line_size-1]
+		                                || '\r' == line[line_size-1]))
+			line_size--;
+		if(0 == line_size)
+			continue;
+
+		if(corpus->count == cap) {
+			cap = cap ? 2*cap : 1024;
+			corpus->messages = realloc(corpus->messages,
+				cap*sizeof(corpus->messages[0]));
+			corpus->sizes = realloc(corpus->sizes,
+				cap*sizeof(corpus->sizes[0]));
+			if(NULL == corpus->messages || NULL == corpus->sizes) {
+				fprintf(stderr,"Can't allocate corpus (out of memory?)\n");
+				exit(1);
+			}
+		}
+
+		corpus->messages[corpus->count] = strndup(line,(size_t)line_size);
+		corpus->sizes[corpus->count] = (size_t)line_size;
+		corpus->bytes += (size_t)line_size;
+		corpus->count++;
+	}
+
+	free(line);
+	fclose(file);
+	if(0 == corpus->count) {
+		fprintf(stderr,"%s: empty corpus\n",path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/** Run every corpus message through an encode stage passes times.
+    @param format Encode format, or NULL for pass-through
+    */
+static void bench_format(const char *format,const char *schema_path,
+                              const struct corpus *corpus,unsigned passes) {
+	struct stage stage;
+	char err[BUFSIZ];
+	size_t i;
+	unsigned pass;
+
+	memset(&stage,0,sizeof(stage));
+	if(format) {
+		json_t *config = json_pack("{s:s,s:s}","format",format,
+			"schema",schema_path ? schema_path : "");
+		const int rc = encode_stage_opaque_creator(config,&stage.opaque,
+			err,sizeof(err));
+		json_decref(config);
+		if(0 != rc) {
+			fprintf(stderr,"%s: %s\n",format,err);
+			return;
+		}
+	}
+
+	memset(&forwarded,0,sizeof(forwarded));
+	const double start = now_s();
+	for(pass=0;pass<passes;++pass) {
+		for(i=0;i<corpus->count;++i) {
+			char *buffer = malloc(corpus->sizes[i]);
+			if(NULL == buffer) {
+				fprintf(stderr,"Can't allocate message (out of memory?)\n");
+				exit(1);
+			}
+			memcpy(buffer,corpus->messages[i],corpus->sizes[i]);
+
+			if(format)
+				encode_stage_process(&stage,buffer,corpus->sizes[i],NULL);
+			else
+				stage_forward(&stage,buffer,corpus->sizes[i],NULL);
+		}
+	}
+	const double elapsed = now_s() - start;
+
+	const size_t messages = (size_t)passes*corpus->count;
+	const size_t bytes_in = (size_t)passes*corpus->bytes;
+	printf("%-8s %10.0f %10.2f %8.2f %10zu\n",format ? format : "pass",
+		bytes_in/elapsed/1e6,messages/elapsed/1e6,
+		(double)forwarded.bytes/bytes_in,messages - forwarded.messages);
+
+	if(format)
+		encode_stage_opaque_destructor(stage.opaque);
+}
+
+int main(int argc,char *argv[]) {
+	static const char *formats[] = {"msgpack","cbor","avro"};
+	const char *schema_path = NULL;
+	unsigned passes = DEFAULT_PASSES;
+	struct corpus corpus;
+	size_t i;
+	int opt;
+
+	while((opt = getopt(argc,argv,"n:s:")) != -1) {
+		switch(opt) {
+		case 'n':
+			passes = (unsigned)atoi(optarg);
+			break;
+		case 's':
+			schema_path = optarg;
+			break;
+		default:
+			fprintf(stderr,"Usage: %s [-n passes] [-s schema.avsc] "
+				"corpus.ndjson\n",argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind + 1 != argc || 0 == passes) {
+		fprintf(stderr,"Usage: %s [-n passes] [-s schema.avsc] "
+			"corpus.ndjson\n",argv[0]);
+		return 1;
+	}
+
+	if(0 != corpus_load(argv[optind],&corpus))
+		return 1;
+
+	printf("%zu messages, %.0f bytes average, %u passes\n",corpus.count,
+		(double)corpus.bytes/corpus.count,passes);
+	printf("%-8s %10s %10s %8s %10s\n","format","MB/s in","Mmsg/s",
+		"out/in","errors");
+
+	bench_format(NULL,NULL,&corpus,passes);
+	for(i=0;i<sizeof(formats)/sizeof(formats[0]);++i) {
+		if(0 == strcmp("avro",formats[i]) && NULL == schema_path)
+			continue;
+		bench_format(formats[i],schema_path,&corpus,passes);
+	}
+
+	for(i=0;i<corpus.count;++i)
+		free(corpus.messages[i]);
+	free(corpus.messages);
+	free(corpus.sizes);
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2015 Eneo Tecnologia S.L.
+# Author: Eugenio Perez <eupm90@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Generate n2kafka enrich stage table (see enrich.h) from a JSON file like:
+
+    {"10.0.0.0/8":{"customer":"acme"},
+     "10.1.0.0/16":{"customer":"acme","site":"mad1"}}
+
+Usage: enrich_table.py <input.json> <output.bin>
+"""
+
+import json
+import socket
+import struct
+import sys
+
+MAGIC = b"N2KE"
+VERSION = 1
+HDR = struct.Struct("=4sIII")
+RANGE = struct.Struct("=IIII")
+
+
+def parse_cidr(cidr):
+    addr, _, plen = cidr.partition("/")
+    plen = int(plen) if plen else 32
+    if not 0 <= plen <= 32:
+        raise ValueError("Invalid prefix length in %s" % cidr)
+    mask = (0xFFFFFFFF << (32 - plen)) & 0xFFFFFFFF
+    first = struct.unpack("!I", socket.inet_aton(addr))[0] & mask
+    return first, first | (~mask & 0xFFFFFFFF)
+
+
+def fragment(members):
+    if not isinstance(members, dict):
+        raise ValueError("Table values must be JSON objects")
+    # Object members without the braces, ready to be spliced
+    return json.dumps(members, separators=(",", ":"), sort_keys=True)[1:-1]
+
+
+def resolve_ranges(prefixes):
+    """Flatten nested prefixes in disjoint ranges, most specific wins"""
+    out = []
+
+    def emit(first, last, frag):
+        if first > last:
+            return
+        if out and out[-1][1] + 1 == first and out[-1][2] == frag:
+            out[-1][1] = last
+        else:
+            out.append([first, last, frag])
+
+    # Bigger prefixes first, so parents are pushed before their children
+    stack = []  # [first, last, fragment, cursor]
+    for first, last, frag in sorted(prefixes, key=lambda p: (p[0], -p[1])):
+        while stack and stack[-1][1] < first:
+            top = stack.pop()
+            emit(top[3], top[1], top[2])
+            if stack:
+                stack[-1][3] = top[1] + 1
+        if stack:
+            emit(stack[-1][3], first - 1, stack[-1][2])
+        stack.append([first, last, frag, first])
+
+    while stack:
+        top = stack.pop()
+        emit(top[3], top[1], top[2])
+        if stack:
+            stack[-1][3] = top[1] + 1
+
+    return out
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+
+    with open(argv[1]) as f:
+        table = json.load(f)
+
+    prefixes = {}
+    for cidr, members in table.items():
+        prefixes[parse_cidr(cidr)] = fragment(members)
+
+    ranges = resolve_ranges([(r[0], r[1], f) for r, f in prefixes.items()])
+
+    fragments = {}
+    blob = b""
+    fragments_start = HDR.size + RANGE.size * len(ranges)
+    for _, _, frag in ranges:
+        if frag not in fragments:
+            encoded = frag.encode("utf-8")
+            fragments[frag] = (fragments_start + len(blob), len(encoded))
+            blob += encoded
+
+    with open(argv[2], "wb") as f:
+        f.write(HDR.pack(MAGIC, VERSION, len(ranges), 0))
+        for first, last, frag in ranges:
+            f.write(RANGE.pack(first, last, *fragments[frag]))
+        f.write(blob)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
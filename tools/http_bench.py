@@ -0,0 +1,249 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2015 Eneo Tecnologia S.L.
+# Author: Eugenio Perez <eupm90@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Benchmark n2kafka HTTP listeners side by side, for example a
+libmicrohttpd one and a native (libev engine) one:
+
+    {"proto":"http","port":2057,"mode":"epoll","num_threads":4},
+    {"proto":"http","port":2058,"engine":"libev","num_threads":4}
+
+Every connection sends POST requests over one keep-alive connection, with
+up to `pipeline` requests in flight. With -2 they are sent as concurrent
+HTTP/2 streams, to listeners with "h2c":true.
+
+Usage: http_bench.py [-2] [-c connections] [-n requests] [-p pipeline]
+                     [-s body_size] [-u path] host:port [host:port ...]
+"""
+
+import getopt
+import multiprocessing
+import socket
+import struct
+import sys
+import time
+
+H2_PREFACE = b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+H2_DATA, H2_HEADERS, H2_RST_STREAM, H2_SETTINGS = 0x0, 0x1, 0x3, 0x4
+H2_GOAWAY = 0x7
+H2_END_STREAM, H2_ACK, H2_END_HEADERS = 0x1, 0x1, 0x4
+H2_MAX_FRAME_SIZE = 16384
+# Server max concurrent streams
+H2_MAX_STREAMS = 100
+
+
+def request(path, body):
+    return (b'POST ' + path.encode() + b' HTTP/1.1\r\n'
+            b'Host: n2kafka\r\n'
+            b'Content-Type: application/json\r\n'
+            b'Content-Length: ' + str(len(body)).encode() + b'\r\n'
+            b'\r\n' + body)
+
+
+def read_responses(sock, pending, count):
+    """Read count responses. Return (ok responses, pending data)"""
+    ok = 0
+    while count > 0:
+        head_end = pending.find(b'\r\n\r\n')
+        if head_end < 0:
+            data = sock.recv(65536)
+            if not data:
+                raise IOError('Connection closed by server')
+            pending += data
+            continue
+
+        if pending.startswith(b'HTTP/1.1 200'):
+            ok += 1
+        pending = pending[head_end + 4:]
+        count -= 1
+
+    return ok, pending
+
+
+def h2_frame(frame_type, flags, stream_id, payload=b''):
+    return (struct.pack('>I', len(payload))[1:] +
+            struct.pack('>BBI', frame_type, flags, stream_id) + payload)
+
+
+def hpack_int(value, prefix_bits, first_byte=0):
+    limit = (1 << prefix_bits) - 1
+    if value < limit:
+        return bytes([first_byte | value])
+    out = [first_byte | limit]
+    value -= limit
+    while value >= 128:
+        out.append(value % 128 + 128)
+        value //= 128
+    out.append(value)
+    return bytes(out)
+
+
+def hpack_literal(index, value):
+    """Literal header field without indexing, with static table name"""
+    return hpack_int(index, 4) + hpack_int(len(value), 7) + value
+
+
+def h2_header_block(host, path, body):
+    """Header block of a POST request"""
+    return (b'\x83\x86' +  # :method POST, :scheme http
+            hpack_literal(4, path.encode()) +
+            hpack_literal(1, host.encode()) +
+            hpack_literal(28, str(len(body)).encode()) +
+            hpack_literal(31, b'application/json'))
+
+
+def h2_request(stream_id, block, body):
+    """HEADERS and DATA frames of a POST request"""
+    frames = [h2_frame(H2_HEADERS, H2_END_HEADERS, stream_id, block)]
+    for offset in range(0, len(body), H2_MAX_FRAME_SIZE):
+        chunk = body[offset:offset + H2_MAX_FRAME_SIZE]
+        last = offset + H2_MAX_FRAME_SIZE >= len(body)
+        frames.append(h2_frame(H2_DATA, H2_END_STREAM if last else 0,
+                               stream_id, chunk))
+    return b''.join(frames)
+
+
+def h2_read_frame(sock, pending):
+    """Return (type, flags, stream id, payload, pending data)"""
+    while len(pending) < 9 or \
+            len(pending) < 9 + struct.unpack('>I', b'\0' + pending[:3])[0]:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError('Connection closed by server')
+        pending += data
+
+    length = struct.unpack('>I', b'\0' + pending[:3])[0]
+    frame_type, flags, stream_id = struct.unpack('>BBI', pending[3:9])
+    return (frame_type, flags, stream_id & 0x7fffffff,
+            pending[9:9 + length], pending[9 + length:])
+
+
+def h2_connection_worker(sock, host, requests, pipeline, path, body):
+    # Server settings raise the default flow control windows
+    sock.sendall(H2_PREFACE + h2_frame(H2_SETTINGS, 0, 0))
+    pending = b''
+    while True:
+        frame_type, flags, _, _, pending = h2_read_frame(sock, pending)
+        if frame_type == H2_SETTINGS and not flags & H2_ACK:
+            sock.sendall(h2_frame(H2_SETTINGS, H2_ACK, 0))
+            break
+
+    block = h2_header_block(host, path, body)
+    ok = 0
+    sent = 0
+    stream_id = 1
+    while sent < requests:
+        n = min(pipeline, requests - sent)
+        sock.sendall(b''.join(h2_request(stream_id + 2 * i, block, body)
+                              for i in range(n)))
+        stream_id += 2 * n
+        sent += n
+
+        answered = set()
+        while len(answered) < n:
+            frame_type, _, sid, payload, pending = h2_read_frame(sock,
+                                                                 pending)
+            if frame_type == H2_HEADERS:
+                answered.add(sid)
+                # Indexed :status 200 is the first header of a response
+                ok += 1 if payload[:1] == b'\x88' else 0
+            elif frame_type == H2_RST_STREAM:
+                answered.add(sid)
+            elif frame_type == H2_GOAWAY:
+                raise IOError('GOAWAY received')
+
+    return ok
+
+
+def connection_worker(args):
+    target, requests, pipeline, path, body, h2 = args
+    host, port = target.rsplit(':', 1)
+    sock = socket.create_connection((host, int(port)))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    if h2:
+        ok = h2_connection_worker(sock, host, requests, pipeline, path, body)
+        sock.close()
+        return ok
+
+    req = request(path, body)
+    pending = b''
+    ok = 0
+    sent = 0
+    while sent < requests:
+        n = min(pipeline, requests - sent)
+        sock.sendall(req * n)
+        sent += n
+        batch_ok, pending = read_responses(sock, pending, n)
+        ok += batch_ok
+
+    sock.close()
+    return ok
+
+
+def bench(target, connections, requests, pipeline, path, body, h2):
+    pool = multiprocessing.Pool(connections)
+    args = [(target, requests, pipeline, path, body, h2)] * connections
+    start = time.time()
+    ok = sum(pool.map(connection_worker, args))
+    elapsed = time.time() - start
+    pool.close()
+    pool.join()
+    return ok, connections * requests, elapsed
+
+
+def main(argv):
+    connections, requests, pipeline, body_size, path = 4, 10000, 1, 256, '/'
+    h2 = False
+    opts, targets = getopt.getopt(argv, '2c:n:p:s:u:')
+    for opt, value in opts:
+        if opt == '-2':
+            h2 = True
+        elif opt == '-c':
+            connections = int(value)
+        elif opt == '-n':
+            requests = int(value)
+        elif opt == '-p':
+            pipeline = int(value)
+        elif opt == '-s':
+            body_size = int(value)
+        elif opt == '-u':
+            path = value
+
+    if not targets:
+        sys.stderr.write(__doc__)
+        return 1
+
+    if h2 and pipeline > H2_MAX_STREAMS:
+        sys.stderr.write('HTTP/2 pipeline is limited to %d streams\n' %
+                         H2_MAX_STREAMS)
+        return 1
+
+    body = b'{"bench":"' + b'x' * max(body_size - 12, 0) + b'"}'
+    print('%-22s %10s %8s %10s %10s' % ('target', 'requests', 'errors',
+                                        'seconds', 'req/s'))
+    for target in targets:
+        ok, total, elapsed = bench(target, connections, requests, pipeline,
+                                   path, body, h2)
+        print('%-22s %10d %8d %10.2f %10.0f' % (target, total, total - ok,
+                                                elapsed, total / elapsed))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -20,13 +20,20 @@
 
 #include "librd/rdlog.h"
 
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #define RB_UNUSED __attribute__((unused))
 
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 
+#define ATOMIC_INC(var) __atomic_add_fetch(&(var),1,__ATOMIC_RELAXED)
+#define ATOMIC_ADD(var,n) __atomic_add_fetch(&(var),n,__ATOMIC_RELAXED)
+#define ATOMIC_LOAD(var) __atomic_load_n(&(var),__ATOMIC_RELAXED)
+#define ATOMIC_STORE(var,n) __atomic_store_n(&(var),n,__ATOMIC_RELAXED)
+
 #define rblog(x...) rdlog(x)
 
 #define fatal(msg...) do{rblog(LOG_ERR,msg);exit(1);}while(0)
@@ -34,4 +41,19 @@
 static inline char *mystrerror(int _errno,char *buffer,size_t buffer_size){
 	strerror_r(_errno,buffer,buffer_size);
 	return buffer;
-}
\ No newline at end of file
+}
+
+/// Wall clock, in seconds. It is only updated every few milliseconds, but it
+/// does not need a system call.
+static inline double coarse_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE,&ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+/// Monotonic clock, in milliseconds
+static inline uint64_t monotonic_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000 + (uint64_t)ts.tv_nsec/1000000;
+}
@@ -0,0 +1,146 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "validate.h"
+#include "json_scan.h"
+#include "kafka.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <librdkafka/rdkafka.h>
+#include <jansson.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_DEAD_LETTER_TOPIC_KEY "dead_letter_topic"
+
+#define VALIDATE_PRIVATE_MAGIC 0x7A11DA7E7A11DAL
+
+struct validate_private{
+#ifdef VALIDATE_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	char *dead_letter_topic;
+	/// Cached dead_letter_topic handler
+	rd_kafka_topic_t *dead_letter_rkt;
+
+	struct {
+		uint64_t valid;
+		uint64_t invalid;
+		uint64_t dead_letter;
+	} counters;
+};
+
+int validate_stage_opaque_creator(json_t *config,void **_opaque,
+                                                char *err,size_t errsize) {
+	const char *dead_letter_topic = NULL;
+	json_error_t jerr;
+
+	assert(_opaque);
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s?s}",
+		CONFIG_DEAD_LETTER_TOPIC_KEY,&dead_letter_topic);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse validate stage: %s",jerr.text);
+		return -1;
+	}
+
+	struct validate_private *priv = calloc(1,sizeof(*priv));
+	if(NULL == priv) {
+		snprintf(err,errsize,"Can't allocate validate private (out of memory?)");
+		return -1;
+	}
+
+#ifdef VALIDATE_PRIVATE_MAGIC
+	priv->magic = VALIDATE_PRIVATE_MAGIC;
+#endif
+
+	if(dead_letter_topic) {
+		priv->dead_letter_topic = strdup(dead_letter_topic);
+		if(NULL == priv->dead_letter_topic) {
+			snprintf(err,errsize,"Can't strdup dead letter topic (out of memory?)");
+			free(priv);
+			return -1;
+		}
+	}
+
+	*_opaque = priv;
+	return 0;
+}
+
+void validate_stage_opaque_destructor(void *opaque) {
+	struct validate_private *priv = opaque;
+#ifdef VALIDATE_PRIVATE_MAGIC
+	assert(VALIDATE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	free(priv->dead_letter_topic);
+	free(priv);
+}
+
+void validate_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct validate_private *priv = opaque;
+#ifdef VALIDATE_PRIVATE_MAGIC
+	assert(VALIDATE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"valid",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.valid)));
+	json_object_set_new(stats,"invalid",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.invalid)));
+	json_object_set_new(stats,"dead_letter",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.dead_letter)));
+}
+
+static rd_kafka_topic_t *dead_letter_rkt(struct validate_private *priv) {
+	rd_kafka_topic_t *rkt = __atomic_load_n(&priv->dead_letter_rkt,
+		__ATOMIC_ACQUIRE);
+	if(NULL == rkt) {
+		rkt = kafka_topic(priv->dead_letter_topic);
+		__atomic_store_n(&priv->dead_letter_rkt,rkt,__ATOMIC_RELEASE);
+	}
+	return rkt;
+}
+
+void validate_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta) {
+	struct validate_private *priv = stage->opaque;
+#ifdef VALIDATE_PRIVATE_MAGIC
+	assert(VALIDATE_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	if(likely(json_validate(buffer,buf_size))) {
+		ATOMIC_INC(priv->counters.valid);
+		stage_forward(stage,buffer,buf_size,meta);
+		return;
+	}
+
+	ATOMIC_INC(priv->counters.invalid);
+	if(unlikely(global_config.debug))
+		rdlog(LOG_DEBUG,"Invalid JSON message: %.*s",(int)buf_size,buffer);
+
+	rd_kafka_topic_t *rkt = priv->dead_letter_topic ? dead_letter_rkt(priv) : NULL;
+	if(rkt) {
+		ATOMIC_INC(priv->counters.dead_letter);
+		send_to_kafka_topic(rkt,buffer,buf_size,RD_KAFKA_MSG_F_FREE,meta,NULL);
+	} else {
+		free(buffer);
+	}
+}
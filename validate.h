@@ -0,0 +1,37 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stage.h"
+
+/*
+ * JSON validation stage. Messages that are not valid UTF-8 JSON are dropped,
+ * or sent to "dead_letter_topic" if it is configured:
+ *
+ *   {"type":"validate","dead_letter_topic":"rb_invalid"}
+ */
+
+#define VALIDATE_STAGE_TYPE "validate"
+
+int validate_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+void validate_stage_opaque_destructor(void *opaque);
+void validate_stage_opaque_stats(void *opaque,struct json_t *stats);
+void validate_stage_process(const struct stage *stage,char *buffer,
+                          size_t buf_size,const struct msg_meta *meta);
@@ -0,0 +1,375 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#ifdef HAVE_LIBZSTD
+
+#include "zstd_dict.h"
+#include "util.h"
+
+#include <librd/rdlog.h>
+#include <jansson.h>
+#include <zstd.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define CONFIG_ZSTD_DICTIONARY_KEY "dictionary"
+#define CONFIG_ZSTD_LEVEL_KEY "level"
+#define CONFIG_ZSTD_HEADER_KEY "header"
+
+#define ZSTD_DEFAULT_LEVEL 3
+#define ZSTD_DEFAULT_HEADER "zstd-dict-id"
+
+#define ZSTD_DICT_PRIVATE_MAGIC 0x2575D1C72575D1C7L
+
+struct zstd_dictionary{
+	ZSTD_CDict *cdict;
+	/// Dictionary id, as sent in kafka header
+	char id[sizeof("4294967295")];
+};
+
+struct zstd_dict_private{
+#ifdef ZSTD_DICT_PRIVATE_MAGIC
+	uint64_t magic;
+#endif
+	/// Protects dictionary from being freed in the middle of a compression
+	pthread_rwlock_t rwlock;
+	struct zstd_dictionary dictionary;
+	char *header;
+	struct {
+		uint64_t messages;
+		uint64_t compressed;
+		uint64_t uncompressed;
+		uint64_t errors;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+	} counters;
+};
+
+/*
+ * Per thread compression context and output buffer. They are shared by all
+ * zstd stages, since a context can be used with any dictionary.
+ */
+
+struct zstd_thread_context{
+	ZSTD_CCtx *cctx;
+	char *buf;
+	size_t size;
+};
+
+static pthread_key_t thread_context_key;
+static pthread_once_t thread_context_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_context_destructor(void *_context) {
+	struct zstd_thread_context *context = _context;
+	ZSTD_freeCCtx(context->cctx);
+	free(context->buf);
+	free(context);
+}
+
+static void thread_context_key_create() {
+	pthread_key_create(&thread_context_key,thread_context_destructor);
+}
+
+/// Get thread compression context, with room for buf_size compressed
+static struct zstd_thread_context *thread_context(size_t buf_size) {
+	pthread_once(&thread_context_key_once,thread_context_key_create);
+
+	struct zstd_thread_context *context
+		= pthread_getspecific(thread_context_key);
+	if(unlikely(NULL == context)) {
+		context = calloc(1,sizeof(*context));
+		if(context)
+			context->cctx = ZSTD_createCCtx();
+		if(NULL == context || NULL == context->cctx) {
+			rdlog(LOG_ERR,"Can't allocate zstd context (out of memory?)");
+			free(context);
+			return NULL;
+		}
+		pthread_setspecific(thread_context_key,context);
+	}
+
+	const size_t bound = ZSTD_compressBound(buf_size);
+	if(unlikely(context->size < bound)) {
+		char *new_buf = realloc(context->buf,bound);
+		if(NULL == new_buf) {
+			rdlog(LOG_ERR,"Can't allocate zstd buffer (out of memory?)");
+			return NULL;
+		}
+		context->buf = new_buf;
+		context->size = bound;
+	}
+
+	return context;
+}
+
+/*
+ * Dictionary
+ */
+
+static void zstd_dictionary_done(struct zstd_dictionary *dictionary) {
+	ZSTD_freeCDict(dictionary->cdict);
+	memset(dictionary,0,sizeof(*dictionary));
+}
+
+static int zstd_dictionary_load(struct zstd_dictionary *dictionary,
+                                const char *path,int level,
+                                char *err,size_t errsize) {
+	char errbuf[BUFSIZ];
+	struct stat st;
+	char *content = NULL;
+	int rc = -1;
+
+	memset(dictionary,0,sizeof(*dictionary));
+
+	FILE *file = fopen(path,"rb");
+	if(NULL == file) {
+		snprintf(err,errsize,"Can't open zstd dictionary %s: %s",path,
+			mystrerror(errno,errbuf,sizeof(errbuf)));
+		return -1;
+	}
+
+	if(0 != fstat(fileno(file),&st) || 0 == st.st_size) {
+		snprintf(err,errsize,"Can't get zstd dictionary %s size",path);
+		goto done;
+	}
+
+	const size_t content_size = (size_t)st.st_size;
+	content = malloc(content_size);
+	if(NULL == content) {
+		snprintf(err,errsize,"Can't allocate zstd dictionary (out of memory?)");
+		goto done;
+	}
+
+	if(content_size != fread(content,1,content_size,file)) {
+		snprintf(err,errsize,"Can't read zstd dictionary %s",path);
+		goto done;
+	}
+
+	/* Raw content dictionaries have no id, and consumers could not know
+	   which one was used */
+	const unsigned id = ZSTD_getDictID_fromDict(content,content_size);
+	if(0 == id) {
+		snprintf(err,errsize,"%s is not a trained zstd dictionary",path);
+		goto done;
+	}
+
+	dictionary->cdict = ZSTD_createCDict(content,content_size,level);
+	if(NULL == dictionary->cdict) {
+		snprintf(err,errsize,"Can't create zstd dictionary from %s",path);
+		goto done;
+	}
+
+	snprintf(dictionary->id,sizeof(dictionary->id),"%u",id);
+	rdlog(LOG_INFO,"Loaded zstd dictionary %s with id %u",path,id);
+	rc = 0;
+
+done:
+	free(content);
+	fclose(file);
+	return rc;
+}
+
+static int parse_zstd_config(json_t *config,const char **path,int *level,
+                             const char **header,char *err,size_t errsize) {
+	json_error_t jerr;
+
+	*level = ZSTD_DEFAULT_LEVEL;
+	*header = ZSTD_DEFAULT_HEADER;
+
+	const int unpack_rc = json_unpack_ex(config,&jerr,0,"{s:s,s?i,s?s}",
+		CONFIG_ZSTD_DICTIONARY_KEY,path,
+		CONFIG_ZSTD_LEVEL_KEY,level,
+		CONFIG_ZSTD_HEADER_KEY,header);
+	if(unpack_rc != 0) {
+		snprintf(err,errsize,"Can't parse zstd stage: %s",jerr.text);
+		return -1;
+	}
+
+	if(*level < 1 || *level > ZSTD_maxCLevel()) {
+		snprintf(err,errsize,"zstd level has to be between 1 and %d",
+			ZSTD_maxCLevel());
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stage
+ */
+
+int zstd_dict_stage_opaque_creator(json_t *config,void **_opaque,
+                                              char *err,size_t errsize) {
+	const char *path = NULL,*header = NULL;
+	int level = 0;
+
+	assert(_opaque);
+
+	if(0 != parse_zstd_config(config,&path,&level,&header,err,errsize))
+		return -1;
+
+	struct zstd_dict_private *priv = calloc(1,sizeof(*priv));
+	if(priv)
+		priv->header = strdup(header);
+	if(NULL == priv || NULL == priv->header) {
+		snprintf(err,errsize,"Can't allocate zstd private (out of memory?)");
+		free(priv);
+		return -1;
+	}
+
+#ifdef ZSTD_DICT_PRIVATE_MAGIC
+	priv->magic = ZSTD_DICT_PRIVATE_MAGIC;
+#endif
+
+	if(0 != zstd_dictionary_load(&priv->dictionary,path,level,err,errsize)) {
+		free(priv->header);
+		free(priv);
+		return -1;
+	}
+
+	pthread_rwlock_init(&priv->rwlock,NULL);
+	*_opaque = priv;
+	return 0;
+}
+
+int zstd_dict_stage_opaque_reload(json_t *config,void *opaque) {
+	struct zstd_dict_private *priv = opaque;
+	struct zstd_dictionary new_dictionary,old_dictionary;
+	const char *path = NULL,*header = NULL;
+	char err[BUFSIZ];
+	int level = 0;
+
+#ifdef ZSTD_DICT_PRIVATE_MAGIC
+	assert(ZSTD_DICT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	if(0 != parse_zstd_config(config,&path,&level,&header,err,sizeof(err))
+	        || 0 != zstd_dictionary_load(&new_dictionary,path,level,err,
+	                                                           sizeof(err))) {
+		rdlog(LOG_ERR,"%s. Keeping old zstd dictionary.",err);
+		return -1;
+	}
+
+	if(0 != strcmp(header,priv->header)) {
+		rdlog(LOG_WARNING,"zstd header can't be changed on reload, "
+			"keeping %s",priv->header);
+	}
+
+	pthread_rwlock_wrlock(&priv->rwlock);
+	old_dictionary = priv->dictionary;
+	priv->dictionary = new_dictionary;
+	pthread_rwlock_unlock(&priv->rwlock);
+
+	zstd_dictionary_done(&old_dictionary);
+	return 0;
+}
+
+void zstd_dict_stage_opaque_destructor(void *opaque) {
+	struct zstd_dict_private *priv = opaque;
+#ifdef ZSTD_DICT_PRIVATE_MAGIC
+	assert(ZSTD_DICT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	zstd_dictionary_done(&priv->dictionary);
+	pthread_rwlock_destroy(&priv->rwlock);
+	free(priv->header);
+	free(priv);
+}
+
+void zstd_dict_stage_opaque_stats(void *opaque,json_t *stats) {
+	struct zstd_dict_private *priv = opaque;
+#ifdef ZSTD_DICT_PRIVATE_MAGIC
+	assert(ZSTD_DICT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	json_object_set_new(stats,"messages",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.messages)));
+	json_object_set_new(stats,"compressed",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.compressed)));
+	json_object_set_new(stats,"uncompressed",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.uncompressed)));
+	json_object_set_new(stats,"errors",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.errors)));
+	json_object_set_new(stats,"bytes_in",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_in)));
+	json_object_set_new(stats,"bytes_out",
+		json_integer((json_int_t)ATOMIC_LOAD(priv->counters.bytes_out)));
+}
+
+void zstd_dict_stage_process(const struct stage *stage,char *buffer,
+                             size_t buf_size,const struct msg_meta *meta) {
+	struct zstd_dict_private *priv = stage->opaque;
+	struct msg_meta compressed_meta;
+	char dictionary_id[sizeof(priv->dictionary.id)];
+	size_t compressed_size = 0;
+
+#ifdef ZSTD_DICT_PRIVATE_MAGIC
+	assert(ZSTD_DICT_PRIVATE_MAGIC == priv->magic);
+#endif
+
+	ATOMIC_INC(priv->counters.messages);
+	ATOMIC_ADD(priv->counters.bytes_in,buf_size);
+
+	struct zstd_thread_context *context = thread_context(buf_size);
+	if(NULL == context || MSG_META_MAX_HEADERS == meta->headers_count) {
+		ATOMIC_INC(priv->counters.errors);
+		goto send_uncompressed;
+	}
+
+	pthread_rwlock_rdlock(&priv->rwlock);
+	compressed_size = ZSTD_compress_usingCDict(context->cctx,context->buf,
+		context->size,buffer,buf_size,priv->dictionary.cdict);
+	memcpy(dictionary_id,priv->dictionary.id,sizeof(dictionary_id));
+	pthread_rwlock_unlock(&priv->rwlock);
+
+	if(ZSTD_isError(compressed_size)) {
+		rdlog(LOG_ERR,"Can't compress message: %s",
+			ZSTD_getErrorName(compressed_size));
+		ATOMIC_INC(priv->counters.errors);
+		goto send_uncompressed;
+	}
+
+	if(compressed_size >= buf_size)
+		goto send_uncompressed;
+
+	/* Compressed is smaller, so it fits in the original buffer */
+	memcpy(buffer,context->buf,compressed_size);
+	compressed_meta = *meta;
+	msg_meta_add_header(&compressed_meta,priv->header,dictionary_id,
+		strlen(dictionary_id));
+
+	ATOMIC_INC(priv->counters.compressed);
+	ATOMIC_ADD(priv->counters.bytes_out,compressed_size);
+	stage_forward(stage,buffer,compressed_size,&compressed_meta);
+	return;
+
+send_uncompressed:
+	ATOMIC_INC(priv->counters.uncompressed);
+	ATOMIC_ADD(priv->counters.bytes_out,buf_size);
+	stage_forward(stage,buffer,buf_size,meta);
+}
+
+#endif
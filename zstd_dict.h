@@ -0,0 +1,50 @@
+/*
+** Copyright (C) 2015 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "config.h"
+
+#ifdef HAVE_LIBZSTD
+
+#include "stage.h"
+
+/*
+ * Per message zstd compression using a dictionary trained offline:
+ *
+ *   zstd --train -r samples/ -o /etc/n2kafka/flows.dict
+ *
+ *   {"type":"zstd","dictionary":"/etc/n2kafka/flows.dict","level":3}
+ *
+ * Compressed messages carry the dictionary id (decimal) in the
+ * "zstd-dict-id" kafka header, or in the one set with "header". Messages
+ * that don't get smaller are sent uncompressed and without that header.
+ * Dictionary is reloaded on SIGHUP.
+ */
+
+#define ZSTD_DICT_STAGE_TYPE "zstd"
+
+int zstd_dict_stage_opaque_creator(struct json_t *config,void **opaque,
+                                                     char *err,size_t errsize);
+int zstd_dict_stage_opaque_reload(struct json_t *config,void *opaque);
+void zstd_dict_stage_opaque_destructor(void *opaque);
+void zstd_dict_stage_opaque_stats(void *opaque,struct json_t *stats);
+void zstd_dict_stage_process(const struct stage *stage,char *buffer,
+                             size_t buf_size,const struct msg_meta *meta);
+
+#endif